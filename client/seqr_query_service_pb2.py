@@ -1,11 +1,22 @@
 # -*- coding: utf-8 -*-
 # Generated by the protocol buffer compiler.  DO NOT EDIT!
+# NO CHECKED-IN PROTOBUF GENCODE
 # source: seqr_query_service.proto
+# Protobuf Python Version: 7.35.1
 """Generated protocol buffer code."""
 from google.protobuf import descriptor as _descriptor
-from google.protobuf import message as _message
-from google.protobuf import reflection as _reflection
+from google.protobuf import descriptor_pool as _descriptor_pool
+from google.protobuf import runtime_version as _runtime_version
 from google.protobuf import symbol_database as _symbol_database
+from google.protobuf.internal import builder as _builder
+_runtime_version.ValidateProtobufRuntimeVersion(
+    _runtime_version.Domain.PUBLIC,
+    7,
+    35,
+    1,
+    '',
+    'seqr_query_service.proto'
+)
 # @@protoc_insertion_point(imports)
 
 _sym_db = _symbol_database.Default()
@@ -13,425 +24,61 @@ _sym_db = _symbol_database.Default()
 
 
 
-DESCRIPTOR = _descriptor.FileDescriptor(
-  name='seqr_query_service.proto',
-  package='seqr',
-  syntax='proto3',
-  serialized_options=None,
-  create_key=_descriptor._internal_create_key,
-  serialized_pb=b'\n\x18seqr_query_service.proto\x12\x04seqr\"\x8f\x05\n\x0cQueryRequest\x12\x12\n\narrow_urls\x18\x01 \x03(\t\x12\x1a\n\x12projection_columns\x18\x02 \x03(\t\x12\x38\n\x11\x66ilter_expression\x18\x03 \x01(\x0b\x32\x1d.seqr.QueryRequest.Expression\x12\x10\n\x08max_rows\x18\x04 \x01(\x05\x1a\x82\x04\n\nExpression\x12\x10\n\x06\x63olumn\x18\x01 \x01(\tH\x00\x12\x38\n\x07literal\x18\x02 \x01(\x0b\x32%.seqr.QueryRequest.Expression.LiteralH\x00\x12\x32\n\x04\x63\x61ll\x18\x03 \x01(\x0b\x32\".seqr.QueryRequest.Expression.CallH\x00\x1a\x9c\x01\n\x07Literal\x12\x14\n\nbool_value\x18\x01 \x01(\x08H\x00\x12\x15\n\x0bint32_value\x18\x02 \x01(\x05H\x00\x12\x15\n\x0bint64_value\x18\x03 \x01(\x03H\x00\x12\x15\n\x0b\x66loat_value\x18\x04 \x01(\x02H\x00\x12\x16\n\x0c\x64ouble_value\x18\x05 \x01(\x01H\x00\x12\x16\n\x0cstring_value\x18\x06 \x01(\tH\x00\x42\x06\n\x04type\x1a\xa8\x01\n\x04\x43\x61ll\x12\x15\n\rfunction_name\x18\x01 \x01(\t\x12\x30\n\targuments\x18\x02 \x03(\x0b\x32\x1d.seqr.QueryRequest.Expression\x12L\n\x12set_lookup_options\x18\x03 \x01(\x0b\x32..seqr.QueryRequest.Expression.SetLookupOptionsH\x00\x42\t\n\x07options\x1a\"\n\x10SetLookupOptions\x12\x0e\n\x06values\x18\x01 \x03(\tB\x06\n\x04type\"9\n\rQueryResponse\x12\x10\n\x08num_rows\x18\x01 \x01(\x05\x12\x16\n\x0erecord_batches\x18\x02 \x01(\x0c\x32\x42\n\x0cQueryService\x12\x32\n\x05Query\x12\x12.seqr.QueryRequest\x1a\x13.seqr.QueryResponse\"\x00\x62\x06proto3'
-)
-
-
-
-
-_QUERYREQUEST_EXPRESSION_LITERAL = _descriptor.Descriptor(
-  name='Literal',
-  full_name='seqr.QueryRequest.Expression.Literal',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  create_key=_descriptor._internal_create_key,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='bool_value', full_name='seqr.QueryRequest.Expression.Literal.bool_value', index=0,
-      number=1, type=8, cpp_type=7, label=1,
-      has_default_value=False, default_value=False,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='int32_value', full_name='seqr.QueryRequest.Expression.Literal.int32_value', index=1,
-      number=2, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='int64_value', full_name='seqr.QueryRequest.Expression.Literal.int64_value', index=2,
-      number=3, type=3, cpp_type=2, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='float_value', full_name='seqr.QueryRequest.Expression.Literal.float_value', index=3,
-      number=4, type=2, cpp_type=6, label=1,
-      has_default_value=False, default_value=float(0),
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='double_value', full_name='seqr.QueryRequest.Expression.Literal.double_value', index=4,
-      number=5, type=1, cpp_type=5, label=1,
-      has_default_value=False, default_value=float(0),
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='string_value', full_name='seqr.QueryRequest.Expression.Literal.string_value', index=5,
-      number=6, type=9, cpp_type=9, label=1,
-      has_default_value=False, default_value=b"".decode('utf-8'),
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-    _descriptor.OneofDescriptor(
-      name='type', full_name='seqr.QueryRequest.Expression.Literal.type',
-      index=0, containing_type=None,
-      create_key=_descriptor._internal_create_key,
-    fields=[]),
-  ],
-  serialized_start=319,
-  serialized_end=475,
-)
-
-_QUERYREQUEST_EXPRESSION_CALL = _descriptor.Descriptor(
-  name='Call',
-  full_name='seqr.QueryRequest.Expression.Call',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  create_key=_descriptor._internal_create_key,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='function_name', full_name='seqr.QueryRequest.Expression.Call.function_name', index=0,
-      number=1, type=9, cpp_type=9, label=1,
-      has_default_value=False, default_value=b"".decode('utf-8'),
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='arguments', full_name='seqr.QueryRequest.Expression.Call.arguments', index=1,
-      number=2, type=11, cpp_type=10, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='set_lookup_options', full_name='seqr.QueryRequest.Expression.Call.set_lookup_options', index=2,
-      number=3, type=11, cpp_type=10, label=1,
-      has_default_value=False, default_value=None,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-    _descriptor.OneofDescriptor(
-      name='options', full_name='seqr.QueryRequest.Expression.Call.options',
-      index=0, containing_type=None,
-      create_key=_descriptor._internal_create_key,
-    fields=[]),
-  ],
-  serialized_start=478,
-  serialized_end=646,
-)
-
-_QUERYREQUEST_EXPRESSION_SETLOOKUPOPTIONS = _descriptor.Descriptor(
-  name='SetLookupOptions',
-  full_name='seqr.QueryRequest.Expression.SetLookupOptions',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  create_key=_descriptor._internal_create_key,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='values', full_name='seqr.QueryRequest.Expression.SetLookupOptions.values', index=0,
-      number=1, type=9, cpp_type=9, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=648,
-  serialized_end=682,
-)
-
-_QUERYREQUEST_EXPRESSION = _descriptor.Descriptor(
-  name='Expression',
-  full_name='seqr.QueryRequest.Expression',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  create_key=_descriptor._internal_create_key,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='column', full_name='seqr.QueryRequest.Expression.column', index=0,
-      number=1, type=9, cpp_type=9, label=1,
-      has_default_value=False, default_value=b"".decode('utf-8'),
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='literal', full_name='seqr.QueryRequest.Expression.literal', index=1,
-      number=2, type=11, cpp_type=10, label=1,
-      has_default_value=False, default_value=None,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='call', full_name='seqr.QueryRequest.Expression.call', index=2,
-      number=3, type=11, cpp_type=10, label=1,
-      has_default_value=False, default_value=None,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-  ],
-  extensions=[
-  ],
-  nested_types=[_QUERYREQUEST_EXPRESSION_LITERAL, _QUERYREQUEST_EXPRESSION_CALL, _QUERYREQUEST_EXPRESSION_SETLOOKUPOPTIONS, ],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-    _descriptor.OneofDescriptor(
-      name='type', full_name='seqr.QueryRequest.Expression.type',
-      index=0, containing_type=None,
-      create_key=_descriptor._internal_create_key,
-    fields=[]),
-  ],
-  serialized_start=176,
-  serialized_end=690,
-)
-
-_QUERYREQUEST = _descriptor.Descriptor(
-  name='QueryRequest',
-  full_name='seqr.QueryRequest',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  create_key=_descriptor._internal_create_key,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='arrow_urls', full_name='seqr.QueryRequest.arrow_urls', index=0,
-      number=1, type=9, cpp_type=9, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='projection_columns', full_name='seqr.QueryRequest.projection_columns', index=1,
-      number=2, type=9, cpp_type=9, label=3,
-      has_default_value=False, default_value=[],
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='filter_expression', full_name='seqr.QueryRequest.filter_expression', index=2,
-      number=3, type=11, cpp_type=10, label=1,
-      has_default_value=False, default_value=None,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='max_rows', full_name='seqr.QueryRequest.max_rows', index=3,
-      number=4, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-  ],
-  extensions=[
-  ],
-  nested_types=[_QUERYREQUEST_EXPRESSION, ],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=35,
-  serialized_end=690,
-)
-
-
-_QUERYRESPONSE = _descriptor.Descriptor(
-  name='QueryResponse',
-  full_name='seqr.QueryResponse',
-  filename=None,
-  file=DESCRIPTOR,
-  containing_type=None,
-  create_key=_descriptor._internal_create_key,
-  fields=[
-    _descriptor.FieldDescriptor(
-      name='num_rows', full_name='seqr.QueryResponse.num_rows', index=0,
-      number=1, type=5, cpp_type=1, label=1,
-      has_default_value=False, default_value=0,
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-    _descriptor.FieldDescriptor(
-      name='record_batches', full_name='seqr.QueryResponse.record_batches', index=1,
-      number=2, type=12, cpp_type=9, label=1,
-      has_default_value=False, default_value=b"",
-      message_type=None, enum_type=None, containing_type=None,
-      is_extension=False, extension_scope=None,
-      serialized_options=None, file=DESCRIPTOR,  create_key=_descriptor._internal_create_key),
-  ],
-  extensions=[
-  ],
-  nested_types=[],
-  enum_types=[
-  ],
-  serialized_options=None,
-  is_extendable=False,
-  syntax='proto3',
-  extension_ranges=[],
-  oneofs=[
-  ],
-  serialized_start=692,
-  serialized_end=749,
-)
-
-_QUERYREQUEST_EXPRESSION_LITERAL.containing_type = _QUERYREQUEST_EXPRESSION
-_QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type'].fields.append(
-  _QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['bool_value'])
-_QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['bool_value'].containing_oneof = _QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type']
-_QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type'].fields.append(
-  _QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['int32_value'])
-_QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['int32_value'].containing_oneof = _QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type']
-_QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type'].fields.append(
-  _QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['int64_value'])
-_QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['int64_value'].containing_oneof = _QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type']
-_QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type'].fields.append(
-  _QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['float_value'])
-_QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['float_value'].containing_oneof = _QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type']
-_QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type'].fields.append(
-  _QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['double_value'])
-_QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['double_value'].containing_oneof = _QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type']
-_QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type'].fields.append(
-  _QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['string_value'])
-_QUERYREQUEST_EXPRESSION_LITERAL.fields_by_name['string_value'].containing_oneof = _QUERYREQUEST_EXPRESSION_LITERAL.oneofs_by_name['type']
-_QUERYREQUEST_EXPRESSION_CALL.fields_by_name['arguments'].message_type = _QUERYREQUEST_EXPRESSION
-_QUERYREQUEST_EXPRESSION_CALL.fields_by_name['set_lookup_options'].message_type = _QUERYREQUEST_EXPRESSION_SETLOOKUPOPTIONS
-_QUERYREQUEST_EXPRESSION_CALL.containing_type = _QUERYREQUEST_EXPRESSION
-_QUERYREQUEST_EXPRESSION_CALL.oneofs_by_name['options'].fields.append(
-  _QUERYREQUEST_EXPRESSION_CALL.fields_by_name['set_lookup_options'])
-_QUERYREQUEST_EXPRESSION_CALL.fields_by_name['set_lookup_options'].containing_oneof = _QUERYREQUEST_EXPRESSION_CALL.oneofs_by_name['options']
-_QUERYREQUEST_EXPRESSION_SETLOOKUPOPTIONS.containing_type = _QUERYREQUEST_EXPRESSION
-_QUERYREQUEST_EXPRESSION.fields_by_name['literal'].message_type = _QUERYREQUEST_EXPRESSION_LITERAL
-_QUERYREQUEST_EXPRESSION.fields_by_name['call'].message_type = _QUERYREQUEST_EXPRESSION_CALL
-_QUERYREQUEST_EXPRESSION.containing_type = _QUERYREQUEST
-_QUERYREQUEST_EXPRESSION.oneofs_by_name['type'].fields.append(
-  _QUERYREQUEST_EXPRESSION.fields_by_name['column'])
-_QUERYREQUEST_EXPRESSION.fields_by_name['column'].containing_oneof = _QUERYREQUEST_EXPRESSION.oneofs_by_name['type']
-_QUERYREQUEST_EXPRESSION.oneofs_by_name['type'].fields.append(
-  _QUERYREQUEST_EXPRESSION.fields_by_name['literal'])
-_QUERYREQUEST_EXPRESSION.fields_by_name['literal'].containing_oneof = _QUERYREQUEST_EXPRESSION.oneofs_by_name['type']
-_QUERYREQUEST_EXPRESSION.oneofs_by_name['type'].fields.append(
-  _QUERYREQUEST_EXPRESSION.fields_by_name['call'])
-_QUERYREQUEST_EXPRESSION.fields_by_name['call'].containing_oneof = _QUERYREQUEST_EXPRESSION.oneofs_by_name['type']
-_QUERYREQUEST.fields_by_name['filter_expression'].message_type = _QUERYREQUEST_EXPRESSION
-DESCRIPTOR.message_types_by_name['QueryRequest'] = _QUERYREQUEST
-DESCRIPTOR.message_types_by_name['QueryResponse'] = _QUERYRESPONSE
-_sym_db.RegisterFileDescriptor(DESCRIPTOR)
-
-QueryRequest = _reflection.GeneratedProtocolMessageType('QueryRequest', (_message.Message,), {
-
-  'Expression' : _reflection.GeneratedProtocolMessageType('Expression', (_message.Message,), {
-
-    'Literal' : _reflection.GeneratedProtocolMessageType('Literal', (_message.Message,), {
-      'DESCRIPTOR' : _QUERYREQUEST_EXPRESSION_LITERAL,
-      '__module__' : 'seqr_query_service_pb2'
-      # @@protoc_insertion_point(class_scope:seqr.QueryRequest.Expression.Literal)
-      })
-    ,
-
-    'Call' : _reflection.GeneratedProtocolMessageType('Call', (_message.Message,), {
-      'DESCRIPTOR' : _QUERYREQUEST_EXPRESSION_CALL,
-      '__module__' : 'seqr_query_service_pb2'
-      # @@protoc_insertion_point(class_scope:seqr.QueryRequest.Expression.Call)
-      })
-    ,
-
-    'SetLookupOptions' : _reflection.GeneratedProtocolMessageType('SetLookupOptions', (_message.Message,), {
-      'DESCRIPTOR' : _QUERYREQUEST_EXPRESSION_SETLOOKUPOPTIONS,
-      '__module__' : 'seqr_query_service_pb2'
-      # @@protoc_insertion_point(class_scope:seqr.QueryRequest.Expression.SetLookupOptions)
-      })
-    ,
-    'DESCRIPTOR' : _QUERYREQUEST_EXPRESSION,
-    '__module__' : 'seqr_query_service_pb2'
-    # @@protoc_insertion_point(class_scope:seqr.QueryRequest.Expression)
-    })
-  ,
-  'DESCRIPTOR' : _QUERYREQUEST,
-  '__module__' : 'seqr_query_service_pb2'
-  # @@protoc_insertion_point(class_scope:seqr.QueryRequest)
-  })
-_sym_db.RegisterMessage(QueryRequest)
-_sym_db.RegisterMessage(QueryRequest.Expression)
-_sym_db.RegisterMessage(QueryRequest.Expression.Literal)
-_sym_db.RegisterMessage(QueryRequest.Expression.Call)
-_sym_db.RegisterMessage(QueryRequest.Expression.SetLookupOptions)
-
-QueryResponse = _reflection.GeneratedProtocolMessageType('QueryResponse', (_message.Message,), {
-  'DESCRIPTOR' : _QUERYRESPONSE,
-  '__module__' : 'seqr_query_service_pb2'
-  # @@protoc_insertion_point(class_scope:seqr.QueryResponse)
-  })
-_sym_db.RegisterMessage(QueryResponse)
-
-
-
-_QUERYSERVICE = _descriptor.ServiceDescriptor(
-  name='QueryService',
-  full_name='seqr.QueryService',
-  file=DESCRIPTOR,
-  index=0,
-  serialized_options=None,
-  create_key=_descriptor._internal_create_key,
-  serialized_start=751,
-  serialized_end=817,
-  methods=[
-  _descriptor.MethodDescriptor(
-    name='Query',
-    full_name='seqr.QueryService.Query',
-    index=0,
-    containing_service=None,
-    input_type=_QUERYREQUEST,
-    output_type=_QUERYRESPONSE,
-    serialized_options=None,
-    create_key=_descriptor._internal_create_key,
-  ),
-])
-_sym_db.RegisterServiceDescriptor(_QUERYSERVICE)
-
-DESCRIPTOR.services_by_name['QueryService'] = _QUERYSERVICE
-
+DESCRIPTOR = _descriptor_pool.Default().AddSerializedFile(b'\n\x18seqr_query_service.proto\x12\x04seqr\"\xad\t\n\x0cQueryRequest\x12\x12\n\narrow_urls\x18\x01 \x03(\t\x12\x12\n\ndataset_id\x18\t \x01(\t\x12\x1a\n\x12projection_columns\x18\x02 \x03(\t\x12\x38\n\x11\x66ilter_expression\x18\x03 \x01(\x0b\x32\x1d.seqr.QueryRequest.Expression\x12\x10\n\x08max_rows\x18\x04 \x01(\x05\x12-\n\tsort_keys\x18\x05 \x03(\x0b\x32\x1a.seqr.QueryRequest.SortKey\x12\r\n\x05limit\x18\x06 \x01(\x05\x12\x12\n\npage_token\x18\x07 \x01(\x0c\x12\x33\n\x0b\x61ggregation\x18\x08 \x01(\x0b\x32\x1e.seqr.QueryRequest.Aggregation\x12\x0f\n\x07profile\x18\n \x01(\x08\x1a\xb1\x04\n\nExpression\x12\x10\n\x06\x63olumn\x18\x01 \x01(\tH\x00\x12\x38\n\x07literal\x18\x02 \x01(\x0b\x32%.seqr.QueryRequest.Expression.LiteralH\x00\x12\x32\n\x04\x63\x61ll\x18\x03 \x01(\x0b\x32\".seqr.QueryRequest.Expression.CallH\x00\x12\x13\n\tparameter\x18\x04 \x01(\tH\x00\x1a\x9c\x01\n\x07Literal\x12\x14\n\nbool_value\x18\x01 \x01(\x08H\x00\x12\x15\n\x0bint32_value\x18\x02 \x01(\x05H\x00\x12\x15\n\x0bint64_value\x18\x03 \x01(\x03H\x00\x12\x15\n\x0b\x66loat_value\x18\x04 \x01(\x02H\x00\x12\x16\n\x0c\x64ouble_value\x18\x05 \x01(\x01H\x00\x12\x16\n\x0cstring_value\x18\x06 \x01(\tH\x00\x42\x06\n\x04type\x1a\xa8\x01\n\x04\x43\x61ll\x12\x15\n\rfunction_name\x18\x01 \x01(\t\x12\x30\n\targuments\x18\x02 \x03(\x0b\x32\x1d.seqr.QueryRequest.Expression\x12L\n\x12set_lookup_options\x18\x03 \x01(\x0b\x32..seqr.QueryRequest.Expression.SetLookupOptionsH\x00\x42\t\n\x07options\x1a<\n\x10SetLookupOptions\x12\x0e\n\x06values\x18\x01 \x03(\t\x12\x18\n\x10values_parameter\x18\x02 \x01(\tB\x06\n\x04type\x1a-\n\x07SortKey\x12\x0e\n\x06\x63olumn\x18\x01 \x01(\t\x12\x12\n\ndescending\x18\x02 \x01(\x08\x1a\x91\x02\n\x0b\x41ggregation\x12\x18\n\x10group_by_columns\x18\x01 \x03(\t\x12<\n\naggregates\x18\x02 \x03(\x0b\x32(.seqr.QueryRequest.Aggregation.Aggregate\x1a\x64\n\tAggregate\x12\x39\n\x08\x66unction\x18\x01 \x01(\x0e\x32\'.seqr.QueryRequest.Aggregation.Function\x12\x0e\n\x06\x63olumn\x18\x02 \x01(\t\x12\x0c\n\x04name\x18\x03 \x01(\t\"D\n\x08\x46unction\x12\t\n\x05\x43OUNT\x10\x00\x12\x12\n\x0e\x43OUNT_DISTINCT\x10\x01\x12\x07\n\x03MIN\x10\x02\x12\x07\n\x03MAX\x10\x03\x12\x07\n\x03SUM\x10\x04\"\xbe\x02\n\tPageToken\x12\x35\n\x0fsort_key_values\x18\x01 \x03(\x0b\x32\x1c.seqr.PageToken.SortKeyValue\x12\x11\n\turl_index\x18\x02 \x01(\x05\x12\x1a\n\x12record_batch_index\x18\x03 \x01(\x05\x12\x11\n\trow_index\x18\x04 \x01(\x03\x12\x1b\n\x13request_fingerprint\x18\x05 \x01(\x0c\x1a\x9a\x01\n\x0cSortKeyValue\x12\x0c\n\x04type\x18\x01 \x01(\t\x12\x14\n\nbool_value\x18\x02 \x01(\x08H\x00\x12\x15\n\x0bint64_value\x18\x03 \x01(\x03H\x00\x12\x16\n\x0cuint64_value\x18\x04 \x01(\x04H\x00\x12\x16\n\x0c\x64ouble_value\x18\x05 \x01(\x01H\x00\x12\x16\n\x0cstring_value\x18\x06 \x01(\tH\x00\x42\x07\n\x05value\"f\n\x0ePrepareRequest\x12\x1a\n\x12projection_columns\x18\x01 \x03(\t\x12\x38\n\x11\x66ilter_expression\x18\x02 \x01(\x0b\x32\x1d.seqr.QueryRequest.Expression\",\n\x0fPrepareResponse\x12\x19\n\x11prepared_query_id\x18\x01 \x01(\t\"\xa4\x03\n\x0e\x45xecuteRequest\x12\x19\n\x11prepared_query_id\x18\x01 \x01(\t\x12\x12\n\narrow_urls\x18\x02 \x03(\t\x12\x12\n\ndataset_id\x18\x05 \x01(\t\x12\x38\n\nparameters\x18\x03 \x03(\x0b\x32$.seqr.ExecuteRequest.ParametersEntry\x12\x10\n\x08max_rows\x18\x04 \x01(\x05\x12\x0f\n\x07profile\x18\x06 \x01(\x08\x1a\x82\x01\n\tParameter\x12\x38\n\x07literal\x18\x01 \x01(\x0b\x32%.seqr.QueryRequest.Expression.LiteralH\x00\x12\x32\n\tvalue_set\x18\x02 \x01(\x0b\x32\x1d.seqr.ExecuteRequest.ValueSetH\x00\x42\x07\n\x05value\x1a\x1a\n\x08ValueSet\x12\x0e\n\x06values\x18\x01 \x03(\t\x1aQ\n\x0fParametersEntry\x12\x0b\n\x03key\x18\x01 \x01(\t\x12-\n\x05value\x18\x02 \x01(\x0b\x32\x1e.seqr.ExecuteRequest.Parameter:\x02\x38\x01\"w\n\rQueryResponse\x12\x10\n\x08num_rows\x18\x01 \x01(\x05\x12\x16\n\x0erecord_batches\x18\x02 \x01(\x0c\x12\x17\n\x0fnext_page_token\x18\x03 \x01(\x0c\x12#\n\x07profile\x18\x04 \x01(\x0b\x32\x12.seqr.QueryProfile\"\xf0\x05\n\x0cQueryProfile\x12\x13\n\x0btotal_nanos\x18\x01 \x01(\x03\x12\x1b\n\x13serialization_nanos\x18\x02 \x01(\x03\x12\x18\n\x10serialized_bytes\x18\x03 \x01(\x03\x12\x14\n\x0crows_scanned\x18\x04 \x01(\x03\x12\x14\n\x0crows_matched\x18\x05 \x01(\x03\x12\x14\n\x0c\x64\x65\x63ode_nanos\x18\x06 \x01(\x03\x12\x14\n\x0c\x66ilter_nanos\x18\x07 \x01(\x03\x12\x14\n\x0c\x66ilter_nodes\x18\x08 \x03(\t\x12\x19\n\x11\x66ilter_node_nanos\x18\t \x03(\x03\x12$\n\x04urls\x18\n \x03(\x0b\x32\x16.seqr.QueryProfile.Url\x1a\xa4\x01\n\x0bRecordBatch\x12\r\n\x05index\x18\x01 \x01(\x05\x12\x14\n\x0crows_scanned\x18\x02 \x01(\x03\x12\x14\n\x0crows_matched\x18\x03 \x01(\x03\x12\x13\n\x0bindex_nanos\x18\x04 \x01(\x03\x12\x14\n\x0c\x64\x65\x63ode_nanos\x18\x05 \x01(\x03\x12\x14\n\x0c\x66ilter_nanos\x18\x06 \x01(\x03\x12\x19\n\x11\x66ilter_node_nanos\x18\x07 \x03(\x03\x1ap\n\x06Morsel\x12\x13\n\x0bqueue_nanos\x18\x01 \x01(\x03\x12\x19\n\x11memory_wait_nanos\x18\x02 \x01(\x03\x12\x36\n\x0erecord_batches\x18\x03 \x03(\x0b\x32\x1e.seqr.QueryProfile.RecordBatch\x1a\xcb\x01\n\x03Url\x12\x0b\n\x03url\x18\x01 \x01(\t\x12\x13\n\x0bqueue_nanos\x18\x02 \x01(\x03\x12\x13\n\x0b\x66\x65tch_nanos\x18\x03 \x01(\x03\x12\x12\n\nread_bytes\x18\x04 \x01(\x03\x12\x12\n\nread_nanos\x18\x05 \x01(\x03\x12\x1a\n\x12num_record_batches\x18\x06 \x01(\x05\x12\x1d\n\x15pruned_record_batches\x18\x07 \x01(\x05\x12*\n\x07morsels\x18\x08 \x03(\x0b\x32\x19.seqr.QueryProfile.Morsel\"<\n\x12QueryResponseChunk\x12\x10\n\x08num_rows\x18\x01 \x01(\x05\x12\x14\n\x0cipc_messages\x18\x02 \x01(\x0c\x32\xf5\x01\n\x0cQueryService\x12\x32\n\x05Query\x12\x12.seqr.QueryRequest\x1a\x13.seqr.QueryResponse\"\x00\x12?\n\x0bQueryStream\x12\x12.seqr.QueryRequest\x1a\x18.seqr.QueryResponseChunk\"\x00\x30\x01\x12\x38\n\x07Prepare\x12\x14.seqr.PrepareRequest\x1a\x15.seqr.PrepareResponse\"\x00\x12\x36\n\x07\x45xecute\x12\x14.seqr.ExecuteRequest\x1a\x13.seqr.QueryResponse\"\x00\x62\x06proto3')
+
+_globals = globals()
+_builder.BuildMessageAndEnumDescriptors(DESCRIPTOR, _globals)
+_builder.BuildTopDescriptorsAndMessages(DESCRIPTOR, 'seqr_query_service_pb2', _globals)
+if not _descriptor._USE_C_DESCRIPTORS:
+  DESCRIPTOR._loaded_options = None
+  _globals['_EXECUTEREQUEST_PARAMETERSENTRY']._loaded_options = None
+  _globals['_EXECUTEREQUEST_PARAMETERSENTRY']._serialized_options = b'8\001'
+  _globals['_QUERYREQUEST']._serialized_start=35
+  _globals['_QUERYREQUEST']._serialized_end=1232
+  _globals['_QUERYREQUEST_EXPRESSION']._serialized_start=348
+  _globals['_QUERYREQUEST_EXPRESSION']._serialized_end=909
+  _globals['_QUERYREQUEST_EXPRESSION_LITERAL']._serialized_start=512
+  _globals['_QUERYREQUEST_EXPRESSION_LITERAL']._serialized_end=668
+  _globals['_QUERYREQUEST_EXPRESSION_CALL']._serialized_start=671
+  _globals['_QUERYREQUEST_EXPRESSION_CALL']._serialized_end=839
+  _globals['_QUERYREQUEST_EXPRESSION_SETLOOKUPOPTIONS']._serialized_start=841
+  _globals['_QUERYREQUEST_EXPRESSION_SETLOOKUPOPTIONS']._serialized_end=901
+  _globals['_QUERYREQUEST_SORTKEY']._serialized_start=911
+  _globals['_QUERYREQUEST_SORTKEY']._serialized_end=956
+  _globals['_QUERYREQUEST_AGGREGATION']._serialized_start=959
+  _globals['_QUERYREQUEST_AGGREGATION']._serialized_end=1232
+  _globals['_QUERYREQUEST_AGGREGATION_AGGREGATE']._serialized_start=1062
+  _globals['_QUERYREQUEST_AGGREGATION_AGGREGATE']._serialized_end=1162
+  _globals['_QUERYREQUEST_AGGREGATION_FUNCTION']._serialized_start=1164
+  _globals['_QUERYREQUEST_AGGREGATION_FUNCTION']._serialized_end=1232
+  _globals['_PAGETOKEN']._serialized_start=1235
+  _globals['_PAGETOKEN']._serialized_end=1553
+  _globals['_PAGETOKEN_SORTKEYVALUE']._serialized_start=1399
+  _globals['_PAGETOKEN_SORTKEYVALUE']._serialized_end=1553
+  _globals['_PREPAREREQUEST']._serialized_start=1555
+  _globals['_PREPAREREQUEST']._serialized_end=1657
+  _globals['_PREPARERESPONSE']._serialized_start=1659
+  _globals['_PREPARERESPONSE']._serialized_end=1703
+  _globals['_EXECUTEREQUEST']._serialized_start=1706
+  _globals['_EXECUTEREQUEST']._serialized_end=2126
+  _globals['_EXECUTEREQUEST_PARAMETER']._serialized_start=1885
+  _globals['_EXECUTEREQUEST_PARAMETER']._serialized_end=2015
+  _globals['_EXECUTEREQUEST_VALUESET']._serialized_start=2017
+  _globals['_EXECUTEREQUEST_VALUESET']._serialized_end=2043
+  _globals['_EXECUTEREQUEST_PARAMETERSENTRY']._serialized_start=2045
+  _globals['_EXECUTEREQUEST_PARAMETERSENTRY']._serialized_end=2126
+  _globals['_QUERYRESPONSE']._serialized_start=2128
+  _globals['_QUERYRESPONSE']._serialized_end=2247
+  _globals['_QUERYPROFILE']._serialized_start=2250
+  _globals['_QUERYPROFILE']._serialized_end=3002
+  _globals['_QUERYPROFILE_RECORDBATCH']._serialized_start=2518
+  _globals['_QUERYPROFILE_RECORDBATCH']._serialized_end=2682
+  _globals['_QUERYPROFILE_MORSEL']._serialized_start=2684
+  _globals['_QUERYPROFILE_MORSEL']._serialized_end=2796
+  _globals['_QUERYPROFILE_URL']._serialized_start=2799
+  _globals['_QUERYPROFILE_URL']._serialized_end=3002
+  _globals['_QUERYRESPONSECHUNK']._serialized_start=3004
+  _globals['_QUERYRESPONSECHUNK']._serialized_end=3064
+  _globals['_QUERYSERVICE']._serialized_start=3067
+  _globals['_QUERYSERVICE']._serialized_end=3312
 # @@protoc_insertion_point(module_scope)
@@ -1,11 +1,31 @@
 # Generated by the gRPC Python protocol compiler plugin. DO NOT EDIT!
 """Client and server classes corresponding to protobuf-defined services."""
 import grpc
+import warnings
 
 import seqr_query_service_pb2 as seqr__query__service__pb2
 
+GRPC_GENERATED_VERSION = '1.84.0'
+GRPC_VERSION = grpc.__version__
+_version_not_supported = False
 
-class QueryServiceStub(object):
+try:
+    from grpc._utilities import first_version_is_lower
+    _version_not_supported = first_version_is_lower(GRPC_VERSION, GRPC_GENERATED_VERSION)
+except ImportError:
+    _version_not_supported = True
+
+if _version_not_supported:
+    raise RuntimeError(
+        f'The grpc package installed is at version {GRPC_VERSION},'
+        + ' but the generated code in seqr_query_service_pb2_grpc.py depends on'
+        + f' grpcio>={GRPC_GENERATED_VERSION}.'
+        + f' Please upgrade your grpc module to grpcio>={GRPC_GENERATED_VERSION}'
+        + f' or downgrade your generated code using grpcio-tools<={GRPC_VERSION}.'
+    )
+
+
+class QueryServiceStub:
     """Missing associated documentation comment in .proto file."""
 
     def __init__(self, channel):
@@ -18,10 +38,25 @@ class QueryServiceStub(object):
                 '/seqr.QueryService/Query',
                 request_serializer=seqr__query__service__pb2.QueryRequest.SerializeToString,
                 response_deserializer=seqr__query__service__pb2.QueryResponse.FromString,
-                )
+                _registered_method=True)
+        self.QueryStream = channel.unary_stream(
+                '/seqr.QueryService/QueryStream',
+                request_serializer=seqr__query__service__pb2.QueryRequest.SerializeToString,
+                response_deserializer=seqr__query__service__pb2.QueryResponseChunk.FromString,
+                _registered_method=True)
+        self.Prepare = channel.unary_unary(
+                '/seqr.QueryService/Prepare',
+                request_serializer=seqr__query__service__pb2.PrepareRequest.SerializeToString,
+                response_deserializer=seqr__query__service__pb2.PrepareResponse.FromString,
+                _registered_method=True)
+        self.Execute = channel.unary_unary(
+                '/seqr.QueryService/Execute',
+                request_serializer=seqr__query__service__pb2.ExecuteRequest.SerializeToString,
+                response_deserializer=seqr__query__service__pb2.QueryResponse.FromString,
+                _registered_method=True)
 
 
-class QueryServiceServicer(object):
+class QueryServiceServicer:
     """Missing associated documentation comment in .proto file."""
 
     def Query(self, request, context):
@@ -30,6 +65,29 @@ class QueryServiceServicer(object):
         context.set_details('Method not implemented!')
         raise NotImplementedError('Method not implemented!')
 
+    def QueryStream(self, request, context):
+        """Like Query, but streams results back as soon as each Arrow file has been
+        processed, instead of waiting for all files to be done.
+        """
+        context.set_code(grpc.StatusCode.UNIMPLEMENTED)
+        context.set_details('Method not implemented!')
+        raise NotImplementedError('Method not implemented!')
+
+    def Prepare(self, request, context):
+        """Compiles a query whose filter expression contains parameters, so it can
+        be executed repeatedly with different parameter values, e.g. sample IDs.
+        """
+        context.set_code(grpc.StatusCode.UNIMPLEMENTED)
+        context.set_details('Method not implemented!')
+        raise NotImplementedError('Method not implemented!')
+
+    def Execute(self, request, context):
+        """Executes a prepared query with the given parameter values.
+        """
+        context.set_code(grpc.StatusCode.UNIMPLEMENTED)
+        context.set_details('Method not implemented!')
+        raise NotImplementedError('Method not implemented!')
+
 
 def add_QueryServiceServicer_to_server(servicer, server):
     rpc_method_handlers = {
@@ -38,14 +96,30 @@ def add_QueryServiceServicer_to_server(servicer, server):
                     request_deserializer=seqr__query__service__pb2.QueryRequest.FromString,
                     response_serializer=seqr__query__service__pb2.QueryResponse.SerializeToString,
             ),
+            'QueryStream': grpc.unary_stream_rpc_method_handler(
+                    servicer.QueryStream,
+                    request_deserializer=seqr__query__service__pb2.QueryRequest.FromString,
+                    response_serializer=seqr__query__service__pb2.QueryResponseChunk.SerializeToString,
+            ),
+            'Prepare': grpc.unary_unary_rpc_method_handler(
+                    servicer.Prepare,
+                    request_deserializer=seqr__query__service__pb2.PrepareRequest.FromString,
+                    response_serializer=seqr__query__service__pb2.PrepareResponse.SerializeToString,
+            ),
+            'Execute': grpc.unary_unary_rpc_method_handler(
+                    servicer.Execute,
+                    request_deserializer=seqr__query__service__pb2.ExecuteRequest.FromString,
+                    response_serializer=seqr__query__service__pb2.QueryResponse.SerializeToString,
+            ),
     }
     generic_handler = grpc.method_handlers_generic_handler(
             'seqr.QueryService', rpc_method_handlers)
     server.add_generic_rpc_handlers((generic_handler,))
+    server.add_registered_method_handlers('seqr.QueryService', rpc_method_handlers)
 
 
  # This class is part of an EXPERIMENTAL API.
-class QueryService(object):
+class QueryService:
     """Missing associated documentation comment in .proto file."""
 
     @staticmethod
@@ -59,8 +133,99 @@ class QueryService(object):
             wait_for_ready=None,
             timeout=None,
             metadata=None):
-        return grpc.experimental.unary_unary(request, target, '/seqr.QueryService/Query',
+        return grpc.experimental.unary_unary(
+            request,
+            target,
+            '/seqr.QueryService/Query',
+            seqr__query__service__pb2.QueryRequest.SerializeToString,
+            seqr__query__service__pb2.QueryResponse.FromString,
+            options,
+            channel_credentials,
+            insecure,
+            call_credentials,
+            compression,
+            wait_for_ready,
+            timeout,
+            metadata,
+            _registered_method=True)
+
+    @staticmethod
+    def QueryStream(request,
+            target,
+            options=(),
+            channel_credentials=None,
+            call_credentials=None,
+            insecure=False,
+            compression=None,
+            wait_for_ready=None,
+            timeout=None,
+            metadata=None):
+        return grpc.experimental.unary_stream(
+            request,
+            target,
+            '/seqr.QueryService/QueryStream',
             seqr__query__service__pb2.QueryRequest.SerializeToString,
+            seqr__query__service__pb2.QueryResponseChunk.FromString,
+            options,
+            channel_credentials,
+            insecure,
+            call_credentials,
+            compression,
+            wait_for_ready,
+            timeout,
+            metadata,
+            _registered_method=True)
+
+    @staticmethod
+    def Prepare(request,
+            target,
+            options=(),
+            channel_credentials=None,
+            call_credentials=None,
+            insecure=False,
+            compression=None,
+            wait_for_ready=None,
+            timeout=None,
+            metadata=None):
+        return grpc.experimental.unary_unary(
+            request,
+            target,
+            '/seqr.QueryService/Prepare',
+            seqr__query__service__pb2.PrepareRequest.SerializeToString,
+            seqr__query__service__pb2.PrepareResponse.FromString,
+            options,
+            channel_credentials,
+            insecure,
+            call_credentials,
+            compression,
+            wait_for_ready,
+            timeout,
+            metadata,
+            _registered_method=True)
+
+    @staticmethod
+    def Execute(request,
+            target,
+            options=(),
+            channel_credentials=None,
+            call_credentials=None,
+            insecure=False,
+            compression=None,
+            wait_for_ready=None,
+            timeout=None,
+            metadata=None):
+        return grpc.experimental.unary_unary(
+            request,
+            target,
+            '/seqr.QueryService/Execute',
+            seqr__query__service__pb2.ExecuteRequest.SerializeToString,
             seqr__query__service__pb2.QueryResponse.FromString,
-            options, channel_credentials,
-            insecure, call_credentials, compression, wait_for_ready, timeout, metadata)
+            options,
+            channel_credentials,
+            insecure,
+            call_credentials,
+            compression,
+            wait_for_ready,
+            timeout,
+            metadata,
+            _registered_method=True)
@@ -1,13 +1,193 @@
 """Converts from Parquet to Arrow IPC."""
 
 import click
+import json
 import math
+import numpy as np
 import google.cloud.storage as gcs
 import pyarrow as pa
+import pyarrow.compute as pc
 import pyarrow.parquet as pq
 
 COMPRESSION = 'zstd'
 COMPRESSION_LEVEL = 19
+# Smaller record batches allow the server to skip more rows based on the zone
+# map, at the cost of a slightly worse compression ratio.
+RECORD_BATCH_SIZE = 32768
+# Schema metadata key for the zone map, see proto/zone_map.proto.
+ZONE_MAP_METADATA_KEY = b'seqr.zone_map'
+# Integer zone map bounds are int64, so uint64 columns may exceed them.
+INT64_MAX = 2**63 - 1
+# Schema metadata key for the tab-separated sample IDs that sample bitset
+# columns refer to, see server/sample_bitset.h.
+SAMPLE_INDEX_METADATA_KEY = b'seqr.sample_index'
+# Prefix of the genotype sample list columns, e.g. samples_num_alt_1.
+SAMPLES_COLUMN_PREFIX = 'samples_'
+
+
+def dictionary_encode_sample_lists(table):
+    """Dictionary-encodes the values of the list<string> sample columns.
+
+    Sample lists repeat the same few sample IDs for every row, so encoding them
+    as list<dictionary<int32, string>> makes files much smaller and lets the
+    server compare integer codes instead of strings. They're only used in
+    filters. Other string lists, like transcript IDs, are returned to clients
+    as they are, so they're left plain.
+    """
+    for index, field in enumerate(table.schema):
+        if not (
+            field.name.startswith(SAMPLES_COLUMN_PREFIX)
+            and pa.types.is_list(field.type)
+            and pa.types.is_string(field.type.value_type)
+        ):
+            continue
+        # IPC files only support one dictionary per column, so encode the
+        # combined column.
+        lists = table.column(index).combine_chunks()
+        encoded_values = pc.dictionary_encode(lists.values)
+        list_type = pa.list_(
+            pa.field(field.type.value_field.name, encoded_values.type)
+        )
+        encoded_lists = pa.Array.from_buffers(
+            list_type,
+            len(lists),
+            lists.buffers()[:2],
+            offset=lists.offset,
+            children=[encoded_values],
+        )
+        table = table.set_column(
+            index,
+            pa.field(
+                field.name,
+                list_type,
+                nullable=field.nullable,
+                metadata=field.metadata,
+            ),
+            encoded_lists,
+        )
+    return table
+
+
+def encode_sample_bitsets(table):
+    """Replaces genotype sample lists by fixed_size_binary bitsets.
+
+    Bit i (in LSB order) of a row is set if the i-th sample of the sample index
+    is in the list. This lets the server evaluate a family's genotype filter
+    with a few word-wide operations per row instead of string comparisons.
+    The sample index is specific to each file and stored in its metadata.
+    """
+    columns = [
+        index
+        for index, field in enumerate(table.schema)
+        if field.name.startswith(SAMPLES_COLUMN_PREFIX)
+        and pa.types.is_list(field.type)
+        and pa.types.is_string(field.type.value_type)
+    ]
+    sample_ids = set()
+    for index in columns:
+        lists = table.column(index).combine_chunks()
+        sample_ids.update(pc.unique(lists.flatten()).to_pylist())
+    sample_ids.discard(None)
+    sample_index = sorted(sample_ids)
+    sample_index_array = pa.array(sample_index, type=pa.string())
+    byte_width = max(1, (len(sample_index) + 7) // 8)
+
+    for index in columns:
+        field = table.schema.field(index)
+        lists = table.column(index).combine_chunks()
+        # Look up the position of every sample ID at once and scatter the
+        # bits into a row-major byte matrix, since Python loops over the
+        # samples of every row are far too slow for large callsets.
+        positions = pc.index_in(
+            pc.list_flatten(lists), value_set=sample_index_array
+        )
+        rows = pc.list_parent_indices(lists).to_numpy()
+        valid = pc.is_valid(positions).to_numpy(zero_copy_only=False)
+        rows = rows[valid]
+        positions = positions.drop_null().to_numpy().astype(np.int64)
+        bits = np.zeros((len(lists), byte_width), dtype=np.uint8)
+        np.bitwise_or.at(
+            bits,
+            (rows, positions // 8),
+            np.left_shift(1, positions % 8).astype(np.uint8),
+        )
+        validity = (
+            pc.is_valid(lists).buffers()[1] if lists.null_count > 0 else None
+        )
+        bitset_type = pa.binary(byte_width)
+        table = table.set_column(
+            index,
+            pa.field(
+                field.name,
+                bitset_type,
+                nullable=field.nullable,
+                metadata=field.metadata,
+            ),
+            pa.Array.from_buffers(
+                bitset_type,
+                len(lists),
+                [validity, pa.py_buffer(bits.tobytes())],
+                null_count=lists.null_count,
+            ),
+        )
+
+    metadata = dict(table.schema.metadata or {})
+    metadata[SAMPLE_INDEX_METADATA_KEY] = '\t'.join(sample_index).encode()
+    return table.replace_schema_metadata(metadata)
+
+
+def column_statistics(column):
+    """Returns the zone map statistics of a numeric column, or None."""
+    if not (
+        pa.types.is_integer(column.type) or pa.types.is_floating(column.type)
+    ):
+        return None
+    result = {'nullCount': str(column.null_count)}
+    # NaN values never compare equal, so min/max would be unsafe to use.
+    if pa.types.is_floating(column.type) and pc.any(pc.is_nan(column)).as_py():
+        return result
+    min_max = pc.min_max(column)
+    min_value, max_value = min_max['min'].as_py(), min_max['max'].as_py()
+    if pa.types.is_integer(column.type):
+        # Integers are stored exactly, as int64 strings like other int64
+        # fields, since doubles would round large values.
+        if min_value is not None and max_value <= INT64_MAX:
+            result['minInt'] = str(min_value)
+            result['maxInt'] = str(max_value)
+        return result
+    if min_value is not None and math.isfinite(min_value):
+        result['min'] = float(min_value)
+    if max_value is not None and math.isfinite(max_value):
+        result['max'] = float(max_value)
+    return result
+
+
+def statistics(table):
+    """Returns the zone map statistics of all numeric columns of a table."""
+    columns = {}
+    for name, column in zip(table.column_names, table.columns):
+        column_stats = column_statistics(column)
+        if column_stats is not None:
+            columns[name] = column_stats
+    return {
+        'numRows': str(table.num_rows),
+        'columns': columns,
+        'uncompressedBytes': str(table.nbytes),
+    }
+
+
+def add_zone_map(table, record_batches):
+    """Returns the table's schema with the zone map of the record batches."""
+    zone_map = {
+        'file': statistics(table),
+        'recordBatches': [
+            statistics(pa.Table.from_batches([record_batch]))
+            for record_batch in record_batches
+        ],
+    }
+    metadata = dict(table.schema.metadata or {})
+    metadata[ZONE_MAP_METADATA_KEY] = json.dumps(zone_map).encode()
+    return table.schema.with_metadata(metadata)
 
 
 @click.command()
@@ -19,7 +199,12 @@ COMPRESSION_LEVEL = 19
 @click.option(
     '--shard_count', help='Shard count for input files', type=int, required=True
 )
-def parquet_to_arrow(input, output, shard_index, shard_count):
+@click.option(
+    '--sample_bitsets',
+    help='Store genotype sample lists as fixed-width bitsets',
+    is_flag=True,
+)
+def parquet_to_arrow(input, output, shard_index, shard_count, sample_bitsets):
     gcs_client = gcs.Client()
 
     def bucket_and_name(gcs_path):
@@ -51,14 +236,20 @@ def parquet_to_arrow(input, output, shard_index, shard_count):
         )
 
         print('Converting to Arrow format...')
+        if sample_bitsets:
+            table = encode_sample_bitsets(table)
+        table = dictionary_encode_sample_lists(table)
+        record_batches = table.to_batches(max_chunksize=RECORD_BATCH_SIZE)
+        schema = add_zone_map(table, record_batches)
         output_buffer_stream = pa.BufferOutputStream()
         ipc_options = pa.ipc.IpcWriteOptions(
             compression=pa.Codec(COMPRESSION, COMPRESSION_LEVEL)
         )
         with pa.ipc.RecordBatchFileWriter(
-            output_buffer_stream, table.schema, options=ipc_options
+            output_buffer_stream, schema, options=ipc_options
         ) as ipc_writer:
-            ipc_writer.write_table(table)
+            for record_batch in record_batches:
+                ipc_writer.write_batch(record_batch)
         buffer = output_buffer_stream.getvalue()
 
         base_name = input_blob.name.split('/')[-1].split('.')[0]
@@ -0,0 +1,623 @@
+#include "aggregation.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/str_cat.h>
+#include <arrow/array/array_binary.h>
+#include <arrow/array/array_primitive.h>
+#include <arrow/array/builder_base.h>
+#include <arrow/array/builder_binary.h>
+#include <arrow/array/builder_primitive.h>
+#include <arrow/type_traits.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+namespace seqr {
+namespace {
+
+using Function = QueryRequest::Aggregation::Function;
+
+// Tags of encoded values. Integers of all widths are encoded as int64, and
+// floating point numbers as doubles, so equal values of files with different
+// column types end up in the same group. Only uint64 values above INT64_MAX,
+// which no other integer equals, are encoded as uint64.
+constexpr char kNullTag = 'n';
+constexpr char kBoolTag = 'b';
+constexpr char kIntTag = 'i';
+constexpr char kUintTag = 'u';
+constexpr char kDoubleTag = 'd';
+constexpr char kStringTag = 's';
+
+bool IsEncodable(const arrow::DataType& type) {
+  return type.id() == arrow::Type::BOOL || type.id() == arrow::Type::STRING ||
+         arrow::is_integer(type.id()) || arrow::is_floating(type.id());
+}
+
+// Returns whether an aggregate function supports a column type.
+bool IsSupported(const Function function, const arrow::DataType& type) {
+  switch (function) {
+    case QueryRequest::Aggregation::COUNT:
+      return true;
+    case QueryRequest::Aggregation::COUNT_DISTINCT:
+      return IsEncodable(type);
+    default:
+      return arrow::is_integer(type.id()) || arrow::is_floating(type.id());
+  }
+}
+
+template <typename ArrowType>
+typename ArrowType::c_type GetValue(const arrow::Array& array,
+                                    const int64_t row) {
+  return static_cast<const arrow::NumericArray<ArrowType>&>(array).Value(row);
+}
+
+// Returns the value of an integer array as int64, or nothing for other types
+// and uint64 values above INT64_MAX.
+std::optional<int64_t> GetInteger(const arrow::Array& array,
+                                  const int64_t row) {
+  switch (array.type_id()) {
+    case arrow::Type::INT8:
+      return GetValue<arrow::Int8Type>(array, row);
+    case arrow::Type::INT16:
+      return GetValue<arrow::Int16Type>(array, row);
+    case arrow::Type::INT32:
+      return GetValue<arrow::Int32Type>(array, row);
+    case arrow::Type::INT64:
+      return GetValue<arrow::Int64Type>(array, row);
+    case arrow::Type::UINT8:
+      return GetValue<arrow::UInt8Type>(array, row);
+    case arrow::Type::UINT16:
+      return GetValue<arrow::UInt16Type>(array, row);
+    case arrow::Type::UINT32:
+      return GetValue<arrow::UInt32Type>(array, row);
+    case arrow::Type::UINT64: {
+      const uint64_t value = GetValue<arrow::UInt64Type>(array, row);
+      if (value > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+        return std::nullopt;
+      }
+      return static_cast<int64_t>(value);
+    }
+    default:
+      return std::nullopt;
+  }
+}
+
+// Like above, for floating point arrays.
+std::optional<double> GetDouble(const arrow::Array& array, const int64_t row) {
+  switch (array.type_id()) {
+    case arrow::Type::FLOAT:
+      return GetValue<arrow::FloatType>(array, row);
+    case arrow::Type::DOUBLE:
+      return GetValue<arrow::DoubleType>(array, row);
+    default:
+      return std::nullopt;
+  }
+}
+
+template <typename T>
+void AppendFixed(const char tag, const T value, std::string* const out) {
+  out->push_back(tag);
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T ReadFixed(const std::string_view data, size_t* const pos) {
+  T result;
+  std::memcpy(&result, data.data() + *pos, sizeof(result));
+  *pos += sizeof(result);
+  return result;
+}
+
+// Appends the encoding of a value of an encodable array and returns its tag.
+char AppendValue(const arrow::Array& array, const int64_t row,
+                 std::string* const out) {
+  if (array.IsNull(row)) {
+    out->push_back(kNullTag);
+    return kNullTag;
+  }
+  if (array.type_id() == arrow::Type::BOOL) {
+    out->push_back(kBoolTag);
+    out->push_back(
+        static_cast<const arrow::BooleanArray&>(array).Value(row) ? 1 : 0);
+    return kBoolTag;
+  }
+  if (array.type_id() == arrow::Type::STRING) {
+    const auto value =
+        static_cast<const arrow::StringArray&>(array).GetView(row);
+    AppendFixed(kStringTag, static_cast<uint32_t>(value.size()), out);
+    out->append(value.data(), value.size());
+    return kStringTag;
+  }
+  if (const auto value = GetInteger(array, row); value.has_value()) {
+    AppendFixed(kIntTag, *value, out);
+    return kIntTag;
+  }
+  if (array.type_id() == arrow::Type::UINT64) {
+    AppendFixed(kUintTag, GetValue<arrow::UInt64Type>(array, row), out);
+    return kUintTag;
+  }
+  AppendFixed(kDoubleTag, *GetDouble(array, row), out);
+  return kDoubleTag;
+}
+
+std::shared_ptr<arrow::DataType> GetKeyType(const char tag) {
+  switch (tag) {
+    case kBoolTag:
+      return arrow::boolean();
+    case kIntTag:
+      return arrow::int64();
+    case kUintTag:
+      return arrow::uint64();
+    case kDoubleTag:
+      return arrow::float64();
+    case kStringTag:
+      return arrow::utf8();
+    default:  // Only nulls.
+      return arrow::null();
+  }
+}
+
+// Decodes a value that was encoded by AppendValue and appends it to a
+// builder of the corresponding key type.
+arrow::Status AppendDecoded(const std::string_view key, size_t* const pos,
+                            arrow::ArrayBuilder* const builder) {
+  const char tag = key[(*pos)++];
+  switch (tag) {
+    case kNullTag:
+      return builder->AppendNull();
+    case kBoolTag:
+      return static_cast<arrow::BooleanBuilder*>(builder)->Append(
+          key[(*pos)++] != 0);
+    case kIntTag: {
+      const auto value = ReadFixed<int64_t>(key, pos);
+      if (builder->type()->id() != arrow::Type::UINT64) {
+        return static_cast<arrow::Int64Builder*>(builder)->Append(value);
+      }
+      if (value < 0) {
+        return arrow::Status::Invalid(
+            "Group-by column has negative values and values above int64");
+      }
+      return static_cast<arrow::UInt64Builder*>(builder)->Append(
+          static_cast<uint64_t>(value));
+    }
+    case kUintTag:
+      return static_cast<arrow::UInt64Builder*>(builder)->Append(
+          ReadFixed<uint64_t>(key, pos));
+    case kDoubleTag:
+      return static_cast<arrow::DoubleBuilder*>(builder)->Append(
+          ReadFixed<double>(key, pos));
+    default: {
+      const auto size = ReadFixed<uint32_t>(key, pos);
+      const auto value = key.substr(*pos, size);
+      *pos += size;
+      return static_cast<arrow::StringBuilder*>(builder)->Append(
+          value.data(), static_cast<int32_t>(value.size()));
+    }
+  }
+}
+
+std::string GetAggregateName(
+    const QueryRequest::Aggregation::Aggregate& aggregate) {
+  if (!aggregate.name().empty()) {
+    return aggregate.name();
+  }
+  std::string result = absl::AsciiStrToLower(
+      QueryRequest::Aggregation::Function_Name(aggregate.function()));
+  if (!aggregate.column().empty()) {
+    absl::StrAppend(&result, "(", aggregate.column(), ")");
+  }
+  return result;
+}
+
+absl::Status ArrowError(const arrow::Status& status) {
+  return absl::InternalError(
+      absl::StrCat("Failed to build aggregates: ", status.ToString()));
+}
+
+}  // namespace
+
+absl::StatusOr<std::vector<std::string>> GetAggregationColumns(
+    const QueryRequest::Aggregation& aggregation) {
+  if (aggregation.aggregates().empty() &&
+      aggregation.group_by_columns().empty()) {
+    return absl::InvalidArgumentError(
+        "Aggregations need group-by columns or aggregates");
+  }
+  std::vector<std::string> result;
+  for (const auto& column : aggregation.group_by_columns()) {
+    if (std::find(result.begin(), result.end(), column) != result.end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Duplicate group-by column ", column));
+    }
+    result.push_back(column);
+  }
+  for (const auto& aggregate : aggregation.aggregates()) {
+    if (!QueryRequest::Aggregation::Function_IsValid(aggregate.function())) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Unknown aggregate function ", aggregate.function()));
+    }
+    if (aggregate.column().empty()) {
+      if (aggregate.function() != QueryRequest::Aggregation::COUNT) {
+        return absl::InvalidArgumentError(
+            absl::StrCat("Aggregate ", GetAggregateName(aggregate),
+                         " needs a column"));
+      }
+      continue;
+    }
+    if (std::find(result.begin(), result.end(), aggregate.column()) ==
+        result.end()) {
+      result.push_back(aggregate.column());
+    }
+  }
+  return result;
+}
+
+GroupedAggregates::GroupedAggregates(
+    const QueryRequest::Aggregation& aggregation,
+    TrackingMemoryPool* const pool)
+    : aggregation_(aggregation),
+      key_types_(aggregation.group_by_columns_size(), 0),
+      pool_(pool) {}
+
+GroupedAggregates::GroupedAggregates(GroupedAggregates&& other)
+    : aggregation_(other.aggregation_),
+      groups_(std::move(other.groups_)),
+      key_types_(std::move(other.key_types_)),
+      pool_(other.pool_),
+      charged_bytes_(std::exchange(other.charged_bytes_, 0)) {}
+
+GroupedAggregates::~GroupedAggregates() {
+  if (pool_ != nullptr && charged_bytes_ > 0) {
+    pool_->Release(charged_bytes_);
+  }
+}
+
+absl::Status GroupedAggregates::Add(const arrow::RecordBatch& record_batch) {
+  // Columns are resolved and type-checked once per record batch.
+  const auto get_column = [&record_batch](const std::string& name,
+                                          const bool is_group_by_column,
+                                          const Function function)
+      -> absl::StatusOr<const arrow::Array*> {
+    const auto* const array = record_batch.GetColumnByName(name).get();
+    if (array == nullptr) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Aggregation column not found: ", name));
+    }
+    if (is_group_by_column ? !IsEncodable(*array->type())
+                           : !IsSupported(function, *array->type())) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unsupported type of aggregation column ", name, ": ",
+                       array->type()->ToString()));
+    }
+    return array;
+  };
+  std::vector<const arrow::Array*> key_arrays;
+  for (const auto& column : aggregation_.group_by_columns()) {
+    const auto array = get_column(column, /* is_group_by_column */ true,
+                                  QueryRequest::Aggregation::COUNT);
+    if (!array.ok()) {
+      return array.status();
+    }
+    key_arrays.push_back(*array);
+  }
+  std::vector<const arrow::Array*> value_arrays;
+  for (const auto& aggregate : aggregation_.aggregates()) {
+    if (aggregate.column().empty()) {  // Counts rows.
+      value_arrays.push_back(nullptr);
+      continue;
+    }
+    const auto array = get_column(aggregate.column(),
+                                  /* is_group_by_column */ false,
+                                  aggregate.function());
+    if (!array.ok()) {
+      return array.status();
+    }
+    value_arrays.push_back(*array);
+  }
+
+  const size_t num_aggregates = value_arrays.size();
+  std::string key;
+  std::string value;
+  std::vector<char> key_tags(key_arrays.size());
+  // The approximate memory of new groups and distinct values, which is
+  // counted once per record batch, so the pool's limit may be exceeded by at
+  // most a record batch's worth.
+  size_t allocated_bytes = 0;
+  for (int64_t row = 0; row < record_batch.num_rows(); ++row) {
+    key.clear();
+    for (size_t i = 0; i < key_arrays.size(); ++i) {
+      key_tags[i] = AppendValue(*key_arrays[i], row, &key);
+    }
+    auto [it, inserted] = groups_.try_emplace(key);
+    std::vector<AggregateState>& states = it->second;
+    if (inserted) {
+      states.resize(num_aggregates);
+      allocated_bytes += sizeof(std::string) + key.size() + sizeof(states) +
+                         num_aggregates * sizeof(AggregateState);
+      for (size_t i = 0; i < key_tags.size(); ++i) {
+        if (key_tags[i] == kNullTag) {
+          continue;
+        }
+        if (const auto status = SetKeyType(i, key_tags[i]); !status.ok()) {
+          return status;
+        }
+      }
+    }
+
+    for (size_t i = 0; i < num_aggregates; ++i) {
+      const arrow::Array* const array = value_arrays[i];
+      AggregateState& state = states[i];
+      const auto function = aggregation_.aggregates(i).function();
+      if (array == nullptr) {
+        ++state.count;
+        continue;
+      }
+      if (array->IsNull(row)) {
+        continue;
+      }
+      switch (function) {
+        case QueryRequest::Aggregation::COUNT:
+          ++state.count;
+          break;
+        case QueryRequest::Aggregation::COUNT_DISTINCT:
+          value.clear();
+          AppendValue(*array, row, &value);
+          if (state.distinct_values.insert(value).second) {
+            allocated_bytes += sizeof(std::string) + value.size();
+          }
+          break;
+        default: {
+          Number number;
+          if (const auto int_value = GetInteger(*array, row);
+              int_value.has_value()) {
+            number.int_value = *int_value;
+          } else if (const auto double_value = GetDouble(*array, row);
+                     double_value.has_value()) {
+            number.is_double = true;
+            number.double_value = *double_value;
+          } else {
+            return absl::OutOfRangeError(absl::StrCat(
+                "Value of ", GetAggregateName(aggregation_.aggregates(i)),
+                " exceeds int64"));
+          }
+          if (const auto status =
+                  AddNumber(aggregation_.aggregates(i), number, &state);
+              !status.ok()) {
+            return status;
+          }
+        }
+      }
+    }
+  }
+  return Charge(static_cast<int64_t>(allocated_bytes));
+}
+
+absl::Status GroupedAggregates::Merge(GroupedAggregates other) {
+  for (size_t i = 0; i < other.key_types_.size(); ++i) {
+    if (other.key_types_[i] == 0) {
+      continue;
+    }
+    if (const auto status = SetKeyType(i, other.key_types_[i]); !status.ok()) {
+      return status;
+    }
+  }
+  // The memory of duplicate groups and values isn't released until this
+  // object is destroyed, which is soon for the partial aggregates of a
+  // morsel.
+  charged_bytes_ += std::exchange(other.charged_bytes_, 0);
+  for (auto& [key, other_states] : other.groups_) {
+    auto [it, inserted] = groups_.try_emplace(key);
+    if (inserted) {
+      it->second = std::move(other_states);
+      continue;
+    }
+    for (size_t i = 0; i < other_states.size(); ++i) {
+      AggregateState& state = it->second[i];
+      AggregateState& other_state = other_states[i];
+      state.count += other_state.count;
+      if (other_state.has_number) {
+        if (const auto status = AddNumber(aggregation_.aggregates(i),
+                                          other_state.number, &state);
+            !status.ok()) {
+          return status;
+        }
+      }
+      if (state.distinct_values.size() < other_state.distinct_values.size()) {
+        std::swap(state.distinct_values, other_state.distinct_values);
+      }
+      state.distinct_values.insert(other_state.distinct_values.begin(),
+                                   other_state.distinct_values.end());
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> GroupedAggregates::Finish(
+    arrow::MemoryPool* const pool) const {
+  const size_t num_aggregates = aggregation_.aggregates_size();
+  // Groups are sorted by their encoded keys, so responses are deterministic.
+  std::vector<std::pair<std::string_view, const std::vector<AggregateState>*>>
+      groups;
+  groups.reserve(groups_.size());
+  for (const auto& [key, states] : groups_) {
+    groups.emplace_back(key, &states);
+  }
+  std::sort(groups.begin(), groups.end());
+  // Without group-by columns, all rows form a single group, even if there are
+  // none.
+  const std::vector<AggregateState> empty_states(num_aggregates);
+  if (aggregation_.group_by_columns().empty() && groups.empty()) {
+    groups.emplace_back("", &empty_states);
+  }
+
+  arrow::FieldVector fields;
+  std::vector<std::unique_ptr<arrow::ArrayBuilder>> builders;
+  for (int i = 0; i < aggregation_.group_by_columns_size(); ++i) {
+    fields.push_back(arrow::field(aggregation_.group_by_columns(i),
+                                  GetKeyType(key_types_[i])));
+  }
+  for (size_t i = 0; i < num_aggregates; ++i) {
+    const auto& aggregate = aggregation_.aggregates(i);
+    auto type = arrow::int64();
+    if (aggregate.function() != QueryRequest::Aggregation::COUNT &&
+        aggregate.function() != QueryRequest::Aggregation::COUNT_DISTINCT &&
+        std::any_of(groups.begin(), groups.end(), [i](const auto& group) {
+          return (*group.second)[i].number.is_double;
+        })) {
+      type = arrow::float64();
+    }
+    fields.push_back(arrow::field(GetAggregateName(aggregate), type));
+  }
+  for (const auto& field : fields) {
+    std::unique_ptr<arrow::ArrayBuilder> builder;
+    if (const auto status = arrow::MakeBuilder(pool, field->type(), &builder);
+        !status.ok()) {
+      return ArrowError(status);
+    }
+    if (const auto status =
+            builder->Reserve(static_cast<int64_t>(groups.size()));
+        !status.ok()) {
+      return ArrowError(status);
+    }
+    builders.push_back(std::move(builder));
+  }
+
+  const size_t num_keys = key_types_.size();
+  for (const auto& [key, states] : groups) {
+    size_t pos = 0;
+    for (size_t i = 0; i < num_keys; ++i) {
+      if (const auto status = AppendDecoded(key, &pos, builders[i].get());
+          !status.ok()) {
+        return ArrowError(status);
+      }
+    }
+    for (size_t i = 0; i < num_aggregates; ++i) {
+      const AggregateState& state = (*states)[i];
+      auto* const builder = builders[num_keys + i].get();
+      arrow::Status status;
+      switch (aggregation_.aggregates(i).function()) {
+        case QueryRequest::Aggregation::COUNT:
+          status =
+              static_cast<arrow::Int64Builder*>(builder)->Append(state.count);
+          break;
+        case QueryRequest::Aggregation::COUNT_DISTINCT:
+          status = static_cast<arrow::Int64Builder*>(builder)->Append(
+              static_cast<int64_t>(state.distinct_values.size()));
+          break;
+        default:
+          if (!state.has_number) {
+            status = builder->AppendNull();
+          } else if (builder->type()->id() == arrow::Type::DOUBLE) {
+            status = static_cast<arrow::DoubleBuilder*>(builder)->Append(
+                state.number.is_double
+                    ? state.number.double_value
+                    : static_cast<double>(state.number.int_value));
+          } else {
+            status = static_cast<arrow::Int64Builder*>(builder)->Append(
+                state.number.int_value);
+          }
+      }
+      if (!status.ok()) {
+        return ArrowError(status);
+      }
+    }
+  }
+
+  arrow::ArrayVector columns;
+  for (const auto& builder : builders) {
+    std::shared_ptr<arrow::Array> column;
+    if (const auto status = builder->Finish(&column); !status.ok()) {
+      return ArrowError(status);
+    }
+    columns.push_back(std::move(column));
+  }
+  return arrow::RecordBatch::Make(arrow::schema(std::move(fields)),
+                                  static_cast<int64_t>(groups.size()),
+                                  std::move(columns));
+}
+
+std::optional<GroupedAggregates::Number> GroupedAggregates::Combine(
+    const Function function, const Number& lhs, const Number& rhs) {
+  const auto combine = [function](const auto lhs_value, const auto rhs_value) {
+    switch (function) {
+      case QueryRequest::Aggregation::MIN:
+        return std::min(lhs_value, rhs_value);
+      case QueryRequest::Aggregation::MAX:
+        return std::max(lhs_value, rhs_value);
+      default:
+        return lhs_value + rhs_value;
+    }
+  };
+  Number result;
+  if (!lhs.is_double && !rhs.is_double) {
+    if (function == QueryRequest::Aggregation::SUM) {
+      if (__builtin_add_overflow(lhs.int_value, rhs.int_value,
+                                 &result.int_value)) {
+        return std::nullopt;
+      }
+      return result;
+    }
+    result.int_value = combine(lhs.int_value, rhs.int_value);
+    return result;
+  }
+  // Integers are converted if files disagree on the column type.
+  const auto as_double = [](const Number& number) {
+    return number.is_double ? number.double_value
+                            : static_cast<double>(number.int_value);
+  };
+  result.is_double = true;
+  result.double_value = combine(as_double(lhs), as_double(rhs));
+  return result;
+}
+
+absl::Status GroupedAggregates::AddNumber(
+    const QueryRequest::Aggregation::Aggregate& aggregate,
+    const Number& number, AggregateState* const state) {
+  if (!state->has_number) {
+    state->number = number;
+    state->has_number = true;
+    return absl::OkStatus();
+  }
+  const auto result = Combine(aggregate.function(), state->number, number);
+  if (!result.has_value()) {
+    return absl::OutOfRangeError(
+        absl::StrCat(GetAggregateName(aggregate), " overflows int64"));
+  }
+  state->number = *result;
+  return absl::OkStatus();
+}
+
+absl::Status GroupedAggregates::Charge(const int64_t bytes) {
+  if (pool_ == nullptr || bytes == 0) {
+    return absl::OkStatus();
+  }
+  if (const auto status = pool_->Reserve(bytes); !status.ok()) {
+    return absl::ResourceExhaustedError(absl::StrCat(
+        "Failed to aggregate rows: ", status.message()));
+  }
+  charged_bytes_ += bytes;
+  return absl::OkStatus();
+}
+
+absl::Status GroupedAggregates::SetKeyType(const size_t column,
+                                           const char type) {
+  char& key_type = key_types_[column];
+  if (key_type == 0) {
+    key_type = type;
+  } else if ((key_type == kIntTag && type == kUintTag) ||
+             (key_type == kUintTag && type == kIntTag)) {
+    // Integer columns with values above INT64_MAX result in uint64.
+    key_type = kUintTag;
+  } else if (key_type != type) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Inconsistent types of group-by column ",
+                     aggregation_.group_by_columns(column)));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace seqr
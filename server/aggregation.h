@@ -0,0 +1,103 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <arrow/memory_pool.h>
+#include <arrow/record_batch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "memory_budget.h"
+#include "seqr_query_service.pb.h"
+
+namespace seqr {
+
+// Validates an aggregation and returns the columns it reads, i.e. the
+// group-by columns followed by the aggregated columns, without duplicates.
+absl::StatusOr<std::vector<std::string>> GetAggregationColumns(
+    const QueryRequest::Aggregation& aggregation);
+
+// Hash aggregation of filtered rows (see QueryRequest.aggregation). Groups are
+// keyed by an encoding of their group-by values, so record batches are
+// aggregated in a single pass without materializing any rows. Partial
+// aggregates, e.g. of different morsels, can be merged. Not thread-safe.
+class GroupedAggregates {
+ public:
+  // `aggregation` must have been validated by GetAggregationColumns and
+  // outlive this object. The memory of groups and distinct values is counted
+  // towards `pool` if given, which must outlive this object too.
+  explicit GroupedAggregates(const QueryRequest::Aggregation& aggregation,
+                             TrackingMemoryPool* pool = nullptr);
+
+  GroupedAggregates(GroupedAggregates&& other);
+  GroupedAggregates& operator=(GroupedAggregates&&) = delete;
+
+  ~GroupedAggregates();
+
+  // Aggregates the rows of a record batch that contains all aggregation
+  // columns. Fails with RESOURCE_EXHAUSTED if the groups and distinct values
+  // exceed the limit of the pool.
+  absl::Status Add(const arrow::RecordBatch& record_batch);
+
+  // Merges the partial aggregates of another object of the same aggregation
+  // and pool. The other object's memory is counted as this one's.
+  absl::Status Merge(GroupedAggregates other);
+
+  size_t num_groups() const { return groups_.size(); }
+
+  // Returns one row per group, with the group-by columns followed by the
+  // aggregates. Without group-by columns, there's always exactly one row.
+  absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> Finish(
+      arrow::MemoryPool* pool) const;
+
+ private:
+  // The value of a MIN, MAX or SUM aggregate.
+  struct Number {
+    bool is_double = false;
+    int64_t int_value = 0;
+    double double_value = 0;
+  };
+
+  struct AggregateState {
+    int64_t count = 0;  // For COUNT.
+    bool has_number = false;
+    Number number;  // For MIN, MAX and SUM.
+    absl::flat_hash_set<std::string> distinct_values;  // For COUNT_DISTINCT.
+  };
+
+  // Combines numbers according to an aggregate function. Returns nothing if
+  // an integer sum overflows.
+  static std::optional<Number> Combine(
+      QueryRequest::Aggregation::Function function, const Number& lhs,
+      const Number& rhs);
+
+  static absl::Status AddNumber(
+      const QueryRequest::Aggregation::Aggregate& aggregate,
+      const Number& number, AggregateState* state);
+
+  // Counts memory that has been allocated towards the pool.
+  absl::Status Charge(int64_t bytes);
+
+  // Records the value type of a group-by column, which needs to agree across
+  // record batches.
+  absl::Status SetKeyType(size_t column, char type);
+
+  const QueryRequest::Aggregation& aggregation_;
+  // By encoded group-by values.
+  absl::flat_hash_map<std::string, std::vector<AggregateState>> groups_;
+  // The encoding type of the non-null values of every group-by column, or 0
+  // if there are none.
+  std::vector<char> key_types_;
+  TrackingMemoryPool* const pool_;
+  // Reserved from pool_, and released on destruction.
+  int64_t charged_bytes_ = 0;
+};
+
+}  // namespace seqr
@@ -0,0 +1,241 @@
+#include "aggregation.h"
+
+#include <arrow/array/array_binary.h>
+#include <arrow/array/array_primitive.h>
+#include <arrow/array/builder_binary.h>
+#include <arrow/array/builder_primitive.h>
+#include <arrow/testing/gtest_util.h>
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "memory_budget.h"
+
+namespace seqr {
+namespace {
+
+std::shared_ptr<arrow::RecordBatch> MakeRecordBatch(
+    const std::vector<std::optional<std::string>>& genes,
+    const std::vector<std::optional<double>>& af) {
+  arrow::StringBuilder gene_builder;
+  for (const auto& gene : genes) {
+    EXPECT_TRUE((gene.has_value() ? gene_builder.Append(*gene)
+                                  : gene_builder.AppendNull())
+                    .ok());
+  }
+  arrow::DoubleBuilder af_builder;
+  for (const auto& value : af) {
+    EXPECT_TRUE((value.has_value() ? af_builder.Append(*value)
+                                   : af_builder.AppendNull())
+                    .ok());
+  }
+  std::shared_ptr<arrow::Array> gene_array;
+  EXPECT_TRUE(gene_builder.Finish(&gene_array).ok());
+  std::shared_ptr<arrow::Array> af_array;
+  EXPECT_TRUE(af_builder.Finish(&af_array).ok());
+  return arrow::RecordBatch::Make(
+      arrow::schema({arrow::field("gene", arrow::utf8()),
+                     arrow::field("AF", arrow::float64())}),
+      static_cast<int64_t>(genes.size()), {gene_array, af_array});
+}
+
+// Groups by gene, counting rows and distinct AF values and computing the
+// maximum AF.
+QueryRequest::Aggregation MakeAggregation() {
+  QueryRequest::Aggregation result;
+  result.add_group_by_columns("gene");
+  result.add_aggregates()->set_function(QueryRequest::Aggregation::COUNT);
+  auto* const count_distinct = result.add_aggregates();
+  count_distinct->set_function(QueryRequest::Aggregation::COUNT_DISTINCT);
+  count_distinct->set_column("AF");
+  auto* const max = result.add_aggregates();
+  max->set_function(QueryRequest::Aggregation::MAX);
+  max->set_column("AF");
+  max->set_name("max_af");
+  return result;
+}
+
+TEST(GetAggregationColumns, ValidatesAggregation) {
+  const auto columns = GetAggregationColumns(MakeAggregation());
+  ASSERT_TRUE(columns.ok()) << columns.status();
+  EXPECT_EQ(*columns, (std::vector<std::string>{"gene", "AF"}));
+
+  EXPECT_TRUE(absl::IsInvalidArgument(
+      GetAggregationColumns(QueryRequest::Aggregation()).status()));
+  QueryRequest::Aggregation missing_column;
+  missing_column.add_aggregates()->set_function(
+      QueryRequest::Aggregation::SUM);
+  EXPECT_TRUE(
+      absl::IsInvalidArgument(GetAggregationColumns(missing_column).status()));
+}
+
+TEST(GroupedAggregates, MergesPartialAggregates) {
+  const QueryRequest::Aggregation aggregation = MakeAggregation();
+  GroupedAggregates aggregates(aggregation);
+  ASSERT_TRUE(aggregates
+                  .Add(*MakeRecordBatch({"A", "B", "A", std::nullopt},
+                                        {0.1, 0.2, 0.1, 0.5}))
+                  .ok());
+  GroupedAggregates partial_aggregates(aggregation);
+  ASSERT_TRUE(partial_aggregates
+                  .Add(*MakeRecordBatch({"A", "C"}, {0.3, std::nullopt}))
+                  .ok());
+  ASSERT_TRUE(aggregates.Merge(std::move(partial_aggregates)).ok());
+  EXPECT_EQ(aggregates.num_groups(), size_t{4});
+
+  const auto record_batch = aggregates.Finish(arrow::default_memory_pool());
+  ASSERT_TRUE(record_batch.ok()) << record_batch.status();
+  ASSERT_OK((*record_batch)->ValidateFull());
+  EXPECT_EQ((*record_batch)->schema()->ToString(),
+            arrow::schema({arrow::field("gene", arrow::utf8()),
+                           arrow::field("count", arrow::int64()),
+                           arrow::field("count_distinct(AF)", arrow::int64()),
+                           arrow::field("max_af", arrow::float64())})
+                ->ToString());
+
+  // Groups are sorted by their encoded keys, which puts nulls first.
+  const auto& genes =
+      static_cast<const arrow::StringArray&>(*(*record_batch)->column(0));
+  const auto& counts =
+      static_cast<const arrow::Int64Array&>(*(*record_batch)->column(1));
+  const auto& distinct_counts =
+      static_cast<const arrow::Int64Array&>(*(*record_batch)->column(2));
+  const auto& max_af =
+      static_cast<const arrow::DoubleArray&>(*(*record_batch)->column(3));
+  ASSERT_EQ(genes.length(), 4);
+  EXPECT_TRUE(genes.IsNull(0));
+  EXPECT_DOUBLE_EQ(max_af.Value(0), 0.5);
+  EXPECT_EQ(genes.GetString(1), "A");
+  EXPECT_EQ(counts.Value(1), 3);
+  EXPECT_EQ(distinct_counts.Value(1), 2);
+  EXPECT_DOUBLE_EQ(max_af.Value(1), 0.3);
+  EXPECT_EQ(genes.GetString(3), "C");
+  EXPECT_EQ(counts.Value(3), 1);
+  EXPECT_EQ(distinct_counts.Value(3), 0);
+  EXPECT_TRUE(max_af.IsNull(3));
+}
+
+TEST(GroupedAggregates, ReturnsSingleRowWithoutGroupByColumns) {
+  QueryRequest::Aggregation aggregation;
+  aggregation.add_aggregates()->set_function(QueryRequest::Aggregation::COUNT);
+  auto* const sum = aggregation.add_aggregates();
+  sum->set_function(QueryRequest::Aggregation::SUM);
+  sum->set_column("AF");
+  GroupedAggregates aggregates(aggregation);
+
+  // Even without any rows.
+  auto record_batch = aggregates.Finish(arrow::default_memory_pool());
+  ASSERT_TRUE(record_batch.ok()) << record_batch.status();
+  ASSERT_EQ((*record_batch)->num_rows(), 1);
+  EXPECT_EQ(
+      static_cast<const arrow::Int64Array&>(*(*record_batch)->column(0))
+          .Value(0),
+      0);
+  EXPECT_TRUE((*record_batch)->column(1)->IsNull(0));
+
+  ASSERT_TRUE(
+      aggregates.Add(*MakeRecordBatch({"A", "B"}, {0.25, 0.5})).ok());
+  record_batch = aggregates.Finish(arrow::default_memory_pool());
+  ASSERT_TRUE(record_batch.ok()) << record_batch.status();
+  ASSERT_EQ((*record_batch)->num_rows(), 1);
+  EXPECT_EQ(
+      static_cast<const arrow::Int64Array&>(*(*record_batch)->column(0))
+          .Value(0),
+      2);
+  EXPECT_DOUBLE_EQ(
+      static_cast<const arrow::DoubleArray&>(*(*record_batch)->column(1))
+          .Value(0),
+      0.75);
+}
+
+TEST(GroupedAggregates, GroupsLargeUnsignedIntegers) {
+  QueryRequest::Aggregation aggregation;
+  aggregation.add_group_by_columns("id");
+  aggregation.add_aggregates()->set_function(QueryRequest::Aggregation::COUNT);
+  GroupedAggregates aggregates(aggregation);
+  ASSERT_OK(aggregates.Add(*arrow::RecordBatchFromJSON(
+      arrow::schema({arrow::field("id", arrow::uint64())}),
+      R"([{"id": 18446744073709551615}, {"id": 1},
+          {"id": 18446744073709551615}])")));
+
+  const auto record_batch = aggregates.Finish(arrow::default_memory_pool());
+  ASSERT_TRUE(record_batch.ok()) << record_batch.status();
+  ASSERT_OK((*record_batch)->ValidateFull());
+  EXPECT_TRUE((*record_batch)->Equals(*arrow::RecordBatchFromJSON(
+      arrow::schema({arrow::field("id", arrow::uint64()),
+                     arrow::field("count", arrow::int64())}),
+      R"([{"id": 1, "count": 1},
+          {"id": 18446744073709551615, "count": 2}])")))
+      << (*record_batch)->ToString();
+}
+
+TEST(GroupedAggregates, FailsOnIntegerOverflow) {
+  QueryRequest::Aggregation aggregation;
+  auto* const sum = aggregation.add_aggregates();
+  sum->set_function(QueryRequest::Aggregation::SUM);
+  sum->set_column("AC");
+  const auto schema = arrow::schema({arrow::field("AC", arrow::int64())});
+  GroupedAggregates aggregates(aggregation);
+  EXPECT_TRUE(absl::IsOutOfRange(aggregates.Add(*arrow::RecordBatchFromJSON(
+      schema, R"([{"AC": 9223372036854775807}, {"AC": 1}])"))));
+
+  // Also when merging partial sums.
+  GroupedAggregates first(aggregation);
+  ASSERT_OK(first.Add(
+      *arrow::RecordBatchFromJSON(schema, R"([{"AC": 9223372036854775807}])")));
+  GroupedAggregates second(aggregation);
+  ASSERT_OK(second.Add(*arrow::RecordBatchFromJSON(schema, R"([{"AC": 1}])")));
+  EXPECT_TRUE(absl::IsOutOfRange(first.Merge(std::move(second))));
+
+  // Values that don't fit into the int64 results.
+  sum->set_function(QueryRequest::Aggregation::MAX);
+  GroupedAggregates max(aggregation);
+  EXPECT_TRUE(absl::IsOutOfRange(max.Add(*arrow::RecordBatchFromJSON(
+      arrow::schema({arrow::field("AC", arrow::uint64())}),
+      R"([{"AC": 18446744073709551615}])"))));
+}
+
+TEST(GroupedAggregates, CountsMemoryTowardsPool) {
+  QueryRequest::Aggregation aggregation;
+  auto* const count_distinct = aggregation.add_aggregates();
+  count_distinct->set_function(QueryRequest::Aggregation::COUNT_DISTINCT);
+  count_distinct->set_column("gene");
+  MemoryBudget budget(1 << 20);
+  TrackingMemoryPool pool(&budget, 4096);
+  std::vector<std::optional<std::string>> genes;
+  for (int i = 0; i < 100; ++i) {
+    genes.push_back(std::string(100, static_cast<char>('A' + i % 26)) + std::to_string(i));
+  }
+  const auto record_batch =
+      MakeRecordBatch(genes, std::vector<std::optional<double>>(100, 0.1));
+  {
+    GroupedAggregates aggregates(aggregation, &pool);
+    ASSERT_OK(aggregates.Add(*record_batch->Slice(0, 10)));
+    EXPECT_GT(pool.bytes_allocated(), 10 * 100);
+
+    // The distinct values of all rows exceed the limit of the query.
+    EXPECT_TRUE(absl::IsResourceExhausted(aggregates.Add(*record_batch)));
+    EXPECT_TRUE(pool.limit_exceeded());
+  }
+  EXPECT_EQ(pool.bytes_allocated(), 0);
+}
+
+TEST(GroupedAggregates, RejectsUnsupportedColumns) {
+  QueryRequest::Aggregation aggregation;
+  auto* const sum = aggregation.add_aggregates();
+  sum->set_function(QueryRequest::Aggregation::SUM);
+  sum->set_column("gene");
+  GroupedAggregates aggregates(aggregation);
+  EXPECT_TRUE(absl::IsInvalidArgument(
+      aggregates.Add(*MakeRecordBatch({"A"}, {0.1}))));
+
+  sum->set_column("missing");
+  EXPECT_TRUE(absl::IsInvalidArgument(
+      aggregates.Add(*MakeRecordBatch({"A"}, {0.1}))));
+}
+
+}  // namespace
+}  // namespace seqr
@@ -0,0 +1,419 @@
+#include "async_server.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/synchronization/mutex.h>
+#include <grpc/support/time.h>
+#include <grpcpp/alarm.h>
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+namespace seqr {
+namespace {
+
+// A call of the asynchronous front end. Each call is a state machine that's
+// driven by the events of its completion queue, so waiting for results
+// doesn't block any thread: workers resume the call by setting an alarm on
+// the completion queue whenever results become available.
+//
+// All events of a call are handled by the thread of its completion queue.
+// A call gets deleted once none of its operations are pending anymore.
+// Deleting a call with a query waits for the query's remaining tasks, so
+// that's done by a teardown task instead of the completion queue's thread.
+class AsyncQueryCall {
+ public:
+  AsyncQueryCall(seqr::QueryService::AsyncService* const service,
+                 grpc::ServerCompletionQueue* const completion_queue,
+                 AsyncQueryEngine* const engine,
+                 Scheduler::TaskGroup* const teardowns)
+      : service_(*service),
+        completion_queue_(*completion_queue),
+        engine_(*engine),
+        teardowns_(*teardowns) {}
+
+  AsyncQueryCall(const AsyncQueryCall&) = delete;
+  AsyncQueryCall& operator=(const AsyncQueryCall&) = delete;
+
+  virtual ~AsyncQueryCall() = default;
+
+  // Waits for the next incoming call of the method.
+  void Start() {
+    ++num_pending_ops_;
+    server_context_.AsyncNotifyWhenDone(&done_tag_);
+    Request(&requested_tag_);
+  }
+
+  // Handles an event returned by a completion queue.
+  static void HandleEvent(void* const tag, const bool ok) {
+    const auto& event_tag = *static_cast<const Tag*>(tag);
+    event_tag.call->Proceed(event_tag.event, ok);
+  }
+
+ protected:
+  // Requests the next incoming call of the method, completing with `tag`.
+  virtual void Request(void* tag) = 0;
+
+  // Returns a call of the same method, to wait for the next incoming call.
+  virtual AsyncQueryCall* Clone() const = 0;
+
+  // Called once the call has been received, usually to start its query.
+  virtual void OnRequested() = 0;
+
+  // Called whenever results may have become available, until the call gets
+  // finished.
+  virtual void OnResultsAvailable() = 0;
+
+  // Called once a write of a streaming call completed.
+  virtual void OnWritten(bool /* ok */) {}
+
+  // Fails the call with the given status.
+  virtual void FinishWithError(const grpc::Status& status) = 0;
+
+  // Returns the tag for writing a streaming response message. At most one
+  // write can be pending at a time.
+  void* WriteTag() {
+    ++num_pending_ops_;
+    return &written_tag_;
+  }
+
+  // Returns the tag for finishing the call, after which no further results
+  // are handed out.
+  void* FinishTag() {
+    ++num_pending_ops_;
+    absl::MutexLock l(&mu_);
+    finishing_ = true;
+    return &finished_tag_;
+  }
+
+  // Starts the query of the given request with `start`, one of the
+  // AsyncQueryEngine methods. OnResultsAvailable is called whenever results
+  // may have become available.
+  template <typename Request, typename Start>
+  void StartQuery(const Request& request, const Start start) {
+    std::unique_ptr<AsyncQuery> query;
+    if (const auto status =
+            (engine_.*start)(request, [this] { WakeUp(); }, &query);
+        !status.ok()) {
+      FinishWithError(status);
+      return;
+    }
+    query_ = std::move(query);
+    // Queries without URLs don't have any results to wait for.
+    WakeUp();
+  }
+
+  AsyncQuery* query() const { return query_.get(); }
+
+  seqr::QueryService::AsyncService& service_;
+  grpc::ServerCompletionQueue& completion_queue_;
+  AsyncQueryEngine& engine_;
+  Scheduler::TaskGroup& teardowns_;
+  grpc::ServerContext server_context_;
+
+ private:
+  enum class Event {
+    kRequested,
+    kResultsAvailable,
+    kWritten,
+    kFinished,
+    kDone,
+  };
+
+  struct Tag {
+    AsyncQueryCall* call;
+    Event event;
+  };
+
+  void Proceed(const Event event, const bool ok) {
+    --num_pending_ops_;
+    switch (event) {
+      case Event::kRequested:
+        // Fails once the server shuts down.
+        if (ok) {
+          // The done event is only returned for calls that have started.
+          ++num_pending_ops_;
+          Clone()->Start();
+          OnRequested();
+        }
+        break;
+      case Event::kResultsAvailable: {
+        bool finishing = false;
+        {
+          absl::MutexLock l(&mu_);
+          wakeup_pending_ = false;
+          finishing = finishing_;
+        }
+        if (!finishing) {
+          OnResultsAvailable();
+        }
+        break;
+      }
+      case Event::kWritten:
+        OnWritten(ok);
+        break;
+      case Event::kFinished:
+        break;
+      case Event::kDone:
+        if (server_context_.IsCancelled() && query_ != nullptr) {
+          query_->Cancel(absl::CancelledError(
+              "The query was cancelled by the client or its deadline "
+              "expired"));
+        }
+        break;
+    }
+    // Only workers increment the count concurrently, and only before the
+    // call gets finished.
+    if (num_pending_ops_ == 0) {
+      if (query_ == nullptr) {
+        delete this;
+      } else {
+        teardowns_.Schedule([this] { delete this; });
+      }
+    }
+  }
+
+  // Schedules a call of OnResultsAvailable on the completion queue, unless one
+  // is pending already. Called from worker threads.
+  void WakeUp() {
+    absl::MutexLock l(&mu_);
+    if (wakeup_pending_ || finishing_) {
+      return;
+    }
+    wakeup_pending_ = true;
+    ++num_pending_ops_;
+    wakeup_alarm_.Set(&completion_queue_, gpr_now(GPR_CLOCK_MONOTONIC),
+                      &results_available_tag_);
+  }
+
+  Tag requested_tag_{this, Event::kRequested};
+  Tag results_available_tag_{this, Event::kResultsAvailable};
+  Tag written_tag_{this, Event::kWritten};
+  Tag finished_tag_{this, Event::kFinished};
+  Tag done_tag_{this, Event::kDone};
+  std::atomic<int> num_pending_ops_ = 0;
+  absl::Mutex mu_;
+  grpc::Alarm wakeup_alarm_ ABSL_GUARDED_BY(mu_);
+  bool wakeup_pending_ ABSL_GUARDED_BY(mu_) = false;
+  bool finishing_ ABSL_GUARDED_BY(mu_) = false;
+  // Declared last, so it's destroyed first. Destroying the query waits for
+  // its remaining tasks, which may still call WakeUp. If the query got
+  // cancelled, they stop early.
+  std::unique_ptr<AsyncQuery> query_;
+};
+
+// An asynchronous Query or Execute call, which responds once all results are
+// available. `kRequestMethod` is the service's method for requesting calls,
+// `kStartMethod` the engine's method for starting their queries.
+template <typename RequestType, auto kRequestMethod, auto kStartMethod>
+class AsyncUnaryQueryCall final : public AsyncQueryCall {
+ public:
+  using AsyncQueryCall::AsyncQueryCall;
+
+ private:
+  void Request(void* const tag) override {
+    (service_.*kRequestMethod)(&server_context_, &request_, &responder_,
+                               &completion_queue_, &completion_queue_, tag);
+  }
+
+  AsyncQueryCall* Clone() const override {
+    return new AsyncUnaryQueryCall(&service_, &completion_queue_, &engine_,
+                                   &teardowns_);
+  }
+
+  void OnRequested() override { StartQuery(request_, kStartMethod); }
+
+  void OnResultsAvailable() override {
+    if (!query()->TakeAvailableResults()) {
+      return;
+    }
+    if (const auto status = query()->BuildResponse(&response_); !status.ok()) {
+      FinishWithError(status);
+      return;
+    }
+    responder_.Finish(response_, grpc::Status::OK, FinishTag());
+  }
+
+  void FinishWithError(const grpc::Status& status) override {
+    responder_.FinishWithError(status, FinishTag());
+  }
+
+  RequestType request_;
+  grpc::ServerAsyncResponseWriter<seqr::QueryResponse> responder_{
+      &server_context_};
+  seqr::QueryResponse response_;
+};
+
+using AsyncQueryUnaryCall =
+    AsyncUnaryQueryCall<seqr::QueryRequest,
+                        &seqr::QueryService::AsyncService::RequestQuery,
+                        &AsyncQueryEngine::StartQuery>;
+using AsyncExecuteCall =
+    AsyncUnaryQueryCall<seqr::ExecuteRequest,
+                        &seqr::QueryService::AsyncService::RequestExecute,
+                        &AsyncQueryEngine::StartExecution>;
+
+// An asynchronous QueryStream call, which writes results as soon as they
+// become available.
+class AsyncStreamQueryCall final : public AsyncQueryCall {
+ public:
+  using AsyncQueryCall::AsyncQueryCall;
+
+ private:
+  void Request(void* const tag) override {
+    service_.RequestQueryStream(&server_context_, &request_, &writer_,
+                                &completion_queue_, &completion_queue_, tag);
+  }
+
+  AsyncQueryCall* Clone() const override {
+    return new AsyncStreamQueryCall(&service_, &completion_queue_, &engine_,
+                                    &teardowns_);
+  }
+
+  void OnRequested() override {
+    StartQuery(request_, &AsyncQueryEngine::StartQueryStream);
+  }
+
+  void OnResultsAvailable() override {
+    if (!write_pending_) {
+      WriteNext();
+    }
+  }
+
+  void OnWritten(const bool ok) override {
+    write_pending_ = false;
+    if (!ok) {
+      query()->Cancel(absl::CancelledError("Failed to write response chunk"));
+      FinishWithError(query()->CancelStatus());
+      return;
+    }
+    WriteNext();
+  }
+
+  void FinishWithError(const grpc::Status& status) override {
+    writer_.Finish(status, FinishTag());
+  }
+
+  // Writes the next chunk, or finishes the call once all results have been
+  // written.
+  void WriteNext() {
+    std::optional<seqr::QueryResponseChunk> chunk;
+    bool last = false;
+    if (const auto status = query()->NextChunk(&chunk, &last); !status.ok()) {
+      FinishWithError(status);
+      return;
+    }
+    if (!last) {
+      if (chunk.has_value()) {
+        write_pending_ = true;
+        writer_.Write(*chunk, WriteTag());
+      }
+      return;
+    }
+    if (chunk.has_value()) {
+      writer_.WriteAndFinish(*chunk, grpc::WriteOptions(), grpc::Status::OK,
+                             FinishTag());
+    } else {
+      writer_.Finish(grpc::Status::OK, FinishTag());
+    }
+  }
+
+  seqr::QueryRequest request_;
+  grpc::ServerAsyncWriter<seqr::QueryResponseChunk> writer_{&server_context_};
+  bool write_pending_ = false;
+};
+
+// An asynchronous Prepare call. Preparing only compiles the query, which is
+// done right away on the thread of the completion queue.
+class AsyncPrepareCall final : public AsyncQueryCall {
+ public:
+  using AsyncQueryCall::AsyncQueryCall;
+
+ private:
+  void Request(void* const tag) override {
+    service_.RequestPrepare(&server_context_, &request_, &responder_,
+                            &completion_queue_, &completion_queue_, tag);
+  }
+
+  AsyncQueryCall* Clone() const override {
+    return new AsyncPrepareCall(&service_, &completion_queue_, &engine_,
+                                &teardowns_);
+  }
+
+  void OnRequested() override {
+    if (const auto status = engine_.Prepare(request_, &response_);
+        !status.ok()) {
+      FinishWithError(status);
+      return;
+    }
+    responder_.Finish(response_, grpc::Status::OK, FinishTag());
+  }
+
+  // There's no query whose results could become available.
+  void OnResultsAvailable() override {}
+
+  void FinishWithError(const grpc::Status& status) override {
+    responder_.FinishWithError(status, FinishTag());
+  }
+
+  seqr::PrepareRequest request_;
+  grpc::ServerAsyncResponseWriter<seqr::PrepareResponse> responder_{
+      &server_context_};
+  seqr::PrepareResponse response_;
+};
+
+}  // namespace
+
+AsyncQueryServer::AsyncQueryServer(AsyncQueryEngine* const engine,
+                                   const int num_threads)
+    : engine_(*engine),
+      num_threads_(std::max(1, num_threads)),
+      teardown_scheduler_(num_threads_) {}
+
+void AsyncQueryServer::Register(grpc::ServerBuilder* const builder) {
+  builder->RegisterService(&service_);
+  for (int i = 0; i < num_threads_; ++i) {
+    completion_queues_.push_back(builder->AddCompletionQueue());
+  }
+}
+
+void AsyncQueryServer::Start() {
+  for (const auto& completion_queue : completion_queues_) {
+    (new AsyncQueryUnaryCall(&service_, completion_queue.get(), &engine_,
+                             &teardowns_))
+        ->Start();
+    (new AsyncStreamQueryCall(&service_, completion_queue.get(), &engine_,
+                              &teardowns_))
+        ->Start();
+    (new AsyncPrepareCall(&service_, completion_queue.get(), &engine_,
+                          &teardowns_))
+        ->Start();
+    (new AsyncExecuteCall(&service_, completion_queue.get(), &engine_,
+                          &teardowns_))
+        ->Start();
+    threads_.emplace_back([completion_queue = completion_queue.get()] {
+      void* tag = nullptr;
+      bool ok = false;
+      while (completion_queue->Next(&tag, &ok)) {
+        AsyncQueryCall::HandleEvent(tag, ok);
+      }
+    });
+  }
+}
+
+void AsyncQueryServer::Shutdown() {
+  if (shut_down_) {
+    return;
+  }
+  shut_down_ = true;
+  for (const auto& completion_queue : completion_queues_) {
+    completion_queue->Shutdown();
+  }
+  // Pending requests for new calls get returned as failed and deleted.
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+  teardowns_.Wait();
+}
+
+}  // namespace seqr
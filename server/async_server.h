@@ -0,0 +1,105 @@
+#pragma once
+
+#include <absl/status/status.h>
+#include <grpcpp/grpcpp.h>
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "scheduler.h"
+#include "seqr_query_service.grpc.pb.h"
+
+namespace seqr {
+
+// A query started by the asynchronous front end. Results are taken without
+// blocking, whenever the query's listener reports that some may have become
+// available. Destroying a query waits for its remaining tasks.
+class AsyncQuery {
+ public:
+  virtual ~AsyncQuery() = default;
+
+  // Stops the query's remaining work, e.g. because the client went away.
+  virtual void Cancel(const absl::Status& reason) = 0;
+
+  // Returns the status to fail the call with once the query got cancelled.
+  virtual grpc::Status CancelStatus() const = 0;
+
+  // Takes the results that are available so far. Returns true once all
+  // results have been taken, or the query failed. BuildResponse can then
+  // build the response of a unary call.
+  virtual bool TakeAvailableResults() = 0;
+  virtual grpc::Status BuildResponse(seqr::QueryResponse* response) = 0;
+
+  // Encodes the results that are available so far into the next chunk of a
+  // streaming call. Leaves `chunk` empty if it needs further results. Sets
+  // `last` once all results have been encoded; `chunk` then holds the end of
+  // the stream, if anything is left.
+  virtual grpc::Status NextChunk(std::optional<seqr::QueryResponseChunk>* chunk,
+                                 bool* last) = 0;
+};
+
+// The query engine, as used by the asynchronous front end. `on_results` is
+// called from worker threads whenever results may have become available and
+// must not block. A failed start returns the status to fail the call with.
+class AsyncQueryEngine {
+ public:
+  virtual ~AsyncQueryEngine() = default;
+
+  // Starts the query of a Query call, whose response is cached.
+  virtual grpc::Status StartQuery(const seqr::QueryRequest& request,
+                                  std::function<void()> on_results,
+                                  std::unique_ptr<AsyncQuery>* query) = 0;
+
+  // Starts the query of an Execute call, whose response is cached.
+  virtual grpc::Status StartExecution(const seqr::ExecuteRequest& request,
+                                      std::function<void()> on_results,
+                                      std::unique_ptr<AsyncQuery>* query) = 0;
+
+  // Starts the query of a QueryStream call, which isn't cached.
+  virtual grpc::Status StartQueryStream(const seqr::QueryRequest& request,
+                                        std::function<void()> on_results,
+                                        std::unique_ptr<AsyncQuery>* query) = 0;
+
+  virtual grpc::Status Prepare(const seqr::PrepareRequest& request,
+                               seqr::PrepareResponse* response) = 0;
+};
+
+// Serves queries through the asynchronous gRPC API. Each thread drives its
+// own completion queue, so thousands of concurrent calls only need a few
+// threads.
+class AsyncQueryServer {
+ public:
+  AsyncQueryServer(AsyncQueryEngine* engine, int num_threads);
+
+  AsyncQueryServer(const AsyncQueryServer&) = delete;
+  AsyncQueryServer& operator=(const AsyncQueryServer&) = delete;
+
+  ~AsyncQueryServer() { Shutdown(); }
+
+  // Registers the service and its completion queues with the builder.
+  void Register(grpc::ServerBuilder* builder);
+
+  // Starts handling calls, once the server has been started.
+  void Start();
+
+  // Stops handling calls. The server has to be shut down before, so no new
+  // events are added to the completion queues.
+  void Shutdown();
+
+ private:
+  AsyncQueryEngine& engine_;
+  const int num_threads_;
+  seqr::QueryService::AsyncService service_;
+  std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> completion_queues_;
+  std::vector<std::thread> threads_;
+  // Deletes finished calls with queries. Calls hold on to the query's
+  // memory until then, which their tasks release once they've stopped.
+  Scheduler teardown_scheduler_;
+  Scheduler::TaskGroup teardowns_{&teardown_scheduler_};
+  bool shut_down_ = false;
+};
+
+}  // namespace seqr
@@ -0,0 +1,221 @@
+#include "async_server.h"
+
+#include <absl/status/status.h>
+#include <absl/strings/str_cat.h>
+#include <absl/synchronization/notification.h>
+#include <grpcpp/grpcpp.h>
+#include <gtest/gtest.h>
+
+#include <chrono>  // NOLINT(build/c++11)
+#include <functional>
+#include <memory>
+#include <optional>
+#include <utility>
+
+namespace seqr {
+namespace {
+
+// A query with a row per URL, whose results are all available right away.
+// Streams return a chunk per row.
+class FakeQuery : public AsyncQuery {
+ public:
+  FakeQuery(const int num_rows, absl::Notification* const release)
+      : num_rows_(num_rows), release_(release) {}
+
+  // Blocks until released, like a query whose tasks are slow to stop.
+  ~FakeQuery() override {
+    if (release_ != nullptr) {
+      release_->WaitForNotification();
+    }
+  }
+
+  void Cancel(const absl::Status& /* reason */) override {}
+
+  grpc::Status CancelStatus() const override {
+    return grpc::Status(grpc::StatusCode::CANCELLED, "Cancelled");
+  }
+
+  bool TakeAvailableResults() override { return true; }
+
+  grpc::Status BuildResponse(seqr::QueryResponse* const response) override {
+    response->set_num_rows(num_rows_);
+    return grpc::Status::OK;
+  }
+
+  grpc::Status NextChunk(std::optional<seqr::QueryResponseChunk>* const chunk,
+                         bool* const last) override {
+    chunk->reset();
+    *last = num_chunks_ == num_rows_;
+    if (!*last) {
+      chunk->emplace().set_num_rows(1);
+      ++num_chunks_;
+    }
+    return grpc::Status::OK;
+  }
+
+ private:
+  const int num_rows_;
+  absl::Notification* const release_;
+  int num_chunks_ = 0;
+};
+
+class FakeEngine : public AsyncQueryEngine {
+ public:
+  grpc::Status StartQuery(const seqr::QueryRequest& request,
+                          std::function<void()> /* on_results */,
+                          std::unique_ptr<AsyncQuery>* const query) override {
+    if (!request.dataset_id().empty()) {
+      return grpc::Status(grpc::StatusCode::NOT_FOUND, "Unknown dataset");
+    }
+    *query =
+        std::make_unique<FakeQuery>(request.arrow_urls_size(), release_queries);
+    return grpc::Status::OK;
+  }
+
+  grpc::Status StartExecution(
+      const seqr::ExecuteRequest& request,
+      std::function<void()> /* on_results */,
+      std::unique_ptr<AsyncQuery>* const query) override {
+    if (request.prepared_query_id() != "prepared") {
+      return grpc::Status(grpc::StatusCode::NOT_FOUND, "Unknown query");
+    }
+    *query =
+        std::make_unique<FakeQuery>(request.arrow_urls_size(), release_queries);
+    return grpc::Status::OK;
+  }
+
+  grpc::Status StartQueryStream(
+      const seqr::QueryRequest& request, std::function<void()> on_results,
+      std::unique_ptr<AsyncQuery>* const query) override {
+    return StartQuery(request, std::move(on_results), query);
+  }
+
+  grpc::Status Prepare(const seqr::PrepareRequest& /* request */,
+                       seqr::PrepareResponse* const response) override {
+    response->set_prepared_query_id("prepared");
+    return grpc::Status::OK;
+  }
+
+  // If set, destroying queries waits for it.
+  absl::Notification* release_queries = nullptr;
+};
+
+class AsyncQueryServerTest : public testing::Test {
+ protected:
+  static constexpr int kPort = 12365;
+
+  void SetUp() override {
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(absl::StrCat("[::]:", kPort),
+                             grpc::InsecureServerCredentials());
+    async_server_.Register(&builder);
+    server_ = builder.BuildAndStart();
+    ASSERT_NE(server_, nullptr);
+    async_server_.Start();
+    stub_ = seqr::QueryService::NewStub(
+        grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                            grpc::InsecureChannelCredentials()));
+  }
+
+  void TearDown() override {
+    if (!release_queries_.HasBeenNotified()) {
+      release_queries_.Notify();
+    }
+    if (server_ != nullptr) {
+      server_->Shutdown();
+    }
+    async_server_.Shutdown();
+  }
+
+  FakeEngine engine_;
+  absl::Notification release_queries_;
+  // A single completion queue, so calls are handled one after another.
+  AsyncQueryServer async_server_{&engine_, /* num_threads */ 1};
+  std::unique_ptr<grpc::Server> server_;
+  std::unique_ptr<seqr::QueryService::Stub> stub_;
+};
+
+TEST_F(AsyncQueryServerTest, RespondsToUnaryCalls) {
+  seqr::QueryRequest query_request;
+  query_request.add_arrow_urls("a");
+  query_request.add_arrow_urls("b");
+  {
+    grpc::ClientContext context;
+    seqr::QueryResponse response;
+    const auto status = stub_->Query(&context, query_request, &response);
+    ASSERT_TRUE(status.ok()) << status.error_message();
+    EXPECT_EQ(response.num_rows(), 2);
+  }
+
+  seqr::PrepareResponse prepare_response;
+  {
+    grpc::ClientContext context;
+    const auto status =
+        stub_->Prepare(&context, seqr::PrepareRequest(), &prepare_response);
+    ASSERT_TRUE(status.ok()) << status.error_message();
+  }
+
+  seqr::ExecuteRequest execute_request;
+  execute_request.set_prepared_query_id(prepare_response.prepared_query_id());
+  execute_request.add_arrow_urls("a");
+  {
+    grpc::ClientContext context;
+    seqr::QueryResponse response;
+    const auto status = stub_->Execute(&context, execute_request, &response);
+    ASSERT_TRUE(status.ok()) << status.error_message();
+    EXPECT_EQ(response.num_rows(), 1);
+  }
+}
+
+TEST_F(AsyncQueryServerTest, StreamsChunks) {
+  seqr::QueryRequest request;
+  request.add_arrow_urls("a");
+  request.add_arrow_urls("b");
+  request.add_arrow_urls("c");
+  grpc::ClientContext context;
+  auto reader = stub_->QueryStream(&context, request);
+  seqr::QueryResponseChunk chunk;
+  int num_chunks = 0;
+  while (reader->Read(&chunk)) {
+    EXPECT_EQ(chunk.num_rows(), 1);
+    ++num_chunks;
+  }
+  const auto status = reader->Finish();
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  EXPECT_EQ(num_chunks, 3);
+}
+
+TEST_F(AsyncQueryServerTest, FailsCallsWhoseQueryDoesNotStart) {
+  seqr::QueryRequest request;
+  request.set_dataset_id("unknown");
+  grpc::ClientContext context;
+  seqr::QueryResponse response;
+  EXPECT_EQ(stub_->Query(&context, request, &response).error_code(),
+            grpc::StatusCode::NOT_FOUND);
+
+  seqr::ExecuteRequest execute_request;
+  execute_request.set_prepared_query_id("unknown");
+  grpc::ClientContext execute_context;
+  EXPECT_EQ(
+      stub_->Execute(&execute_context, execute_request, &response).error_code(),
+      grpc::StatusCode::NOT_FOUND);
+}
+
+TEST_F(AsyncQueryServerTest, DestroysQueriesOffTheCompletionQueue) {
+  engine_.release_queries = &release_queries_;
+  seqr::QueryRequest request;
+  request.add_arrow_urls("a");
+  // Each query blocks its teardown until the end of the test, which would
+  // also block the only completion queue if it was torn down there.
+  for (int i = 0; i < 3; ++i) {
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() +
+                         std::chrono::seconds(10));
+    seqr::QueryResponse response;
+    const auto status = stub_->Query(&context, request, &response);
+    ASSERT_TRUE(status.ok()) << status.error_message();
+  }
+}
+
+}  // namespace
+}  // namespace seqr
@@ -0,0 +1,172 @@
+// Generates synthetic seqr-shaped Arrow files, for sizing servers and testing
+// performance changes without patient data. The rows are split into
+// consecutive files part-00000.arrow, part-00001.arrow, ... in the output
+// directory, like the pipeline's shards:
+//
+//   ../build/server/benchmarks/generate_synthetic_data \
+//       --output_dir=/tmp/synthetic --num_files=100 --rows_per_file=1000000 \
+//       --num_samples=1000 --genotype_density=0.01 --dataset_id=synthetic
+//
+// With --dataset_id, a DatasetManifest for --dataset_manifest is written to
+// dataset_manifest.textproto in the output directory.
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <arrow/util/compression.h>
+#include <google/protobuf/text_format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "dataset_manifest.pb.h"
+#include "synthetic_data.h"
+
+ABSL_FLAG(std::string, output_dir, "", "The directory to write files to.");
+ABSL_FLAG(int, num_files, 1, "The number of files.");
+ABSL_FLAG(int64_t, rows_per_file, 1000000, "The number of rows per file.");
+ABSL_FLAG(int64_t, record_batch_size, 32768,
+          "The number of rows per record batch.");
+ABSL_FLAG(int, num_samples, 3, "The number of samples.");
+ABSL_FLAG(double, genotype_density, 0.3,
+          "The probability that a sample has a non-reference genotype in a "
+          "row, which determines the lengths of the sample lists.");
+ABSL_FLAG(double, null_density, 0.0,
+          "The fraction of rows whose sample lists are null.");
+ABSL_FLAG(double, af_exponent, 4,
+          "AF is drawn as u^af_exponent for a uniform u. 1 gives uniform "
+          "allele frequencies, larger exponents more rare variants.");
+ABSL_FLAG(double, af_null_fraction, 0.1, "The fraction of rows without AF.");
+ABSL_FLAG(double, clinvar_fraction, 0.02,
+          "The fraction of rows with a ClinVar annotation.");
+ABSL_FLAG(int, num_annotation_columns, 0,
+          "The number of additional annotation columns, alternating float "
+          "scores and gene IDs.");
+ABSL_FLAG(std::string, compression, "zstd",
+          "The IPC compression: zstd, lz4 or uncompressed.");
+ABSL_FLAG(bool, zone_map, true,
+          "Whether to store zone maps in the files, like the pipeline.");
+ABSL_FLAG(uint64_t, seed, 42, "The random seed.");
+ABSL_FLAG(int, num_threads, 0,
+          "The number of files to generate in parallel. Defaults to the "
+          "number of cores.");
+ABSL_FLAG(std::string, dataset_id, "",
+          "If set, the ID of the dataset in the written manifest.");
+
+namespace seqr {
+namespace {
+
+int Run() {
+  const std::filesystem::path output_dir = absl::GetFlag(FLAGS_output_dir);
+  if (output_dir.empty()) {
+    std::cerr << "--output_dir is required" << std::endl;
+    return 1;
+  }
+  std::error_code error_code;
+  std::filesystem::create_directories(output_dir, error_code);
+  if (error_code) {
+    std::cerr << "Failed to create " << output_dir << ": "
+              << error_code.message() << std::endl;
+    return 1;
+  }
+
+  SyntheticDataOptions options;
+  options.num_rows = absl::GetFlag(FLAGS_rows_per_file);
+  options.record_batch_size = absl::GetFlag(FLAGS_record_batch_size);
+  options.num_samples = absl::GetFlag(FLAGS_num_samples);
+  options.genotype_density = absl::GetFlag(FLAGS_genotype_density);
+  options.null_density = absl::GetFlag(FLAGS_null_density);
+  options.af_exponent = absl::GetFlag(FLAGS_af_exponent);
+  options.af_null_fraction = absl::GetFlag(FLAGS_af_null_fraction);
+  options.clinvar_fraction = absl::GetFlag(FLAGS_clinvar_fraction);
+  options.num_annotation_columns = absl::GetFlag(FLAGS_num_annotation_columns);
+  options.zone_map = absl::GetFlag(FLAGS_zone_map);
+  options.seed = absl::GetFlag(FLAGS_seed);
+  const auto compression = arrow::util::Codec::GetCompressionType(
+      absl::GetFlag(FLAGS_compression));
+  if (!compression.ok()) {
+    std::cerr << "Invalid --compression: " << compression.status().ToString()
+              << std::endl;
+    return 1;
+  }
+  options.compression = *compression;
+  if (options.num_rows <= 0 || options.record_batch_size <= 0) {
+    std::cerr << "--rows_per_file and --record_batch_size must be positive"
+              << std::endl;
+    return 1;
+  }
+
+  const int num_files = absl::GetFlag(FLAGS_num_files);
+  std::vector<std::filesystem::path> paths;
+  for (int i = 0; i < num_files; ++i) {
+    paths.push_back(std::filesystem::absolute(
+        output_dir / absl::StrFormat("part-%05d.arrow", i)));
+  }
+
+  int num_threads = absl::GetFlag(FLAGS_num_threads);
+  if (num_threads <= 0) {
+    num_threads =
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+  std::atomic<int> next_file = 0;
+  std::atomic<bool> failed = false;
+  std::vector<std::thread> threads;
+  for (int thread_index = 0; thread_index < num_threads; ++thread_index) {
+    threads.emplace_back([&] {
+      for (int i = next_file++; i < num_files && !failed; i = next_file++) {
+        SyntheticDataOptions file_options = options;
+        file_options.first_row = i * options.num_rows;
+        if (const auto status =
+                WriteSyntheticArrowFile(file_options, paths[i].string());
+            !status.ok()) {
+          std::cerr << "Failed to write " << paths[i] << ": "
+                    << status.ToString() << std::endl;
+          failed = true;
+          return;
+        }
+        std::cout << "Wrote " << paths[i].string() << std::endl;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (failed) {
+    return 1;
+  }
+
+  if (const std::string dataset_id = absl::GetFlag(FLAGS_dataset_id);
+      !dataset_id.empty()) {
+    DatasetManifest manifest;
+    auto* const dataset = manifest.add_datasets();
+    dataset->set_id(dataset_id);
+    for (const auto& path : paths) {
+      dataset->add_files()->set_url(absl::StrCat("file://", path.string()));
+    }
+    std::string text;
+    google::protobuf::TextFormat::PrintToString(manifest, &text);
+    const auto manifest_path = output_dir / "dataset_manifest.textproto";
+    if (!(std::ofstream(manifest_path) << text)) {
+      std::cerr << "Failed to write " << manifest_path << std::endl;
+      return 1;
+    }
+    std::cout << "Wrote " << manifest_path.string() << std::endl;
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace seqr
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  return seqr::Run();
+}
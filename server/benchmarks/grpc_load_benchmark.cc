@@ -0,0 +1,240 @@
+// Load test for the gRPC front ends: runs many concurrent slow queries against
+// an in-process server and reports the latency percentiles and the peak
+// number of threads of the process. Queries are slowed down by adding latency
+// to generation lookups, like a remote object store would, so calls stay in
+// flight while their fetches wait.
+//
+// The synchronous API needs a thread per in-flight call, while the
+// asynchronous API only needs its completion queue threads.
+//
+// Run from the server directory, so the test data can be found:
+//   ../build/server/benchmarks/grpc_load_benchmark
+
+#include <absl/flags/declare.h>
+#include <absl/flags/flag.h>
+#include <absl/flags/reflection.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/strip.h>
+#include <absl/synchronization/notification.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <benchmark/benchmark.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/text_format.h>
+#include <grpcpp/grpcpp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "seqr_query_service.grpc.pb.h"
+#include "server.h"
+#include "url_reader.h"
+
+ABSL_DECLARE_FLAG(bool, async_grpc);
+ABSL_DECLARE_FLAG(int, num_io_threads);
+ABSL_DECLARE_FLAG(int64_t, result_cache_bytes);
+
+namespace seqr {
+namespace {
+
+constexpr char kQueryTextProtoFilename[] =
+    "testdata/na12878_trio_query.textproto";
+constexpr int kPort = 12360;
+constexpr absl::Duration kGenerationLatency = absl::Milliseconds(50);
+
+// Reads local files, but delays generation lookups.
+class SlowUrlReader : public UrlReader {
+ public:
+  explicit SlowUrlReader(std::unique_ptr<UrlReader> url_reader)
+      : url_reader_(std::move(url_reader)) {}
+
+  absl::StatusOr<std::shared_ptr<arrow::Buffer>> Read(
+      const std::string_view url, const arrow::StopToken stop_token,
+      std::string* const generation) const override {
+    return url_reader_->Read(url, stop_token, generation);
+  }
+
+  bool MapsContent(const arrow::Buffer& content) const override {
+    return url_reader_->MapsContent(content);
+  }
+
+  absl::StatusOr<std::shared_ptr<arrow::io::RandomAccessFile>> Open(
+      const std::string_view url, const arrow::StopToken stop_token,
+      std::string* const generation) const override {
+    return url_reader_->Open(url, stop_token, generation);
+  }
+
+  absl::StatusOr<std::string> GetGeneration(
+      const std::string_view url) const override {
+    absl::SleepFor(kGenerationLatency);
+    return url_reader_->GetGeneration(url);
+  }
+
+ private:
+  const std::unique_ptr<UrlReader> url_reader_;
+};
+
+QueryRequest ReadTrioQueryRequest() {
+  std::ifstream ifs{kQueryTextProtoFilename};
+  if (!ifs) {
+    std::cerr << "Failed to open " << kQueryTextProtoFilename << std::endl;
+    std::exit(1);
+  }
+  google::protobuf::io::IstreamInputStream iis{&ifs};
+  QueryRequest request;
+  if (!google::protobuf::TextFormat::Parse(&iis, &request)) {
+    std::cerr << "Failed to parse " << kQueryTextProtoFilename << std::endl;
+    std::exit(1);
+  }
+  return request;
+}
+
+// Returns the current number of threads of the process.
+int NumThreads() {
+  std::ifstream ifs{"/proc/self/status"};
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::string_view value = line;
+    int num_threads = 0;
+    if (absl::ConsumePrefix(&value, "Threads:") &&
+        absl::SimpleAtoi(absl::StripAsciiWhitespace(value), &num_threads)) {
+      return num_threads;
+    }
+  }
+  return 0;
+}
+
+// Samples the number of threads in the background until destroyed.
+class PeakThreadCounter {
+ public:
+  PeakThreadCounter()
+      : thread_([this] {
+          do {
+            peak_ = std::max(peak_.load(), NumThreads());
+          } while (
+              !stop_.WaitForNotificationWithTimeout(absl::Milliseconds(1)));
+        }) {}
+
+  ~PeakThreadCounter() {
+    stop_.Notify();
+    thread_.join();
+  }
+
+  // Excludes the sampling thread itself.
+  int peak() const { return peak_ - 1; }
+
+ private:
+  std::atomic<int> peak_ = 0;
+  absl::Notification stop_;
+  std::thread thread_;
+};
+
+double Percentile(std::vector<double> values, const double percentile) {
+  if (values.empty()) {
+    return 0;
+  }
+  const size_t index = std::min(
+      values.size() - 1, static_cast<size_t>(percentile * values.size()));
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+  return values[index];
+}
+
+struct Call {
+  grpc::ClientContext context;
+  QueryResponse response;
+  grpc::Status status;
+  std::unique_ptr<grpc::ClientAsyncResponseReader<QueryResponse>> reader;
+  absl::Time start;
+};
+
+void BM_ConcurrentQueries(benchmark::State& state) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_async_grpc, state.range(0) != 0);
+  // So fetches of concurrent queries don't wait for each other.
+  absl::SetFlag(&FLAGS_num_io_threads, 256);
+  // Identical queries would be answered from the result cache otherwise.
+  absl::SetFlag(&FLAGS_result_cache_bytes, 0);
+  const int num_calls = static_cast<int>(state.range(1));
+
+  auto local_file_reader = MakeLocalFileReader();
+  if (!local_file_reader.ok()) {
+    state.SkipWithError("Failed to create local file reader");
+    return;
+  }
+  const SlowUrlReader url_reader(*std::move(local_file_reader));
+  auto server = CreateServer(kPort, url_reader);
+  if (!server.ok()) {
+    state.SkipWithError("Failed to create server");
+    return;
+  }
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  const QueryRequest request = ReadTrioQueryRequest();
+
+  std::vector<double> latencies_ms;
+  int peak_threads = 0;
+  for (auto _ : state) {
+    PeakThreadCounter thread_counter;
+    grpc::CompletionQueue completion_queue;
+    std::vector<std::unique_ptr<Call>> calls;
+    for (int i = 0; i < num_calls; ++i) {
+      auto call = std::make_unique<Call>();
+      call->start = absl::Now();
+      call->reader =
+          stub->AsyncQuery(&call->context, request, &completion_queue);
+      call->reader->Finish(&call->response, &call->status, call.get());
+      calls.push_back(std::move(call));
+    }
+
+    for (int i = 0; i < num_calls; ++i) {
+      void* tag = nullptr;
+      bool ok = false;
+      if (!completion_queue.Next(&tag, &ok) || !ok) {
+        state.SkipWithError("Failed to complete call");
+        return;
+      }
+      const auto& call = *static_cast<const Call*>(tag);
+      if (!call.status.ok()) {
+        state.SkipWithError(call.status.error_message().c_str());
+        return;
+      }
+      latencies_ms.push_back(
+          absl::ToDoubleMilliseconds(absl::Now() - call.start));
+    }
+    peak_threads = std::max(peak_threads, thread_counter.peak());
+  }
+
+  state.counters["p50_ms"] = Percentile(latencies_ms, 0.5);
+  state.counters["p99_ms"] = Percentile(latencies_ms, 0.99);
+  state.counters["peak_threads"] = peak_threads;
+  state.counters["qps"] = benchmark::Counter(
+      static_cast<double>(latencies_ms.size()), benchmark::Counter::kIsRate);
+}
+
+void ApplyConcurrency(benchmark::internal::Benchmark* const benchmark) {
+  for (const int async_grpc : {0, 1}) {
+    for (const int num_calls : {16, 256, 1024}) {
+      benchmark->Args({async_grpc, num_calls});
+    }
+  }
+  benchmark->ArgNames({"async", "calls"})
+      ->UseRealTime()
+      ->Unit(benchmark::kMillisecond);
+}
+
+BENCHMARK(BM_ConcurrentQueries)->Apply(ApplyConcurrency);
+
+}  // namespace
+}  // namespace seqr
+
+BENCHMARK_MAIN();
@@ -0,0 +1,92 @@
+// Compares decoding synthetic seqr-shaped Arrow files that were written
+// without compression, with LZ4 and with zstd. Throughput is reported in rows
+// and uncompressed bytes, so the codecs are directly comparable; file_bytes is
+// the size of the encoded file.
+//
+//   ../build/server/benchmarks/ipc_decode_benchmark --benchmark_format=json
+
+#include <arrow/io/memory.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/util/compression.h>
+#include <arrow/util/logging.h>
+#include <benchmark/benchmark.h>
+
+#include <map>
+#include <memory>
+#include <utility>
+
+#include "synthetic_data.h"
+
+namespace seqr {
+namespace {
+
+constexpr int64_t kNumRows = int64_t{1} << 20;
+constexpr int kNumSamples = 100;
+constexpr double kGenotypeDensity = 0.05;
+
+// Returns the synthetic file for a codec, generating it on first use.
+const std::shared_ptr<arrow::Buffer>& GetFile(
+    const arrow::Compression::type compression) {
+  static auto* const files =
+      new std::map<arrow::Compression::type, std::shared_ptr<arrow::Buffer>>;
+  auto& file = (*files)[compression];
+  if (file == nullptr) {
+    SyntheticDataOptions options;
+    options.num_rows = kNumRows;
+    options.num_samples = kNumSamples;
+    options.genotype_density = kGenotypeDensity;
+    options.compression = compression;
+    file = MakeSyntheticArrowFile(options).ValueOrDie();
+  }
+  return file;
+}
+
+void Run(benchmark::State& state, const arrow::Compression::type compression) {
+  if (!arrow::util::Codec::IsAvailable(compression)) {
+    state.SkipWithError("Codec not available in this Arrow build");
+    return;
+  }
+  const int64_t uncompressed_bytes =
+      GetFile(arrow::Compression::UNCOMPRESSED)->size();
+  const auto& file = GetFile(compression);
+  auto options = arrow::ipc::IpcReadOptions::Defaults();
+  // Like the server, which decodes record batches on its own threads.
+  options.use_threads = false;
+  int64_t num_rows = 0;
+  for (auto _ : state) {
+    const auto reader =
+        arrow::ipc::RecordBatchFileReader::Open(
+            std::make_shared<arrow::io::BufferReader>(file), options)
+            .ValueOrDie();
+    num_rows = 0;
+    for (int i = 0; i < reader->num_record_batches(); ++i) {
+      const auto record_batch = reader->ReadRecordBatch(i).ValueOrDie();
+      num_rows += record_batch->num_rows();
+      benchmark::DoNotOptimize(record_batch);
+    }
+  }
+  ARROW_CHECK_EQ(num_rows, kNumRows);
+  state.SetItemsProcessed(state.iterations() * num_rows);
+  state.SetBytesProcessed(state.iterations() * uncompressed_bytes);
+  state.counters["file_bytes"] = file->size();
+}
+
+void BM_DecodeUncompressed(benchmark::State& state) {
+  Run(state, arrow::Compression::UNCOMPRESSED);
+}
+BENCHMARK(BM_DecodeUncompressed)->Unit(benchmark::kMillisecond);
+
+void BM_DecodeLz4(benchmark::State& state) {
+  Run(state, arrow::Compression::LZ4_FRAME);
+}
+BENCHMARK(BM_DecodeLz4)->Unit(benchmark::kMillisecond);
+
+void BM_DecodeZstd(benchmark::State& state) {
+  Run(state, arrow::Compression::ZSTD);
+}
+BENCHMARK(BM_DecodeZstd)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace seqr
+
+BENCHMARK_MAIN();
@@ -0,0 +1,270 @@
+// Fires a weighted mix of QueryRequests at a running server from a fixed
+// number of concurrent callers, each sending its next request as soon as the
+// previous one completed, and reports the throughput, the latency percentiles
+// and the server's resident memory:
+//
+//   ../build/server/benchmarks/load_client --server_address=localhost:8080 \
+//       --queries=testdata/na12878_trio_query.textproto:3,other.textproto:1 \
+//       --concurrency=64 --duration=60s \
+//       --server_pid=$(pidof seqr_query_backend)
+
+#include <absl/container/btree_map.h>
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/synchronization/notification.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/text_format.h>
+#include <grpcpp/grpcpp.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include "seqr_query_service.grpc.pb.h"
+
+ABSL_FLAG(std::string, server_address, "localhost:8080",
+          "The address of the server.");
+ABSL_FLAG(std::vector<std::string>, queries, {},
+          "Comma-separated QueryRequest text proto files, each optionally "
+          "followed by :<weight>, the relative frequency of the request in "
+          "the mix. The default weight is 1.");
+ABSL_FLAG(int, concurrency, 16, "The number of concurrent callers.");
+ABSL_FLAG(absl::Duration, duration, absl::Seconds(30),
+          "How long to send requests for.");
+ABSL_FLAG(int, server_pid, 0,
+          "If set, the resident memory of this local process is sampled "
+          "while the load is applied.");
+
+namespace seqr {
+namespace {
+
+struct Query {
+  std::string name;
+  QueryRequest request;
+  double weight = 1;
+};
+
+// The outcome of a single call.
+struct CallResult {
+  int query_index = 0;
+  grpc::StatusCode code = grpc::StatusCode::OK;
+  double latency_ms = 0;
+  int64_t num_rows = 0;
+};
+
+bool ReadQuery(const std::string& spec, Query* const query) {
+  std::vector<std::string> parts = absl::StrSplit(spec, ':');
+  if (parts.size() > 2 ||
+      (parts.size() == 2 && !absl::SimpleAtod(parts[1], &query->weight))) {
+    std::cerr << "Invalid query " << spec << std::endl;
+    return false;
+  }
+  query->name = parts[0];
+  std::ifstream ifs{query->name};
+  google::protobuf::io::IstreamInputStream iis{&ifs};
+  if (!ifs || !google::protobuf::TextFormat::Parse(&iis, &query->request)) {
+    std::cerr << "Failed to read " << query->name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Returns the resident set size of a process in bytes, or 0 if unknown.
+int64_t ResidentBytes(const int pid) {
+  std::ifstream ifs{absl::StrCat("/proc/", pid, "/status")};
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::string_view value = line;
+    int64_t kilobytes = 0;
+    if (absl::ConsumePrefix(&value, "VmRSS:") &&
+        absl::ConsumeSuffix(&value, "kB") &&
+        absl::SimpleAtoi(absl::StripAsciiWhitespace(value), &kilobytes)) {
+      return kilobytes * 1024;
+    }
+  }
+  return 0;
+}
+
+// Samples the resident memory of a process in the background until
+// destroyed.
+class ResidentMemorySampler {
+ public:
+  explicit ResidentMemorySampler(const int pid)
+      : thread_([this, pid] {
+          do {
+            const int64_t bytes = ResidentBytes(pid);
+            absl::MutexLock lock(&mu_);
+            peak_ = std::max(peak_, bytes);
+            last_ = bytes;
+          } while (
+              !stop_.WaitForNotificationWithTimeout(absl::Milliseconds(100)));
+        }) {}
+
+  ~ResidentMemorySampler() {
+    stop_.Notify();
+    thread_.join();
+  }
+
+  int64_t peak() const {
+    absl::MutexLock lock(&mu_);
+    return peak_;
+  }
+
+  int64_t last() const {
+    absl::MutexLock lock(&mu_);
+    return last_;
+  }
+
+ private:
+  mutable absl::Mutex mu_;
+  int64_t peak_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t last_ ABSL_GUARDED_BY(mu_) = 0;
+  absl::Notification stop_;
+  std::thread thread_;
+};
+
+// Returns the given percentile of sorted values.
+double Percentile(const std::vector<double>& sorted_values,
+                  const double percentile) {
+  if (sorted_values.empty()) {
+    return 0;
+  }
+  return sorted_values[std::min(
+      sorted_values.size() - 1,
+      static_cast<size_t>(percentile * sorted_values.size()))];
+}
+
+void PrintLatencies(std::vector<double> latencies_ms) {
+  std::sort(latencies_ms.begin(), latencies_ms.end());
+  std::cout << "p50 " << Percentile(latencies_ms, 0.5) << " ms, p95 "
+            << Percentile(latencies_ms, 0.95) << " ms, p99 "
+            << Percentile(latencies_ms, 0.99) << " ms, p999 "
+            << Percentile(latencies_ms, 0.999) << " ms, max "
+            << (latencies_ms.empty() ? 0 : latencies_ms.back()) << " ms";
+}
+
+int Run() {
+  std::vector<Query> queries;
+  std::vector<double> weights;
+  for (const auto& spec : absl::GetFlag(FLAGS_queries)) {
+    Query query;
+    if (!ReadQuery(spec, &query)) {
+      return 1;
+    }
+    weights.push_back(query.weight);
+    queries.push_back(std::move(query));
+  }
+  if (queries.empty()) {
+    std::cerr << "--queries is required" << std::endl;
+    return 1;
+  }
+
+  grpc::ChannelArguments channel_arguments;
+  channel_arguments.SetMaxReceiveMessageSize(-1);
+  const auto stub = QueryService::NewStub(grpc::CreateCustomChannel(
+      absl::GetFlag(FLAGS_server_address), grpc::InsecureChannelCredentials(),
+      channel_arguments));
+
+  const int server_pid = absl::GetFlag(FLAGS_server_pid);
+  std::unique_ptr<ResidentMemorySampler> memory_sampler;
+  if (server_pid > 0) {
+    memory_sampler = std::make_unique<ResidentMemorySampler>(server_pid);
+  }
+
+  const int concurrency = absl::GetFlag(FLAGS_concurrency);
+  const absl::Time start = absl::Now();
+  const absl::Time deadline = start + absl::GetFlag(FLAGS_duration);
+  std::vector<std::vector<CallResult>> results(concurrency);
+  std::vector<std::thread> callers;
+  for (int caller = 0; caller < concurrency; ++caller) {
+    callers.emplace_back([&, caller] {
+      std::mt19937 rng(caller);
+      std::discrete_distribution<int> query_index(weights.begin(),
+                                                  weights.end());
+      while (absl::Now() < deadline) {
+        CallResult result;
+        result.query_index = query_index(rng);
+        grpc::ClientContext context;
+        QueryResponse response;
+        const absl::Time call_start = absl::Now();
+        const auto status = stub->Query(
+            &context, queries[result.query_index].request, &response);
+        result.latency_ms =
+            absl::ToDoubleMilliseconds(absl::Now() - call_start);
+        result.code = status.error_code();
+        result.num_rows = response.num_rows();
+        results[caller].push_back(result);
+      }
+    });
+  }
+  for (auto& caller : callers) {
+    caller.join();
+  }
+  const double elapsed_seconds = absl::ToDoubleSeconds(absl::Now() - start);
+
+  std::vector<double> latencies_ms;
+  std::vector<std::vector<double>> query_latencies_ms(queries.size());
+  absl::btree_map<grpc::StatusCode, int64_t> num_calls_by_code;
+  int64_t num_rows = 0;
+  for (const auto& caller_results : results) {
+    for (const auto& result : caller_results) {
+      ++num_calls_by_code[result.code];
+      if (result.code == grpc::StatusCode::OK) {
+        latencies_ms.push_back(result.latency_ms);
+        query_latencies_ms[result.query_index].push_back(result.latency_ms);
+        num_rows += result.num_rows;
+      }
+    }
+  }
+
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << latencies_ms.size() << " successful calls in "
+            << elapsed_seconds << " s: "
+            << latencies_ms.size() / elapsed_seconds << " queries/s, "
+            << num_rows / elapsed_seconds << " rows/s" << std::endl;
+  std::cout << "Latency: ";
+  PrintLatencies(latencies_ms);
+  std::cout << std::endl;
+  for (size_t i = 0; i < queries.size(); ++i) {
+    std::cout << "  " << queries[i].name << " ("
+              << query_latencies_ms[i].size() << " calls): ";
+    PrintLatencies(query_latencies_ms[i]);
+    std::cout << std::endl;
+  }
+  for (const auto& [code, num_calls] : num_calls_by_code) {
+    if (code != grpc::StatusCode::OK) {
+      std::cout << num_calls << " calls failed with status code " << code
+                << std::endl;
+    }
+  }
+  if (memory_sampler != nullptr) {
+    std::cout << "Server RSS: peak " << memory_sampler->peak() / (1 << 20)
+              << " MiB, last " << memory_sampler->last() / (1 << 20) << " MiB"
+              << std::endl;
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace seqr
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  return seqr::Run();
+}
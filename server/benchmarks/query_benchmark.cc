@@ -0,0 +1,168 @@
+// Runs a selective query end to end against an in-process server, on
+// synthetic seqr-shaped files with 1M to 100M rows in total. Every query goes
+// through the full per-file path: generation lookup, footer, fetching,
+// decoding, filtering and projection. The caches are disabled, so repeated
+// iterations don't skip any of that, but the files stay in the OS page cache.
+//
+// The files are generated once, with 1M rows each, into
+// $TMPDIR/seqr_query_benchmark, which can take a few minutes for the largest
+// size. Throughput is reported in rows and file bytes scanned:
+//   ../build/server/benchmarks/query_benchmark --benchmark_format=json
+
+#include <absl/flags/declare.h>
+#include <absl/flags/flag.h>
+#include <absl/flags/reflection.h>
+#include <absl/strings/str_cat.h>
+#include <arrow/util/logging.h>
+#include <benchmark/benchmark.h>
+#include <google/protobuf/text_format.h>
+#include <grpcpp/grpcpp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "seqr_query_service.grpc.pb.h"
+#include "server.h"
+#include "synthetic_data.h"
+#include "url_reader.h"
+
+ABSL_DECLARE_FLAG(int64_t, footer_cache_bytes);
+ABSL_DECLARE_FLAG(int64_t, inverted_index_cache_bytes);
+ABSL_DECLARE_FLAG(int64_t, record_batch_cache_bytes);
+ABSL_DECLARE_FLAG(int64_t, result_cache_bytes);
+
+namespace seqr {
+namespace {
+
+namespace fs = std::filesystem;
+
+constexpr int kPort = 12361;
+constexpr int64_t kRowsPerFile = 1000000;
+
+// Rare variants with a ClinVar annotation where a sample is homozygous, which
+// matches about 0.02% of the synthetic rows.
+constexpr char kQueryTextProto[] = R"(
+  projection_columns: "xpos"
+  projection_columns: "variantId"
+  filter_expression { call { function_name: "and"
+    arguments { call { function_name: "and"
+      arguments { call { function_name: "less"
+        arguments { column: "AF" }
+        arguments { literal { float_value: 0.0001 } } } }
+      arguments { call { function_name: "is_valid"
+        arguments { column: "clinvar_clinical_significance" } } } } }
+    arguments { call { function_name: "string_list_contains_any"
+      arguments { column: "samples_num_alt_2" }
+      set_lookup_options { values: "SAMPLE0" } } } } }
+  max_rows: 1000000000
+)";
+
+// Writes the synthetic files for the given number of rows, unless they exist
+// already, and returns their URLs.
+std::vector<std::string> GetFileUrls(const int64_t num_rows) {
+  const fs::path directory = fs::temp_directory_path() / "seqr_query_benchmark";
+  fs::create_directories(directory);
+  const int64_t num_files = (num_rows + kRowsPerFile - 1) / kRowsPerFile;
+  std::vector<fs::path> paths;
+  for (int64_t i = 0; i < num_files; ++i) {
+    paths.push_back(directory / absl::StrCat("part-", i, ".arrow"));
+  }
+
+  // File i contains the rows [i * kRowsPerFile, (i + 1) * kRowsPerFile) of
+  // the same synthetic table, so smaller sizes reuse the files of larger ones.
+  std::atomic<size_t> next_file = 0;
+  std::vector<std::thread> threads;
+  const unsigned num_threads =
+      std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned thread_index = 0; thread_index < num_threads; ++thread_index) {
+    threads.emplace_back([&paths, &next_file] {
+      for (size_t i = next_file++; i < paths.size(); i = next_file++) {
+        if (fs::exists(paths[i])) {
+          continue;
+        }
+        SyntheticDataOptions options;
+        options.first_row = i * kRowsPerFile;
+        options.num_rows = kRowsPerFile;
+        // Written under a temporary name, so interrupted runs don't leave
+        // partial files behind.
+        const fs::path tmp_path = fs::path(paths[i]).concat(".tmp");
+        ARROW_CHECK_OK(WriteSyntheticArrowFile(options, tmp_path.string()));
+        fs::rename(tmp_path, paths[i]);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<std::string> result;
+  for (const auto& path : paths) {
+    result.push_back(absl::StrCat("file://", path.string()));
+  }
+  return result;
+}
+
+void BM_Query(benchmark::State& state) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_footer_cache_bytes, 0);
+  absl::SetFlag(&FLAGS_inverted_index_cache_bytes, 0);
+  absl::SetFlag(&FLAGS_record_batch_cache_bytes, 0);
+  absl::SetFlag(&FLAGS_result_cache_bytes, 0);
+
+  QueryRequest request;
+  ARROW_CHECK(
+      google::protobuf::TextFormat::ParseFromString(kQueryTextProto, &request));
+  int64_t file_bytes = 0;
+  for (const auto& url : GetFileUrls(state.range(0))) {
+    request.add_arrow_urls(url);
+    file_bytes += fs::file_size(url.substr(std::string("file://").size()));
+  }
+
+  auto local_file_reader = MakeLocalFileReader();
+  if (!local_file_reader.ok()) {
+    state.SkipWithError("Failed to create local file reader");
+    return;
+  }
+  auto server = CreateServer(kPort, **local_file_reader);
+  if (!server.ok()) {
+    state.SkipWithError("Failed to create server");
+    return;
+  }
+  grpc::ChannelArguments channel_arguments;
+  channel_arguments.SetMaxReceiveMessageSize(-1);
+  const auto stub = QueryService::NewStub(grpc::CreateCustomChannel(
+      absl::StrCat("localhost:", kPort), grpc::InsecureChannelCredentials(),
+      channel_arguments));
+
+  int64_t num_matches = 0;
+  for (auto _ : state) {
+    grpc::ClientContext context;
+    QueryResponse response;
+    const auto status = stub->Query(&context, request, &response);
+    if (!status.ok()) {
+      state.SkipWithError(status.error_message().c_str());
+      return;
+    }
+    num_matches = response.num_rows();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * file_bytes);
+  state.counters["matches"] = num_matches;
+}
+BENCHMARK(BM_Query)
+    ->Arg(1000000)
+    ->Arg(10000000)
+    ->Arg(100000000)
+    ->ArgName("rows")
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace seqr
+
+BENCHMARK_MAIN();
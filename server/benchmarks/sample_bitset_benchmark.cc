@@ -0,0 +1,119 @@
+// Compares a trio genotype filter on sample lists (string_list_contains_any)
+// with the same filter on sample bitsets (sample_bitset_any), for datasets
+// with 1k and 10k samples.
+//
+//   ../build/server/benchmarks/sample_bitset_benchmark
+
+#include <arrow/array/builder_binary.h>
+#include <arrow/array/builder_nested.h>
+#include <arrow/array/builder_primitive.h>
+#include <arrow/compute/api_scalar.h>
+#include <arrow/util/logging.h>
+#include <benchmark/benchmark.h>
+
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "sample_bitset.h"
+#include "string_list_contains_any.h"
+
+namespace seqr {
+namespace {
+
+namespace cp = arrow::compute;
+
+// Matches the record batch size of the loading pipeline.
+constexpr int kNumRows = 32768;
+// Most variants are only called in a handful of samples.
+constexpr int kMaxSamplesPerRow = 8;
+// The trio whose genotypes are filtered on.
+const std::vector<int32_t> kFamily = {0, 1, 2};
+
+std::string SampleId(const int position) {
+  return "sample" + std::to_string(position);
+}
+
+struct TestData {
+  std::shared_ptr<arrow::Array> lists;
+  std::shared_ptr<arrow::Array> bitsets;
+};
+
+const TestData& GetTestData(const int num_samples) {
+  static auto* const test_data = [] {
+    ARROW_CHECK_OK(RegisterStringListContainsAny(cp::GetFunctionRegistry()));
+    ARROW_CHECK_OK(RegisterSampleBitsetFunctions(cp::GetFunctionRegistry()));
+    return new std::map<int, TestData>;
+  }();
+
+  auto& result = (*test_data)[num_samples];
+  if (result.lists != nullptr) {
+    return result;
+  }
+
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int> num_samples_distribution(
+      0, kMaxSamplesPerRow);
+  std::uniform_int_distribution<int> sample_distribution(0, num_samples - 1);
+
+  arrow::ListBuilder list_builder(arrow::default_memory_pool(),
+                                  std::make_shared<arrow::StringBuilder>());
+  auto& value_builder =
+      static_cast<arrow::StringBuilder&>(*list_builder.value_builder());
+  const int byte_width = (num_samples + 7) / 8;
+  arrow::FixedSizeBinaryBuilder bitset_builder(
+      arrow::fixed_size_binary(byte_width));
+  std::string bitset;
+  for (int i = 0; i < kNumRows; ++i) {
+    ARROW_CHECK_OK(list_builder.Append());
+    bitset.assign(byte_width, '\0');
+    for (int j = num_samples_distribution(random); j > 0; --j) {
+      const int position = sample_distribution(random);
+      ARROW_CHECK_OK(value_builder.Append(SampleId(position)));
+      bitset[position / 8] |= static_cast<char>(1 << (position % 8));
+    }
+    ARROW_CHECK_OK(bitset_builder.Append(bitset));
+  }
+  result.lists = list_builder.Finish().ValueOrDie();
+  result.bitsets = bitset_builder.Finish().ValueOrDie();
+  return result;
+}
+
+void BM_StringList(benchmark::State& state) {
+  const auto& lists = GetTestData(state.range(0)).lists;
+  arrow::StringBuilder value_set_builder;
+  for (const int32_t position : kFamily) {
+    ARROW_CHECK_OK(value_set_builder.Append(SampleId(position)));
+  }
+  const cp::SetLookupOptions options(value_set_builder.Finish().ValueOrDie(),
+                                     /* skip_nulls */ true);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        cp::CallFunction("string_list_contains_any", {lists}, &options)
+            .ValueOrDie());
+  }
+  state.SetItemsProcessed(state.iterations() * lists->length());
+}
+BENCHMARK(BM_StringList)->Arg(1000)->Arg(10000);
+
+void BM_SampleBitset(benchmark::State& state) {
+  const auto& bitsets = GetTestData(state.range(0)).bitsets;
+  arrow::Int32Builder value_set_builder;
+  ARROW_CHECK_OK(value_set_builder.AppendValues(kFamily));
+  const cp::SetLookupOptions options(value_set_builder.Finish().ValueOrDie(),
+                                     /* skip_nulls */ true);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        cp::CallFunction("sample_bitset_any", {bitsets}, &options)
+            .ValueOrDie());
+  }
+  state.SetItemsProcessed(state.iterations() * bitsets->length());
+}
+BENCHMARK(BM_SampleBitset)->Arg(1000)->Arg(10000);
+
+}  // namespace
+}  // namespace seqr
+
+BENCHMARK_MAIN();
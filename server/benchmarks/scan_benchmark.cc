@@ -0,0 +1,210 @@
+// Compares scanning the trio test data with the Arrow dataset scanner, which
+// decodes and filters all required columns, against the two-phase scan.
+//
+// Run from the server directory, so the test data can be found:
+//   ../build/server/benchmarks/scan_benchmark --benchmark_format=json
+
+#include <arrow/dataset/dataset.h>
+#include <arrow/dataset/scanner.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/memory_pool.h>
+#include <arrow/util/logging.h>
+#include <benchmark/benchmark.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/text_format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "scan.h"
+#include "seqr_query_service.pb.h"
+#include "string_list_contains_any.h"
+
+namespace seqr {
+namespace {
+
+constexpr char kQueryTextProtoFilename[] =
+    "testdata/na12878_trio_query.textproto";
+
+// Counts the total number of bytes allocated, in addition to forwarding to the
+// default pool.
+class CountingMemoryPool : public arrow::MemoryPool {
+ public:
+  arrow::Status Allocate(const int64_t size, uint8_t** const out) override {
+    total_bytes_allocated_ += size;
+    return pool_->Allocate(size, out);
+  }
+
+  arrow::Status Reallocate(const int64_t old_size, const int64_t new_size,
+                           uint8_t** const ptr) override {
+    total_bytes_allocated_ += std::max<int64_t>(0, new_size - old_size);
+    return pool_->Reallocate(old_size, new_size, ptr);
+  }
+
+  void Free(uint8_t* const buffer, const int64_t size) override {
+    pool_->Free(buffer, size);
+  }
+
+  int64_t bytes_allocated() const override { return pool_->bytes_allocated(); }
+
+  int64_t max_memory() const override { return pool_->max_memory(); }
+
+  std::string backend_name() const override { return pool_->backend_name(); }
+
+  int64_t total_bytes_allocated() const { return total_bytes_allocated_; }
+
+ private:
+  arrow::MemoryPool* const pool_ = arrow::default_memory_pool();
+  std::atomic<int64_t> total_bytes_allocated_ = 0;
+};
+
+// The compressed trio files, read from disk once.
+struct TestData {
+  ScannerOptions scanner_options;
+  std::vector<std::shared_ptr<arrow::Buffer>> files;
+};
+
+const TestData& GetTestData() {
+  static const TestData* const test_data = [] {
+    if (const auto status = RegisterStringListContainsAny(
+            arrow::compute::GetFunctionRegistry());
+        !status.ok()) {
+      std::cerr << status.ToString() << std::endl;
+      std::abort();
+    }
+
+    QueryRequest request;
+    std::ifstream ifs{kQueryTextProtoFilename};
+    google::protobuf::io::IstreamInputStream iis{&ifs};
+    if (!ifs || !google::protobuf::TextFormat::Parse(&iis, &request)) {
+      std::cerr << "Failed to read " << kQueryTextProtoFilename << std::endl;
+      std::abort();
+    }
+
+    auto scanner_options = BuildScannerOptions(request);
+    if (!scanner_options.ok()) {
+      std::cerr << scanner_options.status() << std::endl;
+      std::abort();
+    }
+
+    auto* const result = new TestData{*std::move(scanner_options), {}};
+    for (const auto& url : request.arrow_urls()) {
+      const std::string path = url.substr(std::string("file://").size());
+      const auto file = arrow::io::ReadableFile::Open(path).ValueOrDie();
+      result->files.push_back(
+          file->Read(file->GetSize().ValueOrDie()).ValueOrDie());
+    }
+    return result;
+  }();
+  return *test_data;
+}
+
+std::shared_ptr<arrow::ipc::RecordBatchFileReader> OpenFile(
+    const std::shared_ptr<arrow::Buffer>& file,
+    const std::vector<std::string>& columns, arrow::MemoryPool* const pool) {
+  auto input = std::make_shared<arrow::io::BufferReader>(file);
+  auto options = arrow::ipc::IpcReadOptions::Defaults();
+  options.use_threads = false;
+  options.memory_pool = pool;
+  const auto schema = arrow::ipc::RecordBatchFileReader::Open(input, options)
+                          .ValueOrDie()
+                          ->schema();
+  for (const auto& column : columns) {
+    options.included_fields.push_back(schema->GetFieldIndex(column));
+  }
+  std::sort(options.included_fields.begin(), options.included_fields.end());
+  return arrow::ipc::RecordBatchFileReader::Open(input, options).ValueOrDie();
+}
+
+void ReportCounters(benchmark::State& state, const int64_t num_rows,
+                    const CountingMemoryPool& pool) {
+  state.counters["rows"] = num_rows;
+  state.counters["bytes_allocated"] = benchmark::Counter(
+      pool.total_bytes_allocated(), benchmark::Counter::kAvgIterations);
+}
+
+// Decodes the projection and filter columns of all record batches, then scans
+// them with the dataset scanner.
+void BM_DatasetScanner(benchmark::State& state) {
+  const auto& test_data = GetTestData();
+  const auto& scanner_options = test_data.scanner_options;
+  std::vector<std::string> columns = scanner_options.filter_columns;
+  columns.insert(columns.end(), scanner_options.late_columns.begin(),
+                 scanner_options.late_columns.end());
+  CountingMemoryPool pool;
+  int64_t num_rows = 0;
+  for (auto _ : state) {
+    num_rows = 0;
+    for (const auto& file : test_data.files) {
+      const auto reader = OpenFile(file, columns, &pool);
+      arrow::RecordBatchVector record_batches;
+      for (int i = 0; i < reader->num_record_batches(); ++i) {
+        record_batches.push_back(reader->ReadRecordBatch(i).ValueOrDie());
+      }
+      const auto dataset = std::make_shared<arrow::dataset::InMemoryDataset>(
+          reader->schema(), record_batches);
+      auto scanner_builder = dataset->NewScan().ValueOrDie();
+      ARROW_CHECK_OK(
+          scanner_builder->Project(scanner_options.projection_columns));
+      ARROW_CHECK_OK(
+          scanner_builder->Filter(scanner_options.filter_expression));
+      ARROW_CHECK_OK(scanner_builder->UseThreads(false));
+      ARROW_CHECK_OK(scanner_builder->Pool(&pool));
+      const auto table = scanner_builder->Finish().ValueOrDie()->ToTable();
+      num_rows += table.ValueOrDie()->num_rows();
+    }
+  }
+  ReportCounters(state, num_rows, pool);
+}
+BENCHMARK(BM_DatasetScanner)->Unit(benchmark::kMillisecond);
+
+// Decodes the filter columns first, and the remaining projection columns only
+// for record batches with matches.
+void BM_TwoPhaseScan(benchmark::State& state) {
+  const auto& test_data = GetTestData();
+  const auto& scanner_options = test_data.scanner_options;
+  CountingMemoryPool pool;
+  int64_t num_rows = 0;
+  for (auto _ : state) {
+    num_rows = 0;
+    for (const auto& file : test_data.files) {
+      const auto filter_reader =
+          OpenFile(file, scanner_options.filter_columns, &pool);
+      const auto late_reader =
+          OpenFile(file, scanner_options.late_columns, &pool);
+      for (int i = 0; i < filter_reader->num_record_batches(); ++i) {
+        const auto record_batch = ScanRecordBatch(
+            scanner_options,
+            [&](const std::vector<std::string>& columns)
+                -> absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> {
+              const auto& reader = columns == scanner_options.filter_columns
+                                       ? filter_reader
+                                       : late_reader;
+              return reader->ReadRecordBatch(i).ValueOrDie();
+            },
+            /* indexed_filter */ nullptr, &pool);
+        if (!record_batch.ok()) {
+          state.SkipWithError(record_batch.status().ToString().c_str());
+          return;
+        }
+        if (*record_batch != nullptr) {
+          num_rows += (*record_batch)->num_rows();
+        }
+      }
+    }
+  }
+  ReportCounters(state, num_rows, pool);
+}
+BENCHMARK(BM_TwoPhaseScan)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace seqr
+
+BENCHMARK_MAIN();
@@ -0,0 +1,197 @@
+// Measures how scanning the trio test data scales with the number of threads,
+// when scheduling a task per file versus a task per morsel of record batches.
+// The files are rewritten with smaller record batches, as in the loading
+// pipeline, so they can be split into morsels.
+//
+// Run from the server directory, so the test data can be found:
+//   ../build/server/benchmarks/scheduler_benchmark
+
+#include <arrow/io/file.h>
+#include <arrow/io/memory.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/ipc/writer.h>
+#include <arrow/table.h>
+#include <arrow/util/compression.h>
+#include <arrow/util/logging.h>
+#include <benchmark/benchmark.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/text_format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "scan.h"
+#include "scheduler.h"
+#include "seqr_query_service.pb.h"
+#include "string_list_contains_any.h"
+
+namespace seqr {
+namespace {
+
+constexpr char kQueryTextProtoFilename[] =
+    "testdata/na12878_trio_query.textproto";
+constexpr int64_t kRecordBatchSize = 4096;
+constexpr int kMorselRecordBatches = 4;
+
+// The trio files, rewritten in memory with kRecordBatchSize rows per record
+// batch.
+struct TestData {
+  ScannerOptions scanner_options;
+  std::vector<std::shared_ptr<arrow::Buffer>> files;
+  std::vector<int> num_record_batches;
+};
+
+std::shared_ptr<arrow::Buffer> Rebatch(const std::string& path,
+                                       int* const num_record_batches) {
+  const auto file = arrow::io::ReadableFile::Open(path).ValueOrDie();
+  const auto reader =
+      arrow::ipc::RecordBatchFileReader::Open(file).ValueOrDie();
+  arrow::RecordBatchVector record_batches;
+  for (int i = 0; i < reader->num_record_batches(); ++i) {
+    record_batches.push_back(reader->ReadRecordBatch(i).ValueOrDie());
+  }
+  const auto table =
+      arrow::Table::FromRecordBatches(reader->schema(), record_batches)
+          .ValueOrDie();
+
+  auto options = arrow::ipc::IpcWriteOptions::Defaults();
+  options.codec =
+      arrow::util::Codec::Create(arrow::Compression::ZSTD).ValueOrDie();
+  const auto output = arrow::io::BufferOutputStream::Create().ValueOrDie();
+  const auto writer =
+      arrow::ipc::MakeFileWriter(output, table->schema(), options)
+          .ValueOrDie();
+  ARROW_CHECK_OK(writer->WriteTable(*table, kRecordBatchSize));
+  ARROW_CHECK_OK(writer->Close());
+  *num_record_batches = static_cast<int>(
+      (table->num_rows() + kRecordBatchSize - 1) / kRecordBatchSize);
+  return output->Finish().ValueOrDie();
+}
+
+const TestData& GetTestData() {
+  static const TestData* const test_data = [] {
+    ARROW_CHECK_OK(
+        RegisterStringListContainsAny(arrow::compute::GetFunctionRegistry()));
+
+    QueryRequest request;
+    std::ifstream ifs{kQueryTextProtoFilename};
+    google::protobuf::io::IstreamInputStream iis{&ifs};
+    if (!ifs || !google::protobuf::TextFormat::Parse(&iis, &request)) {
+      std::cerr << "Failed to read " << kQueryTextProtoFilename << std::endl;
+      std::abort();
+    }
+
+    auto scanner_options = BuildScannerOptions(request);
+    if (!scanner_options.ok()) {
+      std::cerr << scanner_options.status() << std::endl;
+      std::abort();
+    }
+
+    auto* const result = new TestData{*std::move(scanner_options), {}, {}};
+    for (const auto& url : request.arrow_urls()) {
+      int num_record_batches = 0;
+      result->files.push_back(Rebatch(
+          url.substr(std::string("file://").size()), &num_record_batches));
+      result->num_record_batches.push_back(num_record_batches);
+    }
+    return result;
+  }();
+  return *test_data;
+}
+
+std::shared_ptr<arrow::ipc::RecordBatchFileReader> OpenFile(
+    const std::shared_ptr<arrow::Buffer>& file,
+    const std::vector<std::string>& columns) {
+  auto input = std::make_shared<arrow::io::BufferReader>(file);
+  auto options = arrow::ipc::IpcReadOptions::Defaults();
+  options.use_threads = false;
+  const auto schema = arrow::ipc::RecordBatchFileReader::Open(input, options)
+                          .ValueOrDie()
+                          ->schema();
+  for (const auto& column : columns) {
+    options.included_fields.push_back(schema->GetFieldIndex(column));
+  }
+  std::sort(options.included_fields.begin(), options.included_fields.end());
+  return arrow::ipc::RecordBatchFileReader::Open(input, options).ValueOrDie();
+}
+
+// Decodes and scans the record batches [begin, end) of a file, returning the
+// number of matching rows.
+int64_t ScanRecordBatches(const TestData& test_data, const size_t file_index,
+                          const int begin, const int end) {
+  const auto& scanner_options = test_data.scanner_options;
+  const auto& file = test_data.files[file_index];
+  const auto filter_reader = OpenFile(file, scanner_options.filter_columns);
+  const auto late_reader = OpenFile(file, scanner_options.late_columns);
+  int64_t result = 0;
+  for (int i = begin; i < end; ++i) {
+    const auto record_batch = ScanRecordBatch(
+        scanner_options,
+        [&](const std::vector<std::string>& columns)
+            -> absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> {
+          const auto& reader = columns == scanner_options.filter_columns
+                                   ? filter_reader
+                                   : late_reader;
+          return reader->ReadRecordBatch(i).ValueOrDie();
+        });
+    ARROW_CHECK(record_batch.ok()) << record_batch.status();
+    if (*record_batch != nullptr) {
+      result += (*record_batch)->num_rows();
+    }
+  }
+  return result;
+}
+
+void Run(benchmark::State& state, const int morsel_record_batches) {
+  const auto& test_data = GetTestData();
+  Scheduler scheduler(static_cast<int>(state.range(0)));
+  std::atomic<int64_t> num_rows = 0;
+  for (auto _ : state) {
+    num_rows = 0;
+    Scheduler::TaskGroup task_group(&scheduler);
+    for (size_t i = 0; i < test_data.files.size(); ++i) {
+      const int num_record_batches = test_data.num_record_batches[i];
+      const int morsel_size = morsel_record_batches > 0 ? morsel_record_batches
+                                                        : num_record_batches;
+      for (int begin = 0; begin < num_record_batches; begin += morsel_size) {
+        const int end = std::min(begin + morsel_size, num_record_batches);
+        task_group.Schedule([&test_data, &num_rows, i, begin, end] {
+          num_rows += ScanRecordBatches(test_data, i, begin, end);
+        });
+      }
+    }
+    task_group.Wait();
+  }
+  state.counters["rows"] = num_rows;
+}
+
+void ApplyThreadCounts(benchmark::internal::Benchmark* const benchmark) {
+  const int max_threads =
+      std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  for (int num_threads = 1; num_threads < max_threads; num_threads *= 2) {
+    benchmark->Arg(num_threads);
+  }
+  benchmark->Arg(max_threads);
+  benchmark->ArgName("threads")->UseRealTime()->Unit(benchmark::kMillisecond);
+}
+
+// One task per file, like the previous thread pool.
+void BM_TaskPerFile(benchmark::State& state) { Run(state, 0); }
+BENCHMARK(BM_TaskPerFile)->Apply(ApplyThreadCounts);
+
+void BM_TaskPerMorsel(benchmark::State& state) {
+  Run(state, kMorselRecordBatches);
+}
+BENCHMARK(BM_TaskPerMorsel)->Apply(ApplyThreadCounts);
+
+}  // namespace
+}  // namespace seqr
+
+BENCHMARK_MAIN();
@@ -0,0 +1,151 @@
+// Compares string_list_contains_any on plain and dictionary-encoded sample
+// lists from the trio test data, and measures it on synthetic sample lists of
+// varying lengths, null densities and value set sizes. Value sets of size one
+// take the single-string fast path.
+//
+// Run from the server directory, so the test data can be found:
+//   ../build/server/benchmarks/string_list_contains_any_benchmark
+
+#include <arrow/array/builder_binary.h>
+#include <arrow/array/builder_nested.h>
+#include <arrow/compute/api_scalar.h>
+#include <arrow/compute/api_vector.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/util/logging.h>
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <random>
+#include <string>
+
+#include "string_list_contains_any.h"
+#include "synthetic_data.h"
+
+namespace seqr {
+namespace {
+
+namespace cp = arrow::compute;
+
+constexpr char kTestDataPath[] =
+    "testdata/part-00000-na12878-trio.zstd.arrow";
+constexpr char kColumn[] = "samples_num_alt_1";
+constexpr int64_t kSyntheticRows = int64_t{1} << 16;
+constexpr int kSyntheticSamples = 1000;
+
+struct TestData {
+  std::shared_ptr<arrow::Array> strings;
+  std::shared_ptr<arrow::Array> dictionary_strings;
+};
+
+void RegisterFunctions() {
+  static const bool registered = [] {
+    ARROW_CHECK_OK(
+        RegisterStringListContainsAny(cp::GetFunctionRegistry()));
+    return true;
+  }();
+  (void)registered;
+}
+
+const TestData& GetTestData() {
+  static const TestData* const test_data = [] {
+    RegisterFunctions();
+
+    const auto file = arrow::io::ReadableFile::Open(kTestDataPath).ValueOrDie();
+    const auto reader =
+        arrow::ipc::RecordBatchFileReader::Open(file).ValueOrDie();
+    const auto lists = std::static_pointer_cast<arrow::ListArray>(
+        reader->ReadRecordBatch(0).ValueOrDie()->GetColumnByName(kColumn));
+
+    const auto encoded_values =
+        cp::DictionaryEncode(lists->values()).ValueOrDie();
+    const auto dictionary_strings = arrow::MakeArray(arrow::ArrayData::Make(
+        arrow::list(arrow::field("element", encoded_values.type())),
+        lists->length(),
+        {lists->data()->buffers[0], lists->data()->buffers[1]},
+        {encoded_values.array()}, lists->null_count(), lists->offset()));
+    return new TestData{lists, dictionary_strings};
+  }();
+  return *test_data;
+}
+
+void Run(benchmark::State& state, const std::shared_ptr<arrow::Array>& lists) {
+  arrow::StringBuilder value_set_builder;
+  for (int i = 0; i < state.range(0); ++i) {
+    // The first one is a sample in the data, the others are not.
+    ARROW_CHECK_OK(
+        value_set_builder.Append(i == 0 ? "NA12878" : std::to_string(i)));
+  }
+  const cp::SetLookupOptions options(value_set_builder.Finish().ValueOrDie(),
+                                     /* skip_nulls */ true);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        cp::CallFunction("string_list_contains_any", {lists}, &options)
+            .ValueOrDie());
+  }
+  state.SetItemsProcessed(state.iterations() * lists->length());
+}
+
+void BM_StringList(benchmark::State& state) {
+  Run(state, GetTestData().strings);
+}
+BENCHMARK(BM_StringList)->Arg(1)->Arg(3);
+
+void BM_DictionaryList(benchmark::State& state) {
+  Run(state, GetTestData().dictionary_strings);
+}
+BENCHMARK(BM_DictionaryList)->Arg(1)->Arg(3);
+
+// Returns kSyntheticRows lists of `list_length` random samples each, of which
+// `null_percent` percent are null.
+std::shared_ptr<arrow::Array> MakeSampleLists(const int list_length,
+                                              const int null_percent) {
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> sample(0, kSyntheticSamples - 1);
+  std::uniform_int_distribution<int> percent(0, 99);
+  arrow::ListBuilder builder(arrow::default_memory_pool(),
+                             std::make_shared<arrow::StringBuilder>());
+  auto* const value_builder =
+      static_cast<arrow::StringBuilder*>(builder.value_builder());
+  for (int64_t row = 0; row < kSyntheticRows; ++row) {
+    if (percent(rng) < null_percent) {
+      ARROW_CHECK_OK(builder.AppendNull());
+      continue;
+    }
+    ARROW_CHECK_OK(builder.Append());
+    for (int i = 0; i < list_length; ++i) {
+      ARROW_CHECK_OK(value_builder->Append(SyntheticSampleId(sample(rng))));
+    }
+  }
+  return builder.Finish().ValueOrDie();
+}
+
+void BM_SyntheticStringList(benchmark::State& state) {
+  RegisterFunctions();
+  const auto lists = MakeSampleLists(static_cast<int>(state.range(0)),
+                                     static_cast<int>(state.range(1)));
+  arrow::StringBuilder value_set_builder;
+  for (int i = 0; i < state.range(2); ++i) {
+    ARROW_CHECK_OK(value_set_builder.Append(SyntheticSampleId(i)));
+  }
+  const cp::SetLookupOptions options(value_set_builder.Finish().ValueOrDie(),
+                                     /* skip_nulls */ true);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        cp::CallFunction("string_list_contains_any", {lists}, &options)
+            .ValueOrDie());
+  }
+  const auto& values = static_cast<const arrow::ListArray&>(*lists).values();
+  state.SetItemsProcessed(state.iterations() * lists->length());
+  state.SetBytesProcessed(
+      state.iterations() *
+      static_cast<const arrow::StringArray&>(*values).total_values_length());
+}
+BENCHMARK(BM_SyntheticStringList)
+    ->ArgsProduct({{1, 8, 64}, {0, 50}, {1, 4, 64}})
+    ->ArgNames({"list_length", "null_percent", "value_set_size"});
+
+}  // namespace
+}  // namespace seqr
+
+BENCHMARK_MAIN();
@@ -0,0 +1,365 @@
+#include "synthetic_data.h"
+
+#include <absl/strings/str_cat.h>
+#include <arrow/array/builder_binary.h>
+#include <arrow/array/builder_nested.h>
+#include <arrow/array/builder_primitive.h>
+#include <arrow/io/file.h>
+#include <arrow/io/memory.h>
+#include <arrow/ipc/writer.h>
+#include <arrow/util/key_value_metadata.h>
+#include <google/protobuf/util/json_util.h>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "zone_map.h"
+#include "zone_map.pb.h"
+
+namespace seqr {
+namespace {
+
+constexpr int64_t kFirstXpos = int64_t{1000000000} + 10000;
+// The average distance between variants.
+constexpr int64_t kXposStride = 37;
+// The number of distinct gene IDs in annotation columns.
+constexpr int kNumGenes = 20000;
+// The shares of non-reference genotypes that are no-calls and homozygous.
+constexpr double kNoCallFraction = 0.1;
+constexpr double kNumAlt2Fraction = 0.3;
+
+std::shared_ptr<arrow::DataType> SampleListType() {
+  return arrow::list(arrow::field("element", arrow::utf8()));
+}
+
+// Appends one list per row for each genotype category.
+class SampleListBuilders {
+ public:
+  SampleListBuilders() {
+    for (auto& builder : builders_) {
+      builder = std::make_unique<arrow::ListBuilder>(
+          arrow::default_memory_pool(),
+          std::make_shared<arrow::StringBuilder>(), SampleListType());
+    }
+  }
+
+  arrow::Status AppendRow(const bool is_null) {
+    for (auto& builder : builders_) {
+      ARROW_RETURN_NOT_OK(is_null ? builder->AppendNull() : builder->Append());
+    }
+    return arrow::Status::OK();
+  }
+
+  // Adds a sample to the current row of the given category.
+  arrow::Status AppendSample(const int category, const std::string& sample) {
+    return static_cast<arrow::StringBuilder*>(
+               builders_[category]->value_builder())
+        ->Append(sample);
+  }
+
+  arrow::Status Finish(arrow::ArrayVector* const out) {
+    for (auto& builder : builders_) {
+      ARROW_ASSIGN_OR_RAISE(auto array, builder->Finish());
+      out->push_back(std::move(array));
+    }
+    return arrow::Status::OK();
+  }
+
+ private:
+  // samples_no_call, samples_num_alt_1 and samples_num_alt_2.
+  std::unique_ptr<arrow::ListBuilder> builders_[3];
+};
+
+// Calls `function` with each record batch of the rows of the options.
+arrow::Status ForEachRecordBatch(
+    const SyntheticDataOptions& options,
+    const std::function<arrow::Status(const arrow::RecordBatch&)>& function) {
+  const int64_t end_row = options.first_row + options.num_rows;
+  for (int64_t first_row = options.first_row; first_row < end_row;
+       first_row += options.record_batch_size) {
+    ARROW_ASSIGN_OR_RAISE(
+        const auto record_batch,
+        MakeSyntheticRecordBatch(
+            options, first_row,
+            std::min(options.record_batch_size, end_row - first_row)));
+    ARROW_RETURN_NOT_OK(function(*record_batch));
+  }
+  return arrow::Status::OK();
+}
+
+void SetMinMax(const arrow::FloatArray& array,
+               ZoneMap::ColumnStatistics* const statistics) {
+  for (int64_t i = 0; i < array.length(); ++i) {
+    if (array.IsValid(i)) {
+      const double value = array.Value(i);
+      if (!statistics->has_min() || value < statistics->min()) {
+        statistics->set_min(value);
+      }
+      if (!statistics->has_max() || value > statistics->max()) {
+        statistics->set_max(value);
+      }
+    }
+  }
+}
+
+// Integers are kept exact, see ZoneMap.ColumnStatistics.min_int.
+void SetMinMax(const arrow::Int64Array& array,
+               ZoneMap::ColumnStatistics* const statistics) {
+  for (int64_t i = 0; i < array.length(); ++i) {
+    if (array.IsValid(i)) {
+      const int64_t value = array.Value(i);
+      if (!statistics->has_min_int() || value < statistics->min_int()) {
+        statistics->set_min_int(value);
+      }
+      if (!statistics->has_max_int() || value > statistics->max_int()) {
+        statistics->set_max_int(value);
+      }
+    }
+  }
+}
+
+int64_t TotalBufferSize(const arrow::ArrayData& data) {
+  int64_t result = 0;
+  for (const auto& buffer : data.buffers) {
+    if (buffer != nullptr) {
+      result += buffer->size();
+    }
+  }
+  for (const auto& child : data.child_data) {
+    result += TotalBufferSize(*child);
+  }
+  return result;
+}
+
+// Returns the statistics of the numeric columns, like the pipeline's
+// statistics() in parquet_to_arrow.py.
+ZoneMap::Statistics ComputeStatistics(const arrow::RecordBatch& record_batch) {
+  ZoneMap::Statistics result;
+  result.set_num_rows(record_batch.num_rows());
+  for (int i = 0; i < record_batch.num_columns(); ++i) {
+    const arrow::Array& column = *record_batch.column(i);
+    result.set_uncompressed_bytes(result.uncompressed_bytes() +
+                                  TotalBufferSize(*column.data()));
+    ZoneMap::ColumnStatistics statistics;
+    if (column.type_id() == arrow::Type::INT64) {
+      SetMinMax(static_cast<const arrow::Int64Array&>(column), &statistics);
+    } else if (column.type_id() == arrow::Type::FLOAT) {
+      SetMinMax(static_cast<const arrow::FloatArray&>(column), &statistics);
+    } else {
+      continue;
+    }
+    statistics.set_null_count(column.null_count());
+    (*result.mutable_columns())[record_batch.schema()->field(i)->name()] =
+        std::move(statistics);
+  }
+  return result;
+}
+
+// Adds the statistics of a record batch to those of the whole file.
+void MergeStatistics(const ZoneMap::Statistics& statistics,
+                     ZoneMap::Statistics* const file_statistics) {
+  file_statistics->set_num_rows(file_statistics->num_rows() +
+                                statistics.num_rows());
+  file_statistics->set_uncompressed_bytes(
+      file_statistics->uncompressed_bytes() + statistics.uncompressed_bytes());
+  for (const auto& [name, column] : statistics.columns()) {
+    auto& file_column = (*file_statistics->mutable_columns())[name];
+    if (column.has_min() &&
+        (!file_column.has_min() || column.min() < file_column.min())) {
+      file_column.set_min(column.min());
+    }
+    if (column.has_max() &&
+        (!file_column.has_max() || column.max() > file_column.max())) {
+      file_column.set_max(column.max());
+    }
+    if (column.has_min_int() && (!file_column.has_min_int() ||
+                                 column.min_int() < file_column.min_int())) {
+      file_column.set_min_int(column.min_int());
+    }
+    if (column.has_max_int() && (!file_column.has_max_int() ||
+                                 column.max_int() > file_column.max_int())) {
+      file_column.set_max_int(column.max_int());
+    }
+    file_column.set_null_count(file_column.null_count() +
+                               column.null_count());
+  }
+}
+
+// Returns the schema with the zone map of all record batches in its metadata.
+arrow::Result<std::shared_ptr<arrow::Schema>> AddZoneMap(
+    const SyntheticDataOptions& options,
+    const std::shared_ptr<arrow::Schema>& schema) {
+  ZoneMap zone_map;
+  ARROW_RETURN_NOT_OK(ForEachRecordBatch(
+      options, [&zone_map](const arrow::RecordBatch& record_batch) {
+        *zone_map.add_record_batches() = ComputeStatistics(record_batch);
+        MergeStatistics(zone_map.record_batches(
+                            zone_map.record_batches_size() - 1),
+                        zone_map.mutable_file());
+        return arrow::Status::OK();
+      }));
+  std::string json;
+  if (!google::protobuf::util::MessageToJsonString(zone_map, &json).ok()) {
+    return arrow::Status::Invalid("Failed to encode zone map");
+  }
+  return schema->WithMetadata(
+      arrow::key_value_metadata({kZoneMapMetadataKey}, {std::move(json)}));
+}
+
+arrow::Status WriteSyntheticRecordBatches(
+    const SyntheticDataOptions& options,
+    const std::shared_ptr<arrow::io::OutputStream>& output) {
+  auto write_options = arrow::ipc::IpcWriteOptions::Defaults();
+  if (options.compression != arrow::Compression::UNCOMPRESSED) {
+    ARROW_ASSIGN_OR_RAISE(write_options.codec,
+                          arrow::util::Codec::Create(options.compression));
+  }
+  std::shared_ptr<arrow::Schema> schema = SyntheticSchema(options);
+  if (options.zone_map) {
+    ARROW_ASSIGN_OR_RAISE(schema, AddZoneMap(options, schema));
+  }
+  ARROW_ASSIGN_OR_RAISE(
+      const auto writer,
+      arrow::ipc::MakeFileWriter(output, schema, write_options));
+  ARROW_RETURN_NOT_OK(ForEachRecordBatch(
+      options, [&writer](const arrow::RecordBatch& record_batch) {
+        return writer->WriteRecordBatch(record_batch);
+      }));
+  return writer->Close();
+}
+
+}  // namespace
+
+std::string SyntheticSampleId(const int index) {
+  return absl::StrCat("SAMPLE", index);
+}
+
+std::shared_ptr<arrow::Schema> SyntheticSchema(
+    const SyntheticDataOptions& options) {
+  arrow::FieldVector fields = {
+      arrow::field("xpos", arrow::int64()),
+      arrow::field("variantId", arrow::utf8()),
+      arrow::field("AF", arrow::float32()),
+      arrow::field("clinvar_clinical_significance", arrow::utf8()),
+      arrow::field("samples_no_call", SampleListType()),
+      arrow::field("samples_num_alt_1", SampleListType()),
+      arrow::field("samples_num_alt_2", SampleListType()),
+  };
+  for (int i = 0; i < options.num_annotation_columns; ++i) {
+    fields.push_back(
+        arrow::field(absl::StrCat("annotation_", i),
+                     i % 2 == 0 ? arrow::float32() : arrow::utf8()));
+  }
+  return arrow::schema(std::move(fields));
+}
+
+arrow::Result<std::shared_ptr<arrow::RecordBatch>> MakeSyntheticRecordBatch(
+    const SyntheticDataOptions& options, const int64_t first_row,
+    const int64_t num_rows) {
+  std::seed_seq seed{options.seed, static_cast<uint64_t>(first_row)};
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> uniform;
+  // Skips to the next sample with a non-reference genotype.
+  std::geometric_distribution<int64_t> sample_gap(
+      std::clamp(options.genotype_density, 1e-9, 1.0));
+
+  std::vector<std::string> sample_ids;
+  for (int i = 0; i < options.num_samples; ++i) {
+    sample_ids.push_back(SyntheticSampleId(i));
+  }
+
+  arrow::Int64Builder xpos_builder;
+  arrow::StringBuilder variant_id_builder;
+  arrow::FloatBuilder af_builder;
+  arrow::StringBuilder clinvar_builder;
+  SampleListBuilders sample_list_builders;
+  std::vector<std::unique_ptr<arrow::ArrayBuilder>> annotation_builders;
+  for (int i = 0; i < options.num_annotation_columns; ++i) {
+    if (i % 2 == 0) {
+      annotation_builders.push_back(std::make_unique<arrow::FloatBuilder>());
+    } else {
+      annotation_builders.push_back(std::make_unique<arrow::StringBuilder>());
+    }
+  }
+  std::uniform_int_distribution<int> gene(0, kNumGenes - 1);
+  for (int64_t row = first_row; row < first_row + num_rows; ++row) {
+    const int64_t xpos = kFirstXpos + row * kXposStride;
+    ARROW_RETURN_NOT_OK(xpos_builder.Append(xpos));
+    ARROW_RETURN_NOT_OK(variant_id_builder.Append(
+        absl::StrCat("1-", xpos % 1000000000, "-A-G")));
+    if (uniform(rng) < options.af_null_fraction) {
+      ARROW_RETURN_NOT_OK(af_builder.AppendNull());
+    } else {
+      ARROW_RETURN_NOT_OK(af_builder.Append(
+          static_cast<float>(std::pow(uniform(rng), options.af_exponent))));
+    }
+    if (uniform(rng) < options.clinvar_fraction) {
+      ARROW_RETURN_NOT_OK(clinvar_builder.Append("Pathogenic"));
+    } else {
+      ARROW_RETURN_NOT_OK(clinvar_builder.AppendNull());
+    }
+
+    for (int i = 0; i < options.num_annotation_columns; ++i) {
+      if (i % 2 == 0) {
+        ARROW_RETURN_NOT_OK(
+            static_cast<arrow::FloatBuilder&>(*annotation_builders[i])
+                .Append(static_cast<float>(uniform(rng))));
+      } else {
+        ARROW_RETURN_NOT_OK(
+            static_cast<arrow::StringBuilder&>(*annotation_builders[i])
+                .Append(absl::StrCat(
+                    "ENSG", absl::Dec(gene(rng), absl::kZeroPad11))));
+      }
+    }
+
+    const bool is_null = uniform(rng) < options.null_density;
+    ARROW_RETURN_NOT_OK(sample_list_builders.AppendRow(is_null));
+    if (is_null || options.genotype_density <= 0) {
+      continue;
+    }
+    for (int64_t sample = sample_gap(rng); sample < options.num_samples;
+         sample += 1 + sample_gap(rng)) {
+      const double category = uniform(rng);
+      ARROW_RETURN_NOT_OK(sample_list_builders.AppendSample(
+          category < kNoCallFraction                      ? 0
+          : category < kNoCallFraction + kNumAlt2Fraction ? 2
+                                                          : 1,
+          sample_ids[sample]));
+    }
+  }
+
+  arrow::ArrayVector columns(4);
+  ARROW_RETURN_NOT_OK(xpos_builder.Finish(&columns[0]));
+  ARROW_RETURN_NOT_OK(variant_id_builder.Finish(&columns[1]));
+  ARROW_RETURN_NOT_OK(af_builder.Finish(&columns[2]));
+  ARROW_RETURN_NOT_OK(clinvar_builder.Finish(&columns[3]));
+  ARROW_RETURN_NOT_OK(sample_list_builders.Finish(&columns));
+  for (auto& builder : annotation_builders) {
+    ARROW_ASSIGN_OR_RAISE(auto array, builder->Finish());
+    columns.push_back(std::move(array));
+  }
+  return arrow::RecordBatch::Make(SyntheticSchema(options), num_rows,
+                                  std::move(columns));
+}
+
+arrow::Status WriteSyntheticArrowFile(const SyntheticDataOptions& options,
+                                      const std::string& path) {
+  ARROW_ASSIGN_OR_RAISE(const auto output,
+                        arrow::io::FileOutputStream::Open(path));
+  ARROW_RETURN_NOT_OK(WriteSyntheticRecordBatches(options, output));
+  return output->Close();
+}
+
+arrow::Result<std::shared_ptr<arrow::Buffer>> MakeSyntheticArrowFile(
+    const SyntheticDataOptions& options) {
+  ARROW_ASSIGN_OR_RAISE(const auto output,
+                        arrow::io::BufferOutputStream::Create());
+  ARROW_RETURN_NOT_OK(WriteSyntheticRecordBatches(options, output));
+  return output->Finish();
+}
+
+}  // namespace seqr
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <arrow/buffer.h>
+#include <arrow/record_batch.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/type.h>
+#include <arrow/util/compression.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace seqr {
+
+// Describes a synthetic table shaped like the pipeline's output: sorted xpos,
+// variantId, AF, clinvar_clinical_significance, the genotype sample lists
+// samples_no_call, samples_num_alt_1 and samples_num_alt_2, and optionally
+// further annotation columns.
+struct SyntheticDataOptions {
+  // The rows [first_row, first_row + num_rows) of the table, so it can be
+  // split across files.
+  int64_t first_row = 0;
+  int64_t num_rows = int64_t{1} << 20;
+  // Like RECORD_BATCH_SIZE in pipeline/parquet_to_arrow.py.
+  int64_t record_batch_size = 32768;
+  int num_samples = 3;
+  // The probability that a sample has a non-reference genotype in a row,
+  // which determines the lengths of the sample lists.
+  double genotype_density = 0.3;
+  // The fraction of rows whose sample lists are null.
+  double null_density = 0.0;
+  // AF is drawn as u^af_exponent for a uniform u, so 1 gives uniform allele
+  // frequencies and larger exponents make rare variants more common.
+  double af_exponent = 4;
+  double af_null_fraction = 0.1;
+  // The fraction of rows with a ClinVar annotation.
+  double clinvar_fraction = 0.02;
+  // The number of additional columns annotation_0, annotation_1, ..., which
+  // alternate between float scores and gene ID strings, to vary the width of
+  // the table.
+  int num_annotation_columns = 0;
+  // Whether files store a zone map of the numeric columns in their schema
+  // metadata, like the pipeline's.
+  bool zone_map = true;
+  arrow::Compression::type compression = arrow::Compression::ZSTD;
+  uint64_t seed = 42;
+};
+
+// Returns the ID of the i-th synthetic sample.
+std::string SyntheticSampleId(int index);
+
+// Returns the schema of the table, without metadata.
+std::shared_ptr<arrow::Schema> SyntheticSchema(
+    const SyntheticDataOptions& options);
+
+// Returns the rows [first_row, first_row + num_rows), ignoring the rows of
+// the options. Each record batch only depends on the seed and its first row,
+// so they can be generated in any order.
+arrow::Result<std::shared_ptr<arrow::RecordBatch>> MakeSyntheticRecordBatch(
+    const SyntheticDataOptions& options, int64_t first_row, int64_t num_rows);
+
+// Writes an Arrow IPC file with the rows of the options, one record batch at
+// a time, so files can be larger than memory. The zone map needs the
+// statistics of all record batches up front, so they're generated twice.
+arrow::Status WriteSyntheticArrowFile(const SyntheticDataOptions& options,
+                                      const std::string& path);
+
+// Like WriteSyntheticArrowFile, but returns the file content.
+arrow::Result<std::shared_ptr<arrow::Buffer>> MakeSyntheticArrowFile(
+    const SyntheticDataOptions& options);
+
+}  // namespace seqr
@@ -0,0 +1,618 @@
+#include "disk_cache.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/status.h>
+#include <absl/strings/escaping.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/synchronization/notification.h>
+#include <absl/time/clock.h>
+#include <arrow/io/file.h>
+#include <arrow/io/memory.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/ipc/writer.h>
+#include <arrow/util/cancel.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "scheduler.h"
+#include "sha256.h"
+
+namespace seqr {
+namespace {
+
+namespace fs = std::filesystem;
+
+// Every entry consists of a data file and a metadata file. An entry only
+// exists once its metadata file has been renamed into place.
+constexpr char kDataExtension[] = ".arrow";
+constexpr char kMetadataExtension[] = ".meta";
+constexpr char kTemporaryExtension[] = ".tmp";
+
+// How often a reader waiting for another fill checks for cancellation.
+constexpr absl::Duration kFillPollInterval = absl::Milliseconds(10);
+
+// Checksums and keys persist across restarts, so they use SHA-256, which,
+// unlike Arrow's and absl's hashes, is the same in every build.
+std::string Checksum(const arrow::Buffer& buffer) {
+  return absl::BytesToHexString(Sha256(std::string_view(
+      reinterpret_cast<const char*>(buffer.data()), buffer.size())));
+}
+
+// Returns a file name for the given URL and generation.
+std::string EntryKey(const std::string_view url,
+                     const std::string_view generation) {
+  return absl::BytesToHexString(
+      Sha256(absl::StrCat(url, "\n", generation)));
+}
+
+// Flushes the content of a file to disk, so it survives a crash once it has
+// been renamed. For a directory, this flushes the renames within it.
+absl::Status SyncFile(const fs::path& path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return absl::InternalError(
+        absl::StrCat("Failed to open ", path.string(), ": ", strerror(errno)));
+  }
+  const int result = fsync(fd);
+  const int sync_errno = errno;
+  close(fd);
+  if (result != 0) {
+    return absl::InternalError(absl::StrCat(
+        "Failed to sync ", path.string(), ": ", strerror(sync_errno)));
+  }
+  return absl::OkStatus();
+}
+
+// Marks buffers that map cache entries, see UrlReader::MapsContent.
+class MappedBuffer : public arrow::Buffer {
+ public:
+  explicit MappedBuffer(const std::shared_ptr<arrow::Buffer>& map)
+      : arrow::Buffer(map, 0, map->size()) {}
+};
+
+absl::StatusOr<std::shared_ptr<arrow::Buffer>> MapFile(const fs::path& path) {
+  auto file = arrow::io::MemoryMappedFile::Open(path.string(),
+                                                arrow::io::FileMode::READ);
+  if (!file.ok()) {
+    return absl::NotFoundError(absl::StrCat(
+        "Failed to map ", path.string(), ": ", file.status().ToString()));
+  }
+  auto result = (*file)->ReadAt(0, (*file)->GetSize().ValueOr(0));
+  if (!result.ok()) {
+    return absl::InternalError(absl::StrCat(
+        "Failed to read ", path.string(), ": ", result.status().ToString()));
+  }
+  return std::make_shared<MappedBuffer>(*result);
+}
+
+arrow::Status WriteBuffer(const arrow::Buffer& data, const fs::path& path) {
+  ARROW_ASSIGN_OR_RAISE(auto output,
+                        arrow::io::FileOutputStream::Open(path.string()));
+  ARROW_RETURN_NOT_OK(output->Write(data.data(), data.size()));
+  return output->Close();
+}
+
+// Rewrites an Arrow IPC file without compression. The schema, footer metadata
+// and record batch boundaries stay the same, so zone maps and sample indexes
+// still apply.
+arrow::Status WriteDecompressed(std::shared_ptr<arrow::Buffer> data,
+                                const fs::path& path) {
+  auto read_options = arrow::ipc::IpcReadOptions::Defaults();
+  read_options.use_threads = false;
+  ARROW_ASSIGN_OR_RAISE(
+      auto reader,
+      arrow::ipc::RecordBatchFileReader::Open(
+          std::make_shared<arrow::io::BufferReader>(std::move(data)),
+          read_options));
+  ARROW_ASSIGN_OR_RAISE(auto output,
+                        arrow::io::FileOutputStream::Open(path.string()));
+  ARROW_ASSIGN_OR_RAISE(
+      auto writer,
+      arrow::ipc::MakeFileWriter(output, reader->schema(),
+                                 arrow::ipc::IpcWriteOptions::Defaults(),
+                                 reader->metadata()));
+  for (int i = 0; i < reader->num_record_batches(); ++i) {
+    ARROW_ASSIGN_OR_RAISE(auto record_batch, reader->ReadRecordBatch(i));
+    ARROW_RETURN_NOT_OK(writer->WriteRecordBatch(*record_batch));
+  }
+  ARROW_RETURN_NOT_OK(writer->Close());
+  return output->Close();
+}
+
+struct EntryMetadata {
+  int64_t size = 0;
+  std::string checksum;
+  std::string generation;
+  std::string url;
+};
+
+absl::Status WriteMetadata(const EntryMetadata& metadata,
+                           const fs::path& path) {
+  {
+    std::ofstream ofs(path, std::ios::trunc);
+    ofs << metadata.size << "\n"
+        << metadata.checksum << "\n"
+        << metadata.generation << "\n"
+        << metadata.url << "\n";
+    if (!ofs) {
+      return absl::InternalError(
+          absl::StrCat("Failed to write ", path.string()));
+    }
+  }
+  return SyncFile(path);
+}
+
+std::optional<EntryMetadata> ReadMetadata(const fs::path& path) {
+  std::ifstream ifs(path);
+  std::string size;
+  EntryMetadata result;
+  if (!std::getline(ifs, size) || !std::getline(ifs, result.checksum) ||
+      !std::getline(ifs, result.generation) ||
+      !std::getline(ifs, result.url) ||
+      !absl::SimpleAtoi(size, &result.size)) {
+    return std::nullopt;
+  }
+  return result;
+}
+
+class DiskCachedReader : public UrlReader {
+ public:
+  DiskCachedReader(std::unique_ptr<UrlReader> url_reader,
+                   DiskCacheOptions options)
+      : url_reader_(std::move(url_reader)), options_(std::move(options)) {}
+
+  // Stops the fills in the background, which the task group then waits for.
+  ~DiskCachedReader() override { stop_source_.RequestStop(); }
+
+  // Indexes the entries that are left from previous processes, ordered by
+  // their last use, and removes incomplete ones.
+  absl::Status Init() {
+    std::error_code error_code;
+    fs::create_directories(options_.directory, error_code);
+    if (error_code) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Failed to create ", options_.directory, ": ",
+                       error_code.message()));
+    }
+
+    std::vector<std::tuple<fs::file_time_type, std::string, Entry>> entries;
+    std::vector<fs::path> unused_paths;
+    std::error_code list_error_code;
+    for (const auto& dir_entry :
+         fs::directory_iterator(options_.directory, list_error_code)) {
+      const fs::path& path = dir_entry.path();
+      if (path.extension() == kTemporaryExtension) {
+        unused_paths.push_back(path);
+      } else if (path.extension() == kMetadataExtension) {
+        const std::string key = path.stem().string();
+        const auto metadata = ReadMetadata(path);
+        if (!metadata || fs::file_size(DataPath(key), error_code) !=
+                             static_cast<uintmax_t>(metadata->size)) {
+          unused_paths.push_back(path);
+          unused_paths.push_back(DataPath(key));
+          continue;
+        }
+        Entry entry;
+        entry.metadata = *metadata;
+        entries.emplace_back(fs::last_write_time(path, error_code), key,
+                             std::move(entry));
+      } else if (path.extension() == kDataExtension &&
+                 !fs::exists(MetadataPath(path.stem().string()),
+                             error_code)) {
+        unused_paths.push_back(path);
+      }
+    }
+    if (list_error_code) {
+      return absl::InternalError(
+          absl::StrCat("Failed to list ", options_.directory, ": ",
+                       list_error_code.message()));
+    }
+    for (const auto& path : unused_paths) {
+      fs::remove(path, error_code);
+    }
+
+    std::sort(entries.begin(), entries.end(),
+              [](const auto& lhs, const auto& rhs) {
+                return std::get<0>(lhs) > std::get<0>(rhs);
+              });
+    absl::MutexLock lock(&mu_);
+    for (auto& [last_use, key, entry] : entries) {
+      entry.lru_position = lru_.insert(lru_.end(), key);
+      size_bytes_ += entry.metadata.size;
+      entries_.emplace(key, std::move(entry));
+    }
+    EvictIfNecessary(0);
+    return absl::OkStatus();
+  }
+
+  // Entries are looked up by the caller's generation if it has one.
+  absl::StatusOr<std::shared_ptr<arrow::Buffer>> Read(
+      const std::string_view url, const arrow::StopToken stop_token,
+      std::string* const pinned_generation) const override {
+    const auto generation = ResolveGeneration(url, pinned_generation);
+    if (!generation.ok()) {
+      return generation.status();
+    }
+    const std::string key = EntryKey(url, *generation);
+
+    for (;;) {
+      std::optional<EntryMetadata> metadata;
+      bool verified = false;
+      std::shared_ptr<Fill> fill;
+      bool is_filler = false;
+      {
+        absl::MutexLock lock(&mu_);
+        if (const auto it = entries_.find(key); it != entries_.end()) {
+          lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+          metadata = it->second.metadata;
+          verified = it->second.verified;
+        } else {
+          fill = GetFill(key, &is_filler);
+        }
+      }
+
+      if (metadata.has_value()) {
+        if (metadata->url == url && metadata->generation == *generation) {
+          auto result = OpenEntry(key, *metadata, verified);
+          if (result.ok()) {
+            return result;
+          }
+        }
+        // Missing, corrupt or a hash collision.
+        Remove(key);
+        continue;
+      }
+
+      if (!is_filler) {
+        // Fetch again if the other fill failed, e.g. because its query got
+        // cancelled, or its content didn't fit into the cache.
+        while (!fill->done.WaitForNotificationWithTimeout(kFillPollInterval)) {
+          if (stop_token.IsStopRequested()) {
+            return absl::CancelledError(
+                absl::StrCat("Cancelled while waiting for ", url));
+          }
+        }
+        continue;
+      }
+
+      auto result = FillEntry(url, *generation, key, stop_token);
+      FinishFill(url, key, result.status(), fill.get());
+      return result;
+    }
+  }
+
+  // Cached files are opened as a whole, as mapping them doesn't read
+  // anything yet. Other files are opened for ranged reads, so queries don't
+  // wait for the whole download, which fills the cache in the background.
+  absl::StatusOr<std::shared_ptr<arrow::io::RandomAccessFile>> Open(
+      const std::string_view url, const arrow::StopToken stop_token,
+      std::string* const pinned_generation) const override {
+    const auto generation = ResolveGeneration(url, pinned_generation);
+    if (!generation.ok()) {
+      return generation.status();
+    }
+    const std::string key = EntryKey(url, *generation);
+
+    std::optional<EntryMetadata> metadata;
+    bool verified = false;
+    {
+      absl::MutexLock lock(&mu_);
+      if (const auto it = entries_.find(key); it != entries_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+        metadata = it->second.metadata;
+        verified = it->second.verified;
+      }
+    }
+    if (metadata.has_value()) {
+      if (metadata->url == url && metadata->generation == *generation) {
+        auto result = OpenEntry(key, *metadata, verified);
+        if (result.ok()) {
+          return std::make_shared<arrow::io::BufferReader>(
+              *std::move(result));
+        }
+      }
+      // Missing, corrupt or a hash collision.
+      Remove(key);
+    }
+
+    std::shared_ptr<Fill> fill;
+    bool is_filler = false;
+    {
+      absl::MutexLock lock(&mu_);
+      fill = GetFill(key, &is_filler);
+    }
+    if (is_filler) {
+      fill_tasks_.Schedule([this, url = std::string(url),
+                            generation = *generation, key, fill] {
+        const auto result = FillEntry(url, generation, key, fill_stop_token_);
+        FinishFill(url, key, result.status(), fill.get());
+      });
+    }
+
+    std::string ranged_generation = *generation;
+    return url_reader_->Open(url, stop_token, &ranged_generation);
+  }
+
+  absl::StatusOr<std::string> GetGeneration(
+      const std::string_view url) const override {
+    return url_reader_->GetGeneration(url);
+  }
+
+  bool MapsContent(const arrow::Buffer& content) const override {
+    return dynamic_cast<const MappedBuffer*>(&content) != nullptr ||
+           url_reader_->MapsContent(content);
+  }
+
+ private:
+  struct Entry {
+    EntryMetadata metadata;
+    // Whether the checksum has been verified by this process.
+    bool verified = false;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  using EntryMap = absl::flat_hash_map<std::string, Entry>;
+
+  // Lets concurrent reads of a missing entry wait for a single fetch.
+  struct Fill {
+    absl::Notification done;
+  };
+
+  // A generation that's reused until it expires, see
+  // DiskCacheOptions::generation_ttl.
+  struct CachedGeneration {
+    std::string generation;
+    absl::Time expiry;
+  };
+
+  // Returns the generation that `pinned_generation` points to if it isn't
+  // null or empty. Otherwise returns the current generation, possibly
+  // reused from an earlier lookup, and stores it in `pinned_generation`.
+  absl::StatusOr<std::string> ResolveGeneration(
+      const std::string_view url, std::string* const pinned_generation) const {
+    if (pinned_generation != nullptr && !pinned_generation->empty()) {
+      return *pinned_generation;
+    }
+
+    std::string generation;
+    if (options_.generation_ttl > absl::ZeroDuration()) {
+      absl::MutexLock lock(&mu_);
+      if (const auto it = generations_.find(url); it != generations_.end()) {
+        if (absl::Now() < it->second.expiry) {
+          generation = it->second.generation;
+        } else {
+          generations_.erase(it);
+        }
+      }
+    }
+    if (generation.empty()) {
+      auto current_generation = url_reader_->GetGeneration(url);
+      if (!current_generation.ok()) {
+        return current_generation.status();
+      }
+      generation = *std::move(current_generation);
+      if (options_.generation_ttl > absl::ZeroDuration()) {
+        absl::MutexLock lock(&mu_);
+        generations_[std::string(url)] = {
+            generation, absl::Now() + options_.generation_ttl};
+      }
+    }
+
+    if (pinned_generation != nullptr) {
+      *pinned_generation = generation;
+    }
+    return generation;
+  }
+
+  // Returns the pending fill of the given entry, or otherwise starts one,
+  // which the caller then has to finish.
+  std::shared_ptr<Fill> GetFill(const std::string& key, bool* const is_filler)
+      const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    auto& fill = fills_[key];
+    *is_filler = fill == nullptr;
+    if (*is_filler) {
+      fill = std::make_shared<Fill>();
+    }
+    return fill;
+  }
+
+  // Wakes up the reads that wait for a fill. If it failed, the generation
+  // may not be available anymore, so it's looked up again next time.
+  void FinishFill(const std::string_view url, const std::string& key,
+                  const absl::Status& status, Fill* const fill) const {
+    {
+      absl::MutexLock lock(&mu_);
+      fills_.erase(key);
+      if (!status.ok()) {
+        generations_.erase(url);
+      }
+    }
+    fill->done.Notify();
+  }
+
+  fs::path DataPath(const std::string& key) const {
+    return fs::path(options_.directory) / absl::StrCat(key, kDataExtension);
+  }
+
+  fs::path MetadataPath(const std::string& key) const {
+    return fs::path(options_.directory) /
+           absl::StrCat(key, kMetadataExtension);
+  }
+
+  absl::StatusOr<std::shared_ptr<arrow::Buffer>> OpenEntry(
+      const std::string& key, const EntryMetadata& metadata,
+      const bool verified) const {
+    auto result = MapFile(DataPath(key));
+    if (!result.ok()) {
+      return result.status();
+    }
+    if ((*result)->size() != metadata.size) {
+      return absl::DataLossError(absl::StrCat("Size mismatch for ", key));
+    }
+    if (!verified) {
+      if (Checksum(**result) != metadata.checksum) {
+        return absl::DataLossError(
+            absl::StrCat("Checksum mismatch for ", key));
+      }
+      absl::MutexLock lock(&mu_);
+      if (const auto it = entries_.find(key); it != entries_.end()) {
+        it->second.verified = true;
+      }
+    }
+    // Keeps the order of least recently used entries across restarts.
+    std::error_code error_code;
+    fs::last_write_time(MetadataPath(key), fs::file_time_type::clock::now(),
+                        error_code);
+    return result;
+  }
+
+  // Fetches the given generation of a URL and adds it to the cache. Returns
+  // the content as fetched if it can't be cached.
+  absl::StatusOr<std::shared_ptr<arrow::Buffer>> FillEntry(
+      const std::string_view url, std::string generation,
+      const std::string& key, const arrow::StopToken& stop_token) const {
+    auto data = url_reader_->Read(url, stop_token, &generation);
+    if (!data.ok() || (*data)->size() > options_.max_size_bytes) {
+      return data;
+    }
+
+    const fs::path data_path = DataPath(key);
+    const fs::path metadata_path = MetadataPath(key);
+    const fs::path temporary_data_path =
+        absl::StrCat(data_path.string(), kTemporaryExtension);
+    const fs::path temporary_metadata_path =
+        absl::StrCat(metadata_path.string(), kTemporaryExtension);
+    std::error_code error_code;
+    const auto discard = [&] {
+      fs::remove(temporary_data_path, error_code);
+      fs::remove(temporary_metadata_path, error_code);
+      return *data;
+    };
+
+    const arrow::Status write_status =
+        options_.decompress ? WriteDecompressed(*data, temporary_data_path)
+                            : WriteBuffer(**data, temporary_data_path);
+    if (!write_status.ok() || !SyncFile(temporary_data_path).ok()) {
+      return discard();
+    }
+    auto result = MapFile(temporary_data_path);
+    if (!result.ok() || (*result)->size() > options_.max_size_bytes) {
+      return discard();
+    }
+
+    EntryMetadata metadata;
+    metadata.size = (*result)->size();
+    metadata.checksum = Checksum(**result);
+    metadata.generation = generation;
+    metadata.url = std::string(url);
+    if (!WriteMetadata(metadata, temporary_metadata_path).ok()) {
+      return discard();
+    }
+
+    {
+      absl::MutexLock lock(&mu_);
+      EvictIfNecessary(metadata.size);
+      fs::rename(temporary_data_path, data_path, error_code);
+      if (!error_code) {
+        fs::rename(temporary_metadata_path, metadata_path, error_code);
+      }
+      if (error_code) {
+        fs::remove(data_path, error_code);
+        return discard();
+      }
+      Entry entry;
+      entry.metadata = std::move(metadata);
+      entry.verified = true;
+      entry.lru_position = lru_.insert(lru_.begin(), key);
+      size_bytes_ += entry.metadata.size;
+      entries_[key] = std::move(entry);
+    }
+    // Without this, a crash could lose the renames even though the files
+    // themselves were synced. The entry is usable either way, and a lost
+    // entry only gets fetched again.
+    SyncFile(options_.directory).IgnoreError();
+    // The mapping stays valid after renaming the file.
+    return result;
+  }
+
+  void Remove(const std::string& key) const {
+    absl::MutexLock lock(&mu_);
+    if (const auto it = entries_.find(key); it != entries_.end()) {
+      RemoveEntry(it);
+    }
+  }
+
+  // Removes the metadata file first, so a crash in between leaves an
+  // incomplete entry that gets cleaned up on the next start. Files that are
+  // still mapped stay readable until they're unmapped.
+  void RemoveEntry(const EntryMap::iterator it) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    std::error_code error_code;
+    fs::remove(MetadataPath(it->first), error_code);
+    fs::remove(DataPath(it->first), error_code);
+    size_bytes_ -= it->second.metadata.size;
+    lru_.erase(it->second.lru_position);
+    entries_.erase(it);
+  }
+
+  // Evicts least recently used entries until `additional_bytes` fit.
+  void EvictIfNecessary(const int64_t additional_bytes) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    while (!lru_.empty() &&
+           size_bytes_ + additional_bytes > options_.max_size_bytes) {
+      RemoveEntry(entries_.find(lru_.back()));
+    }
+  }
+
+  const std::unique_ptr<UrlReader> url_reader_;
+  const DiskCacheOptions options_;
+  mutable absl::Mutex mu_;
+  mutable EntryMap entries_ ABSL_GUARDED_BY(mu_);
+  // Keys of entries, most recently used first.
+  mutable std::list<std::string> lru_ ABSL_GUARDED_BY(mu_);
+  mutable int64_t size_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+  mutable absl::flat_hash_map<std::string, std::shared_ptr<Fill>> fills_
+      ABSL_GUARDED_BY(mu_);
+  // Keyed by URL.
+  mutable absl::flat_hash_map<std::string, CachedGeneration> generations_
+      ABSL_GUARDED_BY(mu_);
+  // Fills in the background don't belong to any query, so they're only
+  // stopped once the reader gets destroyed.
+  arrow::StopSource stop_source_;
+  const arrow::StopToken fill_stop_token_ = stop_source_.token();
+  // Declared last, so the fills are done before the state they use is
+  // destroyed.
+  mutable Scheduler fill_scheduler_{std::max(1, options_.num_fill_threads),
+                                    "disk_cache_fill"};
+  mutable Scheduler::TaskGroup fill_tasks_{&fill_scheduler_};
+};
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<UrlReader>> MakeDiskCachedReader(
+    std::unique_ptr<UrlReader> url_reader, DiskCacheOptions options) {
+  auto result = std::make_unique<DiskCachedReader>(std::move(url_reader),
+                                                   std::move(options));
+  if (const auto status = result->Init(); !status.ok()) {
+    return status;
+  }
+  return result;
+}
+
+}  // namespace seqr
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <absl/status/statusor.h>
+#include <absl/time/time.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "url_reader.h"
+
+namespace seqr {
+
+struct DiskCacheOptions {
+  // The directory that holds the cached files. Created if it doesn't exist.
+  std::string directory;
+
+  // Least recently used files are removed once their total size exceeds this
+  // value.
+  int64_t max_size_bytes = 0;
+
+  // Whether to rewrite Arrow IPC files without compression before caching
+  // them, so record batches can be decoded straight from the memory map.
+  bool decompress = false;
+
+  // How long the current generation of a URL is reused for reads that don't
+  // pin one, instead of looking it up again. Within this time, changes to
+  // the content may not be seen yet. Zero looks up the generation on every
+  // such read.
+  absl::Duration generation_ttl = absl::ZeroDuration();
+
+  // The number of threads that fill the cache in the background for URLs
+  // that were opened before they got cached.
+  int num_fill_threads = 4;
+};
+
+// Returns a reader that keeps the content fetched through `url_reader` in a
+// local directory, keyed by URL and generation, so repeated reads, including
+// those after a restart, don't go over the network. Cached files are
+// memory-mapped. Reads of URLs that aren't cached yet fetch the whole
+// content. Opens of such URLs return the ranged-read file of `url_reader`
+// instead, while the whole content gets cached in the background.
+//
+// Files are written to temporary files that are synced to disk and then
+// renamed, so a crash never leaves partial entries behind. A checksum is
+// verified the first time an entry is used after a restart, and entries that
+// don't match are fetched again. Objects that are larger than the whole cache
+// are returned without caching them. Thread-safe.
+absl::StatusOr<std::unique_ptr<UrlReader>> MakeDiskCachedReader(
+    std::unique_ptr<UrlReader> url_reader, DiskCacheOptions options);
+
+}  // namespace seqr
@@ -0,0 +1,276 @@
+#include "disk_cache.h"
+
+#include <absl/status/status.h>
+#include <absl/strings/str_cat.h>
+#include <absl/synchronization/notification.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <arrow/io/memory.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/testing/gtest_util.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace seqr {
+namespace {
+
+namespace fs = std::filesystem;
+
+constexpr char kArrowPath[] = "testdata/part-00000-na12878-trio.zstd.arrow";
+
+// Reads local files and counts the reads. Full reads wait for `release` if
+// it isn't null.
+class CountingUrlReader : public UrlReader {
+ public:
+  CountingUrlReader(std::atomic<int>* const num_reads,
+                    absl::Notification* const release)
+      : url_reader_(*MakeLocalFileReader()),
+        num_reads_(*num_reads),
+        release_(release) {}
+
+  absl::StatusOr<std::shared_ptr<arrow::Buffer>> Read(
+      const std::string_view url, const arrow::StopToken stop_token,
+      std::string* const generation) const override {
+    ++num_reads_;
+    if (release_ != nullptr) {
+      release_->WaitForNotification();
+    }
+    return url_reader_->Read(url, stop_token, generation);
+  }
+
+  absl::StatusOr<std::shared_ptr<arrow::io::RandomAccessFile>> Open(
+      const std::string_view url, const arrow::StopToken stop_token,
+      std::string* const generation) const override {
+    ++num_reads_;
+    return url_reader_->Open(url, stop_token, generation);
+  }
+
+  absl::StatusOr<std::string> GetGeneration(
+      const std::string_view url) const override {
+    return url_reader_->GetGeneration(url);
+  }
+
+ private:
+  const std::unique_ptr<UrlReader> url_reader_;
+  std::atomic<int>& num_reads_;
+  absl::Notification* const release_;
+};
+
+class DiskCacheTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    directory_ = fs::path(testing::TempDir()) /
+                 testing::UnitTest::GetInstance()->current_test_info()->name();
+    fs::remove_all(directory_);
+    fs::create_directories(directory_ / "source");
+  }
+
+  void TearDown() override { fs::remove_all(directory_); }
+
+  // Returns a new reader on the same cache directory, like after a restart.
+  std::unique_ptr<UrlReader> MakeReader(
+      const int64_t max_size_bytes, const bool decompress = false,
+      const absl::Duration generation_ttl = absl::ZeroDuration()) {
+    DiskCacheOptions options;
+    options.directory = (directory_ / "cache").string();
+    options.max_size_bytes = max_size_bytes;
+    options.decompress = decompress;
+    options.generation_ttl = generation_ttl;
+    auto result = MakeDiskCachedReader(
+        std::make_unique<CountingUrlReader>(&num_reads_, release_reads_),
+        std::move(options));
+    EXPECT_TRUE(result.ok()) << result.status();
+    return *std::move(result);
+  }
+
+  // Writes a source file and returns its URL.
+  std::string WriteSource(const std::string& name,
+                          const std::string& content) {
+    const fs::path path = directory_ / "source" / name;
+    std::ofstream(path) << content;
+    return absl::StrCat("file://", path.string());
+  }
+
+  fs::path directory_;
+  std::atomic<int> num_reads_ = 0;
+  absl::Notification* release_reads_ = nullptr;
+};
+
+TEST_F(DiskCacheTest, CachesAcrossRestarts) {
+  const std::string url = absl::StrCat("file://", kArrowPath);
+  const std::string content =
+      (*(*MakeLocalFileReader())->Read(url))->ToString();
+
+  auto reader = MakeReader(int64_t{1} << 30);
+  for (int i = 0; i < 2; ++i) {
+    const auto data = reader->Read(url);
+    ASSERT_TRUE(data.ok()) << data.status();
+    EXPECT_EQ((*data)->ToString(), content);
+    EXPECT_TRUE(reader->MapsContent(**data));
+  }
+  const auto file = reader->Open(url);
+  ASSERT_TRUE(file.ok()) << file.status();
+  ASSERT_OK_AND_ASSIGN(const auto buffer, (*file)->ReadAt(0, 6));
+  EXPECT_EQ(buffer->ToString(), "ARROW1");
+  EXPECT_EQ(num_reads_, 1);
+
+  reader = MakeReader(int64_t{1} << 30);
+  const auto data = reader->Read(url);
+  ASSERT_TRUE(data.ok()) << data.status();
+  EXPECT_EQ((*data)->ToString(), content);
+  EXPECT_EQ(num_reads_, 1);
+}
+
+TEST_F(DiskCacheTest, DecompressesArrowFiles) {
+  const std::string url = absl::StrCat("file://", kArrowPath);
+  const auto original = (*MakeLocalFileReader())->Read(url);
+  ASSERT_TRUE(original.ok()) << original.status();
+  const auto data = MakeReader(int64_t{1} << 30, /* decompress */ true)
+                        ->Read(url);
+  ASSERT_TRUE(data.ok()) << data.status();
+  EXPECT_GT((*data)->size(), (*original)->size());
+
+  ASSERT_OK_AND_ASSIGN(
+      const auto original_reader,
+      arrow::ipc::RecordBatchFileReader::Open(
+          std::make_shared<arrow::io::BufferReader>(*original)));
+  ASSERT_OK_AND_ASSIGN(const auto reader,
+                       arrow::ipc::RecordBatchFileReader::Open(
+                           std::make_shared<arrow::io::BufferReader>(*data)));
+  EXPECT_TRUE(reader->schema()->Equals(*original_reader->schema(),
+                                       /* check_metadata */ true));
+  ASSERT_EQ(reader->num_record_batches(),
+            original_reader->num_record_batches());
+  for (int i = 0; i < reader->num_record_batches(); ++i) {
+    ASSERT_OK_AND_ASSIGN(const auto record_batch, reader->ReadRecordBatch(i));
+    ASSERT_OK_AND_ASSIGN(const auto original_record_batch,
+                         original_reader->ReadRecordBatch(i));
+    EXPECT_TRUE(record_batch->Equals(*original_record_batch));
+  }
+}
+
+TEST_F(DiskCacheTest, EvictsLeastRecentlyUsedFiles) {
+  const std::string url_a = WriteSource("a", std::string(100, 'a'));
+  const std::string url_b = WriteSource("b", std::string(100, 'b'));
+  const std::string url_c = WriteSource("c", std::string(100, 'c'));
+
+  auto reader = MakeReader(250);
+  ASSERT_TRUE(reader->Read(url_a).ok());
+  ASSERT_TRUE(reader->Read(url_b).ok());
+  ASSERT_TRUE(reader->Read(url_a).ok());
+  EXPECT_EQ(num_reads_, 2);
+  ASSERT_TRUE(reader->Read(url_c).ok());
+  EXPECT_EQ(num_reads_, 3);
+
+  // The order is kept across restarts.
+  reader = MakeReader(250);
+  ASSERT_TRUE(reader->Read(url_a).ok());
+  ASSERT_TRUE(reader->Read(url_c).ok());
+  EXPECT_EQ(num_reads_, 3);
+  const auto data = reader->Read(url_b);
+  ASSERT_TRUE(data.ok()) << data.status();
+  EXPECT_EQ((*data)->ToString(), std::string(100, 'b'));
+  EXPECT_EQ(num_reads_, 4);
+
+  // Files that are larger than the whole cache are returned as read.
+  const std::string url_d = WriteSource("d", std::string(300, 'd'));
+  for (int i = 0; i < 2; ++i) {
+    const auto data = reader->Read(url_d);
+    ASSERT_TRUE(data.ok()) << data.status();
+    EXPECT_FALSE(reader->MapsContent(**data));
+  }
+  EXPECT_EQ(num_reads_, 6);
+}
+
+TEST_F(DiskCacheTest, FillsOpenedFilesInBackground) {
+  const std::string url = WriteSource("a", "hello world");
+  auto reader = MakeReader(1000);
+
+  // Ranged reads don't wait for the whole file.
+  std::string generation;
+  const auto file = reader->Open(url, arrow::StopToken::Unstoppable(),
+                                 &generation);
+  ASSERT_TRUE(file.ok()) << file.status();
+  EXPECT_FALSE(generation.empty());
+  ASSERT_OK_AND_ASSIGN(const auto buffer, (*file)->ReadAt(6, 5));
+  EXPECT_EQ(buffer->ToString(), "world");
+
+  // Reads wait for the fill instead of fetching again.
+  const auto data = reader->Read(url, arrow::StopToken::Unstoppable(),
+                                 &generation);
+  ASSERT_TRUE(data.ok()) << data.status();
+  EXPECT_EQ((*data)->ToString(), "hello world");
+  EXPECT_TRUE(reader->MapsContent(**data));
+  EXPECT_EQ(num_reads_, 2);
+
+  ASSERT_TRUE(reader->Open(url).ok());
+  EXPECT_EQ(num_reads_, 2);
+}
+
+TEST_F(DiskCacheTest, StopsWaitingForOtherFillsWhenCancelled) {
+  const std::string url = WriteSource("a", "hello world");
+  absl::Notification release;
+  release_reads_ = &release;
+  auto reader = MakeReader(1000);
+
+  std::thread filler([&] { EXPECT_TRUE(reader->Read(url).ok()); });
+  while (num_reads_ == 0) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+
+  // The fill is stuck, but cancelled readers don't wait for it.
+  arrow::StopSource stop_source;
+  stop_source.RequestStop();
+  EXPECT_TRUE(
+      absl::IsCancelled(reader->Read(url, stop_source.token()).status()));
+
+  release.Notify();
+  filler.join();
+  EXPECT_EQ(num_reads_, 1);
+}
+
+TEST_F(DiskCacheTest, ReusesGenerationsUntilTheyExpire) {
+  const std::string url = WriteSource("a", "hello world");
+  auto reader = MakeReader(1000, /* decompress */ false, absl::Hours(1));
+  ASSERT_TRUE(reader->Read(url).ok());
+
+  // The content changes without the reader noticing.
+  WriteSource("a", "hello again world");
+  auto data = reader->Read(url);
+  ASSERT_TRUE(data.ok()) << data.status();
+  EXPECT_EQ((*data)->ToString(), "hello world");
+  EXPECT_EQ(num_reads_, 1);
+
+  // Without reuse, the generation is looked up on every read.
+  reader = MakeReader(1000);
+  data = reader->Read(url);
+  ASSERT_TRUE(data.ok()) << data.status();
+  EXPECT_EQ((*data)->ToString(), "hello again world");
+  EXPECT_EQ(num_reads_, 2);
+}
+
+TEST_F(DiskCacheTest, RefetchesCorruptFiles) {
+  const std::string url = WriteSource("a", "hello world");
+  ASSERT_TRUE(MakeReader(1000)->Read(url).ok());
+
+  for (const auto& dir_entry : fs::directory_iterator(directory_ / "cache")) {
+    if (dir_entry.path().extension() == ".arrow") {
+      std::ofstream(dir_entry.path()) << "hello wurld";
+    }
+  }
+
+  const auto data = MakeReader(1000)->Read(url);
+  ASSERT_TRUE(data.ok()) << data.status();
+  EXPECT_EQ((*data)->ToString(), "hello world");
+  EXPECT_EQ(num_reads_, 2);
+}
+
+}  // namespace
+}  // namespace seqr
@@ -0,0 +1,211 @@
+#include "fake_gcs_server.h"
+
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
+
+#include <algorithm>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string_view>
+#include <vector>
+
+namespace seqr {
+namespace {
+
+HttpResponse ErrorResponse(const int status_code, std::string_view message) {
+  HttpResponse result;
+  result.status_code = status_code;
+  result.content_type = "application/json";
+  result.body = absl::StrCat(R"({"error": {"code": )", status_code,
+                             R"(, "message": ")", message, R"("}})");
+  return result;
+}
+
+// Parses a "bytes=<first>-[<last>]" header into an inclusive range, clamped to
+// the object size.
+std::optional<std::pair<int64_t, int64_t>> ParseRangeHeader(
+    std::string_view header, const int64_t size) {
+  if (!absl::ConsumePrefix(&header, "bytes=")) {
+    return std::nullopt;
+  }
+  const std::vector<std::string_view> parts = absl::StrSplit(header, '-');
+  int64_t first = 0;
+  if (parts.size() != 2 || !absl::SimpleAtoi(parts[0], &first) ||
+      first >= size) {
+    return std::nullopt;
+  }
+  int64_t last = size - 1;
+  if (!parts[1].empty() && !absl::SimpleAtoi(parts[1], &last)) {
+    return std::nullopt;
+  }
+  return std::make_pair(first, std::min(last, size - 1));
+}
+
+// Returns the generation that a request asks for, or 0 for the latest one.
+int64_t RequestedGeneration(const std::string_view query) {
+  for (std::string_view parameter : absl::StrSplit(query, '&')) {
+    int64_t generation = 0;
+    if (absl::ConsumePrefix(&parameter, "generation=") &&
+        absl::SimpleAtoi(parameter, &generation)) {
+      return generation;
+    }
+  }
+  return 0;
+}
+
+// Counts a request as being served for its lifetime, keeping track of the
+// maximum count.
+class ConcurrentRequest {
+ public:
+  ConcurrentRequest(std::atomic<int64_t>* const current,
+                    std::atomic<int64_t>* const max)
+      : current_(current) {
+    const int64_t count = ++*current_;
+    int64_t previous_max = *max;
+    while (count > previous_max &&
+           !max->compare_exchange_weak(previous_max, count)) {
+    }
+  }
+
+  ConcurrentRequest(const ConcurrentRequest&) = delete;
+  ConcurrentRequest& operator=(const ConcurrentRequest&) = delete;
+
+  ~ConcurrentRequest() { --*current_; }
+
+ private:
+  std::atomic<int64_t>* const current_;
+};
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<FakeGcsServer>> FakeGcsServer::Start() {
+  std::unique_ptr<FakeGcsServer> result(new FakeGcsServer());
+  auto http_server = HttpServer::Start(
+      0, [server = result.get()](const HttpRequest& request) {
+        return server->HandleRequest(request);
+      });
+  if (!http_server.ok()) {
+    return http_server.status();
+  }
+  result->http_server_ = *std::move(http_server);
+  return result;
+}
+
+std::string FakeGcsServer::endpoint() const {
+  return absl::StrCat("http://127.0.0.1:", http_server_->port());
+}
+
+void FakeGcsServer::PutObject(const std::string& bucket,
+                              const std::string& name, std::string data) {
+  absl::MutexLock lock(&mu_);
+  objects_[{bucket, name}] = std::make_shared<const Object>(
+      Object{std::move(data), next_generation_++});
+}
+
+absl::Status FakeGcsServer::PutObjectFromFile(const std::string& bucket,
+                                              const std::string& name,
+                                              const std::string& path) {
+  std::ifstream ifs(path, std::ios::binary);
+  if (!ifs) {
+    return absl::NotFoundError(absl::StrCat("Failed to open ", path));
+  }
+  std::stringstream contents;
+  contents << ifs.rdbuf();
+  PutObject(bucket, name, contents.str());
+  return absl::OkStatus();
+}
+
+HttpResponse FakeGcsServer::HandleRequest(const HttpRequest& request) {
+  // JSON API: /[download/]storage/v1/b/<bucket>/o/<object>[?alt=media]
+  // XML API: /<bucket>/<object>
+  std::string_view path = request.path;
+  bool media = true;
+  std::string bucket;
+  std::string name;
+  if (absl::ConsumePrefix(&path, "/download/storage/v1/b/") ||
+      absl::ConsumePrefix(&path, "/storage/v1/b/")) {
+    const std::vector<std::string_view> parts =
+        absl::StrSplit(path, absl::MaxSplits("/o/", 1));
+    if (parts.size() != 2) {
+      return ErrorResponse(400, "Unsupported request");
+    }
+    bucket = UrlDecode(parts[0]);
+    name = UrlDecode(parts[1]);
+    media = absl::StrContains(request.query, "alt=media");
+  } else if (absl::ConsumePrefix(&path, "/")) {
+    const std::vector<std::string_view> parts =
+        absl::StrSplit(path, absl::MaxSplits('/', 1));
+    if (parts.size() != 2) {
+      return ErrorResponse(400, "Unsupported request");
+    }
+    bucket = UrlDecode(parts[0]);
+    name = UrlDecode(parts[1]);
+  }
+
+  std::shared_ptr<const Object> object;
+  absl::Duration latency;
+  int64_t bandwidth = 0;
+  {
+    absl::MutexLock lock(&mu_);
+    latency = latency_;
+    bandwidth = bandwidth_;
+    const auto it = objects_.find(std::make_pair(bucket, name));
+    if (it == objects_.end()) {
+      return ErrorResponse(404, "Not found");
+    }
+    object = it->second;
+  }
+  if (const int64_t generation = RequestedGeneration(request.query);
+      generation != 0 && generation != object->generation) {
+    return ErrorResponse(404, "Generation not found");
+  }
+
+  const int64_t size = object->data.size();
+  HttpResponse result;
+  result.headers.emplace_back("x-goog-generation",
+                              absl::StrCat(object->generation));
+  if (!media) {
+    ++num_metadata_requests_;
+    result.content_type = "application/json";
+    result.body = absl::StrCat(
+        R"({"kind": "storage#object", "id": ")", bucket, "/", name, "/",
+        object->generation, R"(", "bucket": ")", bucket, R"(", "name": ")",
+        name, R"(", "generation": ")", object->generation,
+        R"(", "metageneration": "1", "size": ")", size,
+        R"(", "contentType": "application/octet-stream"})");
+    return result;
+  }
+
+  ++num_media_requests_;
+  const ConcurrentRequest concurrent_request(&concurrent_media_requests_,
+                                             &max_concurrent_media_requests_);
+  absl::SleepFor(latency);
+  result.content_type = "application/octet-stream";
+  const auto range_header = request.headers.find("range");
+  if (range_header == request.headers.end()) {
+    result.body = object->data;
+  } else {
+    const auto range = ParseRangeHeader(range_header->second, size);
+    if (!range) {
+      return ErrorResponse(416, "Invalid range");
+    }
+    result.status_code = 206;
+    result.headers.emplace_back(
+        "Content-Range",
+        absl::StrCat("bytes ", range->first, "-", range->second, "/", size));
+    result.body =
+        object->data.substr(range->first, range->second - range->first + 1);
+  }
+  if (bandwidth > 0) {
+    absl::SleepFor(absl::Seconds(static_cast<double>(result.body.size()) /
+                                 static_cast<double>(bandwidth)));
+  }
+  bytes_served_ += result.body.size();
+  return result;
+}
+
+}  // namespace seqr
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/statusor.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "http_server.h"
+
+namespace seqr {
+
+// An in-memory stand-in for the subset of the GCS JSON and XML APIs that
+// GcsReader uses, so tests can run without network access or credentials.
+class FakeGcsServer {
+ public:
+  static absl::StatusOr<std::unique_ptr<FakeGcsServer>> Start();
+
+  // The endpoint to pass to MakeGcsReader, e.g. "http://127.0.0.1:1234".
+  std::string endpoint() const;
+
+  // Adds or replaces an object, incrementing its generation. Only the latest
+  // generation is kept, so requests for earlier ones fail.
+  void PutObject(const std::string& bucket, const std::string& name,
+                 std::string data);
+
+  // Reads a local file and adds it as an object.
+  absl::Status PutObjectFromFile(const std::string& bucket,
+                                 const std::string& name,
+                                 const std::string& path);
+
+  // The number of object data bytes sent so far, excluding HTTP headers and
+  // metadata responses.
+  int64_t bytes_served() const { return bytes_served_; }
+
+  // The number of object data requests (full or ranged) so far.
+  int64_t num_media_requests() const { return num_media_requests_; }
+
+  // The maximum number of object data requests that were served at the same
+  // time so far.
+  int64_t max_concurrent_media_requests() const {
+    return max_concurrent_media_requests_;
+  }
+
+  // The number of object metadata requests so far.
+  int64_t num_metadata_requests() const { return num_metadata_requests_; }
+
+  // Delays each object data request, to simulate network latency.
+  void set_latency(const absl::Duration latency) {
+    absl::MutexLock lock(&mu_);
+    latency_ = latency;
+  }
+
+  // Limits the throughput of each object data request, to simulate the
+  // bandwidth of a single connection. 0 means unlimited.
+  void set_bandwidth(const int64_t bytes_per_second) {
+    absl::MutexLock lock(&mu_);
+    bandwidth_ = bytes_per_second;
+  }
+
+ private:
+  struct Object {
+    std::string data;
+    int64_t generation = 0;
+  };
+
+  FakeGcsServer() = default;
+
+  HttpResponse HandleRequest(const HttpRequest& request);
+
+  absl::Mutex mu_;
+  absl::flat_hash_map<std::pair<std::string, std::string>,
+                      std::shared_ptr<const Object>>
+      objects_ ABSL_GUARDED_BY(mu_);
+  int64_t next_generation_ ABSL_GUARDED_BY(mu_) = 1;
+  absl::Duration latency_ ABSL_GUARDED_BY(mu_) = absl::ZeroDuration();
+  int64_t bandwidth_ ABSL_GUARDED_BY(mu_) = 0;
+  std::atomic<int64_t> bytes_served_ = 0;
+  std::atomic<int64_t> num_media_requests_ = 0;
+  std::atomic<int64_t> num_metadata_requests_ = 0;
+  std::atomic<int64_t> concurrent_media_requests_ = 0;
+  std::atomic<int64_t> max_concurrent_media_requests_ = 0;
+  // Declared last, so it's destroyed first and stops calling HandleRequest.
+  std::unique_ptr<HttpServer> http_server_;
+};
+
+}  // namespace seqr
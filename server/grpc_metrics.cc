@@ -0,0 +1,158 @@
+#include "grpc_metrics.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/status.h>
+#include <absl/strings/str_cat.h>
+#include <absl/synchronization/mutex.h>
+#include <grpcpp/support/status.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "metrics.h"
+#include "monotonic_clock.h"
+
+namespace seqr {
+namespace {
+
+// The metrics of the RPCs of one method. They live as long as the default
+// MetricsRegistry.
+class MethodMetrics {
+ public:
+  explicit MethodMetrics(const std::string_view method)
+      : labels_(absl::StrCat("method=\"", method, "\"")) {
+    auto& registry = MetricsRegistry::Default();
+    in_flight = registry.GetGauge(
+        absl::StrCat("seqr_grpc_in_flight_requests{", labels_, "}"),
+        "The number of RPCs that haven't finished yet.");
+    latency = registry.GetHistogram(
+        absl::StrCat("seqr_grpc_request_seconds{", labels_, "}"),
+        "The latency of RPCs, until their status is sent.", /* unit */ 1e-9);
+    sent_message_bytes = registry.GetHistogram(
+        absl::StrCat("seqr_grpc_sent_message_bytes{", labels_, "}"),
+        "The sizes of serialized response messages.");
+  }
+
+  // Returns the counter of finished RPCs with the given code. Counters are
+  // only registered once a code occurs, as most never do.
+  Counter* requests(const grpc::StatusCode code) {
+    const auto index = static_cast<size_t>(code);
+    if (index >= requests_.size()) {
+      return requests(grpc::StatusCode::UNKNOWN);
+    }
+    Counter* result = requests_[index].load(std::memory_order_acquire);
+    if (result == nullptr) {
+      // Concurrent lookups get the same counter.
+      result = MetricsRegistry::Default().GetCounter(
+          absl::StrCat("seqr_grpc_requests_total{", labels_, ",code=\"",
+                       absl::StatusCodeToString(
+                           static_cast<absl::StatusCode>(code)),
+                       "\"}"),
+          "The number of finished RPCs.");
+      requests_[index].store(result, std::memory_order_release);
+    }
+    return result;
+  }
+
+  Gauge* in_flight = nullptr;
+  Histogram* latency = nullptr;
+  Histogram* sent_message_bytes = nullptr;
+
+ private:
+  const std::string labels_;
+  // Indexed by grpc::StatusCode, up to UNAUTHENTICATED.
+  std::array<std::atomic<Counter*>, grpc::StatusCode::UNAUTHENTICATED + 1>
+      requests_{};
+};
+
+// Records the number, latency and response sizes of RPCs by method in the
+// default MetricsRegistry.
+class MetricsInterceptor : public grpc::experimental::Interceptor {
+ public:
+  explicit MetricsInterceptor(MethodMetrics* const metrics)
+      : metrics_(*metrics) {
+    metrics_.in_flight->Add(1);
+  }
+
+  ~MetricsInterceptor() override { metrics_.in_flight->Add(-1); }
+
+  void Intercept(
+      grpc::experimental::InterceptorBatchMethods* const methods) override {
+    using grpc::experimental::InterceptionHookPoints;
+    if (methods->QueryInterceptionHookPoint(
+            InterceptionHookPoints::PRE_SEND_MESSAGE)) {
+      // The async API serializes messages before they're intercepted, the
+      // sync API serializes them here.
+      if (const auto* const message = methods->GetSerializedSendMessage();
+          message != nullptr) {
+        metrics_.sent_message_bytes->Record(message->Length());
+      }
+    }
+    if (methods->QueryInterceptionHookPoint(
+            InterceptionHookPoints::PRE_SEND_STATUS)) {
+      metrics_.latency->Record(MonotonicNanos() - start_nanos_);
+      metrics_.requests(methods->GetSendStatus().error_code())->Add();
+    }
+    methods->Proceed();
+  }
+
+ private:
+  MethodMetrics& metrics_;
+  const int64_t start_nanos_ = MonotonicNanos();
+};
+
+// Looks up the metrics of each method once, instead of per RPC.
+class MetricsInterceptorFactory
+    : public grpc::experimental::ServerInterceptorFactoryInterface {
+ public:
+  grpc::experimental::Interceptor* CreateServerInterceptor(
+      grpc::experimental::ServerRpcInfo* const info) override {
+    const std::string_view method = info->method();
+    {
+      absl::ReaderMutexLock lock(&mu_);
+      if (const auto it = metrics_.find(method); it != metrics_.end()) {
+        return new MetricsInterceptor(it->second.get());
+      }
+    }
+    absl::MutexLock lock(&mu_);
+    auto it = metrics_.find(method);
+    if (it == metrics_.end()) {
+      it = metrics_
+               .emplace(method, std::make_unique<MethodMetrics>(method))
+               .first;
+    }
+    return new MetricsInterceptor(it->second.get());
+  }
+
+ private:
+  absl::Mutex mu_;
+  absl::flat_hash_map<std::string, std::unique_ptr<MethodMetrics>> metrics_
+      ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace
+
+std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface>
+MakeMetricsInterceptorFactory() {
+  return std::make_unique<MetricsInterceptorFactory>();
+}
+
+HttpResponse HandleMetricsRequest(const HttpRequest& request) {
+  HttpResponse response;
+  if (request.path != "/metrics") {
+    response.status_code = 404;
+    response.body = "Not found\n";
+    return response;
+  }
+  response.content_type = "text/plain; version=0.0.4";
+  response.body = MetricsRegistry::Default().ExportText();
+  return response;
+}
+
+}  // namespace seqr
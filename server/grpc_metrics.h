@@ -0,0 +1,20 @@
+#pragma once
+
+#include <grpcpp/support/server_interceptor.h>
+
+#include <memory>
+
+#include "http_server.h"
+
+namespace seqr {
+
+// Returns a server interceptor factory that records the number, latency and
+// response sizes of RPCs by method in the default MetricsRegistry.
+std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface>
+MakeMetricsInterceptorFactory();
+
+// Serves the default MetricsRegistry at /metrics, in the Prometheus text
+// format.
+HttpResponse HandleMetricsRequest(const HttpRequest& request);
+
+}  // namespace seqr
@@ -0,0 +1,35 @@
+#include "grpc_metrics.h"
+
+#include <absl/strings/match.h>
+#include <gtest/gtest.h>
+
+#include "metrics.h"
+
+namespace seqr {
+namespace {
+
+TEST(HandleMetricsRequest, ExportsDefaultRegistry) {
+  MetricsRegistry::Default()
+      .GetCounter("seqr_grpc_metrics_test_total", "A test counter.")
+      ->Add(3);
+
+  HttpRequest request;
+  request.method = "GET";
+  request.path = "/metrics";
+  const HttpResponse response = HandleMetricsRequest(request);
+  EXPECT_EQ(response.status_code, 200);
+  EXPECT_EQ(response.content_type, "text/plain; version=0.0.4");
+  EXPECT_TRUE(
+      absl::StrContains(response.body, "seqr_grpc_metrics_test_total 3"))
+      << response.body;
+}
+
+TEST(HandleMetricsRequest, RejectsOtherPaths) {
+  HttpRequest request;
+  request.method = "GET";
+  request.path = "/other";
+  EXPECT_EQ(HandleMetricsRequest(request).status_code, 404);
+}
+
+}  // namespace
+}  // namespace seqr
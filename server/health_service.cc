@@ -0,0 +1,27 @@
+#include "health_service.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <utility>
+
+namespace seqr {
+
+HealthServiceImpl::HealthServiceImpl(std::string service_name,
+                                     const bool serving)
+    : service_name_(std::move(service_name)), serving_(serving) {}
+
+grpc::Status HealthServiceImpl::Check(
+    grpc::ServerContext* /* context */,
+    const grpc::health::v1::HealthCheckRequest* const request,
+    grpc::health::v1::HealthCheckResponse* const response) {
+  if (!request->service().empty() && request->service() != service_name_) {
+    return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                        absl::StrCat("Unknown service ", request->service()));
+  }
+  response->set_status(
+      serving_ ? grpc::health::v1::HealthCheckResponse::SERVING
+               : grpc::health::v1::HealthCheckResponse::NOT_SERVING);
+  return grpc::Status::OK;
+}
+
+}  // namespace seqr
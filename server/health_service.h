@@ -0,0 +1,33 @@
+#pragma once
+
+#include <grpcpp/grpcpp.h>
+
+#include <atomic>
+#include <string>
+
+#include "health.grpc.pb.h"
+
+namespace seqr {
+
+// Serves the standard gRPC health check for the whole server and the given
+// service. Unlike gRPC's default health check service, which only exists
+// once the server has started and then reports SERVING, it starts out with
+// the given status, so load balancers never see the server as ready too
+// early. Watch isn't supported.
+class HealthServiceImpl final : public grpc::health::v1::Health::Service {
+ public:
+  HealthServiceImpl(std::string service_name, bool serving);
+
+  void SetServing(const bool serving) { serving_ = serving; }
+
+  grpc::Status Check(
+      grpc::ServerContext* context,
+      const grpc::health::v1::HealthCheckRequest* request,
+      grpc::health::v1::HealthCheckResponse* response) override;
+
+ private:
+  const std::string service_name_;
+  std::atomic<bool> serving_;
+};
+
+}  // namespace seqr
@@ -0,0 +1,48 @@
+#include "health_service.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace seqr {
+namespace {
+
+using grpc::health::v1::HealthCheckRequest;
+using grpc::health::v1::HealthCheckResponse;
+
+HealthCheckResponse::ServingStatus Check(HealthServiceImpl& health_service,
+                                         const std::string& service) {
+  HealthCheckRequest request;
+  request.set_service(service);
+  HealthCheckResponse response;
+  const grpc::Status status =
+      health_service.Check(/* context */ nullptr, &request, &response);
+  EXPECT_TRUE(status.ok()) << status.error_message();
+  return response.status();
+}
+
+TEST(HealthServiceImpl, ReportsServingStatus) {
+  HealthServiceImpl health_service("seqr.QueryService", /* serving */ false);
+  EXPECT_EQ(Check(health_service, ""), HealthCheckResponse::NOT_SERVING);
+  EXPECT_EQ(Check(health_service, "seqr.QueryService"),
+            HealthCheckResponse::NOT_SERVING);
+
+  health_service.SetServing(true);
+  EXPECT_EQ(Check(health_service, ""), HealthCheckResponse::SERVING);
+  EXPECT_EQ(Check(health_service, "seqr.QueryService"),
+            HealthCheckResponse::SERVING);
+}
+
+TEST(HealthServiceImpl, RejectsUnknownServices) {
+  HealthServiceImpl health_service("seqr.QueryService", /* serving */ true);
+  HealthCheckRequest request;
+  request.set_service("unknown");
+  HealthCheckResponse response;
+  EXPECT_EQ(
+      health_service.Check(/* context */ nullptr, &request, &response)
+          .error_code(),
+      grpc::StatusCode::NOT_FOUND);
+}
+
+}  // namespace
+}  // namespace seqr
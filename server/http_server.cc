@@ -0,0 +1,241 @@
+#include "http_server.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <optional>
+
+namespace seqr {
+namespace {
+
+// Requests with larger headers are rejected.
+constexpr size_t kMaxHeaderSize = 64 << 10;
+
+std::string_view ReasonPhrase(const int status_code) {
+  switch (status_code) {
+    case 200:
+      return "OK";
+    case 206:
+      return "Partial Content";
+    case 400:
+      return "Bad Request";
+    case 404:
+      return "Not Found";
+    case 416:
+      return "Range Not Satisfiable";
+    case 500:
+      return "Internal Server Error";
+    case 503:
+      return "Service Unavailable";
+    default:
+      return "Unknown";
+  }
+}
+
+int HexDigitValue(const char c) {
+  return absl::ascii_isdigit(c) ? c - '0' : absl::ascii_tolower(c) - 'a' + 10;
+}
+
+bool WriteAll(const int fd, std::string_view data) {
+  while (!data.empty()) {
+    const ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data.remove_prefix(n);
+  }
+  return true;
+}
+
+// Parses the request line and headers, i.e. everything up to the empty line.
+std::optional<HttpRequest> ParseRequest(const std::string_view header) {
+  std::vector<std::string_view> lines = absl::StrSplit(header, "\r\n");
+  if (lines.empty()) {
+    return std::nullopt;
+  }
+
+  const std::vector<std::string_view> request_line =
+      absl::StrSplit(lines[0], ' ');
+  if (request_line.size() != 3) {
+    return std::nullopt;
+  }
+
+  HttpRequest result;
+  result.method = std::string(request_line[0]);
+  const std::vector<std::string_view> target =
+      absl::StrSplit(request_line[1], absl::MaxSplits('?', 1));
+  result.path = std::string(target[0]);
+  if (target.size() > 1) {
+    result.query = std::string(target[1]);
+  }
+
+  for (size_t i = 1; i < lines.size(); ++i) {
+    const size_t colon_pos = lines[i].find(':');
+    if (colon_pos == std::string_view::npos) {
+      continue;
+    }
+    result.headers[absl::AsciiStrToLower(lines[i].substr(0, colon_pos))] =
+        std::string(
+            absl::StripAsciiWhitespace(lines[i].substr(colon_pos + 1)));
+  }
+
+  return result;
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<HttpServer>> HttpServer::Start(
+    const int port, Handler handler) {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return absl::InternalError(
+        absl::StrCat("Failed to create socket: ", std::strerror(errno)));
+  }
+
+  const int reuse_addr = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  const auto* const socket_address =
+      reinterpret_cast<const sockaddr*>(&address);
+  if (bind(fd, socket_address, sizeof(address)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    const int error = errno;
+    close(fd);
+    return absl::InternalError(absl::StrCat("Failed to listen on port ", port,
+                                            ": ", std::strerror(error)));
+  }
+
+  // Look up the port in case it was picked by the kernel.
+  socklen_t address_len = sizeof(address);
+  if (getsockname(fd, reinterpret_cast<sockaddr*>(&address), &address_len) <
+      0) {
+    const int error = errno;
+    close(fd);
+    return absl::InternalError(
+        absl::StrCat("Failed to get socket name: ", std::strerror(error)));
+  }
+
+  return std::unique_ptr<HttpServer>(
+      new HttpServer(fd, ntohs(address.sin_port), std::move(handler)));
+}
+
+HttpServer::HttpServer(const int listen_fd, const int port, Handler handler)
+    : listen_fd_(listen_fd), port_(port), handler_(std::move(handler)) {
+  accept_thread_ = std::thread(&HttpServer::AcceptLoop, this);
+}
+
+HttpServer::~HttpServer() {
+  // Unblocks accept().
+  shutdown(listen_fd_, SHUT_RDWR);
+  accept_thread_.join();
+  close(listen_fd_);
+  for (auto& connection : connections_) {
+    connection->thread.join();
+  }
+}
+
+void HttpServer::AcceptLoop() {
+  while (true) {
+    const int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;  // The listening socket has been shut down.
+    }
+
+    // Reap connections that have been handled in the meantime.
+    for (auto it = connections_.begin(); it != connections_.end();) {
+      if ((*it)->done) {
+        (*it)->thread.join();
+        it = connections_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    auto connection = std::make_unique<Connection>();
+    connection->thread = std::thread([this, fd, &done = connection->done] {
+      HandleConnection(fd);
+      done = true;
+    });
+    connections_.push_back(std::move(connection));
+  }
+}
+
+void HttpServer::HandleConnection(const int fd) const {
+  std::string buffer;
+  size_t header_end = std::string::npos;
+  char chunk[4096];
+  while (header_end == std::string::npos && buffer.size() < kMaxHeaderSize) {
+    const ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      close(fd);
+      return;
+    }
+    buffer.append(chunk, n);
+    header_end = buffer.find("\r\n\r\n");
+  }
+
+  HttpResponse response;
+  std::optional<HttpRequest> request;
+  if (header_end != std::string::npos) {
+    request = ParseRequest(std::string_view(buffer).substr(0, header_end));
+  }
+  if (request) {
+    response = handler_(*request);
+  } else {
+    response.status_code = 400;
+    response.body = "Malformed request";
+  }
+
+  std::string head = absl::StrCat(
+      "HTTP/1.1 ", response.status_code, " ",
+      ReasonPhrase(response.status_code), "\r\nContent-Type: ",
+      response.content_type, "\r\nContent-Length: ", response.body.size(),
+      "\r\nConnection: close\r\n");
+  for (const auto& [name, value] : response.headers) {
+    absl::StrAppend(&head, name, ": ", value, "\r\n");
+  }
+  head += "\r\n";
+
+  const bool send_body = !request || request->method != "HEAD";
+  if (WriteAll(fd, head) && (!send_body || WriteAll(fd, response.body))) {
+    shutdown(fd, SHUT_WR);
+  }
+  close(fd);
+}
+
+std::string UrlDecode(const std::string_view str) {
+  std::string result;
+  result.reserve(str.size());
+  for (size_t i = 0; i < str.size(); ++i) {
+    if (str[i] == '%' && i + 2 < str.size() &&
+        absl::ascii_isxdigit(str[i + 1]) && absl::ascii_isxdigit(str[i + 2])) {
+      result.push_back(static_cast<char>(HexDigitValue(str[i + 1]) << 4 |
+                                         HexDigitValue(str[i + 2])));
+      i += 2;
+    } else {
+      result.push_back(str[i]);
+    }
+  }
+  return result;
+}
+
+}  // namespace seqr
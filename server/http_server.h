@@ -0,0 +1,75 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/statusor.h>
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+namespace seqr {
+
+struct HttpRequest {
+  std::string method;
+  std::string path;   // Without the query string, not URL-decoded.
+  std::string query;  // The part after '?', if any.
+  // Header names are lowercase.
+  absl::flat_hash_map<std::string, std::string> headers;
+};
+
+struct HttpResponse {
+  int status_code = 200;
+  std::string content_type = "text/plain";
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::string body;
+};
+
+// A minimal HTTP/1.1 server that handles one request per connection. It's
+// meant for side channels like metrics and for test fixtures, not for serving
+// heavy traffic.
+class HttpServer {
+ public:
+  using Handler = std::function<HttpResponse(const HttpRequest&)>;
+
+  // Starts listening on the given port on all interfaces. A port of 0 picks
+  // an unused port. The handler is called concurrently from multiple threads.
+  static absl::StatusOr<std::unique_ptr<HttpServer>> Start(int port,
+                                                           Handler handler);
+
+  HttpServer(const HttpServer&) = delete;
+  HttpServer& operator=(const HttpServer&) = delete;
+
+  // Stops accepting connections and waits for pending requests to finish.
+  ~HttpServer();
+
+  int port() const { return port_; }
+
+ private:
+  struct Connection {
+    std::thread thread;
+    std::atomic<bool> done = false;
+  };
+
+  HttpServer(int listen_fd, int port, Handler handler);
+
+  void AcceptLoop();
+  void HandleConnection(int fd) const;
+
+  const int listen_fd_;
+  const int port_;
+  const Handler handler_;
+  std::thread accept_thread_;
+  // Only accessed by the accept thread, which also joins finished connections.
+  std::list<std::unique_ptr<Connection>> connections_;
+};
+
+// Decodes %XX escape sequences, e.g. in URL paths.
+std::string UrlDecode(std::string_view str);
+
+}  // namespace seqr
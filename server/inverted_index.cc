@@ -0,0 +1,427 @@
+#include "inverted_index.h"
+
+#include <absl/strings/str_cat.h>
+#include <arrow/array/array_binary.h>
+#include <arrow/array/array_dict.h>
+#include <arrow/array/array_nested.h>
+#include <arrow/array/array_primitive.h>
+#include <arrow/buffer.h>
+#include <arrow/compute/api_scalar.h>
+#include <arrow/util/bit_util.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <string_view>
+#include <utility>
+
+namespace seqr {
+namespace cp = arrow::compute;
+namespace {
+
+constexpr char kStringListContainsAny[] = "string_list_contains_any";
+
+bool IsAnd(const std::string& function_name) {
+  return function_name == "and" || function_name == "and_kleene";
+}
+
+bool IsOr(const std::string& function_name) {
+  return function_name == "or" || function_name == "or_kleene";
+}
+
+// Returns the column that a "string_list_contains_any" call looks up, or
+// nullptr if the call doesn't reference a column directly.
+const std::string* GetLookupColumn(const cp::Expression::Call& call) {
+  if (call.function_name != kStringListContainsAny ||
+      call.arguments.size() != 1) {
+    return nullptr;
+  }
+  const auto* const field_ref = call.arguments[0].field_ref();
+  return field_ref == nullptr ? nullptr : field_ref->name();
+}
+
+void AddIndexableColumns(const cp::Expression& expression,
+                         const std::vector<std::string>& indexed_columns,
+                         std::vector<std::string>* const result) {
+  const cp::Expression::Call* const call = expression.call();
+  if (call == nullptr) {
+    return;
+  }
+  if (const auto* const column = GetLookupColumn(*call);
+      column != nullptr &&
+      std::find(indexed_columns.begin(), indexed_columns.end(), *column) !=
+          indexed_columns.end()) {
+    result->push_back(*column);
+  }
+  for (const auto& argument : call->arguments) {
+    AddIndexableColumns(argument, indexed_columns, result);
+  }
+}
+
+// Appends a row to the rows of a value, unless the row's list contains the
+// value more than once.
+void AddRow(const uint32_t row, std::vector<uint32_t>* const rows) {
+  if (rows->empty() || rows->back() != row) {
+    rows->push_back(row);
+  }
+}
+
+}  // namespace
+
+RowBitmap::RowBitmap(const int64_t num_rows) : num_rows_(num_rows) {}
+
+RowBitmap RowBitmap::FromSortedRows(const int64_t num_rows,
+                                    std::vector<uint32_t> rows) {
+  RowBitmap result(num_rows);
+  result.cardinality_ = static_cast<int64_t>(rows.size());
+  result.rows_ = std::move(rows);
+  result.Optimize();
+  return result;
+}
+
+bool RowBitmap::Contains(const uint32_t row) const {
+  if (dense_) {
+    return (words_[row / 64] >> (row % 64)) & 1;
+  }
+  return std::binary_search(rows_.begin(), rows_.end(), row);
+}
+
+RowBitmap RowBitmap::Union(const RowBitmap& other) const {
+  if (!dense_ && !other.dense_) {
+    std::vector<uint32_t> rows;
+    rows.reserve(rows_.size() + other.rows_.size());
+    std::set_union(rows_.begin(), rows_.end(), other.rows_.begin(),
+                   other.rows_.end(), std::back_inserter(rows));
+    return FromSortedRows(num_rows_, std::move(rows));
+  }
+
+  // At least one side is dense, so the result is likely dense too.
+  const RowBitmap& dense = dense_ ? *this : other;
+  const RowBitmap& rest = dense_ ? other : *this;
+  RowBitmap result = dense;
+  if (rest.dense_) {
+    for (size_t i = 0; i < result.words_.size(); ++i) {
+      result.words_[i] |= rest.words_[i];
+    }
+  } else {
+    for (const uint32_t row : rest.rows_) {
+      result.words_[row / 64] |= uint64_t{1} << (row % 64);
+    }
+  }
+  result.cardinality_ = 0;
+  for (const uint64_t word : result.words_) {
+    result.cardinality_ += std::popcount(word);
+  }
+  result.Optimize();
+  return result;
+}
+
+RowBitmap RowBitmap::Intersect(const RowBitmap& other) const {
+  if (dense_ && other.dense_) {
+    RowBitmap result = *this;
+    result.cardinality_ = 0;
+    for (size_t i = 0; i < result.words_.size(); ++i) {
+      result.words_[i] &= other.words_[i];
+      result.cardinality_ += std::popcount(result.words_[i]);
+    }
+    result.Optimize();
+    return result;
+  }
+
+  std::vector<uint32_t> rows;
+  if (!dense_ && !other.dense_) {
+    std::set_intersection(rows_.begin(), rows_.end(), other.rows_.begin(),
+                          other.rows_.end(), std::back_inserter(rows));
+  } else {
+    // Probe the dense side for each row of the sparse side.
+    const RowBitmap& dense = dense_ ? *this : other;
+    const RowBitmap& sparse = dense_ ? other : *this;
+    for (const uint32_t row : sparse.rows_) {
+      if (dense.Contains(row)) {
+        rows.push_back(row);
+      }
+    }
+  }
+  return FromSortedRows(num_rows_, std::move(rows));
+}
+
+RowBitmap RowBitmap::Complement() const {
+  RowBitmap result(num_rows_);
+  result.dense_ = true;
+  result.words_.assign((num_rows_ + 63) / 64, ~uint64_t{0});
+  if (dense_) {
+    for (size_t i = 0; i < words_.size(); ++i) {
+      result.words_[i] = ~words_[i];
+    }
+  } else {
+    for (const uint32_t row : rows_) {
+      result.words_[row / 64] &= ~(uint64_t{1} << (row % 64));
+    }
+  }
+  // Clear the bits past the last row.
+  if (num_rows_ % 64 != 0) {
+    result.words_.back() &= (uint64_t{1} << (num_rows_ % 64)) - 1;
+  }
+  result.cardinality_ = num_rows_ - cardinality_;
+  result.Optimize();
+  return result;
+}
+
+arrow::Result<std::shared_ptr<arrow::Array>> RowBitmap::ToBooleanArray(
+    arrow::MemoryPool* const pool) const {
+  ARROW_ASSIGN_OR_RAISE(auto bitmap,
+                        arrow::AllocateEmptyBitmap(num_rows_, pool));
+  uint8_t* const data = bitmap->mutable_data();
+  if (dense_) {
+    // Arrow bitmaps are in LSB order, so little-endian words map directly.
+    std::memcpy(data, words_.data(),
+                arrow::BitUtil::BytesForBits(num_rows_));
+  } else {
+    for (const uint32_t row : rows_) {
+      arrow::BitUtil::SetBit(data, row);
+    }
+  }
+  return std::make_shared<arrow::BooleanArray>(num_rows_, std::move(bitmap));
+}
+
+size_t RowBitmap::SizeBytes() const {
+  return sizeof(RowBitmap) + rows_.capacity() * sizeof(uint32_t) +
+         words_.capacity() * sizeof(uint64_t);
+}
+
+void RowBitmap::Optimize() {
+  const size_t num_words = (num_rows_ + 63) / 64;
+  const bool should_be_dense =
+      cardinality_ * sizeof(uint32_t) > num_words * sizeof(uint64_t);
+  if (should_be_dense == dense_) {
+    return;
+  }
+
+  if (should_be_dense) {
+    words_.assign(num_words, 0);
+    for (const uint32_t row : rows_) {
+      words_[row / 64] |= uint64_t{1} << (row % 64);
+    }
+    rows_ = {};
+  } else {
+    rows_.clear();
+    rows_.reserve(cardinality_);
+    for (size_t i = 0; i < words_.size(); ++i) {
+      for (uint64_t word = words_[i]; word != 0; word &= word - 1) {
+        rows_.push_back(
+            static_cast<uint32_t>(i * 64 + std::countr_zero(word)));
+      }
+    }
+    words_ = {};
+  }
+  dense_ = should_be_dense;
+}
+
+bool InvertedIndex::CanIndex(const arrow::DataType& type) {
+  if (type.id() != arrow::Type::LIST) {
+    return false;
+  }
+  const auto& value_type =
+      *static_cast<const arrow::ListType&>(type).value_type();
+  if (value_type.id() == arrow::Type::STRING) {
+    return true;
+  }
+  if (value_type.id() != arrow::Type::DICTIONARY) {
+    return false;
+  }
+  const auto& dictionary_type =
+      static_cast<const arrow::DictionaryType&>(value_type);
+  return dictionary_type.index_type()->id() == arrow::Type::INT32 &&
+         dictionary_type.value_type()->id() == arrow::Type::STRING;
+}
+
+absl::StatusOr<std::shared_ptr<const InvertedIndex>> InvertedIndex::Build(
+    const arrow::Array& lists) {
+  if (!CanIndex(*lists.type())) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Can't index column of type ", lists.type()->ToString()));
+  }
+  if (lists.length() > std::numeric_limits<uint32_t>::max()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Too many rows to index: ", lists.length()));
+  }
+
+  const auto& list_array = static_cast<const arrow::ListArray&>(lists);
+  const auto* const list_offsets = list_array.raw_value_offsets();
+  auto result = std::make_shared<InvertedIndex>();
+  result->num_rows_ = lists.length();
+
+  // Collects the rows per distinct value, calling get_rows(j) for each
+  // non-null value j of each non-null list.
+  const auto collect_rows = [&list_array, list_offsets](const auto& get_rows) {
+    for (int64_t i = 0; i < list_array.length(); ++i) {
+      if (list_array.IsNull(i)) {
+        continue;
+      }
+      for (auto j = list_offsets[i]; j < list_offsets[i + 1]; ++j) {
+        if (auto* const rows = get_rows(j)) {
+          AddRow(static_cast<uint32_t>(i), rows);
+        }
+      }
+    }
+  };
+
+  const auto add_value = [&result](const std::string_view value,
+                                   std::vector<uint32_t> rows) {
+    auto bitmap = RowBitmap::FromSortedRows(result->num_rows_, std::move(rows));
+    auto [it, inserted] =
+        result->rows_by_value_.try_emplace(std::string(value));
+    // Dictionaries may contain duplicate strings.
+    it->second = inserted ? std::move(bitmap) : it->second.Union(bitmap);
+  };
+
+  if (list_array.value_type()->id() == arrow::Type::STRING) {
+    const auto& strings =
+        static_cast<const arrow::StringArray&>(*list_array.values());
+    absl::flat_hash_map<std::string_view, std::vector<uint32_t>> rows_by_value;
+    collect_rows([&strings, &rows_by_value](const int64_t j) {
+      if (strings.IsNull(j)) {
+        return static_cast<std::vector<uint32_t>*>(nullptr);
+      }
+      const auto value = strings.GetView(j);
+      return &rows_by_value[std::string_view(value.data(), value.size())];
+    });
+    for (auto& [value, rows] : rows_by_value) {
+      add_value(value, std::move(rows));
+    }
+  } else {
+    const auto& values =
+        static_cast<const arrow::DictionaryArray&>(*list_array.values());
+    const auto& dictionary =
+        static_cast<const arrow::StringArray&>(*values.dictionary());
+    const auto& indices =
+        static_cast<const arrow::Int32Array&>(*values.indices());
+    std::vector<std::vector<uint32_t>> rows_by_code(dictionary.length());
+    collect_rows([&indices, &rows_by_code](const int64_t j) {
+      return indices.IsNull(j) ? nullptr : &rows_by_code[indices.Value(j)];
+    });
+    for (int64_t code = 0; code < dictionary.length(); ++code) {
+      if (!dictionary.IsNull(code) && !rows_by_code[code].empty()) {
+        const auto value = dictionary.GetView(code);
+        add_value(std::string_view(value.data(), value.size()),
+                  std::move(rows_by_code[code]));
+      }
+    }
+  }
+
+  result->size_bytes_ = sizeof(InvertedIndex);
+  for (const auto& [value, rows] : result->rows_by_value_) {
+    result->size_bytes_ += sizeof(value) + value.size() + rows.SizeBytes();
+  }
+  return result;
+}
+
+RowBitmap InvertedIndex::Lookup(const arrow::Array& value_set) const {
+  RowBitmap result(num_rows_);
+  if (value_set.type_id() != arrow::Type::STRING) {
+    return result;
+  }
+  const auto& strings = static_cast<const arrow::StringArray&>(value_set);
+  for (int64_t i = 0; i < strings.length(); ++i) {
+    if (strings.IsNull(i)) {
+      continue;
+    }
+    const auto value = strings.GetView(i);
+    const auto it =
+        rows_by_value_.find(std::string_view(value.data(), value.size()));
+    if (it != rows_by_value_.end()) {
+      result = result.Union(it->second);
+    }
+  }
+  return result;
+}
+
+std::vector<std::string> GetIndexableColumns(
+    const cp::Expression& filter_expression,
+    const std::vector<std::string>& indexed_columns) {
+  std::vector<std::string> result;
+  if (!indexed_columns.empty()) {
+    AddIndexableColumns(filter_expression, indexed_columns, &result);
+  }
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+std::optional<IndexedFilter> EvaluateWithIndexes(
+    const cp::Expression& filter_expression, const InvertedIndexes& indexes) {
+  const cp::Expression::Call* const call = filter_expression.call();
+  if (call == nullptr) {
+    return std::nullopt;
+  }
+
+  // "string_list_contains_any" never returns null, so the boolean functions
+  // below don't need to distinguish Kleene logic.
+  if (const auto* const column = GetLookupColumn(*call)) {
+    const auto it = indexes.find(*column);
+    const auto* const options =
+        dynamic_cast<const cp::SetLookupOptions*>(call->options.get());
+    if (it == indexes.end() || options == nullptr ||
+        options->value_set.kind() != arrow::Datum::ARRAY) {
+      return std::nullopt;
+    }
+    return IndexedFilter{it->second->Lookup(*options->value_set.make_array()),
+                         /* exact */ true};
+  }
+
+  if (call->function_name == "invert" && call->arguments.size() == 1) {
+    // Only exact results can be inverted.
+    auto argument = EvaluateWithIndexes(call->arguments[0], indexes);
+    if (!argument || !argument->exact) {
+      return std::nullopt;
+    }
+    return IndexedFilter{argument->rows.Complement(), /* exact */ true};
+  }
+
+  if (IsAnd(call->function_name)) {
+    // Any argument that can be evaluated restricts the result.
+    std::optional<IndexedFilter> result;
+    bool exact = true;
+    for (const auto& argument : call->arguments) {
+      auto indexed_argument = EvaluateWithIndexes(argument, indexes);
+      if (!indexed_argument) {
+        exact = false;
+        continue;
+      }
+      exact &= indexed_argument->exact;
+      result = result ? IndexedFilter{result->rows.Intersect(
+                                          indexed_argument->rows)}
+                      : *std::move(indexed_argument);
+    }
+    if (result) {
+      result->exact = exact;
+    }
+    return result;
+  }
+
+  if (IsOr(call->function_name)) {
+    // All arguments need to be evaluated to restrict the result.
+    std::optional<IndexedFilter> result;
+    bool exact = true;
+    for (const auto& argument : call->arguments) {
+      auto indexed_argument = EvaluateWithIndexes(argument, indexes);
+      if (!indexed_argument) {
+        return std::nullopt;
+      }
+      exact &= indexed_argument->exact;
+      result = result ? IndexedFilter{result->rows.Union(
+                                          indexed_argument->rows)}
+                      : *std::move(indexed_argument);
+    }
+    if (result) {
+      result->exact = exact;
+    }
+    return result;
+  }
+
+  return std::nullopt;
+}
+
+}  // namespace seqr
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/statusor.h>
+#include <arrow/array.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/memory_pool.h>
+#include <arrow/result.h>
+#include <arrow/type.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace seqr {
+
+// A set of rows of a record batch. Like a roaring bitmap container, sparse
+// sets are stored as sorted row numbers and dense sets as plain bitmaps,
+// whichever is smaller.
+class RowBitmap {
+ public:
+  RowBitmap() = default;
+
+  // Returns an empty set over the given number of rows.
+  explicit RowBitmap(int64_t num_rows);
+
+  // The rows need to be sorted and unique.
+  static RowBitmap FromSortedRows(int64_t num_rows,
+                                  std::vector<uint32_t> rows);
+
+  int64_t num_rows() const { return num_rows_; }
+  int64_t Cardinality() const { return cardinality_; }
+  bool empty() const { return cardinality_ == 0; }
+  bool Contains(uint32_t row) const;
+
+  // Both sets need to have the same number of rows.
+  RowBitmap Union(const RowBitmap& other) const;
+  RowBitmap Intersect(const RowBitmap& other) const;
+  RowBitmap Complement() const;
+
+  // Returns a boolean array without nulls that is true for the rows in the
+  // set, for use as a filter mask.
+  arrow::Result<std::shared_ptr<arrow::Array>> ToBooleanArray(
+      arrow::MemoryPool* pool = arrow::default_memory_pool()) const;
+
+  size_t SizeBytes() const;
+
+ private:
+  // Converts between the sparse and the dense representation if that saves
+  // memory.
+  void Optimize();
+
+  int64_t num_rows_ = 0;
+  int64_t cardinality_ = 0;
+  bool dense_ = false;
+  std::vector<uint32_t> rows_;   // If !dense_.
+  std::vector<uint64_t> words_;  // If dense_.
+};
+
+// Maps each distinct string of a list<utf8> column of a record batch to the
+// rows whose lists contain it. This answers "string_list_contains_any" with a
+// few bitmap unions instead of scanning all lists, which pays off for sample
+// IDs that only occur in a small fraction of rows.
+class InvertedIndex {
+ public:
+  // Builds the index from a list of strings or a list of dictionary-encoded
+  // strings. Null lists and null strings aren't indexed.
+  static absl::StatusOr<std::shared_ptr<const InvertedIndex>> Build(
+      const arrow::Array& lists);
+
+  // Returns whether columns of the given type can be indexed.
+  static bool CanIndex(const arrow::DataType& type);
+
+  int64_t num_rows() const { return num_rows_; }
+
+  // Returns the rows whose lists contain any of the given strings.
+  RowBitmap Lookup(const arrow::Array& value_set) const;
+
+  size_t SizeBytes() const { return size_bytes_; }
+
+ private:
+  int64_t num_rows_ = 0;
+  absl::flat_hash_map<std::string, RowBitmap> rows_by_value_;
+  size_t size_bytes_ = 0;
+};
+
+// Inverted indexes of a record batch, keyed by column name.
+using InvertedIndexes =
+    absl::flat_hash_map<std::string, std::shared_ptr<const InvertedIndex>>;
+
+// Returns the sorted, deduplicated columns among `indexed_columns` that the
+// (unbound) filter expression looks up with "string_list_contains_any".
+std::vector<std::string> GetIndexableColumns(
+    const arrow::compute::Expression& filter_expression,
+    const std::vector<std::string>& indexed_columns);
+
+// The rows of a record batch that may match a filter expression, as far as
+// its inverted indexes can tell.
+struct IndexedFilter {
+  RowBitmap rows;
+  // If true, exactly these rows match and the filter columns don't need to
+  // be evaluated at all.
+  bool exact = false;
+};
+
+// Evaluates the parts of the filter expression that can be answered by the
+// given indexes: "string_list_contains_any" over indexed columns, combined by
+// "and", "or" and "invert". Returns nullopt if the indexes can't restrict the
+// matching rows.
+std::optional<IndexedFilter> EvaluateWithIndexes(
+    const arrow::compute::Expression& filter_expression,
+    const InvertedIndexes& indexes);
+
+}  // namespace seqr
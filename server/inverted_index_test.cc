@@ -0,0 +1,181 @@
+#include "inverted_index.h"
+
+#include <arrow/array/builder_binary.h>
+#include <arrow/array/builder_nested.h>
+#include <arrow/compute/api_scalar.h>
+#include <arrow/compute/api_vector.h>
+#include <arrow/testing/gtest_util.h>
+#include <gtest/gtest.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace seqr {
+namespace cp = arrow::compute;
+
+// Returns the rows of a bitmap, via its boolean array representation.
+std::vector<uint32_t> Rows(const RowBitmap& bitmap) {
+  const auto array = bitmap.ToBooleanArray().ValueOrDie();
+  const auto& booleans = static_cast<const arrow::BooleanArray&>(*array);
+  std::vector<uint32_t> result;
+  for (int64_t i = 0; i < booleans.length(); ++i) {
+    EXPECT_TRUE(booleans.IsValid(i));
+    if (booleans.Value(i)) {
+      result.push_back(static_cast<uint32_t>(i));
+    }
+  }
+  return result;
+}
+
+TEST(RowBitmap, SetOperations) {
+  const auto a = RowBitmap::FromSortedRows(100, {1, 5, 64, 99});
+  const auto b = RowBitmap::FromSortedRows(100, {5, 6, 99});
+  EXPECT_EQ(Rows(a.Union(b)), (std::vector<uint32_t>{1, 5, 6, 64, 99}));
+  EXPECT_EQ(Rows(a.Intersect(b)), (std::vector<uint32_t>{5, 99}));
+  EXPECT_EQ(a.Complement().Cardinality(), 96);
+  EXPECT_FALSE(a.Complement().Contains(64));
+  EXPECT_TRUE(a.Complement().Contains(63));
+  EXPECT_TRUE(RowBitmap(100).empty());
+}
+
+TEST(RowBitmap, DenseAndSparse) {
+  // Dense sets take less memory as bitmaps.
+  std::vector<uint32_t> even_rows;
+  for (uint32_t i = 0; i < 1000; i += 2) {
+    even_rows.push_back(i);
+  }
+  const auto even = RowBitmap::FromSortedRows(1000, even_rows);
+  const auto sparse = RowBitmap::FromSortedRows(1000, {3, 4, 999});
+  EXPECT_LT(even.SizeBytes(), even_rows.size() * sizeof(uint32_t));
+
+  EXPECT_EQ(Rows(even.Intersect(sparse)), std::vector<uint32_t>{4});
+  EXPECT_EQ(Rows(sparse.Intersect(even)), std::vector<uint32_t>{4});
+  EXPECT_EQ(even.Union(sparse).Cardinality(), 502);
+  EXPECT_EQ(even.Complement().Cardinality(), 500);
+  EXPECT_TRUE(even.Complement().Contains(999));
+  EXPECT_EQ(Rows(even.Intersect(even.Complement())), std::vector<uint32_t>{});
+}
+
+class InvertedIndexTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    // Row 2 is null, row 3 is empty, and row 4 contains a null string.
+    arrow::ListBuilder list_builder(arrow::default_memory_pool(),
+                                    std::make_shared<arrow::StringBuilder>());
+    auto& string_builder =
+        static_cast<arrow::StringBuilder&>(*list_builder.value_builder());
+    ASSERT_OK(list_builder.Append());
+    ASSERT_OK(string_builder.AppendValues({"NA12878", "NA12891"}));
+    ASSERT_OK(list_builder.Append());
+    ASSERT_OK(string_builder.AppendValues({"NA12892", "NA12892"}));
+    ASSERT_OK(list_builder.AppendNull());
+    ASSERT_OK(list_builder.Append());
+    ASSERT_OK(list_builder.Append());
+    ASSERT_OK(string_builder.AppendNull());
+    ASSERT_OK(string_builder.Append("NA12878"));
+    ASSERT_OK_AND_ASSIGN(lists_, list_builder.Finish());
+  }
+
+  static std::shared_ptr<arrow::Array> ValueSet(
+      const std::vector<std::string>& values) {
+    arrow::StringBuilder builder;
+    EXPECT_OK(builder.AppendValues(values));
+    return builder.Finish().ValueOrDie();
+  }
+
+  static cp::Expression ContainsAny(const std::string& column,
+                                    const std::vector<std::string>& values) {
+    return cp::call("string_list_contains_any", {cp::field_ref(column)},
+                    cp::SetLookupOptions(ValueSet(values)));
+  }
+
+  std::shared_ptr<arrow::Array> lists_;
+};
+
+TEST_F(InvertedIndexTest, LooksUpStrings) {
+  const auto index = InvertedIndex::Build(*lists_);
+  ASSERT_TRUE(index.ok()) << index.status();
+  EXPECT_EQ((*index)->num_rows(), 5);
+  EXPECT_EQ(Rows((*index)->Lookup(*ValueSet({"NA12878"}))),
+            (std::vector<uint32_t>{0, 4}));
+  EXPECT_EQ(Rows((*index)->Lookup(*ValueSet({"NA12891", "NA12892"}))),
+            (std::vector<uint32_t>{0, 1}));
+  EXPECT_TRUE((*index)->Lookup(*ValueSet({"unknown"})).empty());
+}
+
+TEST_F(InvertedIndexTest, LooksUpDictionaryEncodedStrings) {
+  const auto& lists = static_cast<const arrow::ListArray&>(*lists_);
+  ASSERT_OK_AND_ASSIGN(const auto encoded_values,
+                       cp::DictionaryEncode(lists.values()));
+  const auto dictionary_lists = arrow::MakeArray(arrow::ArrayData::Make(
+      arrow::list(arrow::field("item", encoded_values.type())), lists.length(),
+      {lists.data()->buffers[0], lists.data()->buffers[1]},
+      {encoded_values.array()}, lists.null_count(), lists.offset()));
+
+  const auto index = InvertedIndex::Build(*dictionary_lists);
+  ASSERT_TRUE(index.ok()) << index.status();
+  EXPECT_EQ(Rows((*index)->Lookup(*ValueSet({"NA12878"}))),
+            (std::vector<uint32_t>{0, 4}));
+  EXPECT_EQ(Rows((*index)->Lookup(*ValueSet({"NA12892"}))),
+            std::vector<uint32_t>{1});
+}
+
+TEST_F(InvertedIndexTest, RejectsOtherTypes) {
+  arrow::StringBuilder builder;
+  ASSERT_OK(builder.Append("NA12878"));
+  ASSERT_OK_AND_ASSIGN(const auto strings, builder.Finish());
+  EXPECT_FALSE(InvertedIndex::CanIndex(*strings->type()));
+  EXPECT_FALSE(InvertedIndex::Build(*strings).ok());
+}
+
+TEST_F(InvertedIndexTest, EvaluatesFilterExpressions) {
+  const auto index = InvertedIndex::Build(*lists_);
+  ASSERT_TRUE(index.ok()) << index.status();
+  const InvertedIndexes indexes = {{"samples", *index}};
+
+  EXPECT_EQ(GetIndexableColumns(
+                cp::and_(ContainsAny("samples", {"NA12878"}),
+                         ContainsAny("genes", {"ENSG00000141510"})),
+                {"samples"}),
+            std::vector<std::string>{"samples"});
+
+  // Boolean combinations of indexed lookups are exact.
+  auto result = EvaluateWithIndexes(
+      cp::and_(ContainsAny("samples", {"NA12878"}),
+               cp::not_(ContainsAny("samples", {"NA12891"}))),
+      indexes);
+  ASSERT_TRUE(result.has_value());
+  EXPECT_TRUE(result->exact);
+  EXPECT_EQ(Rows(result->rows), std::vector<uint32_t>{4});
+
+  result = EvaluateWithIndexes(
+      cp::or_(ContainsAny("samples", {"NA12892"}),
+              ContainsAny("samples", {"NA12891"})),
+      indexes);
+  ASSERT_TRUE(result.has_value());
+  EXPECT_TRUE(result->exact);
+  EXPECT_EQ(Rows(result->rows), (std::vector<uint32_t>{0, 1}));
+
+  // Conjunctions with other predicates only restrict the candidate rows.
+  const auto af_filter = cp::less(cp::field_ref("AF"), cp::literal(0.01));
+  result = EvaluateWithIndexes(
+      cp::and_(ContainsAny("samples", {"NA12878"}), af_filter), indexes);
+  ASSERT_TRUE(result.has_value());
+  EXPECT_FALSE(result->exact);
+  EXPECT_EQ(Rows(result->rows), (std::vector<uint32_t>{0, 4}));
+
+  // Disjunctions and negations with other predicates can't be restricted.
+  EXPECT_FALSE(EvaluateWithIndexes(
+                   cp::or_(ContainsAny("samples", {"NA12878"}), af_filter),
+                   indexes)
+                   .has_value());
+  const auto negation =
+      cp::not_(cp::and_(ContainsAny("samples", {"NA12878"}), af_filter));
+  EXPECT_FALSE(EvaluateWithIndexes(negation, indexes).has_value());
+  EXPECT_FALSE(EvaluateWithIndexes(ContainsAny("genes", {"ENSG00000141510"}),
+                                   indexes)
+                   .has_value());
+}
+
+}  // namespace seqr
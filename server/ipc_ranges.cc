@@ -0,0 +1,572 @@
+#include "ipc_ranges.h"
+
+#include <absl/strings/str_cat.h>
+#include <arrow/buffer.h>
+#include <arrow/extension_type.h>
+#include <arrow/ipc/dictionary.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/util/bit_util.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+
+namespace seqr {
+namespace {
+
+// The trailer of an Arrow IPC file: the footer size, followed by the magic.
+constexpr std::string_view kIpcFileMagic = "ARROW1";
+constexpr int64_t kIpcFileTrailerSize = sizeof(int32_t) + kIpcFileMagic.size();
+
+// Marks the start of an encapsulated message, followed by the metadata size.
+// Files written before Arrow 0.15 lack the marker.
+constexpr uint32_t kContinuationMarker = 0xFFFFFFFF;
+
+// Field indices and struct sizes of the flatbuffers in Arrow's Footer.fbs and
+// Message.fbs.
+constexpr int kFooterRecordBatchesField = 3;
+constexpr int64_t kBlockStructSize = 24;
+constexpr int kMessageHeaderTypeField = 1;
+constexpr int kMessageHeaderField = 2;
+constexpr uint8_t kRecordBatchHeaderType = 3;
+constexpr int kRecordBatchBuffersField = 2;
+constexpr int64_t kBufferStructSize = 16;
+
+// Reads the few flatbuffer tables, vectors and structs that are needed to
+// locate record batch buffers, without depending on Arrow's internal
+// generated headers. All accessors return false if they'd read out of
+// bounds.
+class FlatbufferReader {
+ public:
+  explicit FlatbufferReader(const std::string_view data) : data_(data) {}
+
+  template <typename T>
+  bool Read(const int64_t position, T* const out) const {
+    if (position < 0 || position > static_cast<int64_t>(data_.size()) -
+                                       static_cast<int64_t>(sizeof(T))) {
+      return false;
+    }
+    std::memcpy(out, data_.data() + position, sizeof(T));
+    *out = arrow::BitUtil::FromLittleEndian(*out);
+    return true;
+  }
+
+  // Follows the offset at `position` to a table.
+  bool Table(const int64_t position, int64_t* const table) const {
+    uint32_t offset = 0;
+    if (!Read(position, &offset)) {
+      return false;
+    }
+    *table = position + offset;
+    return true;
+  }
+
+  // Sets `field` to the position of a field of a table, or -1 if the field
+  // isn't set.
+  bool Field(const int64_t table, const int index, int64_t* const field) const {
+    int32_t vtable_offset = 0;
+    uint16_t vtable_size = 0;
+    if (!Read(table, &vtable_offset) ||
+        !Read(table - vtable_offset, &vtable_size)) {
+      return false;
+    }
+    *field = -1;
+    const int64_t entry = 4 + 2 * index;
+    if (entry + 2 > vtable_size) {
+      return true;
+    }
+    uint16_t field_offset = 0;
+    if (!Read(table - vtable_offset + entry, &field_offset)) {
+      return false;
+    }
+    if (field_offset != 0) {
+      *field = table + field_offset;
+    }
+    return true;
+  }
+
+  // Follows the offset at `position` to a vector, setting the position of
+  // its first element and its length.
+  bool Vector(const int64_t position, int64_t* const begin,
+              uint32_t* const length) const {
+    int64_t vector = 0;
+    if (!Table(position, &vector) || !Read(vector, length)) {
+      return false;
+    }
+    *begin = vector + sizeof(uint32_t);
+    return true;
+  }
+
+ private:
+  const std::string_view data_;
+};
+
+std::string_view AsStringView(const arrow::Buffer& buffer) {
+  return std::string_view(reinterpret_cast<const char*>(buffer.data()),
+                          buffer.size());
+}
+
+absl::Status IpcError(const arrow::Status& status,
+                      const std::string_view context) {
+  return absl::InvalidArgumentError(
+      absl::StrCat(context, ": ", status.ToString()));
+}
+
+// Reads `nbytes` at `position`, failing on short reads.
+absl::StatusOr<std::shared_ptr<arrow::Buffer>> ReadExactly(
+    arrow::io::RandomAccessFile* const file, const int64_t position,
+    const int64_t nbytes) {
+  auto result = file->ReadAt(position, nbytes);
+  if (!result.ok()) {
+    return IpcError(result.status(),
+                    absl::StrCat("Failed to read ", nbytes, " bytes at ",
+                                 position));
+  }
+  if ((*result)->size() != nbytes) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Short read of ", (*result)->size(), " instead of ",
+                     nbytes, " bytes at ", position));
+  }
+  return *std::move(result);
+}
+
+// Returns the metadata flatbuffer of the message of a block. It's copied to
+// an aligned buffer, as the flatbuffer verifier checks alignment.
+absl::StatusOr<std::shared_ptr<arrow::Buffer>> ReadMessageMetadata(
+    arrow::io::RandomAccessFile* const file, const IpcBlock& block,
+    arrow::MemoryPool* const pool) {
+  const auto prefixed_metadata =
+      ReadExactly(file, block.offset, block.metadata_length);
+  if (!prefixed_metadata.ok()) {
+    return prefixed_metadata.status();
+  }
+  const FlatbufferReader reader(AsStringView(**prefixed_metadata));
+  int64_t begin = sizeof(uint32_t);
+  uint32_t marker = 0;
+  int32_t length = 0;
+  if (!reader.Read(0, &marker) ||
+      !reader.Read(marker == kContinuationMarker ? begin : 0, &length)) {
+    return absl::InvalidArgumentError("Truncated message metadata");
+  }
+  if (marker == kContinuationMarker) {
+    begin += sizeof(int32_t);
+  }
+  if (length < 0 || begin + length > block.metadata_length) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid message metadata length ", length));
+  }
+
+  auto result = arrow::AllocateBuffer(length, pool);
+  if (!result.ok()) {
+    return IpcError(result.status(), "Failed to allocate message metadata");
+  }
+  std::memcpy((*result)->mutable_data(), (*prefixed_metadata)->data() + begin,
+              length);
+  return std::shared_ptr<arrow::Buffer>(*std::move(result));
+}
+
+// Returns the ranges of the body buffers of a record batch message, relative
+// to the start of the body.
+absl::StatusOr<std::vector<ByteRange>> RecordBatchBuffers(
+    const arrow::Buffer& metadata) {
+  const FlatbufferReader reader(AsStringView(metadata));
+  int64_t message = 0;
+  int64_t header_type_field = 0;
+  int64_t header_field = 0;
+  uint8_t header_type = 0;
+  if (!reader.Table(0, &message) ||
+      !reader.Field(message, kMessageHeaderTypeField, &header_type_field) ||
+      !reader.Field(message, kMessageHeaderField, &header_field) ||
+      !reader.Read(header_type_field, &header_type)) {
+    return absl::InvalidArgumentError("Invalid message metadata");
+  }
+  if (header_type != kRecordBatchHeaderType || header_field < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Expected a record batch message instead of type ",
+                     static_cast<int>(header_type)));
+  }
+
+  int64_t record_batch = 0;
+  int64_t buffers_field = 0;
+  int64_t begin = 0;
+  uint32_t length = 0;
+  if (!reader.Table(header_field, &record_batch) ||
+      !reader.Field(record_batch, kRecordBatchBuffersField, &buffers_field) ||
+      buffers_field < 0 || !reader.Vector(buffers_field, &begin, &length)) {
+    return absl::InvalidArgumentError("Invalid record batch metadata");
+  }
+  std::vector<ByteRange> result(length);
+  for (uint32_t i = 0; i < length; ++i) {
+    const int64_t position = begin + i * kBufferStructSize;
+    int64_t size = 0;
+    if (!reader.Read(position, &result[i].begin) ||
+        !reader.Read(position + sizeof(int64_t), &size) || size < 0) {
+      return absl::InvalidArgumentError("Invalid record batch buffers");
+    }
+    result[i].end = result[i].begin + size;
+  }
+  return result;
+}
+
+// The number of buffers of an array of the given type in record batch
+// messages, including those of child arrays.
+int NumIpcBuffers(const arrow::DataType& type) {
+  switch (type.id()) {
+    case arrow::Type::NA:
+      // Null arrays don't have any buffers in IPC messages.
+      return 0;
+    case arrow::Type::EXTENSION:
+      return NumIpcBuffers(
+          *static_cast<const arrow::ExtensionType&>(type).storage_type());
+    default:
+      break;
+  }
+  // Unions keep a placeholder for their missing validity buffer.
+  int result = static_cast<int>(type.layout().buffers.size());
+  for (const auto& child : type.fields()) {
+    result += NumIpcBuffers(*child->type());
+  }
+  return result;
+}
+
+bool HasDictionary(const arrow::DataType& type) {
+  if (type.id() == arrow::Type::DICTIONARY) {
+    return true;
+  }
+  if (type.id() == arrow::Type::EXTENSION) {
+    return HasDictionary(
+        *static_cast<const arrow::ExtensionType&>(type).storage_type());
+  }
+  return std::any_of(type.fields().begin(), type.fields().end(),
+                     [](const auto& child) {
+                       return HasDictionary(*child->type());
+                     });
+}
+
+// Serves reads from the ranges that have been fetched. Reads outside of them
+// go to the fallback file, or fail without one. Only supports ReadAt, which
+// is all that decoding uses.
+class FetchedRangesFile : public arrow::io::RandomAccessFile {
+ public:
+  FetchedRangesFile(std::vector<FetchedRange> ranges, const int64_t size,
+                    std::shared_ptr<arrow::io::RandomAccessFile> fallback)
+      : ranges_(std::move(ranges)),
+        size_(size),
+        fallback_(std::move(fallback)) {
+    std::sort(ranges_.begin(), ranges_.end(),
+              [](const FetchedRange& a, const FetchedRange& b) {
+                return a.offset < b.offset;
+              });
+  }
+
+  arrow::Status Close() override {
+    closed_ = true;
+    return arrow::Status::OK();
+  }
+
+  bool closed() const override { return closed_; }
+
+  arrow::Result<int64_t> Tell() const override {
+    return arrow::Status::NotImplemented("Only ReadAt is supported");
+  }
+
+  arrow::Status Seek(const int64_t /* position */) override {
+    return arrow::Status::NotImplemented("Only ReadAt is supported");
+  }
+
+  arrow::Result<int64_t> GetSize() override { return size_; }
+
+  arrow::Result<int64_t> Read(const int64_t /* nbytes */,
+                              void* const /* out */) override {
+    return arrow::Status::NotImplemented("Only ReadAt is supported");
+  }
+
+  arrow::Result<std::shared_ptr<arrow::Buffer>> Read(
+      const int64_t /* nbytes */) override {
+    return arrow::Status::NotImplemented("Only ReadAt is supported");
+  }
+
+  arrow::Result<int64_t> ReadAt(const int64_t position, const int64_t nbytes,
+                                void* const out) override {
+    ARROW_ASSIGN_OR_RAISE(auto buffer, ReadAt(position, nbytes));
+    std::memcpy(out, buffer->data(), buffer->size());
+    return buffer->size();
+  }
+
+  arrow::Result<std::shared_ptr<arrow::Buffer>> ReadAt(
+      const int64_t position, const int64_t nbytes) override {
+    // The last range that starts at or before the position.
+    auto it = std::upper_bound(
+        ranges_.begin(), ranges_.end(), position,
+        [](const int64_t value, const FetchedRange& range) {
+          return value < range.offset;
+        });
+    if (it != ranges_.begin()) {
+      --it;
+      if (position + nbytes <= it->offset + it->data->size()) {
+        return arrow::SliceBuffer(it->data, position - it->offset, nbytes);
+      }
+    }
+    if (fallback_ != nullptr) {
+      return fallback_->ReadAt(position, nbytes);
+    }
+    return arrow::Status::IOError("Range [", position, ", ", position + nbytes,
+                                  ") wasn't fetched");
+  }
+
+ private:
+  // Sorted by offset.
+  std::vector<FetchedRange> ranges_;
+  const int64_t size_;
+  const std::shared_ptr<arrow::io::RandomAccessFile> fallback_;
+  bool closed_ = false;
+};
+
+// Checks that the included fields exist and can be decoded without their
+// dictionaries. An empty selection includes all fields.
+absl::StatusOr<std::vector<int>> IncludedFields(
+    const arrow::Schema& schema, const arrow::ipc::IpcReadOptions& options) {
+  std::vector<int> result = options.included_fields;
+  if (result.empty()) {
+    for (int i = 0; i < schema.num_fields(); ++i) {
+      result.push_back(i);
+    }
+  }
+  for (const int field_index : result) {
+    if (field_index < 0 || field_index >= schema.num_fields()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid field index ", field_index));
+    }
+    // Excluded dictionary fields are skipped without their dictionaries.
+    if (const auto& field = *schema.field(field_index);
+        HasDictionary(*field.type())) {
+      return absl::UnimplementedError(
+          absl::StrCat("Field ", field.name(), " is dictionary-encoded"));
+    }
+  }
+  return result;
+}
+
+// Returns the ranges of the body buffers of the included fields, relative to
+// the start of the body and coalesced with `max_gap`.
+absl::StatusOr<std::vector<ByteRange>> IncludedBodyRanges(
+    const arrow::Buffer& metadata, const IpcBlock& block,
+    const arrow::Schema& schema, const std::vector<int>& included_fields,
+    const int64_t max_gap) {
+  const auto buffers = RecordBatchBuffers(metadata);
+  if (!buffers.ok()) {
+    return buffers.status();
+  }
+
+  const auto field_buffers = FieldBufferIndices(schema);
+  std::vector<ByteRange> ranges;
+  for (const int field_index : included_fields) {
+    const auto [first, last] = field_buffers[field_index];
+    if (last > static_cast<int>(buffers->size())) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Record batch has ", buffers->size(),
+                       " buffers, but the schema needs more"));
+    }
+    ranges.insert(ranges.end(), buffers->begin() + first,
+                  buffers->begin() + last);
+  }
+
+  auto result = CoalesceRanges(std::move(ranges), max_gap);
+  for (const auto& range : result) {
+    if (range.begin < 0 || range.end > block.body_length) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Buffer range [", range.begin, ", ", range.end,
+                       ") exceeds the body length ", block.body_length));
+    }
+  }
+  return result;
+}
+
+}  // namespace
+
+absl::StatusOr<std::vector<IpcBlock>> ReadIpcFileBlocks(
+    arrow::io::RandomAccessFile* const file) {
+  const auto file_size = file->GetSize();
+  if (!file_size.ok()) {
+    return IpcError(file_size.status(), "Failed to get file size");
+  }
+  if (*file_size < kIpcFileTrailerSize) {
+    return absl::InvalidArgumentError("File is too small for an IPC file");
+  }
+  const auto trailer = ReadExactly(file, *file_size - kIpcFileTrailerSize,
+                                   kIpcFileTrailerSize);
+  if (!trailer.ok()) {
+    return trailer.status();
+  }
+  int32_t footer_length = 0;
+  if (AsStringView(**trailer).substr(sizeof(int32_t)) != kIpcFileMagic ||
+      !FlatbufferReader(AsStringView(**trailer)).Read(0, &footer_length) ||
+      footer_length <= 0 ||
+      footer_length > *file_size - kIpcFileTrailerSize) {
+    return absl::InvalidArgumentError("Invalid IPC file trailer");
+  }
+
+  const auto footer = ReadExactly(
+      file, *file_size - kIpcFileTrailerSize - footer_length, footer_length);
+  if (!footer.ok()) {
+    return footer.status();
+  }
+  const FlatbufferReader reader(AsStringView(**footer));
+  int64_t root = 0;
+  int64_t blocks_field = 0;
+  if (!reader.Table(0, &root) ||
+      !reader.Field(root, kFooterRecordBatchesField, &blocks_field)) {
+    return absl::InvalidArgumentError("Invalid IPC file footer");
+  }
+  std::vector<IpcBlock> result;
+  if (blocks_field < 0) {
+    return result;
+  }
+  int64_t begin = 0;
+  uint32_t length = 0;
+  if (!reader.Vector(blocks_field, &begin, &length)) {
+    return absl::InvalidArgumentError("Invalid IPC file footer");
+  }
+  result.resize(length);
+  for (uint32_t i = 0; i < length; ++i) {
+    // The metadata length is padded to 8 bytes.
+    const int64_t position = begin + i * kBlockStructSize;
+    auto& block = result[i];
+    if (!reader.Read(position, &block.offset) ||
+        !reader.Read(position + 8, &block.metadata_length) ||
+        !reader.Read(position + 16, &block.body_length)) {
+      return absl::InvalidArgumentError("Invalid IPC file blocks");
+    }
+  }
+  return result;
+}
+
+std::vector<std::pair<int, int>> FieldBufferIndices(
+    const arrow::Schema& schema) {
+  std::vector<std::pair<int, int>> result;
+  result.reserve(schema.num_fields());
+  int first = 0;
+  for (const auto& field : schema.fields()) {
+    const int last = first + NumIpcBuffers(*field->type());
+    result.emplace_back(first, last);
+    first = last;
+  }
+  return result;
+}
+
+std::vector<ByteRange> CoalesceRanges(std::vector<ByteRange> ranges,
+                                      const int64_t max_gap) {
+  ranges.erase(std::remove_if(ranges.begin(), ranges.end(),
+                              [](const ByteRange& range) {
+                                return range.begin >= range.end;
+                              }),
+               ranges.end());
+  std::sort(ranges.begin(), ranges.end(),
+            [](const ByteRange& a, const ByteRange& b) {
+              return a.begin < b.begin;
+            });
+  std::vector<ByteRange> result;
+  for (const auto& range : ranges) {
+    if (!result.empty() && range.begin <= result.back().end + max_gap) {
+      result.back().end = std::max(result.back().end, range.end);
+    } else {
+      result.push_back(range);
+    }
+  }
+  return result;
+}
+
+absl::StatusOr<std::vector<FetchedRange>> FetchRecordBatchColumns(
+    arrow::io::RandomAccessFile* const file, const IpcBlock& block,
+    const std::shared_ptr<arrow::Schema>& schema,
+    const arrow::ipc::IpcReadOptions& options, const int64_t max_gap) {
+  const auto included_fields = IncludedFields(*schema, options);
+  if (!included_fields.ok()) {
+    return included_fields.status();
+  }
+
+  std::vector<FetchedRange> result;
+  auto prefixed_metadata =
+      ReadExactly(file, block.offset, block.metadata_length);
+  if (!prefixed_metadata.ok()) {
+    return prefixed_metadata.status();
+  }
+  result.push_back(FetchedRange{block.offset, *std::move(prefixed_metadata)});
+
+  // Served from the range that was just fetched.
+  FetchedRangesFile metadata_file(result, block.offset + block.metadata_length,
+                                  /* fallback */ nullptr);
+  const auto metadata =
+      ReadMessageMetadata(&metadata_file, block, options.memory_pool);
+  if (!metadata.ok()) {
+    return metadata.status();
+  }
+  const auto ranges = IncludedBodyRanges(**metadata, block, *schema,
+                                         *included_fields, max_gap);
+  if (!ranges.ok()) {
+    return ranges.status();
+  }
+  const int64_t body_offset = block.offset + block.metadata_length;
+  for (const auto& range : *ranges) {
+    auto buffer = ReadExactly(file, body_offset + range.begin,
+                              range.end - range.begin);
+    if (!buffer.ok()) {
+      return buffer.status();
+    }
+    result.push_back(
+        FetchedRange{body_offset + range.begin, *std::move(buffer)});
+  }
+  return result;
+}
+
+std::shared_ptr<arrow::io::RandomAccessFile> WithFetchedRanges(
+    std::shared_ptr<arrow::io::RandomAccessFile> file,
+    std::vector<FetchedRange> ranges) {
+  const int64_t size = file->GetSize().ValueOr(0);
+  return std::make_shared<FetchedRangesFile>(std::move(ranges), size,
+                                             std::move(file));
+}
+
+absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> ReadRecordBatchColumns(
+    arrow::io::RandomAccessFile* const file, const IpcBlock& block,
+    const std::shared_ptr<arrow::Schema>& schema,
+    const arrow::ipc::IpcReadOptions& options, const int64_t max_gap) {
+  const auto included_fields = IncludedFields(*schema, options);
+  if (!included_fields.ok()) {
+    return included_fields.status();
+  }
+
+  const auto metadata = ReadMessageMetadata(file, block, options.memory_pool);
+  if (!metadata.ok()) {
+    return metadata.status();
+  }
+  const auto ranges = IncludedBodyRanges(**metadata, block, *schema,
+                                         *included_fields, max_gap);
+  if (!ranges.ok()) {
+    return ranges.status();
+  }
+
+  // Offsets are relative to the body.
+  const int64_t body_offset = block.offset + block.metadata_length;
+  std::vector<FetchedRange> fetched;
+  for (const auto& range : *ranges) {
+    auto buffer = ReadExactly(file, body_offset + range.begin,
+                              range.end - range.begin);
+    if (!buffer.ok()) {
+      return buffer.status();
+    }
+    fetched.push_back(FetchedRange{range.begin, *std::move(buffer)});
+  }
+
+  FetchedRangesFile body(std::move(fetched), block.body_length,
+                         /* fallback */ nullptr);
+  const arrow::ipc::DictionaryMemo dictionary_memo;
+  auto result = arrow::ipc::ReadRecordBatch(**metadata, schema,
+                                            &dictionary_memo, options, &body);
+  if (!result.ok()) {
+    return IpcError(result.status(), "Failed to decode record batch");
+  }
+  return *std::move(result);
+}
+
+}  // namespace seqr
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <absl/status/statusor.h>
+#include <arrow/buffer.h>
+#include <arrow/io/interfaces.h>
+#include <arrow/ipc/options.h>
+#include <arrow/record_batch.h>
+#include <arrow/type.h>
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace seqr {
+
+// The location of a record batch message in an Arrow IPC file, as listed in
+// the file footer.
+struct IpcBlock {
+  int64_t offset = 0;
+  // Including the length prefix and padding of the metadata.
+  int32_t metadata_length = 0;
+  int64_t body_length = 0;
+};
+
+// A range [begin, end) of bytes.
+struct ByteRange {
+  int64_t begin = 0;
+  int64_t end = 0;
+};
+
+// Bytes of a file that have been read ahead of time, starting at `offset`.
+struct FetchedRange {
+  int64_t offset = 0;
+  std::shared_ptr<arrow::Buffer> data;
+};
+
+// Returns the record batch blocks listed in the footer of an Arrow IPC file.
+absl::StatusOr<std::vector<IpcBlock>> ReadIpcFileBlocks(
+    arrow::io::RandomAccessFile* file);
+
+// Returns, for each field of the schema, the range [first, last) of indices
+// of its buffers (including those of its children) in record batch messages.
+std::vector<std::pair<int, int>> FieldBufferIndices(
+    const arrow::Schema& schema);
+
+// Returns the sorted union of the given ranges, merging ranges that are at
+// most `max_gap` bytes apart. Empty ranges are dropped.
+std::vector<ByteRange> CoalesceRanges(std::vector<ByteRange> ranges,
+                                      int64_t max_gap);
+
+// Reads a record batch of an Arrow IPC file with the given schema, decoding
+// only `options.included_fields`. Unlike RecordBatchFileReader, which reads
+// the whole message body, this parses the message metadata and only reads
+// the body buffers of the included fields, in ranges coalesced with
+// `max_gap`. Buffers are allocated from `options.memory_pool`. Returns an
+// Unimplemented error if an included field is dictionary-encoded, as
+// dictionaries aren't read.
+absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> ReadRecordBatchColumns(
+    arrow::io::RandomAccessFile* file, const IpcBlock& block,
+    const std::shared_ptr<arrow::Schema>& schema,
+    const arrow::ipc::IpcReadOptions& options, int64_t max_gap);
+
+// Reads the ranges that ReadRecordBatchColumns needs with the same
+// arguments: the message metadata and the coalesced buffers of the included
+// fields. Decoding from WithFetchedRanges of them doesn't read the file
+// again, so the reads can happen ahead of time, e.g. on I/O threads.
+absl::StatusOr<std::vector<FetchedRange>> FetchRecordBatchColumns(
+    arrow::io::RandomAccessFile* file, const IpcBlock& block,
+    const std::shared_ptr<arrow::Schema>& schema,
+    const arrow::ipc::IpcReadOptions& options, int64_t max_gap);
+
+// Returns a file that serves reads within the given ranges from memory and
+// forwards all other reads to `file`. Only ReadAt and GetSize are supported.
+std::shared_ptr<arrow::io::RandomAccessFile> WithFetchedRanges(
+    std::shared_ptr<arrow::io::RandomAccessFile> file,
+    std::vector<FetchedRange> ranges);
+
+}  // namespace seqr
@@ -0,0 +1,159 @@
+#include "ipc_ranges.h"
+
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/testing/gtest_util.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace seqr {
+namespace {
+
+constexpr char kArrowPath[] = "testdata/part-00000-na12878-trio.zstd.arrow";
+
+// Counts the bytes read by ReadAt.
+class CountingFile : public arrow::io::RandomAccessFile {
+ public:
+  explicit CountingFile(std::shared_ptr<arrow::io::RandomAccessFile> file)
+      : file_(std::move(file)) {}
+
+  int64_t bytes_read() const { return bytes_read_; }
+
+  arrow::Status Close() override { return file_->Close(); }
+
+  bool closed() const override { return file_->closed(); }
+
+  arrow::Result<int64_t> Tell() const override { return file_->Tell(); }
+
+  arrow::Status Seek(const int64_t position) override {
+    return file_->Seek(position);
+  }
+
+  arrow::Result<int64_t> GetSize() override { return file_->GetSize(); }
+
+  arrow::Result<int64_t> Read(const int64_t nbytes, void* const out) override {
+    return file_->Read(nbytes, out);
+  }
+
+  arrow::Result<std::shared_ptr<arrow::Buffer>> Read(
+      const int64_t nbytes) override {
+    return file_->Read(nbytes);
+  }
+
+  arrow::Result<std::shared_ptr<arrow::Buffer>> ReadAt(
+      const int64_t position, const int64_t nbytes) override {
+    ARROW_ASSIGN_OR_RAISE(auto result, file_->ReadAt(position, nbytes));
+    bytes_read_ += result->size();
+    return result;
+  }
+
+ private:
+  const std::shared_ptr<arrow::io::RandomAccessFile> file_;
+  std::atomic<int64_t> bytes_read_ = 0;
+};
+
+TEST(IpcRangesTest, FieldBufferIndices) {
+  const auto schema = arrow::schema({
+      arrow::field("int", arrow::int32()),
+      arrow::field("strings", arrow::list(arrow::utf8())),
+      arrow::field("null", arrow::null()),
+      arrow::field("struct",
+                   arrow::struct_({arrow::field("bool", arrow::boolean())})),
+  });
+  const std::vector<std::pair<int, int>> expected = {
+      {0, 2}, {2, 7}, {7, 7}, {7, 10}};
+  EXPECT_EQ(FieldBufferIndices(*schema), expected);
+}
+
+TEST(IpcRangesTest, CoalesceRanges) {
+  const auto result =
+      CoalesceRanges({{100, 200}, {0, 10}, {15, 20}, {50, 50}, {150, 160}},
+                     /* max_gap */ 5);
+  ASSERT_EQ(result.size(), 2);
+  EXPECT_EQ(result[0].begin, 0);
+  EXPECT_EQ(result[0].end, 20);
+  EXPECT_EQ(result[1].begin, 100);
+  EXPECT_EQ(result[1].end, 200);
+}
+
+TEST(IpcRangesTest, ReadsOnlyIncludedColumns) {
+  ASSERT_OK_AND_ASSIGN(const auto local_file,
+                       arrow::io::ReadableFile::Open(kArrowPath));
+  ASSERT_OK_AND_ASSIGN(const auto full_reader,
+                       arrow::ipc::RecordBatchFileReader::Open(local_file));
+  const auto schema = full_reader->schema();
+
+  auto options = arrow::ipc::IpcReadOptions::Defaults();
+  options.use_threads = false;
+  options.included_fields = {schema->GetFieldIndex("xpos"),
+                             schema->GetFieldIndex("variantId")};
+  std::sort(options.included_fields.begin(), options.included_fields.end());
+  ASSERT_OK_AND_ASSIGN(
+      const auto reader,
+      arrow::ipc::RecordBatchFileReader::Open(local_file, options));
+
+  // Decoded buffers are allocated from the given pool.
+  arrow::ProxyMemoryPool pool(arrow::default_memory_pool());
+  auto ranged_options = options;
+  ranged_options.memory_pool = &pool;
+
+  CountingFile file(local_file);
+  const auto blocks = ReadIpcFileBlocks(&file);
+  ASSERT_TRUE(blocks.ok()) << blocks.status();
+  ASSERT_EQ(static_cast<int>(blocks->size()), reader->num_record_batches());
+
+  int64_t body_bytes = 0;
+  for (size_t i = 0; i < blocks->size(); ++i) {
+    ASSERT_OK_AND_ASSIGN(const auto expected, reader->ReadRecordBatch(i));
+    const auto record_batch = ReadRecordBatchColumns(
+        &file, (*blocks)[i], schema, ranged_options, /* max_gap */ 0);
+    ASSERT_TRUE(record_batch.ok()) << record_batch.status();
+    EXPECT_EQ((*record_batch)->num_columns(), 2);
+    EXPECT_TRUE((*record_batch)->Equals(*expected));
+    body_bytes += (*blocks)[i].body_length;
+  }
+  EXPECT_LT(file.bytes_read(), body_bytes / 10);
+  EXPECT_GT(pool.max_memory(), 0);
+}
+
+TEST(IpcRangesTest, DecodesFromFetchedRanges) {
+  ASSERT_OK_AND_ASSIGN(const auto local_file,
+                       arrow::io::ReadableFile::Open(kArrowPath));
+  ASSERT_OK_AND_ASSIGN(const auto full_reader,
+                       arrow::ipc::RecordBatchFileReader::Open(local_file));
+  const auto schema = full_reader->schema();
+  auto options = arrow::ipc::IpcReadOptions::Defaults();
+  options.use_threads = false;
+  options.included_fields = {schema->GetFieldIndex("xpos")};
+  ASSERT_OK_AND_ASSIGN(
+      const auto reader,
+      arrow::ipc::RecordBatchFileReader::Open(local_file, options));
+
+  const auto file = std::make_shared<CountingFile>(local_file);
+  const auto blocks = ReadIpcFileBlocks(file.get());
+  ASSERT_TRUE(blocks.ok()) << blocks.status();
+  ASSERT_FALSE(blocks->empty());
+  const auto ranges = FetchRecordBatchColumns(file.get(), blocks->front(),
+                                              schema, options,
+                                              /* max_gap */ 0);
+  ASSERT_TRUE(ranges.ok()) << ranges.status();
+
+  // Decoding doesn't read anything else.
+  const int64_t bytes_fetched = file->bytes_read();
+  const auto fetched_file = WithFetchedRanges(file, *ranges);
+  const auto record_batch = ReadRecordBatchColumns(
+      fetched_file.get(), blocks->front(), schema, options, /* max_gap */ 0);
+  ASSERT_TRUE(record_batch.ok()) << record_batch.status();
+  EXPECT_EQ(file->bytes_read(), bytes_fetched);
+  ASSERT_OK_AND_ASSIGN(const auto expected, reader->ReadRecordBatch(0));
+  EXPECT_TRUE((*record_batch)->Equals(*expected));
+}
+
+}  // namespace
+}  // namespace seqr
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/statusor.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/synchronization/notification.h>
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace seqr {
+
+// A thread-safe cache that evicts least recently used entries once the total
+// size of its values exceeds a byte budget. Value types need to implement
+// `size_t SizeBytes() const`.
+//
+// Loading is single-flight: if multiple threads request the same missing key
+// concurrently, only one of them runs the loader, while the others wait for
+// its result. Errors are returned to all waiting callers, but not cached.
+template <typename Value>
+class LruCache {
+ public:
+  using ValuePtr = std::shared_ptr<const Value>;
+  using Loader = std::function<absl::StatusOr<ValuePtr>()>;
+
+  explicit LruCache(const size_t max_size_bytes)
+      : max_size_bytes_(max_size_bytes) {}
+
+  LruCache(const LruCache&) = delete;
+  LruCache& operator=(const LruCache&) = delete;
+
+  // Returns the value for the given key, calling the loader if necessary.
+  absl::StatusOr<ValuePtr> GetOrLoad(const std::string& key,
+                                     const Loader& loader) {
+    std::shared_ptr<Entry> entry;
+    bool is_loader = false;
+    {
+      absl::MutexLock lock(&mu_);
+      auto& map_entry = entries_[key];
+      if (map_entry == nullptr) {
+        map_entry = std::make_shared<Entry>();
+        is_loader = true;
+      } else if (map_entry->in_lru) {
+        lru_.splice(lru_.begin(), lru_, map_entry->lru_position);
+      }
+      entry = map_entry;
+    }
+
+    if (!is_loader) {
+      entry->loaded.WaitForNotification();
+      return entry->value;
+    }
+
+    auto value = loader();
+    {
+      absl::MutexLock lock(&mu_);
+      entry->value = value;
+      if (value.ok() && *value != nullptr &&
+          (*value)->SizeBytes() <= max_size_bytes_) {
+        entry->size_bytes = (*value)->SizeBytes();
+        entry->lru_position = lru_.insert(lru_.begin(), key);
+        entry->in_lru = true;
+        size_bytes_ += entry->size_bytes;
+        EvictIfNecessary();
+      } else {
+        // Don't keep errors or values that exceed the budget on their own.
+        entries_.erase(key);
+      }
+    }
+    entry->loaded.Notify();
+    return value;
+  }
+
+  // Returns the value for the given key, or null if it's neither cached nor
+  // being loaded. Waits for an ongoing load, and returns null if it fails.
+  ValuePtr Get(const std::string& key) {
+    std::shared_ptr<Entry> entry;
+    {
+      absl::MutexLock lock(&mu_);
+      const auto it = entries_.find(key);
+      if (it == entries_.end()) {
+        return nullptr;
+      }
+      entry = it->second;
+      if (entry->in_lru) {
+        lru_.splice(lru_.begin(), lru_, entry->lru_position);
+      }
+    }
+    entry->loaded.WaitForNotification();
+    return entry->value.ok() ? *entry->value : nullptr;
+  }
+
+  // Returns whether a value for the given key is cached or being loaded,
+  // without affecting its recency.
+  bool Contains(const std::string& key) const {
+    absl::MutexLock lock(&mu_);
+    return entries_.contains(key);
+  }
+
+  // Returns the total size of all cached values.
+  size_t SizeBytes() const {
+    absl::MutexLock lock(&mu_);
+    return size_bytes_;
+  }
+
+ private:
+  struct Entry {
+    absl::Notification loaded;
+    // Only valid once `loaded` has been notified.
+    absl::StatusOr<ValuePtr> value;
+    size_t size_bytes = 0;
+    // Entries that are still loading aren't part of the LRU list yet.
+    bool in_lru = false;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  void EvictIfNecessary() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    while (size_bytes_ > max_size_bytes_ && !lru_.empty()) {
+      const auto it = entries_.find(lru_.back());
+      size_bytes_ -= it->second->size_bytes;
+      // Callers that still hold the value keep it alive.
+      entries_.erase(it);
+      lru_.pop_back();
+    }
+  }
+
+  const size_t max_size_bytes_;
+  mutable absl::Mutex mu_;
+  absl::flat_hash_map<std::string, std::shared_ptr<Entry>> entries_
+      ABSL_GUARDED_BY(mu_);
+  // Most recently used keys are at the front.
+  std::list<std::string> lru_ ABSL_GUARDED_BY(mu_);
+  size_t size_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace seqr
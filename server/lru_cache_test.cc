@@ -0,0 +1,129 @@
+#include "lru_cache.h"
+
+#include <absl/synchronization/blocking_counter.h>
+#include <absl/synchronization/notification.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+namespace seqr {
+
+struct TestValue {
+  size_t SizeBytes() const { return size_bytes; }
+
+  int id = 0;
+  size_t size_bytes = 0;
+};
+
+using TestCache = LruCache<TestValue>;
+
+TestCache::Loader MakeLoader(const int id, const size_t size_bytes,
+                             int* const num_calls) {
+  return [id, size_bytes, num_calls]() -> absl::StatusOr<TestCache::ValuePtr> {
+    ++*num_calls;
+    return std::make_shared<const TestValue>(TestValue{id, size_bytes});
+  };
+}
+
+TEST(LruCache, LoadsOnce) {
+  TestCache cache(100);
+  int num_calls = 0;
+  for (int i = 0; i < 3; ++i) {
+    const auto value = cache.GetOrLoad("a", MakeLoader(1, 10, &num_calls));
+    ASSERT_TRUE(value.ok()) << value.status();
+    EXPECT_EQ((*value)->id, 1);
+  }
+  EXPECT_EQ(num_calls, 1);
+  EXPECT_EQ(cache.SizeBytes(), 10);
+}
+
+TEST(LruCache, EvictsLeastRecentlyUsed) {
+  TestCache cache(100);
+  int num_calls = 0;
+  ASSERT_TRUE(cache.GetOrLoad("a", MakeLoader(1, 40, &num_calls)).ok());
+  ASSERT_TRUE(cache.GetOrLoad("b", MakeLoader(2, 40, &num_calls)).ok());
+  // Touch "a", so "b" becomes the least recently used entry.
+  ASSERT_TRUE(cache.GetOrLoad("a", MakeLoader(1, 40, &num_calls)).ok());
+  ASSERT_TRUE(cache.GetOrLoad("c", MakeLoader(3, 40, &num_calls)).ok());
+  EXPECT_EQ(num_calls, 3);
+  EXPECT_EQ(cache.SizeBytes(), 80);
+  EXPECT_TRUE(cache.Contains("a"));
+  EXPECT_FALSE(cache.Contains("b"));
+
+  ASSERT_TRUE(cache.GetOrLoad("a", MakeLoader(1, 40, &num_calls)).ok());
+  EXPECT_EQ(num_calls, 3);
+  ASSERT_TRUE(cache.GetOrLoad("b", MakeLoader(2, 40, &num_calls)).ok());
+  EXPECT_EQ(num_calls, 4);
+}
+
+TEST(LruCache, GetsOnlyLoadedValues) {
+  TestCache cache(100);
+  int num_calls = 0;
+  EXPECT_EQ(cache.Get("a"), nullptr);
+  ASSERT_TRUE(cache.GetOrLoad("a", MakeLoader(1, 10, &num_calls)).ok());
+  const auto value = cache.Get("a");
+  ASSERT_NE(value, nullptr);
+  EXPECT_EQ(value->id, 1);
+  EXPECT_EQ(num_calls, 1);
+}
+
+TEST(LruCache, DoesNotKeepOversizedValues) {
+  TestCache cache(100);
+  int num_calls = 0;
+  for (int i = 0; i < 2; ++i) {
+    const auto value = cache.GetOrLoad("a", MakeLoader(1, 101, &num_calls));
+    ASSERT_TRUE(value.ok()) << value.status();
+    EXPECT_EQ((*value)->id, 1);
+  }
+  EXPECT_EQ(num_calls, 2);
+  EXPECT_EQ(cache.SizeBytes(), 0);
+}
+
+TEST(LruCache, DoesNotCacheErrors) {
+  TestCache cache(100);
+  int num_calls = 0;
+  const auto failing_loader =
+      [&num_calls]() -> absl::StatusOr<TestCache::ValuePtr> {
+    ++num_calls;
+    return absl::NotFoundError("not found");
+  };
+  EXPECT_EQ(cache.GetOrLoad("a", failing_loader).status().code(),
+            absl::StatusCode::kNotFound);
+  const auto value = cache.GetOrLoad("a", MakeLoader(1, 10, &num_calls));
+  ASSERT_TRUE(value.ok()) << value.status();
+  EXPECT_EQ(num_calls, 2);
+}
+
+TEST(LruCache, SingleFlight) {
+  constexpr int kNumThreads = 8;
+  TestCache cache(100);
+  std::atomic<int> num_calls = 0;
+  absl::Notification release_loader;
+  absl::BlockingCounter started(kNumThreads);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&] {
+      started.DecrementCount();
+      const auto value =
+          cache.GetOrLoad("a", [&]() -> absl::StatusOr<TestCache::ValuePtr> {
+            ++num_calls;
+            release_loader.WaitForNotification();
+            return std::make_shared<const TestValue>(TestValue{1, 10});
+          });
+      ASSERT_TRUE(value.ok()) << value.status();
+      EXPECT_EQ((*value)->id, 1);
+    });
+  }
+
+  started.Wait();
+  release_loader.Notify();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(num_calls, 1);
+}
+
+}  // namespace seqr
@@ -1,9 +1,32 @@
+#include <absl/flags/flag.h>
 #include <absl/flags/parse.h>
+#include <absl/time/time.h>
 
+#include <cstdint>
 #include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
 
+#include "disk_cache.h"
 #include "server.h"
 
+ABSL_FLAG(std::string, disk_cache_dir, "",
+          "If set, GCS objects are cached in this local directory, e.g. on an "
+          "SSD, so cache misses and restarts don't download them again.");
+
+ABSL_FLAG(int64_t, disk_cache_bytes, int64_t{100} << 30,
+          "The maximum total size of the files in --disk_cache_dir.");
+
+ABSL_FLAG(bool, disk_cache_decompress, true,
+          "Whether to store Arrow files in --disk_cache_dir without "
+          "compression, so they don't need to be decompressed again.");
+
+ABSL_FLAG(absl::Duration, disk_cache_generation_ttl, absl::Seconds(10),
+          "How long the disk cache reuses the generation of a GCS object for "
+          "reads that don't pin one, instead of looking it up again. Changes "
+          "to objects may take this long to be seen.");
+
 int main(int argc, char** argv) {
   absl::ParseCommandLine(argc, argv);
 
@@ -25,8 +48,25 @@ int main(int argc, char** argv) {
               << std::endl;
     return 1;
   }
+  std::unique_ptr<seqr::UrlReader> url_reader = *std::move(gcs_reader);
+
+  if (!absl::GetFlag(FLAGS_disk_cache_dir).empty()) {
+    seqr::DiskCacheOptions options;
+    options.directory = absl::GetFlag(FLAGS_disk_cache_dir);
+    options.max_size_bytes = absl::GetFlag(FLAGS_disk_cache_bytes);
+    options.decompress = absl::GetFlag(FLAGS_disk_cache_decompress);
+    options.generation_ttl = absl::GetFlag(FLAGS_disk_cache_generation_ttl);
+    auto disk_cached_reader =
+        seqr::MakeDiskCachedReader(std::move(url_reader), std::move(options));
+    if (!disk_cached_reader.ok()) {
+      std::cerr << "Failed to create disk cache: "
+                << disk_cached_reader.status() << std::endl;
+      return 1;
+    }
+    url_reader = *std::move(disk_cached_reader);
+  }
 
-  auto grpc_server = seqr::CreateServer(port, **gcs_reader);
+  auto grpc_server = seqr::CreateServer(port, *url_reader);
   if (!grpc_server.ok()) {
     std::cerr << "Failed to create server: " << grpc_server.status()
               << std::endl;
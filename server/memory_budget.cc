@@ -0,0 +1,271 @@
+#include "memory_budget.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/synchronization/notification.h>
+
+#include <algorithm>
+
+namespace seqr {
+
+namespace {
+
+void RunCallbacks(
+    std::vector<std::pair<std::function<void(absl::Status)>, absl::Status>>
+        callbacks) {
+  for (auto& [done, status] : callbacks) {
+    done(std::move(status));
+  }
+}
+
+}  // namespace
+
+MemoryBudget::~MemoryBudget() {
+  Callbacks callbacks;
+  std::thread timer;
+  {
+    absl::MutexLock l(&mu_);
+    stopping_ = true;
+    for (auto& waiter : waiters_) {
+      callbacks.emplace_back(
+          std::move(waiter.done),
+          absl::CancelledError("The memory budget was destroyed"));
+    }
+    waiters_.clear();
+    timer = std::move(timer_);
+    waiters_changed_.SignalAll();
+  }
+  if (timer.joinable()) {
+    timer.join();
+  }
+  RunCallbacks(std::move(callbacks));
+}
+
+void MemoryBudget::ReserveAsync(const int64_t bytes,
+                                const absl::Duration timeout,
+                                const void* const owner,
+                                std::function<void(absl::Status)> done) {
+  if (bytes > limit_bytes_) {
+    done(absl::ResourceExhaustedError(
+        absl::StrCat("Estimated memory of ", bytes,
+                     " bytes exceeds the server's budget of ", limit_bytes_,
+                     " bytes")));
+    return;
+  }
+
+  const absl::Time deadline = absl::Now() + timeout;
+  absl::Status status;
+  {
+    absl::MutexLock l(&mu_);
+    // Earlier waiters go first.
+    if (waiters_.empty() && reserved_bytes_ + bytes <= limit_bytes_) {
+      reserved_bytes_ += bytes;
+    } else if (deadline <= absl::Now()) {
+      status = TimeoutError(bytes);
+    } else {
+      waiters_.push_back(Waiter{bytes, deadline, owner, std::move(done)});
+      if (deadline != absl::InfiniteFuture() && !timer_.joinable()) {
+        timer_ = std::thread([this] { RunTimer(); });
+      }
+      waiters_changed_.SignalAll();
+      return;
+    }
+  }
+  done(std::move(status));
+}
+
+void MemoryBudget::CancelReservations(const void* const owner,
+                                      const absl::Status& status) {
+  Callbacks callbacks;
+  {
+    absl::MutexLock l(&mu_);
+    for (auto it = waiters_.begin(); it != waiters_.end();) {
+      if (it->owner == owner) {
+        callbacks.emplace_back(std::move(it->done), status);
+        it = waiters_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    // Waiters behind a cancelled one may fit now.
+    for (auto& callback : TakeFinishedWaiters()) {
+      callbacks.push_back(std::move(callback));
+    }
+  }
+  RunCallbacks(std::move(callbacks));
+}
+
+absl::Status MemoryBudget::Reserve(const int64_t bytes,
+                                   const absl::Duration timeout) {
+  absl::Notification reserved;
+  absl::Status result;
+  ReserveAsync(bytes, timeout, /* owner */ nullptr,
+               [&reserved, &result](absl::Status status) {
+                 result = std::move(status);
+                 reserved.Notify();
+               });
+  reserved.WaitForNotification();
+  return result;
+}
+
+void MemoryBudget::ForceReserve(const int64_t bytes) {
+  absl::MutexLock l(&mu_);
+  reserved_bytes_ += bytes;
+}
+
+void MemoryBudget::Release(const int64_t bytes) {
+  Callbacks callbacks;
+  {
+    absl::MutexLock l(&mu_);
+    reserved_bytes_ -= bytes;
+    callbacks = TakeFinishedWaiters();
+  }
+  RunCallbacks(std::move(callbacks));
+}
+
+MemoryBudget::Callbacks MemoryBudget::TakeFinishedWaiters() {
+  Callbacks result;
+  const absl::Time now = absl::Now();
+  for (auto it = waiters_.begin(); it != waiters_.end();) {
+    if (it->deadline <= now) {
+      result.emplace_back(std::move(it->done), TimeoutError(it->bytes));
+      it = waiters_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  while (!waiters_.empty() &&
+         reserved_bytes_ + waiters_.front().bytes <= limit_bytes_) {
+    reserved_bytes_ += waiters_.front().bytes;
+    result.emplace_back(std::move(waiters_.front().done), absl::OkStatus());
+    waiters_.pop_front();
+  }
+  if (!result.empty()) {
+    waiters_changed_.SignalAll();
+  }
+  return result;
+}
+
+absl::Status MemoryBudget::TimeoutError(const int64_t bytes) const {
+  return absl::ResourceExhaustedError(absl::StrCat(
+      "Timed out waiting for ", bytes, " bytes of memory, with ",
+      reserved_bytes_, " of ", limit_bytes_, " bytes in use"));
+}
+
+void MemoryBudget::RunTimer() {
+  while (true) {
+    Callbacks callbacks;
+    {
+      absl::MutexLock l(&mu_);
+      absl::Time next_deadline = absl::InfiniteFuture();
+      for (const auto& waiter : waiters_) {
+        next_deadline = std::min(next_deadline, waiter.deadline);
+      }
+      if (!stopping_) {
+        waiters_changed_.WaitWithDeadline(&mu_, next_deadline);
+      }
+      if (stopping_) {
+        return;
+      }
+      callbacks = TakeFinishedWaiters();
+    }
+    RunCallbacks(std::move(callbacks));
+  }
+}
+
+TrackingMemoryPool::TrackingMemoryPool(MemoryBudget* const budget,
+                                       const int64_t limit_bytes,
+                                       arrow::MemoryPool* const parent)
+    : budget_(*budget), limit_bytes_(limit_bytes), parent_(*parent) {}
+
+TrackingMemoryPool::~TrackingMemoryPool() {
+  // Reservations that weren't released explicitly.
+  DetachFromBudget();
+}
+
+void TrackingMemoryPool::DetachFromBudget() {
+  int64_t bytes = 0;
+  {
+    absl::MutexLock l(&budget_mu_);
+    if (detached_) {
+      return;
+    }
+    detached_ = true;
+    bytes = budget_bytes_;
+    budget_bytes_ = 0;
+  }
+  if (bytes != 0) {
+    budget_.Release(bytes);
+  }
+}
+
+arrow::Status TrackingMemoryPool::Reserve(const int64_t bytes) {
+  const int64_t total = bytes_allocated_ += bytes;
+  if (total > limit_bytes_) {
+    bytes_allocated_ -= bytes;
+    limit_exceeded_ = true;
+    return arrow::Status::OutOfMemory("Query exceeds its memory limit of ",
+                                      limit_bytes_, " bytes");
+  }
+  {
+    absl::MutexLock l(&budget_mu_);
+    if (!detached_) {
+      budget_bytes_ += bytes;
+      budget_.ForceReserve(bytes);
+    }
+  }
+
+  int64_t max_memory = max_memory_;
+  while (total > max_memory &&
+         !max_memory_.compare_exchange_weak(max_memory, total)) {
+  }
+  return arrow::Status::OK();
+}
+
+void TrackingMemoryPool::Release(const int64_t bytes) {
+  bytes_allocated_ -= bytes;
+  {
+    absl::MutexLock l(&budget_mu_);
+    if (detached_) {
+      return;
+    }
+    budget_bytes_ -= bytes;
+  }
+  budget_.Release(bytes);
+}
+
+arrow::Status TrackingMemoryPool::Allocate(const int64_t size,
+                                           uint8_t** const out) {
+  ARROW_RETURN_NOT_OK(Reserve(size));
+  if (auto status = parent_.Allocate(size, out); !status.ok()) {
+    Release(size);
+    return status;
+  }
+  return arrow::Status::OK();
+}
+
+arrow::Status TrackingMemoryPool::Reallocate(const int64_t old_size,
+                                             const int64_t new_size,
+                                             uint8_t** const ptr) {
+  const int64_t growth = new_size - old_size;
+  if (growth > 0) {
+    ARROW_RETURN_NOT_OK(Reserve(growth));
+  }
+  if (auto status = parent_.Reallocate(old_size, new_size, ptr);
+      !status.ok()) {
+    if (growth > 0) {
+      Release(growth);
+    }
+    return status;
+  }
+  if (growth < 0) {
+    Release(-growth);
+  }
+  return arrow::Status::OK();
+}
+
+void TrackingMemoryPool::Free(uint8_t* const buffer, const int64_t size) {
+  parent_.Free(buffer, size);
+  Release(size);
+}
+
+}  // namespace seqr
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <absl/base/thread_annotations.h>
+#include <absl/status/status.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
+#include <arrow/memory_pool.h>
+#include <arrow/status.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+namespace seqr {
+
+// A byte budget that's shared by all queries, to keep the server within its
+// memory limit. Work is admitted by reserving its estimated footprint upfront,
+// while memory that has already been allocated is counted unconditionally.
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(const int64_t limit_bytes)
+      : limit_bytes_(limit_bytes) {}
+
+  MemoryBudget(const MemoryBudget&) = delete;
+  MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+  // Fails the reservations that are still waiting.
+  ~MemoryBudget();
+
+  int64_t limit_bytes() const { return limit_bytes_; }
+
+  int64_t reserved_bytes() const {
+    absl::MutexLock l(&mu_);
+    return reserved_bytes_;
+  }
+
+  // Reserves the given number of bytes once they fit into the budget and
+  // then calls `done` with OK, without blocking the caller. Waiting
+  // reservations are admitted in the order they were made, so large ones
+  // don't starve. `done` gets RESOURCE_EXHAUSTED if the bytes exceed the
+  // whole budget or don't fit within the timeout. It runs inline, on the
+  // thread that releases memory or on the budget's timer thread, so it must
+  // not block.
+  //
+  // The owner identifies the reservation for CancelReservations.
+  void ReserveAsync(int64_t bytes, absl::Duration timeout, const void* owner,
+                    std::function<void(absl::Status)> done);
+
+  // Fails the waiting reservations of the given owner with the given status.
+  // Their callbacks have run by the time this returns.
+  void CancelReservations(const void* owner, const absl::Status& status);
+
+  // Like ReserveAsync, but waits for the reservation.
+  absl::Status Reserve(int64_t bytes, absl::Duration timeout);
+
+  // Reserves the given number of bytes without waiting, even if that exceeds
+  // the budget.
+  void ForceReserve(int64_t bytes);
+
+  void Release(int64_t bytes);
+
+ private:
+  struct Waiter {
+    int64_t bytes = 0;
+    absl::Time deadline;
+    const void* owner = nullptr;
+    std::function<void(absl::Status)> done;
+  };
+
+  // Callbacks of finished reservations, which run without holding the lock.
+  using Callbacks =
+      std::vector<std::pair<std::function<void(absl::Status)>, absl::Status>>;
+
+  // Fails the waiters whose deadline passed and admits the ones that fit, in
+  // order.
+  Callbacks TakeFinishedWaiters() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  absl::Status TimeoutError(int64_t bytes) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Fails waiters once their deadline passes, even if no memory gets
+  // released in the meantime.
+  void RunTimer();
+
+  const int64_t limit_bytes_;
+  mutable absl::Mutex mu_;
+  int64_t reserved_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+  std::list<Waiter> waiters_ ABSL_GUARDED_BY(mu_);
+  // Started with the first waiter that has a deadline.
+  std::thread timer_ ABSL_GUARDED_BY(mu_);
+  absl::CondVar waiters_changed_;
+  bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+};
+
+// A memory pool for the allocations of a single query. Allocations are
+// forwarded to a parent pool and counted towards the shared budget. Once the
+// query would exceed its own limit, allocations fail with an out-of-memory
+// error, so a single large query can't take down the server.
+//
+// Buffers keep a pointer to the pool that allocated them, so the pool has to
+// outlive them. Data that's shared across queries, like cached record
+// batches, therefore holds a reference to the pool it was allocated from.
+// Once the query is done, the pool gets detached from the budget, so such
+// data is only bounded by its cache from then on.
+class TrackingMemoryPool : public arrow::MemoryPool {
+ public:
+  TrackingMemoryPool(MemoryBudget* budget, int64_t limit_bytes,
+                     arrow::MemoryPool* parent = arrow::default_memory_pool());
+
+  ~TrackingMemoryPool() override;
+
+  // Counts memory that isn't allocated through the pool, like downloaded
+  // files, towards the query.
+  arrow::Status Reserve(int64_t bytes);
+  void Release(int64_t bytes);
+
+  // Stops counting the pool's memory towards the budget, releasing what's
+  // currently counted.
+  void DetachFromBudget();
+
+  // Whether any reservation or allocation failed because of the limit.
+  bool limit_exceeded() const { return limit_exceeded_; }
+
+  int64_t limit_bytes() const { return limit_bytes_; }
+
+  arrow::Status Allocate(int64_t size, uint8_t** out) override;
+  arrow::Status Reallocate(int64_t old_size, int64_t new_size,
+                           uint8_t** ptr) override;
+  void Free(uint8_t* buffer, int64_t size) override;
+
+  // Includes reservations.
+  int64_t bytes_allocated() const override { return bytes_allocated_; }
+  int64_t max_memory() const override { return max_memory_; }
+  std::string backend_name() const override { return parent_.backend_name(); }
+
+ private:
+  MemoryBudget& budget_;
+  const int64_t limit_bytes_;
+  arrow::MemoryPool& parent_;
+  std::atomic<int64_t> bytes_allocated_ = 0;
+  std::atomic<int64_t> max_memory_ = 0;
+  std::atomic<bool> limit_exceeded_ = false;
+  // Guards the bytes counted towards the budget, so detaching doesn't race
+  // with releases.
+  absl::Mutex budget_mu_;
+  int64_t budget_bytes_ ABSL_GUARDED_BY(budget_mu_) = 0;
+  bool detached_ ABSL_GUARDED_BY(budget_mu_) = false;
+};
+
+}  // namespace seqr
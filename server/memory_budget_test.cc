@@ -0,0 +1,135 @@
+#include "memory_budget.h"
+
+#include <absl/synchronization/notification.h>
+#include <arrow/buffer.h>
+#include <arrow/testing/gtest_util.h>
+#include <gtest/gtest.h>
+
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+namespace seqr {
+
+TEST(MemoryBudget, ReservesWithinLimit) {
+  MemoryBudget budget(100);
+  EXPECT_TRUE(budget.Reserve(60, absl::ZeroDuration()).ok());
+  EXPECT_EQ(budget.reserved_bytes(), 60);
+
+  // Doesn't fit until the first reservation is released.
+  EXPECT_TRUE(
+      absl::IsResourceExhausted(budget.Reserve(60, absl::ZeroDuration())));
+  budget.Release(60);
+  EXPECT_TRUE(budget.Reserve(60, absl::ZeroDuration()).ok());
+
+  // Allocations that already happened are counted regardless.
+  budget.ForceReserve(60);
+  EXPECT_EQ(budget.reserved_bytes(), 120);
+
+  // Never fits.
+  EXPECT_TRUE(
+      absl::IsResourceExhausted(budget.Reserve(101, absl::InfiniteDuration())));
+}
+
+TEST(MemoryBudget, WaitsForReleases) {
+  MemoryBudget budget(100);
+  ASSERT_TRUE(budget.Reserve(100, absl::ZeroDuration()).ok());
+  std::thread releaser([&budget] {
+    absl::SleepFor(absl::Milliseconds(10));
+    budget.Release(50);
+  });
+  EXPECT_TRUE(budget.Reserve(50, absl::InfiniteDuration()).ok());
+  releaser.join();
+  EXPECT_EQ(budget.reserved_bytes(), 100);
+}
+
+TEST(MemoryBudget, AdmitsAsyncReservationsInOrder) {
+  MemoryBudget budget(100);
+  budget.ForceReserve(100);
+  std::vector<int> admitted;
+  budget.ReserveAsync(60, absl::InfiniteDuration(), /* owner */ nullptr,
+                      [&admitted](const absl::Status& status) {
+                        EXPECT_TRUE(status.ok()) << status;
+                        admitted.push_back(1);
+                      });
+  budget.ReserveAsync(20, absl::InfiniteDuration(), /* owner */ nullptr,
+                      [&admitted](const absl::Status& status) {
+                        EXPECT_TRUE(status.ok()) << status;
+                        admitted.push_back(2);
+                      });
+  EXPECT_TRUE(admitted.empty());
+
+  // The second reservation would fit, but waits for the first one.
+  budget.Release(30);
+  EXPECT_TRUE(admitted.empty());
+  budget.Release(50);
+  EXPECT_EQ(admitted, (std::vector<int>{1, 2}));
+  EXPECT_EQ(budget.reserved_bytes(), 100);
+}
+
+TEST(MemoryBudget, CancelsAndTimesOutAsyncReservations) {
+  MemoryBudget budget(100);
+  budget.ForceReserve(100);
+  const int owner = 0;
+  absl::Status cancelled;
+  budget.ReserveAsync(10, absl::InfiniteDuration(), &owner,
+                      [&cancelled](const absl::Status& status) {
+                        cancelled = status;
+                      });
+  budget.CancelReservations(&owner, absl::CancelledError("Query failed"));
+  EXPECT_TRUE(absl::IsCancelled(cancelled)) << cancelled;
+
+  // Fails without any memory getting released.
+  absl::Notification timed_out;
+  budget.ReserveAsync(10, absl::Milliseconds(10), &owner,
+                      [&timed_out](const absl::Status& status) {
+                        EXPECT_TRUE(absl::IsResourceExhausted(status))
+                            << status;
+                        timed_out.Notify();
+                      });
+  timed_out.WaitForNotification();
+  EXPECT_EQ(budget.reserved_bytes(), 100);
+}
+
+TEST(TrackingMemoryPool, CountsAllocations) {
+  MemoryBudget budget(1 << 20);
+  {
+    TrackingMemoryPool pool(&budget, 1024);
+    ASSERT_OK_AND_ASSIGN(auto buffer, arrow::AllocateResizableBuffer(512,
+                                                                     &pool));
+    EXPECT_GE(pool.bytes_allocated(), 512);
+    EXPECT_EQ(budget.reserved_bytes(), pool.bytes_allocated());
+
+    ASSERT_OK(pool.Reserve(256));
+    EXPECT_EQ(budget.reserved_bytes(), pool.bytes_allocated());
+
+    // Exceeds the query's limit.
+    EXPECT_FALSE(pool.limit_exceeded());
+    EXPECT_TRUE(buffer->Resize(1024).IsOutOfMemory());
+    EXPECT_TRUE(pool.limit_exceeded());
+
+    pool.Release(256);
+    buffer.reset();
+    EXPECT_EQ(pool.bytes_allocated(), 0);
+    EXPECT_GE(pool.max_memory(), 768);
+    ASSERT_OK(pool.Reserve(100));
+  }
+  // Outstanding reservations are released with the pool.
+  EXPECT_EQ(budget.reserved_bytes(), 0);
+}
+
+TEST(TrackingMemoryPool, DetachesFromBudget) {
+  MemoryBudget budget(1 << 20);
+  TrackingMemoryPool pool(&budget, 1024);
+  ASSERT_OK_AND_ASSIGN(auto buffer, arrow::AllocateBuffer(512, &pool));
+  EXPECT_EQ(budget.reserved_bytes(), pool.bytes_allocated());
+
+  // Memory that outlives the query, like cached record batches, isn't
+  // counted anymore, and freeing it doesn't release it twice.
+  pool.DetachFromBudget();
+  EXPECT_EQ(budget.reserved_bytes(), 0);
+  buffer.reset();
+  EXPECT_EQ(pool.bytes_allocated(), 0);
+  EXPECT_EQ(budget.reserved_bytes(), 0);
+}
+
+}  // namespace seqr
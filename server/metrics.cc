@@ -0,0 +1,312 @@
+#include "metrics.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+namespace seqr {
+
+namespace metrics_internal {
+
+int ThreadShard() {
+  static std::atomic<int> next_shard = 0;
+  thread_local const int shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % kNumShards;
+  return shard;
+}
+
+}  // namespace metrics_internal
+
+namespace {
+
+// Returns the name without labels.
+std::string_view FamilyName(const std::string_view name) {
+  return name.substr(0, name.find('{'));
+}
+
+// Returns a series name with a suffix and optionally another label, e.g.
+// `x_bucket{a="b",le="1"}` for `x{a="b"}`.
+std::string SeriesName(const std::string_view name,
+                       const std::string_view suffix,
+                       const std::string_view label = {}) {
+  const std::string_view family = FamilyName(name);
+  std::string_view labels = name.substr(family.size());
+  if (!labels.empty()) {
+    labels = labels.substr(1, labels.size() - 2);
+  }
+  std::string result = absl::StrCat(family, suffix);
+  if (!labels.empty() || !label.empty()) {
+    absl::StrAppend(&result, "{", labels,
+                    !labels.empty() && !label.empty() ? "," : "", label, "}");
+  }
+  return result;
+}
+
+std::string FormatValue(const double value) {
+  return absl::StrFormat("%.12g", value);
+}
+
+// Calls the function for all entries of the map whose name belongs to the
+// family.
+template <typename Map, typename Function>
+void ForEachInFamily(const Map& map, const std::string& family,
+                     const Function& function) {
+  for (auto it = map.lower_bound(family);
+       it != map.end() && it->first.compare(0, family.size(), family) == 0;
+       ++it) {
+    if (FamilyName(it->first) == family) {
+      function(it->first, it->second);
+    }
+  }
+}
+
+void AppendHistogram(const std::string& name, const Histogram& histogram,
+                     std::string* const text) {
+  const auto snapshot = histogram.GetSnapshot();
+  int last_bucket = 0;
+  for (int i = 0; i < Histogram::kNumBuckets; ++i) {
+    if (snapshot.counts[i] > 0) {
+      last_bucket = i;
+    }
+  }
+  // Buckets are cumulative, with a bound per power of two. Bucket bounds are
+  // powers of two as well, so each histogram bucket falls below exactly one
+  // exported bound. The exported count for bound b is of values below b
+  // rather than up to it, which only differs for integers that are exactly b.
+  const uint64_t max_bound = std::bit_ceil(
+      static_cast<uint64_t>(Histogram::BucketUpperBound(last_bucket)));
+  int64_t cumulative = 0;
+  int bucket = 0;
+  for (uint64_t bound = 1; bound <= max_bound && bound != 0; bound <<= 1) {
+    while (bucket < Histogram::kNumBuckets &&
+           static_cast<uint64_t>(Histogram::BucketUpperBound(bucket)) <=
+               bound) {
+      cumulative += snapshot.counts[bucket++];
+    }
+    absl::StrAppend(
+        text,
+        SeriesName(name, "_bucket",
+                   absl::StrCat("le=\"",
+                                FormatValue(static_cast<double>(bound) *
+                                            histogram.unit()),
+                                "\"")),
+        " ", cumulative, "\n");
+  }
+  absl::StrAppend(text, SeriesName(name, "_bucket", "le=\"+Inf\""), " ",
+                  snapshot.count, "\n");
+  absl::StrAppend(text, SeriesName(name, "_sum"), " ",
+                  FormatValue(snapshot.sum * histogram.unit()), "\n");
+  absl::StrAppend(text, SeriesName(name, "_count"), " ", snapshot.count,
+                  "\n");
+}
+
+}  // namespace
+
+int64_t Counter::Value() const {
+  int64_t result = 0;
+  for (const auto& shard : shards_) {
+    result += shard.value.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+void Histogram::Record(const int64_t value) {
+  auto& shard = shards_[metrics_internal::ThreadShard()];
+  const int64_t clamped = std::max<int64_t>(value, 0);
+  shard.counts[BucketIndex(clamped)].fetch_add(1, std::memory_order_relaxed);
+  shard.sum.fetch_add(clamped, std::memory_order_relaxed);
+}
+
+int Histogram::BucketIndex(const int64_t value) {
+  if (value < kSubBuckets) {
+    return std::max<int64_t>(value, 0);
+  }
+  // The position of the highest bit, at least kSubBucketBits. The next
+  // kSubBucketBits bits select the sub-bucket.
+  const int shift = std::bit_width(static_cast<uint64_t>(value)) - 1 -
+                    kSubBucketBits;
+  const int sub_bucket = (value >> shift) - kSubBuckets;
+  return kSubBuckets * (shift + 1) + sub_bucket;
+}
+
+int64_t Histogram::BucketLowerBound(const int index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  const int shift = index / kSubBuckets - 1;
+  return static_cast<int64_t>(kSubBuckets + index % kSubBuckets) << shift;
+}
+
+int64_t Histogram::BucketUpperBound(const int index) {
+  if (index < kSubBuckets) {
+    return index + 1;
+  }
+  const int shift = index / kSubBuckets - 1;
+  const uint64_t upper = static_cast<uint64_t>(BucketLowerBound(index)) +
+                         (uint64_t{1} << shift);
+  // The upper bound of the last bucket doesn't fit.
+  return std::min<uint64_t>(upper, std::numeric_limits<int64_t>::max());
+}
+
+Histogram::Snapshot Histogram::GetSnapshot() const {
+  Snapshot result;
+  result.counts.resize(kNumBuckets);
+  for (const auto& shard : shards_) {
+    for (int i = 0; i < kNumBuckets; ++i) {
+      const int64_t count = shard.counts[i].load(std::memory_order_relaxed);
+      result.counts[i] += count;
+      result.count += count;
+    }
+    result.sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+int64_t Histogram::Snapshot::Percentile(const double percentile) const {
+  if (count == 0) {
+    return 0;
+  }
+  const int64_t rank = std::clamp<int64_t>(
+      static_cast<int64_t>(std::ceil(percentile / 100 * count)), 1, count);
+  int64_t cumulative = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    cumulative += counts[i];
+    if (cumulative >= rank) {
+      return BucketUpperBound(i) - 1;
+    }
+  }
+  return BucketUpperBound(kNumBuckets - 1) - 1;
+}
+
+MetricsRegistry& MetricsRegistry::Default() {
+  static auto* const result = new MetricsRegistry();
+  return *result;
+}
+
+void MetricsRegistry::AddFamily(const std::string_view name, const Type type,
+                                const std::string_view help) {
+  const auto it = families_
+                      .try_emplace(std::string(FamilyName(name)),
+                                   Family{type, std::string(help)})
+                      .first;
+  assert(it->second.type == type && "Metric registered with another type");
+  (void)it;
+}
+
+Counter* MetricsRegistry::GetCounter(const std::string_view name,
+                                     const std::string_view help) {
+  absl::MutexLock lock(&mu_);
+  AddFamily(name, Type::kCounter, help);
+  auto& result = counters_[std::string(name)];
+  if (result == nullptr) {
+    result = std::make_unique<Counter>();
+  }
+  return result.get();
+}
+
+Gauge* MetricsRegistry::GetGauge(const std::string_view name,
+                                 const std::string_view help) {
+  absl::MutexLock lock(&mu_);
+  AddFamily(name, Type::kGauge, help);
+  auto& result = gauges_[std::string(name)];
+  if (result == nullptr) {
+    result = std::make_unique<Gauge>();
+  }
+  return result.get();
+}
+
+Histogram* MetricsRegistry::GetHistogram(const std::string_view name,
+                                         const std::string_view help,
+                                         const double unit) {
+  absl::MutexLock lock(&mu_);
+  AddFamily(name, Type::kHistogram, help);
+  auto& result = histograms_[std::string(name)];
+  if (result == nullptr) {
+    result = std::make_unique<Histogram>(unit);
+  }
+  return result.get();
+}
+
+MetricsRegistry::CallbackRegistration::~CallbackRegistration() {
+  absl::MutexLock lock(&registry_.mu_);
+  registry_.callbacks_.erase(id_);
+}
+
+std::unique_ptr<MetricsRegistry::CallbackRegistration>
+MetricsRegistry::AddGaugeCallback(const std::string_view name,
+                                  const std::string_view help,
+                                  std::function<double()> callback) {
+  return AddCallback(name, Type::kGauge, help, std::move(callback));
+}
+
+std::unique_ptr<MetricsRegistry::CallbackRegistration>
+MetricsRegistry::AddCounterCallback(const std::string_view name,
+                                    const std::string_view help,
+                                    std::function<double()> callback) {
+  return AddCallback(name, Type::kCounter, help, std::move(callback));
+}
+
+std::unique_ptr<MetricsRegistry::CallbackRegistration>
+MetricsRegistry::AddCallback(const std::string_view name, const Type type,
+                             const std::string_view help,
+                             std::function<double()> callback) {
+  absl::MutexLock lock(&mu_);
+  AddFamily(name, type, help);
+  const uint64_t id = next_callback_id_++;
+  callbacks_.emplace(id, Callback{std::string(name), std::move(callback)});
+  return std::make_unique<CallbackRegistration>(this, id);
+}
+
+std::string MetricsRegistry::ExportText() const {
+  absl::MutexLock lock(&mu_);
+  // Callback values by name, summed.
+  absl::btree_map<std::string, double> callback_values;
+  for (const auto& [id, callback] : callbacks_) {
+    callback_values[callback.name] += callback.callback();
+  }
+
+  std::string result;
+  for (const auto& [family, info] : families_) {
+    absl::StrAppend(&result, "# HELP ", family, " ", info.help, "\n");
+    switch (info.type) {
+      case Type::kCounter:
+        absl::StrAppend(&result, "# TYPE ", family, " counter\n");
+        ForEachInFamily(counters_, family,
+                        [&](const std::string& name, const auto& counter) {
+                          absl::StrAppend(&result, name, " ",
+                                          counter->Value(), "\n");
+                        });
+        break;
+      case Type::kGauge:
+        absl::StrAppend(&result, "# TYPE ", family, " gauge\n");
+        ForEachInFamily(gauges_, family,
+                        [&](const std::string& name, const auto& gauge) {
+                          absl::StrAppend(&result, name, " ", gauge->Value(),
+                                          "\n");
+                        });
+        break;
+      case Type::kHistogram:
+        absl::StrAppend(&result, "# TYPE ", family, " histogram\n");
+        ForEachInFamily(histograms_, family,
+                        [&](const std::string& name, const auto& histogram) {
+                          AppendHistogram(name, *histogram, &result);
+                        });
+        break;
+    }
+    ForEachInFamily(callback_values, family,
+                    [&](const std::string& name, const double value) {
+                      absl::StrAppend(&result, name, " ", FormatValue(value),
+                                      "\n");
+                    });
+  }
+  return result;
+}
+
+}  // namespace seqr
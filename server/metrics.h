@@ -0,0 +1,222 @@
+#pragma once
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/btree_map.h>
+#include <absl/synchronization/mutex.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace seqr {
+
+namespace metrics_internal {
+
+// Updates are spread over this many shards, each on its own cache line. A
+// thread always updates the same shard, so threads only contend if they
+// share one.
+constexpr int kNumShards = 16;
+
+// Returns the shard of the current thread.
+int ThreadShard();
+
+}  // namespace metrics_internal
+
+// A count that only goes up, e.g. of requests or bytes. Lock-free.
+class Counter {
+ public:
+  Counter() = default;
+
+  Counter(const Counter&) = delete;
+  Counter& operator=(const Counter&) = delete;
+
+  void Add(const int64_t value = 1) {
+    shards_[metrics_internal::ThreadShard()].value.fetch_add(
+        value, std::memory_order_relaxed);
+  }
+
+  int64_t Value() const;
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<int64_t> value = 0;
+  };
+
+  std::array<Shard, metrics_internal::kNumShards> shards_;
+};
+
+// A value that goes up and down, e.g. a queue depth. Lock-free.
+class Gauge {
+ public:
+  Gauge() = default;
+
+  Gauge(const Gauge&) = delete;
+  Gauge& operator=(const Gauge&) = delete;
+
+  void Set(const int64_t value) {
+    value_.store(value, std::memory_order_relaxed);
+  }
+
+  void Add(const int64_t value) {
+    value_.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  int64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_ = 0;
+};
+
+// The distribution of non-negative values, e.g. latencies in nanoseconds.
+// Like an HDR histogram, buckets are log-linear: each power of two is split
+// into kSubBuckets buckets of equal width, so any recorded value is known
+// within 1/kSubBuckets of its magnitude, from nanoseconds to hours. Recording
+// is lock-free.
+class Histogram {
+ public:
+  static constexpr int kSubBucketBits = 3;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  // Values below kSubBuckets have a bucket each, followed by kSubBuckets per
+  // power of two up to 2^63.
+  static constexpr int kNumBuckets = kSubBuckets * (64 - kSubBucketBits);
+
+  // Values are multiplied by `unit` when exported, e.g. 1e-9 for nanoseconds
+  // that are exported as seconds.
+  explicit Histogram(double unit = 1) : unit_(unit) {}
+
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  // Negative values are recorded as 0.
+  void Record(int64_t value);
+
+  double unit() const { return unit_; }
+
+  // Returns the bucket of a value, and the range [lower, upper) of values in
+  // a bucket.
+  static int BucketIndex(int64_t value);
+  static int64_t BucketLowerBound(int index);
+  static int64_t BucketUpperBound(int index);
+
+  struct Snapshot {
+    std::vector<int64_t> counts;  // By bucket.
+    int64_t count = 0;
+    int64_t sum = 0;
+
+    // Returns the largest value of the bucket that contains the given
+    // percentile (between 0 and 100), or 0 if nothing was recorded.
+    int64_t Percentile(double percentile) const;
+  };
+
+  // The buckets are read one by one while values may get recorded, so the
+  // snapshot isn't necessarily consistent.
+  Snapshot GetSnapshot() const;
+
+ private:
+  struct alignas(64) Shard {
+    std::array<std::atomic<int64_t>, kNumBuckets> counts{};
+    std::atomic<int64_t> sum = 0;
+  };
+
+  const double unit_;
+  std::array<Shard, metrics_internal::kNumShards> shards_;
+};
+
+// Holds the metrics of the process and exports them in the Prometheus text
+// format. Metrics are created on first use and live as long as the registry,
+// so callers typically look them up once and keep the pointer.
+//
+// Names follow the Prometheus conventions and may include labels, e.g.
+// `seqr_scheduler_tasks_total{pool="io"}`. Metrics with the same name but
+// different labels need to be of the same type, and share the help text of
+// the first one. Thread-safe.
+class MetricsRegistry {
+ public:
+  // The registry that the server's instrumentation uses.
+  static MetricsRegistry& Default();
+
+  MetricsRegistry() = default;
+
+  MetricsRegistry(const MetricsRegistry&) = delete;
+  MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+  Counter* GetCounter(std::string_view name, std::string_view help);
+  Gauge* GetGauge(std::string_view name, std::string_view help);
+  Histogram* GetHistogram(std::string_view name, std::string_view help,
+                          double unit = 1);
+
+  // Unregisters a callback when destroyed.
+  class CallbackRegistration {
+   public:
+    CallbackRegistration(MetricsRegistry* registry, uint64_t id)
+        : registry_(*registry), id_(id) {}
+
+    CallbackRegistration(const CallbackRegistration&) = delete;
+    CallbackRegistration& operator=(const CallbackRegistration&) = delete;
+
+    ~CallbackRegistration();
+
+   private:
+    MetricsRegistry& registry_;
+    const uint64_t id_;
+  };
+
+  // Registers a metric whose value is computed on export, for state that's
+  // tracked elsewhere already, like cache statistics. Callbacks with the
+  // same name are summed. They're called while the registry is locked, so
+  // they must not access it.
+  [[nodiscard]] std::unique_ptr<CallbackRegistration> AddGaugeCallback(
+      std::string_view name, std::string_view help,
+      std::function<double()> callback);
+  [[nodiscard]] std::unique_ptr<CallbackRegistration> AddCounterCallback(
+      std::string_view name, std::string_view help,
+      std::function<double()> callback);
+
+  // Returns all metrics in the Prometheus text exposition format, sorted by
+  // name. Histograms are exported with a bucket per power of two up to their
+  // largest value.
+  std::string ExportText() const;
+
+ private:
+  enum class Type { kCounter, kGauge, kHistogram };
+
+  struct Family {
+    Type type;
+    std::string help;
+  };
+
+  struct Callback {
+    std::string name;
+    std::function<double()> callback;
+  };
+
+  // Registers the family of a metric name, unless it exists already, which
+  // has to be with the same type.
+  void AddFamily(std::string_view name, Type type, std::string_view help)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  std::unique_ptr<CallbackRegistration> AddCallback(
+      std::string_view name, Type type, std::string_view help,
+      std::function<double()> callback);
+
+  mutable absl::Mutex mu_;
+  // By name without labels.
+  absl::btree_map<std::string, Family> families_ ABSL_GUARDED_BY(mu_);
+  // By name with labels.
+  absl::btree_map<std::string, std::unique_ptr<Counter>> counters_
+      ABSL_GUARDED_BY(mu_);
+  absl::btree_map<std::string, std::unique_ptr<Gauge>> gauges_
+      ABSL_GUARDED_BY(mu_);
+  absl::btree_map<std::string, std::unique_ptr<Histogram>> histograms_
+      ABSL_GUARDED_BY(mu_);
+  // By registration ID.
+  absl::btree_map<uint64_t, Callback> callbacks_ ABSL_GUARDED_BY(mu_);
+  uint64_t next_callback_id_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace seqr
@@ -0,0 +1,111 @@
+#include "metrics.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+namespace seqr {
+
+TEST(Counter, SumsAcrossThreads) {
+  Counter counter;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&counter] {
+      for (int j = 0; j < 10000; ++j) {
+        counter.Add();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  counter.Add(5);
+  EXPECT_EQ(counter.Value(), 80005);
+}
+
+TEST(Histogram, BucketsContainTheirValues) {
+  for (const int64_t value :
+       {int64_t{0}, int64_t{1}, int64_t{7}, int64_t{8}, int64_t{15},
+        int64_t{16}, int64_t{17}, int64_t{1000}, int64_t{123456789},
+        std::numeric_limits<int64_t>::max()}) {
+    const int index = Histogram::BucketIndex(value);
+    ASSERT_GE(index, 0);
+    ASSERT_LT(index, Histogram::kNumBuckets);
+    EXPECT_LE(Histogram::BucketLowerBound(index), value) << value;
+    if (value < std::numeric_limits<int64_t>::max()) {
+      EXPECT_GT(Histogram::BucketUpperBound(index), value) << value;
+    }
+  }
+  // Consecutive buckets are adjacent.
+  for (int i = 1; i < Histogram::kNumBuckets; ++i) {
+    EXPECT_EQ(Histogram::BucketLowerBound(i),
+              Histogram::BucketUpperBound(i - 1));
+    EXPECT_EQ(Histogram::BucketIndex(Histogram::BucketLowerBound(i)), i);
+  }
+}
+
+TEST(Histogram, ComputesPercentiles) {
+  Histogram histogram;
+  for (int64_t value = 1; value <= 1000; ++value) {
+    histogram.Record(value);
+  }
+  histogram.Record(-5);
+  const auto snapshot = histogram.GetSnapshot();
+  EXPECT_EQ(snapshot.count, 1001);
+  EXPECT_EQ(snapshot.sum, 500500);
+  // Within the bucket width of an eighth of the magnitude.
+  EXPECT_NEAR(snapshot.Percentile(50), 500, 500 / 8);
+  EXPECT_NEAR(snapshot.Percentile(99), 990, 990 / 8);
+  EXPECT_EQ(snapshot.Percentile(0), 0);
+  EXPECT_GE(snapshot.Percentile(100), 1000);
+  EXPECT_EQ(Histogram().GetSnapshot().Percentile(50), 0);
+}
+
+TEST(MetricsRegistry, ExportsText) {
+  MetricsRegistry registry;
+  registry.GetCounter("requests_total{method=\"a\"}", "Requests.")->Add(2);
+  registry.GetCounter("requests_total{method=\"b\"}", "Ignored.")->Add(3);
+  registry.GetGauge("queued", "Queued tasks.")->Set(4);
+  auto* const histogram =
+      registry.GetHistogram("latency_seconds{method=\"a\"}", "Latency.", 0.5);
+  histogram->Record(1);
+  histogram->Record(3);
+  EXPECT_EQ(registry.GetCounter("requests_total{method=\"a\"}", "")->Value(),
+            2);
+
+  EXPECT_EQ(registry.ExportText(),
+            "# HELP latency_seconds Latency.\n"
+            "# TYPE latency_seconds histogram\n"
+            "latency_seconds_bucket{method=\"a\",le=\"0.5\"} 0\n"
+            "latency_seconds_bucket{method=\"a\",le=\"1\"} 1\n"
+            "latency_seconds_bucket{method=\"a\",le=\"2\"} 2\n"
+            "latency_seconds_bucket{method=\"a\",le=\"+Inf\"} 2\n"
+            "latency_seconds_sum{method=\"a\"} 2\n"
+            "latency_seconds_count{method=\"a\"} 2\n"
+            "# HELP queued Queued tasks.\n"
+            "# TYPE queued gauge\n"
+            "queued 4\n"
+            "# HELP requests_total Requests.\n"
+            "# TYPE requests_total counter\n"
+            "requests_total{method=\"a\"} 2\n"
+            "requests_total{method=\"b\"} 3\n");
+}
+
+TEST(MetricsRegistry, SumsCallbacksUntilUnregistered) {
+  MetricsRegistry registry;
+  auto first = registry.AddGaugeCallback("bytes", "Bytes.", [] { return 1; });
+  {
+    auto second =
+        registry.AddGaugeCallback("bytes", "Bytes.", [] { return 2.5; });
+    EXPECT_EQ(registry.ExportText(),
+              "# HELP bytes Bytes.\n# TYPE bytes gauge\nbytes 3.5\n");
+  }
+  EXPECT_EQ(registry.ExportText(),
+            "# HELP bytes Bytes.\n# TYPE bytes gauge\nbytes 1\n");
+}
+
+}  // namespace seqr
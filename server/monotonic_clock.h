@@ -0,0 +1,16 @@
+#pragma once
+
+#include <chrono>  // NOLINT(build/c++11)
+#include <cstdint>
+
+namespace seqr {
+
+// Returns the current time of a monotonic clock in nanoseconds, for measuring
+// durations. Cheap enough to call per record batch.
+inline int64_t MonotonicNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace seqr
@@ -0,0 +1,252 @@
+#include "prepared_query.h"
+
+#include <absl/strings/escaping.h>
+#include <absl/strings/str_cat.h>
+
+#include <algorithm>
+#include <optional>
+#include <utility>
+
+#include "sha256.h"
+
+namespace seqr {
+namespace cp = arrow::compute;
+namespace {
+
+// Bindings are approximated by the size of their parameter values.
+constexpr size_t kBindingCacheBytes = 1 << 20;
+
+bool HasParameters(const QueryRequest::Expression& expression) {
+  switch (expression.type_case()) {
+    case QueryRequest::Expression::kParameter:
+      return true;
+    case QueryRequest::Expression::kCall: {
+      const auto& call = expression.call();
+      if (call.has_set_lookup_options() &&
+          !call.set_lookup_options().values_parameter().empty()) {
+        return true;
+      }
+      return std::any_of(call.arguments().begin(), call.arguments().end(),
+                         HasParameters);
+    }
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+struct PreparedQuery::Node {
+  // Subtrees without parameters are built when preparing.
+  std::optional<cp::Expression> expression;
+  // The name of a parameter in place of a literal.
+  std::string parameter;
+  // For calls that contain parameters.
+  std::string function_name;
+  std::vector<std::unique_ptr<Node>> arguments;
+  std::shared_ptr<cp::FunctionOptions> options;
+  // The name of a parameter in place of set lookup values.
+  std::string values_parameter;
+};
+
+struct PreparedQuery::Binding {
+  size_t SizeBytes() const { return size_bytes; }
+
+  std::shared_ptr<const ScannerOptions> scanner_options;
+  size_t size_bytes = 0;
+};
+
+std::string PreparedQuery::Id(const PrepareRequest& request) {
+  // Executions only pass the ID, so different queries must never share one.
+  return absl::BytesToHexString(Sha256(request.SerializeAsString()));
+}
+
+absl::StatusOr<std::shared_ptr<const PreparedQuery>> PreparedQuery::Prepare(
+    const PrepareRequest& request) {
+  ParameterKinds parameter_kinds;
+  auto filter = Compile(request.filter_expression(), &parameter_kinds);
+  if (!filter.ok()) {
+    return filter.status();
+  }
+  return std::shared_ptr<const PreparedQuery>(new PreparedQuery(
+      request, *std::move(filter), std::move(parameter_kinds)));
+}
+
+PreparedQuery::PreparedQuery(const PrepareRequest& request,
+                             std::unique_ptr<Node> filter,
+                             ParameterKinds parameter_kinds)
+    : projection_columns_(request.projection_columns().begin(),
+                          request.projection_columns().end()),
+      filter_(std::move(filter)),
+      parameter_kinds_(std::move(parameter_kinds)),
+      size_bytes_(request.ByteSizeLong() + kBindingCacheBytes),
+      bindings_(kBindingCacheBytes) {}
+
+PreparedQuery::~PreparedQuery() = default;
+
+absl::StatusOr<std::unique_ptr<PreparedQuery::Node>> PreparedQuery::Compile(
+    const QueryRequest::Expression& expression,
+    ParameterKinds* const parameter_kinds) {
+  const auto add_parameter = [parameter_kinds](
+                                 const std::string& name,
+                                 const ParameterKind kind) -> absl::Status {
+    if (name.empty()) {
+      return absl::InvalidArgumentError("Parameter names must not be empty");
+    }
+    const auto [it, inserted] = parameter_kinds->emplace(name, kind);
+    if (!inserted && it->second != kind) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Parameter ", name, " is used both as a literal and a value set"));
+    }
+    return absl::OkStatus();
+  };
+
+  auto node = std::make_unique<Node>();
+  if (!HasParameters(expression)) {
+    auto built_expression = BuildFilterExpression(expression);
+    if (!built_expression.ok()) {
+      return built_expression.status();
+    }
+    node->expression = *std::move(built_expression);
+    return node;
+  }
+
+  if (expression.type_case() == QueryRequest::Expression::kParameter) {
+    if (const auto status =
+            add_parameter(expression.parameter(), ParameterKind::kLiteral);
+        !status.ok()) {
+      return status;
+    }
+    node->parameter = expression.parameter();
+    return node;
+  }
+
+  // Otherwise only calls contain parameters.
+  const auto& call = expression.call();
+  node->function_name = call.function_name();
+  for (const auto& argument : call.arguments()) {
+    auto argument_node = Compile(argument, parameter_kinds);
+    if (!argument_node.ok()) {
+      return argument_node.status();
+    }
+    node->arguments.push_back(*std::move(argument_node));
+  }
+  if (call.has_set_lookup_options()) {
+    const auto& set_lookup_options = call.set_lookup_options();
+    if (!set_lookup_options.values_parameter().empty()) {
+      if (const auto status = add_parameter(
+              set_lookup_options.values_parameter(), ParameterKind::kValueSet);
+          !status.ok()) {
+        return status;
+      }
+      node->values_parameter = set_lookup_options.values_parameter();
+    } else {
+      auto options = BuildSetLookupOptions(set_lookup_options.values());
+      if (!options.ok()) {
+        return options.status();
+      }
+      node->options = *std::move(options);
+    }
+  }
+  return node;
+}
+
+absl::StatusOr<cp::Expression> PreparedQuery::Instantiate(
+    const Node& node, const ExecuteRequest& request) {
+  if (node.expression.has_value()) {
+    return *node.expression;
+  }
+
+  // Parameters have been validated already.
+  if (!node.parameter.empty()) {
+    return BuildLiteral(request.parameters().at(node.parameter).literal());
+  }
+
+  std::vector<cp::Expression> arguments;
+  arguments.reserve(node.arguments.size());
+  for (const auto& argument : node.arguments) {
+    auto expression = Instantiate(*argument, request);
+    if (!expression.ok()) {
+      return expression.status();
+    }
+    arguments.push_back(*std::move(expression));
+  }
+  std::shared_ptr<cp::FunctionOptions> options = node.options;
+  if (!node.values_parameter.empty()) {
+    auto set_lookup_options = BuildSetLookupOptions(
+        request.parameters().at(node.values_parameter).value_set().values());
+    if (!set_lookup_options.ok()) {
+      return set_lookup_options.status();
+    }
+    options = *std::move(set_lookup_options);
+  }
+  return cp::call(node.function_name, std::move(arguments),
+                  std::move(options));
+}
+
+absl::StatusOr<std::shared_ptr<const ScannerOptions>> PreparedQuery::Bind(
+    const ExecuteRequest& request) const {
+  for (const auto& [name, kind] : parameter_kinds_) {
+    const auto it = request.parameters().find(name);
+    if (it == request.parameters().end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Missing parameter ", name));
+    }
+    const auto value_case = it->second.value_case();
+    if (kind == ParameterKind::kLiteral &&
+        value_case != ExecuteRequest::Parameter::kLiteral) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Parameter ", name, " must be a literal"));
+    }
+    if (kind == ParameterKind::kValueSet &&
+        value_case != ExecuteRequest::Parameter::kValueSet) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Parameter ", name, " must be a value set"));
+    }
+  }
+
+  // Parameters are sorted by name, as map iteration order is unspecified.
+  std::vector<std::string> names;
+  for (const auto& [name, parameter] : request.parameters()) {
+    if (!parameter_kinds_.contains(name)) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unknown parameter ", name));
+    }
+    names.push_back(name);
+  }
+  std::sort(names.begin(), names.end());
+  std::string key = absl::StrCat(request.max_rows());
+  for (const auto& name : names) {
+    const std::string value =
+        request.parameters().at(name).SerializeAsString();
+    absl::StrAppend(&key, "#", name.size(), ":", name, value.size(), ":",
+                    value);
+  }
+
+  const auto load_binding =
+      [this, &request, size_bytes = key.size()]()
+      -> absl::StatusOr<std::shared_ptr<const Binding>> {
+    auto filter_expression = Instantiate(*filter_, request);
+    if (!filter_expression.ok()) {
+      return filter_expression.status();
+    }
+    auto scanner_options =
+        BuildScannerOptions(projection_columns_, *std::move(filter_expression),
+                            request.max_rows());
+    if (!scanner_options.ok()) {
+      return scanner_options.status();
+    }
+    auto result = std::make_shared<Binding>();
+    result->scanner_options =
+        std::make_shared<const ScannerOptions>(*std::move(scanner_options));
+    result->size_bytes = size_bytes;
+    return result;
+  };
+  const auto binding = bindings_.GetOrLoad(key, load_binding);
+  if (!binding.ok()) {
+    return binding.status();
+  }
+  return (*binding)->scanner_options;
+}
+
+}  // namespace seqr
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/statusor.h>
+#include <arrow/compute/exec/expression.h>
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lru_cache.h"
+#include "scan.h"
+#include "seqr_query_service.pb.h"
+
+namespace seqr {
+
+// A query whose filter expression may contain parameters in place of literals
+// and set lookup values. Preparing compiles the parts of the filter without
+// parameters once, including their set lookup value sets, so executions only
+// substitute the parameter values. Executions with the same parameter values
+// share their scanner options, and with them the filters bound to each schema
+// (see BoundFilterCache). Thread-safe.
+class PreparedQuery {
+ public:
+  // Returns the ID of the given query. It's derived from the query, so
+  // preparing the same query again, even on another server, gives the same
+  // ID.
+  static std::string Id(const PrepareRequest& request);
+
+  static absl::StatusOr<std::shared_ptr<const PreparedQuery>> Prepare(
+      const PrepareRequest& request);
+
+  PreparedQuery(const PreparedQuery&) = delete;
+  PreparedQuery& operator=(const PreparedQuery&) = delete;
+
+  ~PreparedQuery();
+
+  // Returns scanner options with the parameters of the request bound. Fails
+  // if parameters are missing, unknown or of the wrong kind.
+  absl::StatusOr<std::shared_ptr<const ScannerOptions>> Bind(
+      const ExecuteRequest& request) const;
+
+  // For LruCache.
+  size_t SizeBytes() const { return size_bytes_; }
+
+ private:
+  struct Node;
+  struct Binding;
+  enum class ParameterKind { kLiteral, kValueSet };
+  using ParameterKinds = absl::flat_hash_map<std::string, ParameterKind>;
+
+  PreparedQuery(const PrepareRequest& request, std::unique_ptr<Node> filter,
+                ParameterKinds parameter_kinds);
+
+  static absl::StatusOr<std::unique_ptr<Node>> Compile(
+      const QueryRequest::Expression& expression,
+      ParameterKinds* parameter_kinds);
+
+  static absl::StatusOr<arrow::compute::Expression> Instantiate(
+      const Node& node, const ExecuteRequest& request);
+
+  const std::vector<std::string> projection_columns_;
+  const std::unique_ptr<const Node> filter_;
+  const ParameterKinds parameter_kinds_;
+  const size_t size_bytes_;
+  // By parameter values and max_rows.
+  mutable LruCache<Binding> bindings_;
+};
+
+}  // namespace seqr
@@ -0,0 +1,115 @@
+#include "prepared_query.h"
+
+#include <arrow/compute/exec/expression.h>
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace seqr {
+namespace {
+
+// Prepares `xpos < $max_xpos and is_in(variantId, $variant_ids)`.
+PrepareRequest MakePrepareRequest() {
+  PrepareRequest request;
+  request.add_projection_columns("variantId");
+  auto* const and_call = request.mutable_filter_expression()->mutable_call();
+  and_call->set_function_name("and");
+  auto* const less_call = and_call->add_arguments()->mutable_call();
+  less_call->set_function_name("less");
+  less_call->add_arguments()->set_column("xpos");
+  less_call->add_arguments()->set_parameter("max_xpos");
+  auto* const is_in_call = and_call->add_arguments()->mutable_call();
+  is_in_call->set_function_name("is_in");
+  is_in_call->add_arguments()->set_column("variantId");
+  is_in_call->mutable_set_lookup_options()->set_values_parameter(
+      "variant_ids");
+  return request;
+}
+
+ExecuteRequest MakeExecuteRequest(const int64_t max_xpos) {
+  ExecuteRequest request;
+  request.set_max_rows(10);
+  auto& parameters = *request.mutable_parameters();
+  parameters["max_xpos"].mutable_literal()->set_int64_value(max_xpos);
+  auto* const value_set = parameters["variant_ids"].mutable_value_set();
+  value_set->add_values("a");
+  value_set->add_values("b");
+  return request;
+}
+
+TEST(PreparedQuery, IdIsDerivedFromQuery) {
+  const PrepareRequest request = MakePrepareRequest();
+  EXPECT_EQ(PreparedQuery::Id(request), PreparedQuery::Id(request));
+  // A hex-encoded SHA-256 digest.
+  EXPECT_EQ(PreparedQuery::Id(request).size(), 64);
+  PrepareRequest other_request = request;
+  other_request.add_projection_columns("xpos");
+  EXPECT_NE(PreparedQuery::Id(request), PreparedQuery::Id(other_request));
+}
+
+TEST(PreparedQuery, BindsParameters) {
+  const auto prepared_query = PreparedQuery::Prepare(MakePrepareRequest());
+  ASSERT_TRUE(prepared_query.ok()) << prepared_query.status();
+
+  const auto scanner_options = (*prepared_query)->Bind(MakeExecuteRequest(3));
+  ASSERT_TRUE(scanner_options.ok()) << scanner_options.status();
+  EXPECT_EQ((*scanner_options)->max_rows, size_t{10});
+  EXPECT_EQ((*scanner_options)->filter_columns,
+            (std::vector<std::string>{"variantId", "xpos"}));
+  ASSERT_NE((*scanner_options)->bound_filters, nullptr);
+  EXPECT_NE((*scanner_options)->filter_expression.ToString().find("3"),
+            std::string::npos);
+}
+
+TEST(PreparedQuery, SharesBindingsForEqualParameters) {
+  const auto prepared_query = PreparedQuery::Prepare(MakePrepareRequest());
+  ASSERT_TRUE(prepared_query.ok()) << prepared_query.status();
+
+  const auto first = (*prepared_query)->Bind(MakeExecuteRequest(3));
+  ASSERT_TRUE(first.ok()) << first.status();
+  const auto second = (*prepared_query)->Bind(MakeExecuteRequest(3));
+  ASSERT_TRUE(second.ok()) << second.status();
+  EXPECT_EQ(*first, *second);
+
+  const auto other = (*prepared_query)->Bind(MakeExecuteRequest(4));
+  ASSERT_TRUE(other.ok()) << other.status();
+  EXPECT_NE(*first, *other);
+}
+
+TEST(PreparedQuery, RejectsInvalidParameters) {
+  const auto prepared_query = PreparedQuery::Prepare(MakePrepareRequest());
+  ASSERT_TRUE(prepared_query.ok()) << prepared_query.status();
+
+  ExecuteRequest missing = MakeExecuteRequest(3);
+  missing.mutable_parameters()->erase("max_xpos");
+  EXPECT_TRUE(
+      absl::IsInvalidArgument((*prepared_query)->Bind(missing).status()));
+
+  ExecuteRequest unknown = MakeExecuteRequest(3);
+  (*unknown.mutable_parameters())["other"].mutable_literal()->set_int64_value(
+      1);
+  EXPECT_TRUE(
+      absl::IsInvalidArgument((*prepared_query)->Bind(unknown).status()));
+
+  ExecuteRequest wrong_kind = MakeExecuteRequest(3);
+  (*wrong_kind.mutable_parameters())["max_xpos"]
+      .mutable_value_set()
+      ->add_values("a");
+  EXPECT_TRUE(
+      absl::IsInvalidArgument((*prepared_query)->Bind(wrong_kind).status()));
+}
+
+TEST(PreparedQuery, RejectsConflictingParameterKinds) {
+  PrepareRequest request = MakePrepareRequest();
+  request.mutable_filter_expression()
+      ->mutable_call()
+      ->mutable_arguments(1)
+      ->mutable_call()
+      ->mutable_set_lookup_options()
+      ->set_values_parameter("max_xpos");
+  EXPECT_TRUE(
+      absl::IsInvalidArgument(PreparedQuery::Prepare(request).status()));
+}
+
+}  // namespace
+}  // namespace seqr
@@ -0,0 +1,358 @@
+#include "resident_datasets.h"
+
+#include <absl/container/flat_hash_set.h>
+#include <absl/strings/str_cat.h>
+#include <arrow/io/memory.h>
+#include <arrow/ipc/reader.h>
+#include <google/protobuf/text_format.h>
+
+#include <iostream>
+#include <utility>
+
+namespace seqr {
+namespace {
+
+// Adds the sizes of the array's buffers, including those of its children, to
+// `allocated_bytes`, except for buffers that point into `data`, which set
+// `references_data` instead.
+void CountBuffers(const arrow::ArrayData& array_data,
+                  const arrow::Buffer& data, int64_t* const allocated_bytes,
+                  bool* const references_data) {
+  for (const auto& buffer : array_data.buffers) {
+    if (buffer == nullptr) {
+      continue;
+    }
+    if (buffer->data() >= data.data() &&
+        buffer->data() < data.data() + data.size()) {
+      *references_data = true;
+    } else {
+      *allocated_bytes += buffer->size();
+    }
+  }
+  for (const auto& child_data : array_data.child_data) {
+    CountBuffers(*child_data, data, allocated_bytes, references_data);
+  }
+  if (array_data.dictionary != nullptr) {
+    CountBuffers(*array_data.dictionary, data, allocated_bytes,
+                 references_data);
+  }
+}
+
+bool HasUnpinnedFiles(const DatasetManifest& manifest) {
+  for (const auto& dataset : manifest.datasets()) {
+    for (const auto& file : dataset.files()) {
+      if (file.generation().empty()) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+absl::StatusOr<DatasetManifest> ParseDatasetManifest(
+    const std::string_view text) {
+  DatasetManifest result;
+  if (!google::protobuf::TextFormat::ParseFromString(std::string(text),
+                                                     &result)) {
+    return absl::InvalidArgumentError("Failed to parse dataset manifest");
+  }
+  absl::flat_hash_set<std::string_view> ids;
+  for (const auto& dataset : result.datasets()) {
+    if (dataset.id().empty()) {
+      return absl::InvalidArgumentError("Dataset without ID");
+    }
+    if (!ids.insert(dataset.id()).second) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Duplicate dataset ID ", dataset.id()));
+    }
+    for (const auto& file : dataset.files()) {
+      if (file.url().empty()) {
+        return absl::InvalidArgumentError(
+            absl::StrCat("File without URL in dataset ", dataset.id()));
+      }
+    }
+  }
+  return result;
+}
+
+std::string ManifestFileKey(const DatasetManifest::File& file) {
+  return absl::StrCat(file.url(), "#", file.generation());
+}
+
+absl::StatusOr<std::shared_ptr<const ResidentFile>> LoadResidentFile(
+    const UrlReader& url_reader, const DatasetManifest::File& file) {
+  const std::string& url = file.url();
+  auto result = std::make_shared<ResidentFile>();
+  result->url = url;
+  // The read is pinned to the manifest's generation if it has one, so the
+  // content can't change while it's being loaded.
+  result->generation = file.generation();
+  const auto data = url_reader.Read(url, arrow::StopToken::Unstoppable(),
+                                    &result->generation);
+  if (!data.ok()) {
+    return absl::Status(
+        data.status().code(),
+        absl::StrCat("Failed to read ", url, ": ", data.status().message()));
+  }
+  result->file_size = (*data)->size();
+
+  auto read_options = arrow::ipc::IpcReadOptions::Defaults();
+  // Files are loaded in parallel already.
+  read_options.use_threads = false;
+  auto reader = arrow::ipc::RecordBatchFileReader::Open(
+      std::make_shared<arrow::io::BufferReader>(*data), read_options);
+  if (!reader.ok()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Failed to open record batch reader for ", url, ": ",
+                     reader.status().ToString()));
+  }
+  result->schema = (*reader)->schema();
+  for (int i = 0; i < (*reader)->num_record_batches(); ++i) {
+    auto record_batch = (*reader)->ReadRecordBatch(i);
+    if (!record_batch.ok()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Failed to read record batch ", i, " of ", url, ": ",
+                       record_batch.status().ToString()));
+    }
+    result->record_batches.push_back(*std::move(record_batch));
+  }
+
+  // Uncompressed buffers point into the content, which then stays alive.
+  bool references_data = false;
+  for (const auto& record_batch : result->record_batches) {
+    for (const auto& column : record_batch->column_data()) {
+      CountBuffers(*column, **data, &result->memory_bytes, &references_data);
+    }
+  }
+  if (references_data && !url_reader.MapsContent(**data)) {
+    result->memory_bytes += result->file_size;
+  }
+  return result;
+}
+
+ResidentDatasets::ResidentDatasets(const UrlReader& url_reader,
+                                   Scheduler* const scheduler,
+                                   MemoryBudget* const memory_budget)
+    : url_reader_(url_reader),
+      scheduler_(*scheduler),
+      memory_budget_(*memory_budget) {}
+
+ResidentDatasets::~ResidentDatasets() {
+  StopWatching();
+  absl::MutexLock lock(&mu_);
+  for (const auto& [key, file] : files_) {
+    memory_budget_.Release(file->memory_bytes);
+  }
+}
+
+void ResidentDatasets::StopWatching() {
+  if (!stop_watching_.HasBeenNotified()) {
+    stop_watching_.Notify();
+  }
+  if (watch_thread_.joinable()) {
+    watch_thread_.join();
+  }
+}
+
+DatasetManifest ResidentDatasets::PinGenerations(
+    const DatasetManifest& manifest) {
+  DatasetManifest result = manifest;
+  absl::flat_hash_map<std::string, std::string> generations;
+  for (const auto& dataset : result.datasets()) {
+    for (const auto& file : dataset.files()) {
+      if (file.generation().empty()) {
+        generations.emplace(file.url(), "");
+      }
+    }
+  }
+
+  std::vector<std::pair<const std::string, std::string>*> to_look_up;
+  for (auto& url_and_generation : generations) {
+    to_look_up.push_back(&url_and_generation);
+  }
+  {
+    Scheduler::TaskGroup task_group(&scheduler_);
+    for (auto* const url_and_generation : to_look_up) {
+      task_group.Schedule([this, url_and_generation] {
+        auto generation = url_reader_.GetGeneration(url_and_generation->first);
+        if (generation.ok()) {
+          url_and_generation->second = *std::move(generation);
+        }
+      });
+    }
+    task_group.Wait();
+  }
+
+  for (auto& dataset : *result.mutable_datasets()) {
+    for (auto& file : *dataset.mutable_files()) {
+      if (file.generation().empty()) {
+        file.set_generation(generations[file.url()]);
+      }
+    }
+  }
+  return result;
+}
+
+absl::Status ResidentDatasets::Apply(const DatasetManifest& unpinned_manifest) {
+  absl::MutexLock apply_lock(&apply_mu_);
+  const DatasetManifest manifest = PinGenerations(unpinned_manifest);
+
+  // Files can be listed by multiple datasets, but are only loaded once.
+  absl::flat_hash_map<std::string, const DatasetManifest::File*> missing_files;
+  {
+    absl::MutexLock lock(&mu_);
+    for (const auto& dataset : manifest.datasets()) {
+      for (const auto& file : dataset.files()) {
+        std::string key = ManifestFileKey(file);
+        if (!files_.contains(key)) {
+          missing_files.emplace(std::move(key), &file);
+        }
+      }
+    }
+  }
+
+  std::vector<std::pair<std::string, const DatasetManifest::File*>> to_load(
+      missing_files.begin(), missing_files.end());
+  std::vector<absl::StatusOr<std::shared_ptr<const ResidentFile>>> loaded(
+      to_load.size());
+  {
+    Scheduler::TaskGroup task_group(&scheduler_);
+    for (size_t i = 0; i < to_load.size(); ++i) {
+      task_group.Schedule([this, &to_load, &loaded, i] {
+        loaded[i] = LoadResidentFile(url_reader_, *to_load[i].second);
+      });
+    }
+    task_group.Wait();
+  }
+
+  absl::Status result;
+  absl::flat_hash_map<std::string, std::shared_ptr<const ResidentFile>>
+      available_files;
+  for (size_t i = 0; i < to_load.size(); ++i) {
+    if (loaded[i].ok()) {
+      available_files.emplace(to_load[i].first, *std::move(loaded[i]));
+    } else if (result.ok()) {
+      result = loaded[i].status();
+    }
+  }
+
+  absl::MutexLock lock(&mu_);
+  absl::flat_hash_map<std::string, std::shared_ptr<const ResidentDataset>>
+      datasets;
+  for (const auto& manifest_dataset : manifest.datasets()) {
+    auto dataset = std::make_shared<ResidentDataset>();
+    for (const auto& file : manifest_dataset.files()) {
+      std::string key = ManifestFileKey(file);
+      auto it = available_files.find(key);
+      if (it == available_files.end()) {
+        it = files_.find(key);
+        if (it == files_.end()) {
+          break;
+        }
+      }
+      dataset->files.push_back(it->second);
+      dataset->file_keys.push_back(std::move(key));
+    }
+    if (dataset->files.size() ==
+        static_cast<size_t>(manifest_dataset.files_size())) {
+      datasets[manifest_dataset.id()] = std::move(dataset);
+    } else if (const auto it = datasets_.find(manifest_dataset.id());
+               it != datasets_.end()) {
+      datasets[manifest_dataset.id()] = it->second;
+    }
+  }
+
+  // Only keep the files of the new datasets, and only count those towards
+  // the budget. Dropped files may still be used by queries for a while.
+  absl::flat_hash_map<std::string, std::shared_ptr<const ResidentFile>> files;
+  for (const auto& [id, dataset] : datasets) {
+    for (size_t i = 0; i < dataset->files.size(); ++i) {
+      files.emplace(dataset->file_keys[i], dataset->files[i]);
+    }
+  }
+  for (const auto& [key, file] : files) {
+    if (!files_.contains(key)) {
+      memory_budget_.ForceReserve(file->memory_bytes);
+    }
+  }
+  for (const auto& [key, file] : files_) {
+    if (!files.contains(key)) {
+      memory_budget_.Release(file->memory_bytes);
+    }
+  }
+  datasets_ = std::move(datasets);
+  files_ = std::move(files);
+  applied_ = true;
+  return result;
+}
+
+absl::Status ResidentDatasets::ApplyIfChanged(
+    const std::string& manifest_url, std::string* const generation,
+    std::optional<DatasetManifest>* const manifest) {
+  auto current_generation = url_reader_.GetGeneration(manifest_url);
+  if (!current_generation.ok()) {
+    return current_generation.status();
+  }
+  if (*current_generation == *generation) {
+    // Only files whose generation is looked up can change.
+    if (manifest->has_value() && HasUnpinnedFiles(**manifest)) {
+      return Apply(**manifest);
+    }
+    return absl::OkStatus();
+  }
+  const auto data = url_reader_.Read(
+      manifest_url, arrow::StopToken::Unstoppable(), &*current_generation);
+  if (!data.ok()) {
+    return data.status();
+  }
+  auto parsed_manifest = ParseDatasetManifest((*data)->ToString());
+  if (!parsed_manifest.ok()) {
+    return parsed_manifest.status();
+  }
+  // Failed files are retried once the manifest changes again, or for files
+  // without a generation, on the next check.
+  *generation = *std::move(current_generation);
+  *manifest = *std::move(parsed_manifest);
+  return Apply(**manifest);
+}
+
+void ResidentDatasets::Watch(std::string manifest_url,
+                             const absl::Duration poll_interval,
+                             std::function<void()> on_loaded) {
+  watch_thread_ = std::thread([this, manifest_url = std::move(manifest_url),
+                               poll_interval,
+                               on_loaded = std::move(on_loaded)] {
+    std::string generation;
+    std::optional<DatasetManifest> manifest;
+    bool loaded = false;
+    do {
+      const auto status =
+          ApplyIfChanged(manifest_url, &generation, &manifest);
+      if (!status.ok()) {
+        std::cerr << "Failed to apply dataset manifest " << manifest_url
+                  << ": " << status << std::endl;
+      }
+      if (!loaded && !generation.empty()) {
+        loaded = true;
+        on_loaded();
+      }
+    } while (!stop_watching_.WaitForNotificationWithTimeout(poll_interval));
+  });
+}
+
+absl::StatusOr<std::shared_ptr<const ResidentDataset>> ResidentDatasets::Get(
+    const std::string_view id) const {
+  absl::MutexLock lock(&mu_);
+  if (!applied_) {
+    return absl::UnavailableError("Datasets haven't been loaded yet");
+  }
+  const auto it = datasets_.find(id);
+  if (it == datasets_.end()) {
+    return absl::NotFoundError(absl::StrCat("Unknown dataset ", id));
+  }
+  return it->second;
+}
+
+}  // namespace seqr
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/synchronization/notification.h>
+#include <absl/time/time.h>
+#include <arrow/record_batch.h>
+#include <arrow/type.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "dataset_manifest.pb.h"
+#include "memory_budget.h"
+#include "scheduler.h"
+#include "url_reader.h"
+
+namespace seqr {
+
+// An Arrow file whose record batches are decoded in memory, with all columns.
+struct ResidentFile {
+  std::string url;
+  std::string generation;
+  std::shared_ptr<arrow::Schema> schema;
+  arrow::RecordBatchVector record_batches;
+  int64_t file_size = 0;
+  // The memory that the record batches hold, not counting content that the
+  // URL reader maps.
+  int64_t memory_bytes = 0;
+};
+
+// The files of a dataset, in manifest order.
+struct ResidentDataset {
+  std::vector<std::shared_ptr<const ResidentFile>> files;
+  // Identify the files' manifest entries, see ManifestFileKey.
+  std::vector<std::string> file_keys;
+};
+
+// Parses a DatasetManifest in protobuf text format. Dataset IDs need to be
+// unique and not empty, and all files need a URL.
+absl::StatusOr<DatasetManifest> ParseDatasetManifest(std::string_view text);
+
+// Identifies a file's URL and generation in a manifest.
+std::string ManifestFileKey(const DatasetManifest::File& file);
+
+// Reads a file and decodes all its record batches. The read is pinned to the
+// file's generation if it has one.
+absl::StatusOr<std::shared_ptr<const ResidentFile>> LoadResidentFile(
+    const UrlReader& url_reader, const DatasetManifest::File& file);
+
+// Keeps the datasets of a manifest in memory, so queries on them don't fetch
+// or decode anything. The memory of the resident files is reserved in the
+// budget, so queries only get what's left. Thread-safe.
+class ResidentDatasets {
+ public:
+  // Files are loaded on the scheduler's threads.
+  ResidentDatasets(const UrlReader& url_reader, Scheduler* scheduler,
+                   MemoryBudget* memory_budget);
+
+  ResidentDatasets(const ResidentDatasets&) = delete;
+  ResidentDatasets& operator=(const ResidentDatasets&) = delete;
+
+  // Stops watching the manifest and releases the memory of the files.
+  ~ResidentDatasets();
+
+  // Loads the files of the manifest that aren't resident yet in parallel,
+  // then switches all datasets over at once and drops the files that are no
+  // longer listed. Files without a generation in the manifest are pinned to
+  // their current one (e.g. the modification time and size of local files),
+  // so they're loaded again once they change. Files that are listed in both
+  // manifests with the same generation aren't loaded again. Queries that got
+  // a dataset before keep using its files, so they're never paused. If files
+  // fail to load, the datasets that list them keep their previous version,
+  // if any, and the first error is returned.
+  absl::Status Apply(const DatasetManifest& manifest);
+
+  // Reads and applies the manifest at the given URL, and then keeps applying
+  // it whenever its generation, or that of a file it lists without one,
+  // changes, checking in a background thread. `on_loaded` is called once a
+  // manifest has been applied for the first time, even if some of its files
+  // failed to load.
+  void Watch(std::string manifest_url, absl::Duration poll_interval,
+             std::function<void()> on_loaded);
+
+  // Waits for an ongoing check of the manifest and stops watching it.
+  void StopWatching();
+
+  // Returns the current version of a dataset. Fails with Unavailable until
+  // the first manifest has been applied, and with NotFound for unknown IDs.
+  absl::StatusOr<std::shared_ptr<const ResidentDataset>> Get(
+      std::string_view id) const;
+
+ private:
+  // Reads the manifest at the URL if its generation differs from
+  // `*generation`, and then applies it. Otherwise applies `*manifest` again
+  // if it lists files without a generation, which may have changed. Updates
+  // `*generation` and `*manifest` once a manifest has been read.
+  absl::Status ApplyIfChanged(const std::string& manifest_url,
+                              std::string* generation,
+                              std::optional<DatasetManifest>* manifest);
+
+  // Returns the manifest with the current generation filled in for files
+  // that don't have one. These are left empty if the lookup fails, so
+  // loading them fails as well, or pins the generation at load time.
+  DatasetManifest PinGenerations(const DatasetManifest& manifest);
+
+  const UrlReader& url_reader_;
+  Scheduler& scheduler_;
+  MemoryBudget& memory_budget_;
+  // Serializes applying manifests.
+  absl::Mutex apply_mu_;
+  mutable absl::Mutex mu_;
+  bool applied_ ABSL_GUARDED_BY(mu_) = false;
+  absl::flat_hash_map<std::string, std::shared_ptr<const ResidentDataset>>
+      datasets_ ABSL_GUARDED_BY(mu_);
+  // By ManifestFileKey. Only contains files of the current datasets.
+  absl::flat_hash_map<std::string, std::shared_ptr<const ResidentFile>> files_
+      ABSL_GUARDED_BY(mu_);
+  absl::Notification stop_watching_;
+  std::thread watch_thread_;
+};
+
+}  // namespace seqr
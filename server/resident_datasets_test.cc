@@ -0,0 +1,191 @@
+#include "resident_datasets.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/synchronization/notification.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace seqr {
+namespace {
+
+constexpr char kUrl0[] =
+    "file://testdata/part-00000-na12878-trio.zstd.arrow";
+constexpr char kUrl1[] =
+    "file://testdata/part-00001-na12878-trio.zstd.arrow";
+constexpr char kUrl2[] =
+    "file://testdata/part-00002-na12878-trio.zstd.arrow";
+
+DatasetManifest ParseManifest(const std::string& text) {
+  auto result = ParseDatasetManifest(text);
+  EXPECT_TRUE(result.ok()) << result.status();
+  return *std::move(result);
+}
+
+class ResidentDatasetsTest : public testing::Test {
+ protected:
+  std::unique_ptr<UrlReader> url_reader_ = *MakeLocalFileReader();
+  Scheduler scheduler_{4};
+  MemoryBudget memory_budget_{int64_t{1} << 40};
+};
+
+TEST(ParseDatasetManifest, ValidatesManifest) {
+  const auto manifest = ParseDatasetManifest(absl::StrCat(
+      R"(datasets { id: "trio" files { url: ")", kUrl0,
+      R"(" } files { url: ")", kUrl1, R"(" generation: "1" } })"));
+  ASSERT_TRUE(manifest.ok()) << manifest.status();
+  ASSERT_EQ(manifest->datasets_size(), 1);
+  EXPECT_EQ(ManifestFileKey(manifest->datasets(0).files(1)),
+            absl::StrCat(kUrl1, "#1"));
+
+  EXPECT_TRUE(absl::IsInvalidArgument(
+      ParseDatasetManifest("datasets { id: ").status()));
+  EXPECT_TRUE(absl::IsInvalidArgument(
+      ParseDatasetManifest(R"(datasets { id: "a" } datasets { id: "a" })")
+          .status()));
+  EXPECT_TRUE(absl::IsInvalidArgument(
+      ParseDatasetManifest(R"(datasets { id: "a" files {} })").status()));
+}
+
+TEST_F(ResidentDatasetsTest, AppliesManifestChanges) {
+  ResidentDatasets resident_datasets(*url_reader_, &scheduler_,
+                                     &memory_budget_);
+  EXPECT_TRUE(absl::IsUnavailable(resident_datasets.Get("trio").status()));
+
+  ASSERT_TRUE(resident_datasets
+                  .Apply(ParseManifest(absl::StrCat(
+                      R"(datasets { id: "trio" files { url: ")", kUrl0,
+                      R"(" } files { url: ")", kUrl1, R"(" } })")))
+                  .ok());
+  const auto trio = resident_datasets.Get("trio");
+  ASSERT_TRUE(trio.ok()) << trio.status();
+  ASSERT_EQ((*trio)->files.size(), size_t{2});
+  EXPECT_EQ((*trio)->files[1]->url, kUrl1);
+  EXPECT_FALSE((*trio)->files[1]->record_batches.empty());
+  EXPECT_NE((*trio)->files[1]->schema->GetFieldByName("xpos"), nullptr);
+  EXPECT_TRUE(absl::IsNotFound(resident_datasets.Get("other").status()));
+
+  // Files that are still listed aren't loaded again.
+  ASSERT_TRUE(resident_datasets
+                  .Apply(ParseManifest(absl::StrCat(
+                      R"(datasets { id: "trio" files { url: ")", kUrl1,
+                      R"(" } files { url: ")", kUrl2,
+                      R"(" } } datasets { id: "other" files { url: ")",
+                      kUrl1, R"(" } })")))
+                  .ok());
+  const auto new_trio = resident_datasets.Get("trio");
+  ASSERT_TRUE(new_trio.ok()) << new_trio.status();
+  ASSERT_EQ((*new_trio)->files.size(), size_t{2});
+  EXPECT_EQ((*new_trio)->files[0], (*trio)->files[1]);
+  EXPECT_EQ((*new_trio)->files[1]->url, kUrl2);
+  const auto other = resident_datasets.Get("other");
+  ASSERT_TRUE(other.ok()) << other.status();
+  EXPECT_EQ((*other)->files[0], (*trio)->files[1]);
+  // Queries that got the previous version can still use it.
+  EXPECT_EQ((*trio)->files[0]->url, kUrl0);
+
+  // Datasets with files that fail to load keep their previous version.
+  EXPECT_TRUE(absl::IsFailedPrecondition(resident_datasets.Apply(
+      ParseManifest(absl::StrCat(R"(datasets { id: "trio" files { url: ")",
+                                 kUrl0, R"(" generation: "wrong" } })")))));
+  const auto unchanged_trio = resident_datasets.Get("trio");
+  ASSERT_TRUE(unchanged_trio.ok()) << unchanged_trio.status();
+  EXPECT_EQ(*unchanged_trio, *new_trio);
+  EXPECT_TRUE(absl::IsNotFound(resident_datasets.Get("other").status()));
+
+  // The decompressed record batches count towards the budget, but the
+  // mapped files don't.
+  const int64_t memory_bytes = (*new_trio)->files[0]->memory_bytes +
+                               (*new_trio)->files[1]->memory_bytes;
+  EXPECT_GT(memory_bytes, 0);
+  EXPECT_EQ(memory_budget_.reserved_bytes(), memory_bytes);
+  ASSERT_TRUE(resident_datasets.Apply(DatasetManifest()).ok());
+  EXPECT_EQ(memory_budget_.reserved_bytes(), 0);
+}
+
+TEST_F(ResidentDatasetsTest, WatchesManifest) {
+  const std::string path =
+      (std::filesystem::path(testing::TempDir()) / "dataset_manifest.textpb")
+          .string();
+  std::ofstream(path) << R"(datasets { id: "a" files { url: ")" << kUrl0
+                      << R"(" } })";
+
+  ResidentDatasets resident_datasets(*url_reader_, &scheduler_,
+                                     &memory_budget_);
+  absl::Notification loaded;
+  resident_datasets.Watch(absl::StrCat("file://", path),
+                          absl::Milliseconds(10),
+                          [&loaded] { loaded.Notify(); });
+  ASSERT_TRUE(loaded.WaitForNotificationWithTimeout(absl::Seconds(30)));
+  EXPECT_TRUE(resident_datasets.Get("a").ok());
+
+  // The generation of local files includes their size.
+  std::ofstream(path) << R"(datasets { id: "bb" files { url: ")" << kUrl1
+                      << R"(" } })";
+  const absl::Time deadline = absl::Now() + absl::Seconds(30);
+  while (!resident_datasets.Get("bb").ok() && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  EXPECT_TRUE(resident_datasets.Get("bb").ok());
+  EXPECT_TRUE(absl::IsNotFound(resident_datasets.Get("a").status()));
+
+  resident_datasets.StopWatching();
+  std::filesystem::remove(path);
+}
+
+TEST_F(ResidentDatasetsTest, ReloadsChangedFilesWithoutGeneration) {
+  const std::filesystem::path directory =
+      std::filesystem::path(testing::TempDir()) / "reloaded_dataset";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+  const std::filesystem::path data_path = directory / "data.arrow";
+  const std::filesystem::path manifest_path = directory / "manifest.textpb";
+  // Replaces the file instead of overwriting it, as it's still mapped.
+  const auto copy = [&data_path](const std::string_view url) {
+    const std::filesystem::path temporary_path = data_path.string() + ".tmp";
+    std::filesystem::copy_file(url.substr(std::string_view("file://").size()),
+                               temporary_path);
+    std::filesystem::rename(temporary_path, data_path);
+  };
+  copy(kUrl0);
+  std::ofstream(manifest_path) << R"(datasets { id: "a" files { url: "file://)"
+                               << data_path.string() << R"(" } })";
+
+  ResidentDatasets resident_datasets(*url_reader_, &scheduler_,
+                                     &memory_budget_);
+  absl::Notification loaded;
+  resident_datasets.Watch(absl::StrCat("file://", manifest_path.string()),
+                          absl::Milliseconds(10),
+                          [&loaded] { loaded.Notify(); });
+  ASSERT_TRUE(loaded.WaitForNotificationWithTimeout(absl::Seconds(30)));
+  const auto dataset = resident_datasets.Get("a");
+  ASSERT_TRUE(dataset.ok()) << dataset.status();
+  const std::string generation = (*dataset)->files[0]->generation;
+  EXPECT_FALSE(generation.empty());
+
+  // The manifest stays the same, but the file's size changes.
+  copy(kUrl1);
+  const absl::Time deadline = absl::Now() + absl::Seconds(30);
+  while ((*resident_datasets.Get("a"))->files[0]->generation == generation &&
+         absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  const auto reloaded = resident_datasets.Get("a");
+  ASSERT_TRUE(reloaded.ok()) << reloaded.status();
+  EXPECT_NE((*reloaded)->files[0]->generation, generation);
+  EXPECT_EQ((*reloaded)->files[0]->file_size,
+            static_cast<int64_t>(std::filesystem::file_size(data_path)));
+
+  resident_datasets.StopWatching();
+  std::filesystem::remove_all(directory);
+}
+
+}  // namespace
+}  // namespace seqr
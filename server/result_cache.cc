@@ -0,0 +1,208 @@
+#include "result_cache.h"
+
+#include <absl/container/flat_hash_set.h>
+#include <absl/strings/str_cat.h>
+
+#include <algorithm>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace seqr {
+namespace {
+
+// Functions whose result doesn't depend on the order of their arguments.
+const absl::flat_hash_set<std::string_view>& CommutativeFunctions() {
+  static const auto* const result = new absl::flat_hash_set<std::string_view>{
+      "and", "and_kleene", "or", "or_kleene", "equal", "not_equal"};
+  return *result;
+}
+
+// Set lookup functions whose results don't depend on the order and
+// multiplicity of their values. Others, like "index_in", return positions
+// within the values.
+const absl::flat_hash_set<std::string_view>& ValueSetFunctions() {
+  static const auto* const result = new absl::flat_hash_set<std::string_view>{
+      "is_in", "string_list_contains_any", "sample_bitset_any",
+      "sample_bitset_all", "sample_bitset_none"};
+  return *result;
+}
+
+// Appends a length-prefixed string, so concatenations are unambiguous.
+void AppendString(const std::string_view value, std::string* const key) {
+  absl::StrAppend(key, value.size(), ":", value);
+}
+
+// Appends set lookup values, sorted and deduplicated if the function they're
+// passed to ignores their order and multiplicity.
+void AppendValueSet(std::vector<std::string> values, const bool as_set,
+                    std::string* const key) {
+  if (as_set) {
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+  }
+  absl::StrAppend(key, "[", values.size(), "]");
+  for (const auto& value : values) {
+    AppendString(value, key);
+  }
+}
+
+void AppendExpression(const QueryRequest::Expression& expression,
+                      std::string* const key) {
+  switch (expression.type_case()) {
+    case QueryRequest::Expression::kColumn:
+      absl::StrAppend(key, "c");
+      AppendString(expression.column(), key);
+      return;
+    case QueryRequest::Expression::kLiteral:
+      // Serializations of scalar fields are deterministic.
+      absl::StrAppend(key, "l");
+      AppendString(expression.literal().SerializeAsString(), key);
+      return;
+    case QueryRequest::Expression::kParameter:
+      absl::StrAppend(key, "p");
+      AppendString(expression.parameter(), key);
+      return;
+    case QueryRequest::Expression::kCall: {
+      const auto& call = expression.call();
+      std::vector<std::string> arguments;
+      arguments.reserve(call.arguments_size());
+      for (const auto& argument : call.arguments()) {
+        AppendExpression(argument, &arguments.emplace_back());
+      }
+      if (CommutativeFunctions().contains(call.function_name())) {
+        std::sort(arguments.begin(), arguments.end());
+      }
+      absl::StrAppend(key, "f");
+      AppendString(call.function_name(), key);
+      absl::StrAppend(key, "(", arguments.size(), ")");
+      for (const auto& argument : arguments) {
+        AppendString(argument, key);
+      }
+      if (call.has_set_lookup_options()) {
+        const auto& options = call.set_lookup_options();
+        absl::StrAppend(key, "s");
+        AppendString(options.values_parameter(), key);
+        AppendValueSet({options.values().begin(), options.values().end()},
+                       ValueSetFunctions().contains(call.function_name()),
+                       key);
+      }
+      return;
+    }
+    default:
+      absl::StrAppend(key, "?");
+      return;
+  }
+}
+
+}  // namespace
+
+std::string CanonicalQueryKey(const QueryRequest& request) {
+  std::string result = absl::StrCat("query#", request.max_rows(), "#",
+                                    request.projection_columns_size());
+  // The order of projection columns determines the response schema.
+  for (const auto& column : request.projection_columns()) {
+    AppendString(column, &result);
+  }
+  AppendExpression(request.filter_expression(), &result);
+  // Sorted queries return a page of rows instead of all matches.
+  absl::StrAppend(&result, "#", request.sort_keys_size());
+  for (const auto& sort_key : request.sort_keys()) {
+    absl::StrAppend(&result, sort_key.descending() ? "d" : "a");
+    AppendString(sort_key.column(), &result);
+  }
+  absl::StrAppend(&result, "#", request.limit(), "#");
+  AppendString(request.page_token(), &result);
+  // The order of group-by columns and aggregates determines the response
+  // schema, so the aggregation isn't normalized.
+  if (request.has_aggregation()) {
+    absl::StrAppend(&result, "#a");
+    AppendString(request.aggregation().SerializeAsString(), &result);
+  }
+  return result;
+}
+
+std::string CanonicalQueryKey(const ExecuteRequest& request) {
+  std::string result = absl::StrCat("execute#", request.max_rows(), "#");
+  AppendString(request.prepared_query_id(), &result);
+  // Map iteration order is unspecified.
+  std::vector<std::string> names;
+  for (const auto& [name, parameter] : request.parameters()) {
+    names.push_back(name);
+  }
+  std::sort(names.begin(), names.end());
+  for (const auto& name : names) {
+    const auto& parameter = request.parameters().at(name);
+    AppendString(name, &result);
+    if (parameter.has_value_set()) {
+      absl::StrAppend(&result, "v");
+      // Only the prepared query knows the function that the values are
+      // passed to, so they're kept as they are.
+      const auto& values = parameter.value_set().values();
+      AppendValueSet({values.begin(), values.end()}, /* as_set */ false,
+                     &result);
+    } else {
+      absl::StrAppend(&result, "l");
+      AppendString(parameter.literal().SerializeAsString(), &result);
+    }
+  }
+  return result;
+}
+
+ResultCache::ResultCache(const size_t max_size_bytes, const absl::Duration ttl,
+                         std::function<absl::Time()> clock)
+    : max_size_bytes_(max_size_bytes), ttl_(ttl), clock_(std::move(clock)) {}
+
+std::shared_ptr<const QueryResponse> ResultCache::Get(const std::string& key) {
+  absl::MutexLock lock(&mu_);
+  const auto it = entries_.find(key);
+  if (it != entries_.end() && clock_() >= it->second.expiration) {
+    Erase(it);
+  } else if (it != entries_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+    ++stats_.hits;
+    stats_.bytes_saved += it->second.response->ByteSizeLong();
+    return it->second.response;
+  }
+  ++stats_.misses;
+  return nullptr;
+}
+
+void ResultCache::Insert(const std::string& key,
+                         std::shared_ptr<const QueryResponse> response) {
+  const size_t size_bytes = key.size() + response->ByteSizeLong();
+  absl::MutexLock lock(&mu_);
+  if (const auto it = entries_.find(key); it != entries_.end()) {
+    Erase(it);
+  }
+  // Don't keep responses that exceed the budget on their own.
+  if (size_bytes > max_size_bytes_) {
+    return;
+  }
+  lru_.push_front(key);
+  entries_.emplace(key, Entry{std::move(response), size_bytes,
+                              clock_() + ttl_, lru_.begin()});
+  size_bytes_ += size_bytes;
+  while (size_bytes_ > max_size_bytes_) {
+    Erase(entries_.find(lru_.back()));
+  }
+}
+
+ResultCache::Stats ResultCache::stats() const {
+  absl::MutexLock lock(&mu_);
+  return stats_;
+}
+
+size_t ResultCache::SizeBytes() const {
+  absl::MutexLock lock(&mu_);
+  return size_bytes_;
+}
+
+void ResultCache::Erase(
+    const absl::flat_hash_map<std::string, Entry>::iterator it) {
+  size_bytes_ -= it->second.size_bytes;
+  lru_.erase(it->second.lru_position);
+  entries_.erase(it);
+}
+
+}  // namespace seqr
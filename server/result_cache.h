@@ -0,0 +1,87 @@
+#pragma once
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+
+#include "seqr_query_service.pb.h"
+
+namespace seqr {
+
+// Returns a key that's equal for requests that are guaranteed to return the
+// same results, as long as their URLs haven't changed: arguments of
+// commutative functions and set lookup values are sorted, and duplicate set
+// lookup values are removed. URLs are not part of the key, as their
+// generations need to be added.
+std::string CanonicalQueryKey(const QueryRequest& request);
+
+// Like above, for an execution of a prepared query.
+std::string CanonicalQueryKey(const ExecuteRequest& request);
+
+// Caches serialized query responses under a byte budget. Entries expire after
+// a fixed time to live, and least recently used entries are evicted first.
+// Keys need to include the generations of all URLs, so changed files never
+// return stale results. Thread-safe.
+class ResultCache {
+ public:
+  struct Stats {
+    int64_t hits = 0;
+    int64_t misses = 0;
+    // Serialized bytes of responses that were returned from the cache.
+    int64_t bytes_saved = 0;
+  };
+
+  ResultCache(size_t max_size_bytes, absl::Duration ttl,
+              std::function<absl::Time()> clock = absl::Now);
+
+  ResultCache(const ResultCache&) = delete;
+  ResultCache& operator=(const ResultCache&) = delete;
+
+  // Returns false if the byte budget is 0, in which case nothing is cached.
+  bool enabled() const { return max_size_bytes_ > 0; }
+
+  // Returns the cached response for the given key, or null if there's none
+  // or it has expired.
+  std::shared_ptr<const QueryResponse> Get(const std::string& key);
+
+  // Caches the response for the given key, replacing any previous one.
+  void Insert(const std::string& key,
+              std::shared_ptr<const QueryResponse> response);
+
+  Stats stats() const;
+
+  // Returns the total size of all cached entries.
+  size_t SizeBytes() const;
+
+ private:
+  struct Entry {
+    std::shared_ptr<const QueryResponse> response;
+    size_t size_bytes = 0;
+    absl::Time expiration;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  void Erase(absl::flat_hash_map<std::string, Entry>::iterator it)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const size_t max_size_bytes_;
+  const absl::Duration ttl_;
+  const std::function<absl::Time()> clock_;
+  mutable absl::Mutex mu_;
+  absl::flat_hash_map<std::string, Entry> entries_ ABSL_GUARDED_BY(mu_);
+  // Most recently used keys are at the front.
+  std::list<std::string> lru_ ABSL_GUARDED_BY(mu_);
+  size_t size_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+  Stats stats_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace seqr
@@ -0,0 +1,146 @@
+#include "result_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+
+namespace seqr {
+namespace {
+
+QueryRequest MakeQueryRequest(const std::string& first_value,
+                              const std::string& second_value) {
+  QueryRequest request;
+  request.add_projection_columns("variantId");
+  request.set_max_rows(10);
+  auto* const and_call = request.mutable_filter_expression()->mutable_call();
+  and_call->set_function_name("and");
+  auto* const is_in_call = and_call->add_arguments()->mutable_call();
+  is_in_call->set_function_name("is_in");
+  is_in_call->add_arguments()->set_column("variantId");
+  is_in_call->mutable_set_lookup_options()->add_values(first_value);
+  is_in_call->mutable_set_lookup_options()->add_values(second_value);
+  and_call->add_arguments()->mutable_call()->set_function_name("is_valid");
+  and_call->mutable_arguments(1)->mutable_call()->add_arguments()->set_column(
+      "AF");
+  return request;
+}
+
+std::shared_ptr<const QueryResponse> MakeResponse(const size_t size) {
+  auto result = std::make_shared<QueryResponse>();
+  result->set_record_batches(std::string(size, 'x'));
+  return result;
+}
+
+TEST(CanonicalQueryKey, NormalizesEquivalentQueries) {
+  const QueryRequest request = MakeQueryRequest("a", "b");
+  QueryRequest reordered = MakeQueryRequest("b", "a");
+  auto* const and_call = reordered.mutable_filter_expression()->mutable_call();
+  and_call->mutable_arguments()->SwapElements(0, 1);
+  // Duplicate values don't change the result.
+  auto* const is_in_call = and_call->mutable_arguments(1)->mutable_call();
+  is_in_call->mutable_set_lookup_options()->add_values("a");
+  EXPECT_EQ(CanonicalQueryKey(request), CanonicalQueryKey(reordered));
+
+  // URLs aren't part of the key.
+  QueryRequest with_urls = request;
+  with_urls.add_arrow_urls("file://a.arrow");
+  EXPECT_EQ(CanonicalQueryKey(request), CanonicalQueryKey(with_urls));
+}
+
+TEST(CanonicalQueryKey, DistinguishesDifferentQueries) {
+  const QueryRequest request = MakeQueryRequest("a", "b");
+  EXPECT_NE(CanonicalQueryKey(request),
+            CanonicalQueryKey(MakeQueryRequest("a", "c")));
+
+  QueryRequest other_max_rows = request;
+  other_max_rows.set_max_rows(11);
+  EXPECT_NE(CanonicalQueryKey(request), CanonicalQueryKey(other_max_rows));
+
+  // The order of projection columns matters.
+  QueryRequest first = request;
+  first.add_projection_columns("xpos");
+  QueryRequest second = request;
+  second.mutable_projection_columns(0)->assign("xpos");
+  second.add_projection_columns("variantId");
+  EXPECT_NE(CanonicalQueryKey(first), CanonicalQueryKey(second));
+
+  // So do sort keys and pages.
+  QueryRequest sorted = request;
+  auto* const sort_key = sorted.add_sort_keys();
+  sort_key->set_column("variantId");
+  sorted.set_limit(5);
+  EXPECT_NE(CanonicalQueryKey(request), CanonicalQueryKey(sorted));
+  QueryRequest descending = sorted;
+  descending.mutable_sort_keys(0)->set_descending(true);
+  EXPECT_NE(CanonicalQueryKey(sorted), CanonicalQueryKey(descending));
+  QueryRequest next_page = sorted;
+  next_page.set_page_token("token");
+  EXPECT_NE(CanonicalQueryKey(sorted), CanonicalQueryKey(next_page));
+
+  // Positions within the values depend on their order.
+  QueryRequest index_in = request;
+  auto* const index_in_call = index_in.mutable_filter_expression()
+                                  ->mutable_call()
+                                  ->mutable_arguments(0)
+                                  ->mutable_call();
+  index_in_call->set_function_name("index_in");
+  QueryRequest reordered_index_in = index_in;
+  index_in_call->mutable_set_lookup_options()->mutable_values()->SwapElements(
+      0, 1);
+  EXPECT_NE(CanonicalQueryKey(index_in), CanonicalQueryKey(reordered_index_in));
+
+  // Aggregations return different responses.
+  QueryRequest count = request;
+  count.mutable_aggregation()->add_aggregates();
+  EXPECT_NE(CanonicalQueryKey(request), CanonicalQueryKey(count));
+}
+
+TEST(ResultCache, ReturnsInsertedResponses) {
+  ResultCache cache(1000, absl::Minutes(1));
+  EXPECT_EQ(cache.Get("a"), nullptr);
+  cache.Insert("a", MakeResponse(100));
+  const auto response = cache.Get("a");
+  ASSERT_NE(response, nullptr);
+  EXPECT_EQ(response->record_batches().size(), size_t{100});
+
+  const auto stats = cache.stats();
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.bytes_saved,
+            static_cast<int64_t>(response->ByteSizeLong()));
+}
+
+TEST(ResultCache, EvictsLeastRecentlyUsed) {
+  ResultCache cache(250, absl::Minutes(1));
+  cache.Insert("a", MakeResponse(100));
+  cache.Insert("b", MakeResponse(100));
+  // Touch "a", so "b" becomes the least recently used entry.
+  EXPECT_NE(cache.Get("a"), nullptr);
+  cache.Insert("c", MakeResponse(100));
+  EXPECT_NE(cache.Get("a"), nullptr);
+  EXPECT_EQ(cache.Get("b"), nullptr);
+  EXPECT_NE(cache.Get("c"), nullptr);
+  EXPECT_LE(cache.SizeBytes(), size_t{250});
+}
+
+TEST(ResultCache, ExpiresEntries) {
+  absl::Time now = absl::UnixEpoch();
+  ResultCache cache(1000, absl::Minutes(1), [&now] { return now; });
+  cache.Insert("a", MakeResponse(10));
+  now += absl::Seconds(59);
+  EXPECT_NE(cache.Get("a"), nullptr);
+  now += absl::Seconds(1);
+  EXPECT_EQ(cache.Get("a"), nullptr);
+  EXPECT_EQ(cache.SizeBytes(), size_t{0});
+}
+
+TEST(ResultCache, DoesNotKeepOversizedResponses) {
+  ResultCache cache(100, absl::Minutes(1));
+  cache.Insert("a", MakeResponse(200));
+  EXPECT_EQ(cache.Get("a"), nullptr);
+  EXPECT_EQ(cache.SizeBytes(), size_t{0});
+}
+
+}  // namespace
+}  // namespace seqr
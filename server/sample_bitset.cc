@@ -0,0 +1,277 @@
+#include "sample_bitset.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <arrow/array/array_binary.h>
+#include <arrow/array/array_primitive.h>
+#include <arrow/array/builder_primitive.h>
+#include <arrow/compute/api_scalar.h>
+#include <arrow/compute/exec.h>
+#include <arrow/compute/function.h>
+#include <arrow/compute/kernel.h>
+#include <arrow/util/bitmap_writer.h>
+#include <arrow/util/key_value_metadata.h>
+#include <arrow/visitor_inline.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace seqr {
+namespace cp = arrow::compute;
+namespace {
+
+enum class Mode {
+  kAny,
+  kAll,
+  kNone,
+};
+
+constexpr const char* kFunctionNames[] = {
+    "sample_bitset_any", "sample_bitset_all", "sample_bitset_none"};
+
+bool IsSampleBitsetFunction(const std::string_view function_name) {
+  for (const auto name : kFunctionNames) {
+    if (function_name == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// A 64-bit word of the sample mask, at a byte offset within a row's bitset.
+// Only words with at least one bit set are kept, so a family's genotype
+// filter typically only needs one or two words per row, regardless of the
+// number of samples.
+struct MaskWord {
+  int32_t offset = 0;
+  int32_t size = 0;  // Less than 8 for the last word of a row.
+  uint64_t mask = 0;
+};
+
+struct SampleBitsetState : public cp::KernelState {
+  int32_t byte_width = 0;
+  std::vector<MaskWord> mask_words;
+  // Samples that aren't in the index never have their bits set.
+  bool has_missing_samples = false;
+};
+
+arrow::Result<std::unique_ptr<cp::KernelState>> InitSampleBitset(
+    cp::KernelContext* const ctx, const cp::KernelInitArgs& args) {
+  const auto* const options =
+      static_cast<const cp::SetLookupOptions*>(args.options);
+  if (options == nullptr ||
+      options->value_set.kind() != arrow::Datum::ARRAY ||
+      options->value_set.type()->id() != arrow::Type::INT32) {
+    return arrow::Status::Invalid(
+        "SetLookupOptions value_set needs to be an int32 array of sample "
+        "bit positions");
+  }
+
+  auto result = std::make_unique<SampleBitsetState>();
+  result->byte_width =
+      static_cast<const arrow::FixedSizeBinaryType&>(*args.inputs[0].type)
+          .byte_width();
+
+  std::vector<uint64_t> words((result->byte_width + 7) / 8, 0);
+  const arrow::Int32Array positions(options->value_set.array());
+  if (positions.length() == 0) {
+    return arrow::Status::Invalid("SetLookupOptions value_set is empty");
+  }
+  for (int64_t i = 0; i < positions.length(); ++i) {
+    const int32_t position = positions.IsValid(i) ? positions.Value(i) : -1;
+    if (position < 0 || position >= result->byte_width * 8) {
+      result->has_missing_samples = true;
+      continue;
+    }
+    // Little-endian, so bit i of the word at byte offset 8k is bit i of the
+    // bitset, starting at bit 64k.
+    words[position / 64] |= uint64_t{1} << (position % 64);
+  }
+
+  for (size_t i = 0; i < words.size(); ++i) {
+    if (words[i] != 0) {
+      const int32_t offset = static_cast<int32_t>(i * 8);
+      result->mask_words.push_back(
+          MaskWord{offset, std::min(8, result->byte_width - offset), words[i]});
+    }
+  }
+
+  return result;
+}
+
+uint64_t LoadWord(const uint8_t* const data, const MaskWord& mask_word) {
+  uint64_t result = 0;
+  if (mask_word.size == 8) {
+    std::memcpy(&result, data + mask_word.offset, 8);
+  } else {
+    std::memcpy(&result, data + mask_word.offset, mask_word.size);
+  }
+  return result;
+}
+
+template <Mode mode>
+bool Matches(const uint8_t* const row, const SampleBitsetState& state) {
+  for (const auto& mask_word : state.mask_words) {
+    const uint64_t bits = LoadWord(row, mask_word) & mask_word.mask;
+    if constexpr (mode == Mode::kAny) {
+      if (bits != 0) {
+        return true;
+      }
+    } else if constexpr (mode == Mode::kAll) {
+      if (bits != mask_word.mask) {
+        return false;
+      }
+    } else {
+      if (bits != 0) {
+        return false;
+      }
+    }
+  }
+  if constexpr (mode == Mode::kAny) {
+    return false;
+  } else if constexpr (mode == Mode::kAll) {
+    return !state.has_missing_samples;
+  } else {
+    return true;
+  }
+}
+
+template <Mode mode>
+arrow::Status ExecSampleBitset(cp::KernelContext* const ctx,
+                               const cp::ExecBatch& batch,
+                               arrow::Datum* const out) {
+  const auto& state = static_cast<const SampleBitsetState&>(*ctx->state());
+
+  // The boolean output array has already been preallocated, and its validity
+  // is computed from the input, so null rows can be written as false.
+  arrow::ArrayData* const output = out->mutable_array();
+  arrow::internal::FirstTimeBitmapWriter writer{
+      output->buffers[1]->mutable_data(), output->offset, output->length};
+
+  const arrow::ArrayData& input = *batch[0].array();
+  const uint8_t* row =
+      input.buffers[1]->data() + input.offset * state.byte_width;
+  for (int64_t i = 0; i < input.length; ++i, row += state.byte_width) {
+    if (Matches<mode>(row, state)) {
+      writer.Set();
+    } else {
+      writer.Clear();
+    }
+    writer.Next();
+  }
+
+  writer.Finish();
+
+  return arrow::Status::OK();
+}
+
+template <Mode mode>
+arrow::Status RegisterSampleBitsetFunction(
+    cp::FunctionRegistry* const registry) {
+  auto function = std::make_shared<cp::ScalarFunction>(
+      kFunctionNames[static_cast<int>(mode)], cp::Arity::Unary(), nullptr);
+  cp::ScalarKernel kernel(
+      {cp::InputType(arrow::Type::FIXED_SIZE_BINARY)}, arrow::boolean(),
+      ExecSampleBitset<mode>, InitSampleBitset);
+  kernel.null_handling = cp::NullHandling::INTERSECTION;
+  if (const auto status = function->AddKernel(std::move(kernel));
+      !status.ok()) {
+    return status;
+  }
+  return registry->AddFunction(std::move(function));
+}
+
+}  // namespace
+
+SampleIndex ReadSampleIndex(const arrow::Schema& schema) {
+  SampleIndex result;
+  const auto& metadata = schema.metadata();
+  if (metadata == nullptr) {
+    return result;
+  }
+  const int index = metadata->FindKey(kSampleIndexMetadataKey);
+  if (index < 0) {
+    return result;
+  }
+  int32_t position = 0;
+  for (const std::string_view sample_id :
+       absl::StrSplit(metadata->value(index), '\t')) {
+    result.emplace(sample_id, position++);
+  }
+  return result;
+}
+
+arrow::Status RegisterSampleBitsetFunctions(
+    cp::FunctionRegistry* const registry) {
+  ARROW_RETURN_NOT_OK(RegisterSampleBitsetFunction<Mode::kAny>(registry));
+  ARROW_RETURN_NOT_OK(RegisterSampleBitsetFunction<Mode::kAll>(registry));
+  return RegisterSampleBitsetFunction<Mode::kNone>(registry);
+}
+
+absl::StatusOr<cp::Expression> ResolveSampleBitsetSamples(
+    const cp::Expression& expression, const SampleIndex& sample_index) {
+  const cp::Expression::Call* const call = expression.call();
+  if (call == nullptr) {
+    return expression;
+  }
+
+  std::vector<cp::Expression> arguments;
+  arguments.reserve(call->arguments.size());
+  for (const auto& argument : call->arguments) {
+    auto resolved = ResolveSampleBitsetSamples(argument, sample_index);
+    if (!resolved.ok()) {
+      return resolved.status();
+    }
+    arguments.push_back(*std::move(resolved));
+  }
+
+  std::shared_ptr<cp::FunctionOptions> options = call->options;
+  if (IsSampleBitsetFunction(call->function_name)) {
+    const auto* const set_lookup_options =
+        dynamic_cast<const cp::SetLookupOptions*>(options.get());
+    if (set_lookup_options == nullptr ||
+        set_lookup_options->value_set.kind() != arrow::Datum::ARRAY) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          call->function_name, " requires set lookup options with samples"));
+    }
+
+    const auto values = set_lookup_options->value_set.make_array();
+    if (values->type_id() == arrow::Type::STRING) {
+      if (sample_index.empty()) {
+        return absl::InvalidArgumentError(
+            absl::StrCat(call->function_name,
+                         " requires a file with a sample index"));
+      }
+
+      arrow::Int32Builder builder;
+      if (const auto status = builder.Reserve(values->length());
+          !status.ok()) {
+        return absl::InternalError(status.ToString());
+      }
+      arrow::VisitArrayDataInline<arrow::StringType>(
+          *values->data(),
+          [&builder, &sample_index](const arrow::util::string_view sample_id) {
+            const auto it = sample_index.find(
+                std::string_view(sample_id.data(), sample_id.size()));
+            builder.UnsafeAppend(it == sample_index.end() ? -1 : it->second);
+          },
+          [&builder] { builder.UnsafeAppend(-1); });
+
+      std::shared_ptr<arrow::Array> positions;
+      if (const auto status = builder.Finish(&positions); !status.ok()) {
+        return absl::InternalError(status.ToString());
+      }
+      options = std::make_shared<cp::SetLookupOptions>(
+          positions, set_lookup_options->skip_nulls);
+    }
+  }
+
+  return cp::call(call->function_name, std::move(arguments),
+                  std::move(options));
+}
+
+}  // namespace seqr
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/statusor.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/compute/registry.h>
+#include <arrow/status.h>
+#include <arrow/type.h>
+
+#include <cstdint>
+#include <string>
+
+namespace seqr {
+
+// Genotype columns can optionally be stored as fixed_size_binary bitsets,
+// where bit i (in LSB order, like Arrow validity bitmaps) is set if the i-th
+// sample of the file's sample index is in that genotype category. The sample
+// index is stored as tab-separated sample IDs under this schema metadata key.
+inline constexpr char kSampleIndexMetadataKey[] = "seqr.sample_index";
+
+// Maps sample IDs to bit positions.
+using SampleIndex = absl::flat_hash_map<std::string, int32_t>;
+
+// Returns the sample index stored in the schema metadata, which is empty if
+// the file doesn't have one.
+SampleIndex ReadSampleIndex(const arrow::Schema& schema);
+
+// Call this function once at startup time to register the Arrow compute
+// functions "sample_bitset_any", "sample_bitset_all" and "sample_bitset_none".
+// They take a bitset column and SetLookupOptions with an int32 value set of
+// bit positions, and return whether any, all or none of those bits are set.
+// Negative positions denote samples that aren't in the index, whose bits are
+// never set.
+arrow::Status RegisterSampleBitsetFunctions(
+    arrow::compute::FunctionRegistry* registry);
+
+// Requests specify samples by ID, as string value sets. This replaces them
+// with the bit positions from the given sample index, so the expression can
+// be evaluated against a particular file.
+absl::StatusOr<arrow::compute::Expression> ResolveSampleBitsetSamples(
+    const arrow::compute::Expression& expression,
+    const SampleIndex& sample_index);
+
+}  // namespace seqr
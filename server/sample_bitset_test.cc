@@ -0,0 +1,116 @@
+#include "sample_bitset.h"
+
+#include <arrow/array/builder_binary.h>
+#include <arrow/array/builder_primitive.h>
+#include <arrow/compute/api_scalar.h>
+#include <arrow/compute/exec.h>
+#include <arrow/testing/gtest_util.h>
+#include <arrow/util/key_value_metadata.h>
+#include <gtest/gtest.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace seqr {
+namespace cp = arrow::compute;
+
+class SampleBitsetTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_OK(RegisterSampleBitsetFunctions(registry_.get()));
+
+    // 70 samples, so rows span two words, the second one partial.
+    arrow::FixedSizeBinaryBuilder builder(arrow::fixed_size_binary(9));
+    using Row = std::optional<std::vector<int>>;
+    for (const auto& row : {Row({0, 65}), Row({0}), Row({65}),
+                            Row(std::vector<int>{}), Row()}) {
+      if (!row) {
+        ASSERT_OK(builder.AppendNull());
+        continue;
+      }
+      std::string bitset(9, '\0');
+      for (const int position : *row) {
+        bitset[position / 8] |= static_cast<char>(1 << (position % 8));
+      }
+      ASSERT_OK(builder.Append(bitset));
+    }
+    ASSERT_OK_AND_ASSIGN(bitsets_, builder.Finish());
+  }
+
+  // Returns the result of the function for the given bit positions as a
+  // string, with "1", "0" and "_" for true, false and null.
+  std::string Call(const std::string& function_name,
+                   const std::vector<int32_t>& positions) {
+    arrow::Int32Builder builder;
+    EXPECT_OK(builder.AppendValues(positions));
+    const cp::SetLookupOptions options(builder.Finish().ValueOrDie(),
+                                       /* skip_nulls */ true);
+    cp::ExecContext ctx(arrow::default_memory_pool(), nullptr,
+                        registry_.get());
+    const auto result =
+        cp::CallFunction(function_name, {bitsets_}, &options, &ctx);
+    EXPECT_OK(result.status());
+    const auto& values =
+        static_cast<const arrow::BooleanArray&>(*result->make_array());
+    std::string str;
+    for (int64_t i = 0; i < values.length(); ++i) {
+      str += values.IsNull(i) ? '_' : values.Value(i) ? '1' : '0';
+    }
+    return str;
+  }
+
+  // Don't clobber the global registry.
+  std::unique_ptr<cp::FunctionRegistry> registry_ =
+      cp::FunctionRegistry::Make();
+  std::shared_ptr<arrow::Array> bitsets_;
+};
+
+TEST_F(SampleBitsetTest, Any) {
+  EXPECT_EQ(Call("sample_bitset_any", {0}), "1100_");
+  EXPECT_EQ(Call("sample_bitset_any", {0, 65}), "1110_");
+  EXPECT_EQ(Call("sample_bitset_any", {1, -1}), "0000_");
+}
+
+TEST_F(SampleBitsetTest, All) {
+  EXPECT_EQ(Call("sample_bitset_all", {0}), "1100_");
+  EXPECT_EQ(Call("sample_bitset_all", {0, 65}), "1000_");
+  // Missing samples are never set.
+  EXPECT_EQ(Call("sample_bitset_all", {0, -1}), "0000_");
+}
+
+TEST_F(SampleBitsetTest, None) {
+  EXPECT_EQ(Call("sample_bitset_none", {0}), "0011_");
+  EXPECT_EQ(Call("sample_bitset_none", {0, 65}), "0001_");
+  EXPECT_EQ(Call("sample_bitset_none", {-1}), "1111_");
+}
+
+TEST(ResolveSampleBitsetSamples, ReplacesSampleIdsWithPositions) {
+  const auto schema = arrow::schema({})->WithMetadata(arrow::key_value_metadata(
+      {kSampleIndexMetadataKey}, {"NA12878\tNA12891\tNA12892"}));
+  const auto sample_index = ReadSampleIndex(*schema);
+  ASSERT_EQ(sample_index.size(), 3);
+  EXPECT_EQ(sample_index.at("NA12892"), 2);
+
+  arrow::StringBuilder builder;
+  ASSERT_OK(builder.AppendValues({"NA12892", "unknown"}));
+  ASSERT_OK_AND_ASSIGN(const auto sample_ids, builder.Finish());
+  const auto expression =
+      cp::and_(cp::call("sample_bitset_all", {cp::field_ref("num_alt_2")},
+                        cp::SetLookupOptions(sample_ids)),
+               cp::field_ref("valid"));
+
+  const auto resolved = ResolveSampleBitsetSamples(expression, sample_index);
+  ASSERT_TRUE(resolved.ok()) << resolved.status();
+  const auto& call = *resolved->call()->arguments[0].call();
+  const auto& options = static_cast<const cp::SetLookupOptions&>(*call.options);
+  arrow::Int32Builder expected_builder;
+  ASSERT_OK(expected_builder.AppendValues({2, -1}));
+  ASSERT_OK_AND_ASSIGN(const auto expected, expected_builder.Finish());
+  EXPECT_TRUE(options.value_set.make_array()->Equals(*expected));
+
+  // Files without a sample index can't be queried by sample.
+  EXPECT_FALSE(ResolveSampleBitsetSamples(expression, {}).ok());
+}
+
+}  // namespace seqr
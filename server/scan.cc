@@ -0,0 +1,704 @@
+#include "scan.h"
+
+#include <absl/strings/str_cat.h>
+#include <arrow/array/array_primitive.h>
+#include <arrow/array/builder_binary.h>
+#include <arrow/compute/api_scalar.h>
+#include <arrow/compute/api_vector.h>
+#include <arrow/compute/exec.h>
+#include <arrow/datum.h>
+#include <arrow/result.h>
+#include <arrow/scalar.h>
+#include <arrow/type_traits.h>
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "aggregation.h"
+#include "metrics.h"
+#include "monotonic_clock.h"
+#include "sha256.h"
+
+namespace seqr {
+namespace cp = arrow::compute;
+namespace {
+
+// Returns the sorted, deduplicated names of the columns referenced by the
+// expression.
+std::vector<std::string> GetFilterColumns(const cp::Expression& expression) {
+  std::vector<std::string> result;
+  for (const auto& field_ref : cp::FieldsInExpression(expression)) {
+    if (const auto* const name = field_ref.name()) {
+      result.push_back(*name);
+    }
+  }
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+// Returns the number of rows selected by a boolean filter result. Nulls
+// aren't selected.
+int64_t CountSelectedRows(const arrow::Datum& mask, const int64_t num_rows) {
+  if (mask.is_scalar()) {
+    const auto& scalar = mask.scalar_as<arrow::BooleanScalar>();
+    return scalar.is_valid && scalar.value ? num_rows : 0;
+  }
+  return static_cast<const arrow::BooleanArray&>(*mask.make_array())
+      .true_count();
+}
+
+// Returns the function of a top-level call whose arguments are filter nodes,
+// or an empty string if the expression is a single node.
+std::string FilterNodeFunction(const cp::Expression& filter_expression) {
+  const auto* const call = filter_expression.call();
+  if (call == nullptr) {
+    return "";
+  }
+  const std::string& name = call->function_name;
+  return name == "and" || name == "and_kleene" || name == "or" ||
+                 name == "or_kleene"
+             ? name
+             : "";
+}
+
+// Appends the filter nodes of an argument of a call to `function`.
+void AppendFilterNodes(const cp::Expression& expression,
+                       const std::string& function,
+                       std::vector<cp::Expression>* const nodes) {
+  const auto* const call = expression.call();
+  if (call == nullptr || call->function_name != function) {
+    nodes->push_back(expression);
+    return;
+  }
+  for (const auto& argument : call->arguments) {
+    AppendFilterNodes(argument, function, nodes);
+  }
+}
+
+// Like cp::ExecuteScalarExpression, but evaluates the filter nodes below
+// calls to `function` separately, adding their times to the profile in the
+// order of GetFilterNodes.
+arrow::Result<arrow::Datum> ExecuteFilterNodes(
+    const cp::Expression& expression, const std::string& function,
+    const arrow::Datum& input, cp::ExecContext* const exec_context,
+    QueryProfile::RecordBatch* const profile) {
+  const auto* const call = expression.call();
+  if (call == nullptr || call->function_name != function) {
+    const int64_t start = MonotonicNanos();
+    auto result = cp::ExecuteScalarExpression(expression, input, exec_context);
+    profile->add_filter_node_nanos(MonotonicNanos() - start);
+    return result;
+  }
+  std::vector<arrow::Datum> arguments;
+  arguments.reserve(call->arguments.size());
+  for (const auto& argument : call->arguments) {
+    ARROW_ASSIGN_OR_RAISE(
+        auto value, ExecuteFilterNodes(argument, function, input,
+                                       exec_context, profile));
+    arguments.push_back(std::move(value));
+  }
+  return cp::CallFunction(function, arguments, call->options.get(),
+                          exec_context);
+}
+
+// The scanner's counters in the default MetricsRegistry, from which scan
+// rates like rows per second are derived.
+struct ScanMetrics {
+  ScanMetrics() {
+    auto& registry = MetricsRegistry::Default();
+    record_batches = registry.GetCounter(
+        "seqr_scan_record_batches_total",
+        "The number of record batches whose filter was evaluated.");
+    rows = registry.GetCounter("seqr_scan_rows_total",
+                               "The number of rows that were filtered.");
+    matched_rows = registry.GetCounter(
+        "seqr_scan_matched_rows_total",
+        "The number of rows that matched the filter.");
+  }
+
+  Counter* record_batches;
+  Counter* rows;
+  Counter* matched_rows;
+};
+
+const ScanMetrics& GetScanMetrics() {
+  static const auto* const result = new ScanMetrics();
+  return *result;
+}
+
+}  // namespace
+
+absl::StatusOr<arrow::compute::Expression> BuildFilterExpression(
+    const QueryRequest::Expression& filter_expression) {
+  switch (filter_expression.type_case()) {
+    case QueryRequest::Expression::TYPE_NOT_SET:
+      return absl::InvalidArgumentError("Expression type not set");
+
+    case QueryRequest::Expression::kColumn:
+      return cp::field_ref(filter_expression.column());
+
+    case QueryRequest::Expression::kLiteral:
+      return BuildLiteral(filter_expression.literal());
+
+    case QueryRequest::Expression::kParameter:
+      return absl::InvalidArgumentError(
+          absl::StrCat("Parameter ", filter_expression.parameter(),
+                       " is only allowed in prepared queries"));
+
+    case QueryRequest::Expression::kCall: {
+      const auto& call = filter_expression.call();
+      std::vector<cp::Expression> arguments;
+      arguments.reserve(call.arguments_size());
+      for (const auto& argument : call.arguments()) {
+        auto expression = BuildFilterExpression(argument);
+        if (!expression.ok()) {
+          return expression.status();
+        }
+        arguments.push_back(*std::move(expression));
+      }
+
+      std::shared_ptr<cp::FunctionOptions> options;
+      switch (call.options_case()) {
+        case QueryRequest::Expression::Call::OPTIONS_NOT_SET:
+          break;
+        case QueryRequest::Expression::Call::kSetLookupOptions: {
+          const auto& set_lookup_options = call.set_lookup_options();
+          if (!set_lookup_options.values_parameter().empty()) {
+            return absl::InvalidArgumentError(absl::StrCat(
+                "Parameter ", set_lookup_options.values_parameter(),
+                " is only allowed in prepared queries"));
+          }
+          auto set_lookup = BuildSetLookupOptions(set_lookup_options.values());
+          if (!set_lookup.ok()) {
+            return set_lookup.status();
+          }
+          options = *std::move(set_lookup);
+        }
+      }
+
+      return cp::call(call.function_name(), std::move(arguments), options);
+    }
+  }
+
+  return absl::InternalError(
+      absl::StrCat("Unhandled case: ", filter_expression.type_case()));
+}
+
+absl::StatusOr<cp::Expression> BuildLiteral(
+    const QueryRequest::Expression::Literal& literal) {
+  switch (literal.type_case()) {
+    case QueryRequest::Expression::Literal::TYPE_NOT_SET:
+      return absl::InvalidArgumentError("Literal type not set");
+    case QueryRequest::Expression::Literal::kBoolValue:
+      return cp::literal(literal.bool_value());
+    case QueryRequest::Expression::Literal::kInt32Value:
+      return cp::literal(literal.int32_value());
+    case QueryRequest::Expression::Literal::kInt64Value:
+      return cp::literal(literal.int64_value());
+    case QueryRequest::Expression::Literal::kFloatValue:
+      return cp::literal(literal.float_value());
+    case QueryRequest::Expression::Literal::kDoubleValue:
+      return cp::literal(literal.double_value());
+    case QueryRequest::Expression::Literal::kStringValue:
+      return cp::literal(literal.string_value());
+  }
+
+  return absl::InternalError(
+      absl::StrCat("Unhandled case: ", literal.type_case()));
+}
+
+absl::StatusOr<PageToken::SortKeyValue> EncodeSortKeyValue(
+    const arrow::Scalar& scalar) {
+  PageToken::SortKeyValue result;
+  result.set_type(scalar.type->ToString());
+  const auto type_id = scalar.type->id();
+  // Integers are widened without changing their sign, so values above
+  // INT64_MAX are kept exactly.
+  std::shared_ptr<arrow::DataType> wide_type;
+  if (arrow::is_signed_integer(type_id)) {
+    wide_type = arrow::int64();
+  } else if (arrow::is_unsigned_integer(type_id)) {
+    wide_type = arrow::uint64();
+  } else if (type_id == arrow::Type::FLOAT || type_id == arrow::Type::DOUBLE) {
+    wide_type = arrow::float64();
+  } else if (type_id != arrow::Type::BOOL && type_id != arrow::Type::STRING) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Unsupported sort key type: ", scalar.type->ToString()));
+  }
+  if (!scalar.is_valid) {
+    return result;
+  }
+  std::shared_ptr<arrow::Scalar> wide_scalar;
+  if (wide_type != nullptr) {
+    auto cast = scalar.CastTo(wide_type);
+    if (!cast.ok()) {
+      return absl::InternalError(absl::StrCat("Failed to cast sort key: ",
+                                              cast.status().ToString()));
+    }
+    wide_scalar = *std::move(cast);
+  }
+  switch (type_id) {
+    case arrow::Type::BOOL:
+      result.set_bool_value(
+          static_cast<const arrow::BooleanScalar&>(scalar).value);
+      break;
+    case arrow::Type::STRING:
+      result.set_string_value(
+          static_cast<const arrow::StringScalar&>(scalar).value->ToString());
+      break;
+    default:
+      if (wide_type->id() == arrow::Type::INT64) {
+        result.set_int64_value(
+            static_cast<const arrow::Int64Scalar&>(*wide_scalar).value);
+      } else if (wide_type->id() == arrow::Type::UINT64) {
+        result.set_uint64_value(
+            static_cast<const arrow::UInt64Scalar&>(*wide_scalar).value);
+      } else {
+        result.set_double_value(
+            static_cast<const arrow::DoubleScalar&>(*wide_scalar).value);
+      }
+  }
+  return result;
+}
+
+absl::StatusOr<std::shared_ptr<arrow::Scalar>> DecodeSortKeyValue(
+    const PageToken::SortKeyValue& value) {
+  std::shared_ptr<arrow::DataType> type;
+  for (auto candidate :
+       {arrow::boolean(), arrow::int8(), arrow::int16(), arrow::int32(),
+        arrow::int64(), arrow::uint8(), arrow::uint16(), arrow::uint32(),
+        arrow::uint64(), arrow::float32(), arrow::float64(), arrow::utf8()}) {
+    if (candidate->ToString() == value.type()) {
+      type = std::move(candidate);
+      break;
+    }
+  }
+  if (type == nullptr) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Unsupported sort key type: ", value.type()));
+  }
+
+  std::shared_ptr<arrow::Scalar> wide_scalar;
+  switch (value.value_case()) {
+    case PageToken::SortKeyValue::VALUE_NOT_SET:
+      return arrow::MakeNullScalar(type);
+    case PageToken::SortKeyValue::kBoolValue:
+      wide_scalar = std::make_shared<arrow::BooleanScalar>(value.bool_value());
+      break;
+    case PageToken::SortKeyValue::kInt64Value:
+      wide_scalar = std::make_shared<arrow::Int64Scalar>(value.int64_value());
+      break;
+    case PageToken::SortKeyValue::kUint64Value:
+      wide_scalar =
+          std::make_shared<arrow::UInt64Scalar>(value.uint64_value());
+      break;
+    case PageToken::SortKeyValue::kDoubleValue:
+      wide_scalar = std::make_shared<arrow::DoubleScalar>(value.double_value());
+      break;
+    case PageToken::SortKeyValue::kStringValue:
+      wide_scalar = std::make_shared<arrow::StringScalar>(value.string_value());
+      break;
+  }
+  if (wide_scalar == nullptr) {
+    return absl::InternalError(
+        absl::StrCat("Unhandled case: ", value.value_case()));
+  }
+  if (wide_scalar->type->Equals(*type)) {
+    return wide_scalar;
+  }
+  auto result = wide_scalar->CastTo(type);
+  if (!result.ok()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid sort key value of type ", value.type(), ": ",
+                     result.status().ToString()));
+  }
+  return *std::move(result);
+}
+
+absl::StatusOr<std::shared_ptr<cp::SetLookupOptions>> BuildSetLookupOptions(
+    const google::protobuf::RepeatedPtrField<std::string>& values) {
+  arrow::StringBuilder builder;
+  for (const auto& str : values) {
+    if (const auto status = builder.Append(str); !status.ok()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Failed to append string value: ", status.message()));
+    }
+  }
+  std::shared_ptr<arrow::StringArray> value_set;
+  if (const auto status = builder.Finish(&value_set); !status.ok()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Failed to build string array: ", status.message()));
+  }
+  return std::make_shared<cp::SetLookupOptions>(value_set,
+                                                /* skip_nulls */ true);
+}
+
+absl::StatusOr<cp::Expression> BoundFilterCache::Bind(
+    const cp::Expression& expression, const arrow::Schema& schema) {
+  // Fingerprints are empty for types that don't support them.
+  std::string key = schema.fingerprint();
+  if (key.empty()) {
+    key = schema.ToString();
+  }
+
+  absl::MutexLock l(&mu_);
+  if (const auto it = bound_.find(key); it != bound_.end()) {
+    return it->second;
+  }
+  // Kernel state is allocated from the default pool, as bound expressions
+  // outlive individual queries.
+  cp::ExecContext exec_context;
+  auto bound_expression = expression.Bind(schema, &exec_context);
+  if (!bound_expression.ok()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Failed to bind filter expression: ",
+                     bound_expression.status().ToString()));
+  }
+  bound_.emplace(std::move(key), *bound_expression);
+  return *std::move(bound_expression);
+}
+
+absl::StatusOr<ScannerOptions> BuildScannerOptions(
+    const QueryRequest& request) {
+  auto filter_expression = BuildFilterExpression(request.filter_expression());
+  if (!filter_expression.ok()) {
+    return filter_expression.status();
+  }
+  std::vector<std::string> projection_columns(
+      request.projection_columns().begin(), request.projection_columns().end());
+  if (request.has_aggregation()) {
+    if (!request.sort_keys().empty()) {
+      return absl::InvalidArgumentError(
+          "Aggregations can't be combined with sort keys");
+    }
+    auto aggregation_columns = GetAggregationColumns(request.aggregation());
+    if (!aggregation_columns.ok()) {
+      return aggregation_columns.status();
+    }
+    auto result = BuildScannerOptions(*std::move(aggregation_columns),
+                                      *std::move(filter_expression),
+                                      request.max_rows());
+    if (result.ok()) {
+      result->aggregation = request.aggregation();
+    }
+    return result;
+  }
+  if (request.sort_keys().empty()) {
+    return BuildScannerOptions(std::move(projection_columns),
+                               *std::move(filter_expression),
+                               request.max_rows());
+  }
+
+  if (request.limit() <= 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid limit value of ", request.limit()));
+  }
+  std::vector<cp::Expression> conjuncts = {*std::move(filter_expression)};
+  for (const auto& sort_key : request.sort_keys()) {
+    if (std::find(projection_columns.begin(), projection_columns.end(),
+                  sort_key.column()) == projection_columns.end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Sort key ", sort_key.column(),
+                       " is not a projection column"));
+    }
+  }
+
+  // The fingerprint covers everything but the page token, which only
+  // differs between pages.
+  QueryRequest first_page_request = request;
+  first_page_request.clear_page_token();
+  std::string request_fingerprint =
+      Sha256(first_page_request.SerializeAsString());
+  std::optional<PageToken> page_token;
+  if (!request.page_token().empty()) {
+    page_token.emplace();
+    if (!page_token->ParseFromString(request.page_token()) ||
+        page_token->request_fingerprint() != request_fingerprint ||
+        page_token->sort_key_values_size() != request.sort_keys_size()) {
+      return absl::InvalidArgumentError(
+          "The page token doesn't belong to this request");
+    }
+    for (const auto& value : page_token->sort_key_values()) {
+      if (const auto scalar = DecodeSortKeyValue(value); !scalar.ok()) {
+        return scalar.status();
+      }
+    }
+    // Nulls sort last, so they never come before the token's value.
+    const auto& first_sort_key = request.sort_keys(0);
+    const auto first_column = cp::field_ref(first_sort_key.column());
+    const auto first_value =
+        *DecodeSortKeyValue(page_token->sort_key_values(0));
+    if (first_value->is_valid) {
+      conjuncts.push_back(cp::or_(
+          cp::call(first_sort_key.descending() ? "less_equal"
+                                               : "greater_equal",
+                   {first_column, cp::literal(first_value)}),
+          cp::is_null(first_column)));
+    } else {
+      conjuncts.push_back(cp::is_null(first_column));
+    }
+  }
+
+  auto result =
+      BuildScannerOptions(std::move(projection_columns), cp::and_(conjuncts),
+                          request.limit());
+  if (!result.ok()) {
+    return result.status();
+  }
+  result->sort_keys.assign(request.sort_keys().begin(),
+                           request.sort_keys().end());
+  result->limit = static_cast<size_t>(request.limit());
+  result->page_token = std::move(page_token);
+  result->request_fingerprint = std::move(request_fingerprint);
+  return result;
+}
+
+absl::StatusOr<ScannerOptions> BuildScannerOptions(
+    std::vector<std::string> projection_columns,
+    cp::Expression filter_expression, const int32_t max_rows) {
+  if (max_rows <= 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid max_rows value of ", max_rows));
+  }
+
+  ScannerOptions result;
+  result.projection_columns = std::move(projection_columns);
+  result.filter_expression = std::move(filter_expression);
+  result.bound_filters = std::make_shared<BoundFilterCache>();
+  result.max_rows = static_cast<size_t>(max_rows);
+  result.filter_columns = GetFilterColumns(result.filter_expression);
+
+  std::vector<std::string> sorted_projection_columns =
+      result.projection_columns;
+  std::sort(sorted_projection_columns.begin(),
+            sorted_projection_columns.end());
+  sorted_projection_columns.erase(
+      std::unique(sorted_projection_columns.begin(),
+                  sorted_projection_columns.end()),
+      sorted_projection_columns.end());
+  if (result.filter_columns.empty()) {
+    // Nothing to filter on, so there's no point in a second phase. This also
+    // avoids loading an empty column selection, which would mean all columns.
+    result.filter_columns = std::move(sorted_projection_columns);
+  } else {
+    std::set_difference(
+        sorted_projection_columns.begin(), sorted_projection_columns.end(),
+        result.filter_columns.begin(), result.filter_columns.end(),
+        std::back_inserter(result.late_columns));
+  }
+  return result;
+}
+
+std::vector<cp::Expression> GetFilterNodes(
+    const cp::Expression& filter_expression) {
+  std::vector<cp::Expression> result;
+  AppendFilterNodes(filter_expression, FilterNodeFunction(filter_expression),
+                    &result);
+  return result;
+}
+
+absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> ScanRecordBatch(
+    const ScannerOptions& scanner_options, const RecordBatchLoader& loader,
+    const IndexedFilter* const indexed_filter, arrow::MemoryPool* const pool,
+    QueryProfile::RecordBatch* const profile) {
+  if (indexed_filter != nullptr && indexed_filter->rows.empty()) {
+    return nullptr;
+  }
+
+  // Clocks are only read when profiling.
+  const auto load = [&loader,
+                     profile](const std::vector<std::string>& columns) {
+    if (profile == nullptr) {
+      return loader(columns);
+    }
+    const int64_t start = MonotonicNanos();
+    auto result = loader(columns);
+    profile->set_decode_nanos(profile->decode_nanos() + MonotonicNanos() -
+                              start);
+    return result;
+  };
+
+  cp::ExecContext exec_context(pool);
+  std::shared_ptr<arrow::RecordBatch> filter_record_batch;
+  int64_t num_rows = 0;
+  arrow::Datum mask;
+  // Only set if the filter was evaluated on the candidates of the indexes.
+  std::shared_ptr<arrow::Array> candidate_mask;
+  std::vector<std::string> late_columns = scanner_options.late_columns;
+  if (indexed_filter != nullptr && indexed_filter->exact) {
+    // The index already determined the matches, so there's no need to load
+    // filter columns that aren't projected.
+    num_rows = indexed_filter->rows.num_rows();
+    auto index_mask = indexed_filter->rows.ToBooleanArray(pool);
+    if (!index_mask.ok()) {
+      return absl::InternalError(absl::StrCat(
+          "Failed to build index mask: ", index_mask.status().ToString()));
+    }
+    mask = *std::move(index_mask);
+    late_columns = scanner_options.projection_columns;
+    std::sort(late_columns.begin(), late_columns.end());
+    late_columns.erase(std::unique(late_columns.begin(), late_columns.end()),
+                       late_columns.end());
+  } else {
+    // Phase one: evaluate the filter expression.
+    auto record_batch = load(scanner_options.filter_columns);
+    if (!record_batch.ok()) {
+      return record_batch.status();
+    }
+    filter_record_batch = *std::move(record_batch);
+    num_rows = filter_record_batch->num_rows();
+
+    // Rows that the indexes ruled out don't need to be evaluated, so the
+    // filter only runs on the candidates. The late columns are restricted to
+    // them as well.
+    if (indexed_filter != nullptr &&
+        indexed_filter->rows.Cardinality() < num_rows) {
+      if (indexed_filter->rows.num_rows() != num_rows) {
+        return absl::InternalError(absl::StrCat(
+            "Index size mismatch: ", indexed_filter->rows.num_rows(), " vs ",
+            num_rows));
+      }
+      auto index_mask = indexed_filter->rows.ToBooleanArray(pool);
+      if (!index_mask.ok()) {
+        return absl::InternalError(absl::StrCat(
+            "Failed to build index mask: ", index_mask.status().ToString()));
+      }
+      candidate_mask = *std::move(index_mask);
+      auto candidates = cp::Filter(filter_record_batch, candidate_mask,
+                                   cp::FilterOptions::Defaults(),
+                                   &exec_context);
+      if (!candidates.ok()) {
+        return absl::InternalError(
+            absl::StrCat("Failed to select indexed candidates: ",
+                         candidates.status().ToString()));
+      }
+      filter_record_batch = candidates->record_batch();
+      num_rows = filter_record_batch->num_rows();
+    }
+
+    absl::StatusOr<cp::Expression> bound_expression;
+    if (scanner_options.bound_filters != nullptr) {
+      bound_expression = scanner_options.bound_filters->Bind(
+          scanner_options.filter_expression, *filter_record_batch->schema());
+    } else {
+      BoundFilterCache bound_filters;
+      bound_expression = bound_filters.Bind(scanner_options.filter_expression,
+                                            *filter_record_batch->schema());
+    }
+    if (!bound_expression.ok()) {
+      return bound_expression.status();
+    }
+
+    const arrow::Datum input(filter_record_batch);
+    const int64_t filter_start = profile != nullptr ? MonotonicNanos() : 0;
+    auto filter_mask =
+        profile != nullptr
+            ? ExecuteFilterNodes(*bound_expression,
+                                 FilterNodeFunction(*bound_expression), input,
+                                 &exec_context, profile)
+            : cp::ExecuteScalarExpression(*bound_expression, input,
+                                          &exec_context);
+    if (profile != nullptr) {
+      profile->set_filter_nanos(MonotonicNanos() - filter_start);
+    }
+    if (!filter_mask.ok()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Failed to evaluate filter expression: ",
+                       filter_mask.status().ToString()));
+    }
+    mask = *std::move(filter_mask);
+    if (mask.type() == nullptr || mask.type()->id() != arrow::Type::BOOL) {
+      return absl::InvalidArgumentError(
+          "Filter expression doesn't evaluate to a boolean");
+    }
+  }
+
+  const int64_t num_selected_rows = CountSelectedRows(mask, num_rows);
+  const auto& metrics = GetScanMetrics();
+  metrics.record_batches->Add();
+  metrics.rows->Add(num_rows);
+  metrics.matched_rows->Add(num_selected_rows);
+  if (profile != nullptr) {
+    profile->set_rows_scanned(num_rows);
+    profile->set_rows_matched(num_selected_rows);
+  }
+  if (num_selected_rows == 0) {
+    return nullptr;
+  }
+
+  // Phase two: only now load the remaining projection columns.
+  std::shared_ptr<arrow::RecordBatch> late_record_batch;
+  if (!late_columns.empty()) {
+    auto record_batch = load(late_columns);
+    if (!record_batch.ok()) {
+      return record_batch.status();
+    }
+    late_record_batch = *std::move(record_batch);
+    if (candidate_mask != nullptr) {
+      if (late_record_batch->num_rows() != candidate_mask->length()) {
+        return absl::InternalError(absl::StrCat(
+            "Record batch size mismatch: ", candidate_mask->length(), " vs ",
+            late_record_batch->num_rows()));
+      }
+      auto candidates = cp::Filter(late_record_batch, candidate_mask,
+                                   cp::FilterOptions::Defaults(),
+                                   &exec_context);
+      if (!candidates.ok()) {
+        return absl::InternalError(
+            absl::StrCat("Failed to select indexed candidates: ",
+                         candidates.status().ToString()));
+      }
+      late_record_batch = candidates->record_batch();
+    }
+    if (late_record_batch->num_rows() != num_rows) {
+      return absl::InternalError(
+          absl::StrCat("Record batch size mismatch: ", num_rows, " vs ",
+                       late_record_batch->num_rows()));
+    }
+  }
+
+  arrow::FieldVector fields;
+  arrow::ArrayVector columns;
+  for (const auto& name : scanner_options.projection_columns) {
+    const auto* record_batch = filter_record_batch.get();
+    int index = record_batch == nullptr
+                    ? -1
+                    : record_batch->schema()->GetFieldIndex(name);
+    if (index < 0 && late_record_batch != nullptr) {
+      record_batch = late_record_batch.get();
+      index = record_batch->schema()->GetFieldIndex(name);
+    }
+    if (index < 0) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Projection column not found: ", name));
+    }
+    fields.push_back(record_batch->schema()->field(index));
+    columns.push_back(record_batch->column(index));
+  }
+  auto projected_record_batch = arrow::RecordBatch::Make(
+      arrow::schema(std::move(fields)), num_rows, std::move(columns));
+  if (num_selected_rows == num_rows) {
+    return projected_record_batch;
+  }
+
+  const int64_t filter_start = profile != nullptr ? MonotonicNanos() : 0;
+  const auto filtered = cp::Filter(projected_record_batch, mask,
+                                   cp::FilterOptions::Defaults(),
+                                   &exec_context);
+  if (profile != nullptr) {
+    profile->set_filter_nanos(profile->filter_nanos() + MonotonicNanos() -
+                              filter_start);
+  }
+  if (!filtered.ok()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Failed to filter record batch: ", filtered.status().ToString()));
+  }
+  return filtered->record_batch();
+}
+
+}  // namespace seqr
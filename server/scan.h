@@ -0,0 +1,140 @@
+#pragma once
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/statusor.h>
+#include <absl/synchronization/mutex.h>
+#include <arrow/compute/api_scalar.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/memory_pool.h>
+#include <arrow/record_batch.h>
+#include <arrow/scalar.h>
+#include <arrow/type.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "inverted_index.h"
+#include "seqr_query_service.pb.h"
+
+namespace seqr {
+
+// Returns an Arrow compute expression from the protobuf specification.
+// Fails for parameters, which are only allowed in prepared queries.
+absl::StatusOr<arrow::compute::Expression> BuildFilterExpression(
+    const QueryRequest::Expression& filter_expression);
+
+// Returns an Arrow literal from the protobuf specification.
+absl::StatusOr<arrow::compute::Expression> BuildLiteral(
+    const QueryRequest::Expression::Literal& literal);
+
+// Encodes a sort key value for page tokens, keeping its type. Supports
+// booleans, numbers and strings, including nulls.
+absl::StatusOr<PageToken::SortKeyValue> EncodeSortKeyValue(
+    const arrow::Scalar& scalar);
+
+// Returns the scalar of a sort key value of a page token, which is invalid
+// for nulls.
+absl::StatusOr<std::shared_ptr<arrow::Scalar>> DecodeSortKeyValue(
+    const PageToken::SortKeyValue& value);
+
+// Returns set lookup options for the given values, building their value set.
+absl::StatusOr<std::shared_ptr<arrow::compute::SetLookupOptions>>
+BuildSetLookupOptions(const google::protobuf::RepeatedPtrField<std::string>&
+                          values);
+
+// Caches a filter expression bound to the schemas of record batches. Binding
+// initializes kernel state, like the hash sets of set lookups, so this is
+// done once per schema instead of once per record batch. Thread-safe.
+class BoundFilterCache {
+ public:
+  // Returns `expression` bound to the given schema. The cache must only be
+  // used for a single expression.
+  absl::StatusOr<arrow::compute::Expression> Bind(
+      const arrow::compute::Expression& expression,
+      const arrow::Schema& schema);
+
+ private:
+  absl::Mutex mu_;
+  // By schema fingerprint.
+  absl::flat_hash_map<std::string, arrow::compute::Expression> bound_
+      ABSL_GUARDED_BY(mu_);
+};
+
+struct ScannerOptions {
+  std::vector<std::string> projection_columns;
+  arrow::compute::Expression filter_expression;
+  // Bindings of `filter_expression`. Needs to be replaced whenever the
+  // filter expression changes. If null, the filter is bound for every record
+  // batch.
+  std::shared_ptr<BoundFilterCache> bound_filters;
+  size_t max_rows = 0;
+  // Sorted columns that are decoded for every record batch to evaluate the
+  // filter expression.
+  std::vector<std::string> filter_columns;
+  // Sorted projection columns that aren't filter columns. These are only
+  // decoded for record batches that contain matches.
+  std::vector<std::string> late_columns;
+  // Only set for sorted queries, which return the first `limit` rows after
+  // the page token instead of enforcing max_rows (see TopK).
+  std::vector<QueryRequest::SortKey> sort_keys;
+  size_t limit = 0;
+  std::optional<PageToken> page_token;
+  // Identifies the request in page tokens.
+  std::string request_fingerprint;
+  // Only set for aggregation queries, whose projection columns are the
+  // aggregation columns (see GetAggregationColumns).
+  std::optional<QueryRequest::Aggregation> aggregation;
+};
+
+// For sorted queries with a page token, rows whose first sort key comes
+// before the token's are filtered out, which lets zone maps skip files and
+// record batches of previous pages. Nulls sort last.
+absl::StatusOr<ScannerOptions> BuildScannerOptions(
+    const QueryRequest& request);
+
+// Like above, for a filter expression that has been built already.
+absl::StatusOr<ScannerOptions> BuildScannerOptions(
+    std::vector<std::string> projection_columns,
+    arrow::compute::Expression filter_expression, int32_t max_rows);
+
+// Returns the nodes of a filter expression that are timed separately when
+// profiling (see QueryProfile.filter_nodes): the arguments of a top-level
+// "and" or "or" call, including those of nested calls of the same function,
+// or otherwise the expression itself.
+std::vector<arrow::compute::Expression> GetFilterNodes(
+    const arrow::compute::Expression& filter_expression);
+
+// Returns the given columns of a record batch. Columns that don't exist are
+// left out.
+using RecordBatchLoader =
+    std::function<absl::StatusOr<std::shared_ptr<arrow::RecordBatch>>(
+        const std::vector<std::string>& columns)>;
+
+// Returns the projection columns of the rows in a record batch that match the
+// filter expression, or nullptr if there are no matches. This is a two-phase
+// scan: the filter columns are loaded first, and the late columns only if any
+// rows match. As filters are typically very selective, most record batches
+// never have their projection columns decoded.
+//
+// If the inverted indexes of the record batch restrict the matching rows
+// (see EvaluateWithIndexes), record batches without candidate rows are
+// skipped without loading anything. Otherwise, the filter expression is only
+// evaluated on the candidate rows. If the indexes determine the matches
+// exactly, the filter columns aren't loaded either.
+//
+// With a profile, the scanned and matched rows and the times of loading and
+// filtering are recorded in it. The filter nodes are then evaluated one by
+// one, to time them separately.
+absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> ScanRecordBatch(
+    const ScannerOptions& scanner_options, const RecordBatchLoader& loader,
+    const IndexedFilter* indexed_filter = nullptr,
+    arrow::MemoryPool* pool = arrow::default_memory_pool(),
+    QueryProfile::RecordBatch* profile = nullptr);
+
+}  // namespace seqr
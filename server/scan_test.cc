@@ -0,0 +1,330 @@
+#include "scan.h"
+
+#include <arrow/array/builder_binary.h>
+#include <arrow/array/builder_primitive.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/scalar.h>
+#include <arrow/testing/gtest_util.h>
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace seqr {
+namespace cp = arrow::compute;
+
+class ScanRecordBatchTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    arrow::Int64Builder xpos_builder;
+    ASSERT_OK(xpos_builder.AppendValues({1, 2, 3, 4}));
+    ASSERT_OK_AND_ASSIGN(const auto xpos, xpos_builder.Finish());
+    arrow::DoubleBuilder af_builder;
+    ASSERT_OK(af_builder.AppendValues({0.1, 0.5, 0.2, 0.9}));
+    ASSERT_OK_AND_ASSIGN(const auto af, af_builder.Finish());
+    arrow::StringBuilder variant_id_builder;
+    ASSERT_OK(variant_id_builder.AppendValues({"a", "b", "c", "d"}));
+    ASSERT_OK_AND_ASSIGN(const auto variant_id, variant_id_builder.Finish());
+    record_batch_ = arrow::RecordBatch::Make(
+        arrow::schema({arrow::field("xpos", arrow::int64()),
+                       arrow::field("AF", arrow::float64()),
+                       arrow::field("variantId", arrow::utf8())}),
+        4, {xpos, af, variant_id});
+  }
+
+  // Returns a loader that selects columns from record_batch_ and records
+  // which columns were requested.
+  RecordBatchLoader MakeLoader() {
+    return [this](const std::vector<std::string>& columns)
+               -> absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> {
+      loaded_columns_.push_back(columns);
+      arrow::FieldVector fields;
+      arrow::ArrayVector arrays;
+      for (const auto& column : columns) {
+        const int index = record_batch_->schema()->GetFieldIndex(column);
+        if (index >= 0) {
+          fields.push_back(record_batch_->schema()->field(index));
+          arrays.push_back(record_batch_->column(index));
+        }
+      }
+      return arrow::RecordBatch::Make(arrow::schema(fields),
+                                      record_batch_->num_rows(), arrays);
+    };
+  }
+
+  static ScannerOptions MakeScannerOptions(cp::Expression filter_expression) {
+    ScannerOptions result;
+    result.projection_columns = {"variantId", "xpos"};
+    result.filter_expression = std::move(filter_expression);
+    result.max_rows = 100;
+    result.filter_columns = {"AF", "xpos"};
+    result.late_columns = {"variantId"};
+    return result;
+  }
+
+  std::shared_ptr<arrow::RecordBatch> record_batch_;
+  std::vector<std::vector<std::string>> loaded_columns_;
+};
+
+TEST_F(ScanRecordBatchTest, LoadsLateColumnsOnlyForMatches) {
+  const auto scanner_options = MakeScannerOptions(
+      cp::and_(cp::greater(cp::field_ref("AF"), cp::literal(0.3)),
+               cp::less(cp::field_ref("xpos"), cp::literal(int64_t{4}))));
+  const auto result = ScanRecordBatch(scanner_options, MakeLoader());
+  ASSERT_TRUE(result.ok()) << result.status();
+  ASSERT_NE(*result, nullptr);
+
+  EXPECT_EQ(loaded_columns_,
+            (std::vector<std::vector<std::string>>{{"AF", "xpos"},
+                                                   {"variantId"}}));
+  // Projection columns in request order.
+  ASSERT_EQ((*result)->num_columns(), 2);
+  EXPECT_EQ((*result)->schema()->field(0)->name(), "variantId");
+  EXPECT_EQ((*result)->schema()->field(1)->name(), "xpos");
+  ASSERT_EQ((*result)->num_rows(), 1);
+  EXPECT_EQ((*result)->column(0)->GetScalar(0).ValueOrDie()->ToString(), "b");
+}
+
+TEST_F(ScanRecordBatchTest, SkipsLateColumnsWithoutMatches) {
+  const auto scanner_options = MakeScannerOptions(
+      cp::greater(cp::field_ref("AF"), cp::literal(1.0)));
+  const auto result = ScanRecordBatch(scanner_options, MakeLoader());
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_EQ(*result, nullptr);
+  EXPECT_EQ(loaded_columns_,
+            (std::vector<std::vector<std::string>>{{"AF", "xpos"}}));
+}
+
+TEST_F(ScanRecordBatchTest, ReportsMissingColumns) {
+  auto scanner_options = MakeScannerOptions(
+      cp::greater(cp::field_ref("AC"), cp::literal(1)));
+  scanner_options.filter_columns = {"AC"};
+  EXPECT_FALSE(ScanRecordBatch(scanner_options, MakeLoader()).ok());
+}
+
+TEST_F(ScanRecordBatchTest, UsesExactIndexedFilter) {
+  const auto scanner_options = MakeScannerOptions(
+      cp::greater(cp::field_ref("AF"), cp::literal(0.3)));
+  const IndexedFilter indexed_filter{RowBitmap::FromSortedRows(4, {1}),
+                                     /* exact */ true};
+  const auto result =
+      ScanRecordBatch(scanner_options, MakeLoader(), &indexed_filter);
+  ASSERT_TRUE(result.ok()) << result.status();
+  ASSERT_NE(*result, nullptr);
+
+  // Only the projection columns are loaded.
+  EXPECT_EQ(loaded_columns_, (std::vector<std::vector<std::string>>{
+                                 {"variantId", "xpos"}}));
+  ASSERT_EQ((*result)->num_rows(), 1);
+  EXPECT_EQ((*result)->column(0)->GetScalar(0).ValueOrDie()->ToString(), "b");
+}
+
+TEST_F(ScanRecordBatchTest, SkipsRecordBatchesWithoutIndexedCandidates) {
+  const auto scanner_options = MakeScannerOptions(
+      cp::greater(cp::field_ref("AF"), cp::literal(0.3)));
+  const IndexedFilter indexed_filter{RowBitmap(4), /* exact */ false};
+  const auto result =
+      ScanRecordBatch(scanner_options, MakeLoader(), &indexed_filter);
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_EQ(*result, nullptr);
+  EXPECT_TRUE(loaded_columns_.empty());
+}
+
+TEST_F(ScanRecordBatchTest, EvaluatesFilterOnlyOnIndexedCandidates) {
+  // Rows 1 and 3 match, but the index ruled out row 1.
+  const auto scanner_options = MakeScannerOptions(
+      cp::greater(cp::field_ref("AF"), cp::literal(0.3)));
+  const IndexedFilter indexed_filter{RowBitmap::FromSortedRows(4, {0, 3}),
+                                     /* exact */ false};
+  QueryProfile::RecordBatch profile;
+  const auto result =
+      ScanRecordBatch(scanner_options, MakeLoader(), &indexed_filter,
+                      arrow::default_memory_pool(), &profile);
+  ASSERT_TRUE(result.ok()) << result.status();
+  ASSERT_NE(*result, nullptr);
+
+  EXPECT_EQ(profile.rows_scanned(), 2);
+  EXPECT_EQ(profile.rows_matched(), 1);
+  ASSERT_EQ((*result)->num_rows(), 1);
+  EXPECT_EQ((*result)->column(0)->GetScalar(0).ValueOrDie()->ToString(), "d");
+  EXPECT_EQ((*result)->column(1)->GetScalar(0).ValueOrDie()->ToString(), "4");
+}
+
+TEST_F(ScanRecordBatchTest, RecordsProfile) {
+  const auto scanner_options = MakeScannerOptions(
+      cp::and_({cp::greater(cp::field_ref("AF"), cp::literal(0.3)),
+                cp::less(cp::field_ref("xpos"), cp::literal(int64_t{4})),
+                cp::call("is_valid", {cp::field_ref("AF")})}));
+  QueryProfile::RecordBatch profile;
+  const auto result = ScanRecordBatch(scanner_options, MakeLoader(),
+                                      /* indexed_filter */ nullptr,
+                                      arrow::default_memory_pool(), &profile);
+  ASSERT_TRUE(result.ok()) << result.status();
+  ASSERT_NE(*result, nullptr);
+  ASSERT_EQ((*result)->num_rows(), 1);
+  EXPECT_EQ((*result)->column(0)->GetScalar(0).ValueOrDie()->ToString(), "b");
+
+  EXPECT_EQ(profile.rows_scanned(), 4);
+  EXPECT_EQ(profile.rows_matched(), 1);
+  // One time per conjunct, although and_ nests them.
+  EXPECT_EQ(profile.filter_node_nanos_size(), 3);
+}
+
+TEST(GetFilterNodes, SplitsTopLevelCalls) {
+  const auto af = cp::greater(cp::field_ref("AF"), cp::literal(0.3));
+  const auto xpos = cp::less(cp::field_ref("xpos"), cp::literal(1));
+  const auto clinvar =
+      cp::call("is_valid", {cp::field_ref("clinvar_clinical_significance")});
+  EXPECT_EQ(GetFilterNodes(cp::and_({af, xpos, clinvar})),
+            (std::vector<cp::Expression>{af, xpos, clinvar}));
+  // Only calls of the top-level function are split.
+  EXPECT_EQ(GetFilterNodes(cp::or_(cp::and_(af, xpos), clinvar)),
+            (std::vector<cp::Expression>{cp::and_(af, xpos), clinvar}));
+  EXPECT_EQ(GetFilterNodes(af), std::vector<cp::Expression>{af});
+}
+
+TEST(BuildScannerOptions, SplitsFilterAndLateColumns) {
+  QueryRequest request;
+  request.add_projection_columns("xpos");
+  request.add_projection_columns("variantId");
+  request.set_max_rows(1);
+  auto* const call = request.mutable_filter_expression()->mutable_call();
+  call->set_function_name("less");
+  call->add_arguments()->set_column("xpos");
+  call->add_arguments()->mutable_literal()->set_int64_value(5);
+
+  const auto scanner_options = BuildScannerOptions(request);
+  ASSERT_TRUE(scanner_options.ok()) << scanner_options.status();
+  EXPECT_EQ(scanner_options->filter_columns,
+            std::vector<std::string>{"xpos"});
+  EXPECT_EQ(scanner_options->late_columns,
+            std::vector<std::string>{"variantId"});
+}
+
+TEST(BuildScannerOptions, RejectsParameters) {
+  QueryRequest request;
+  request.add_projection_columns("xpos");
+  request.set_max_rows(1);
+  auto* const call = request.mutable_filter_expression()->mutable_call();
+  call->set_function_name("less");
+  call->add_arguments()->set_column("xpos");
+  call->add_arguments()->set_parameter("max_xpos");
+
+  const auto scanner_options = BuildScannerOptions(request);
+  EXPECT_TRUE(absl::IsInvalidArgument(scanner_options.status()))
+      << scanner_options.status();
+}
+
+TEST(BuildScannerOptions, ValidatesSortedQueries) {
+  QueryRequest request;
+  request.add_projection_columns("variantId");
+  request.add_sort_keys()->set_column("xpos");
+  request.set_limit(10);
+  request.mutable_filter_expression()->mutable_literal()->set_bool_value(true);
+  // Sort keys need to be projected.
+  EXPECT_TRUE(absl::IsInvalidArgument(BuildScannerOptions(request).status()));
+
+  request.add_projection_columns("xpos");
+  auto scanner_options = BuildScannerOptions(request);
+  ASSERT_TRUE(scanner_options.ok()) << scanner_options.status();
+  EXPECT_EQ(scanner_options->limit, size_t{10});
+  // Nulls are sorted rather than filtered out, so the sort key is only
+  // projected.
+  EXPECT_TRUE(scanner_options->filter_columns.empty());
+  EXPECT_FALSE(scanner_options->page_token.has_value());
+
+  // Page tokens only apply to the request they were returned for.
+  PageToken page_token;
+  auto* const sort_key_value = page_token.add_sort_key_values();
+  sort_key_value->set_type("int64");
+  sort_key_value->set_int64_value(3);
+  page_token.set_request_fingerprint(scanner_options->request_fingerprint);
+  request.set_page_token(page_token.SerializeAsString());
+  scanner_options = BuildScannerOptions(request);
+  ASSERT_TRUE(scanner_options.ok()) << scanner_options.status();
+  EXPECT_TRUE(scanner_options->page_token.has_value());
+
+  // Nulls sort last, so tokens may point at them.
+  sort_key_value->clear_int64_value();
+  request.set_page_token(page_token.SerializeAsString());
+  EXPECT_TRUE(BuildScannerOptions(request).ok());
+  sort_key_value->set_type("list<item: int64>");
+  request.set_page_token(page_token.SerializeAsString());
+  EXPECT_TRUE(absl::IsInvalidArgument(BuildScannerOptions(request).status()));
+  sort_key_value->set_type("int64");
+  request.set_page_token(page_token.SerializeAsString());
+  request.set_limit(11);
+  EXPECT_TRUE(absl::IsInvalidArgument(BuildScannerOptions(request).status()));
+
+  request.set_limit(0);
+  request.clear_page_token();
+  EXPECT_TRUE(absl::IsInvalidArgument(BuildScannerOptions(request).status()));
+}
+
+TEST(SortKeyValue, KeepsTypesAndValues) {
+  for (const auto& scalar : std::vector<std::shared_ptr<arrow::Scalar>>{
+           arrow::MakeScalar(std::numeric_limits<uint64_t>::max()),
+           arrow::MakeScalar(int8_t{-3}), arrow::MakeScalar(0.5f),
+           arrow::MakeScalar(true), arrow::MakeScalar(std::string("a")),
+           arrow::MakeNullScalar(arrow::uint32())}) {
+    const auto value = EncodeSortKeyValue(*scalar);
+    ASSERT_TRUE(value.ok()) << value.status();
+    const auto decoded = DecodeSortKeyValue(*value);
+    ASSERT_TRUE(decoded.ok()) << decoded.status();
+    EXPECT_TRUE((*decoded)->Equals(*scalar))
+        << scalar->ToString() << " became " << (*decoded)->ToString();
+  }
+  EXPECT_FALSE(EncodeSortKeyValue(arrow::Date32Scalar(1)).ok());
+}
+
+TEST(BuildScannerOptions, ProjectsAggregationColumns) {
+  QueryRequest request;
+  request.add_projection_columns("variantId");
+  request.set_max_rows(10);
+  auto* const call = request.mutable_filter_expression()->mutable_call();
+  call->set_function_name("less");
+  call->add_arguments()->set_column("xpos");
+  call->add_arguments()->mutable_literal()->set_int64_value(5);
+  auto* const aggregation = request.mutable_aggregation();
+  aggregation->add_group_by_columns("gene");
+  auto* const max = aggregation->add_aggregates();
+  max->set_function(QueryRequest::Aggregation::MAX);
+  max->set_column("AF");
+
+  const auto scanner_options = BuildScannerOptions(request);
+  ASSERT_TRUE(scanner_options.ok()) << scanner_options.status();
+  EXPECT_EQ(scanner_options->projection_columns,
+            (std::vector<std::string>{"gene", "AF"}));
+  EXPECT_EQ(scanner_options->late_columns,
+            (std::vector<std::string>{"AF", "gene"}));
+  EXPECT_TRUE(scanner_options->aggregation.has_value());
+
+  request.add_sort_keys()->set_column("gene");
+  EXPECT_TRUE(absl::IsInvalidArgument(BuildScannerOptions(request).status()));
+}
+
+TEST(BoundFilterCache, BindsOncePerSchema) {
+  const auto expression = cp::greater(cp::field_ref("AF"), cp::literal(0.3));
+  BoundFilterCache bound_filters;
+  const auto schema = arrow::schema({arrow::field("AF", arrow::float64())});
+  const auto bound = bound_filters.Bind(expression, *schema);
+  ASSERT_TRUE(bound.ok()) << bound.status();
+  EXPECT_TRUE(bound->IsBound());
+
+  // Equal schemas share the bound expression.
+  const auto other_bound = bound_filters.Bind(
+      expression, *arrow::schema({arrow::field("AF", arrow::float64())}));
+  ASSERT_TRUE(other_bound.ok()) << other_bound.status();
+  EXPECT_EQ(bound->call(), other_bound->call());
+
+  // Other schemas are bound separately.
+  const auto float_bound = bound_filters.Bind(
+      expression, *arrow::schema({arrow::field("AF", arrow::float32())}));
+  ASSERT_TRUE(float_bound.ok()) << float_bound.status();
+  EXPECT_NE(bound->call(), float_bound->call());
+}
+
+}  // namespace seqr
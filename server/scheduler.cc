@@ -0,0 +1,185 @@
+#include "scheduler.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <cassert>
+#include <string>
+#include <utility>
+
+#include "monotonic_clock.h"
+
+namespace seqr {
+namespace {
+
+// The scheduler and worker that the current thread belongs to, if any.
+thread_local const Scheduler* current_scheduler = nullptr;
+thread_local int current_worker_index = -1;
+
+}  // namespace
+
+Scheduler::Scheduler(const int num_threads, const std::string_view name) {
+  assert(num_threads > 0);
+  if (!name.empty()) {
+    auto& registry = MetricsRegistry::Default();
+    const std::string labels = absl::StrCat("{pool=\"", name, "\"}");
+    queued_tasks_metric_ = registry.GetGauge(
+        absl::StrCat("seqr_scheduler_queued_tasks", labels),
+        "The number of tasks waiting for a worker.");
+    queue_wait_metric_ = registry.GetHistogram(
+        absl::StrCat("seqr_scheduler_queue_wait_seconds", labels),
+        "How long tasks waited for a worker.", /* unit */ 1e-9);
+    tasks_metric_ =
+        registry.GetCounter(absl::StrCat("seqr_scheduler_tasks_total", labels),
+                            "The number of tasks that were run.");
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    threads_.push_back(std::thread(&Scheduler::WorkLoop, this, i));
+  }
+}
+
+Scheduler::~Scheduler() {
+  {
+    absl::MutexLock l(&sleep_mu_);
+    stopping_ = true;
+    work_available_.SignalAll();
+  }
+  for (auto& t : threads_) {
+    t.join();
+  }
+}
+
+void Scheduler::Submit(std::function<void()> task) {
+  assert(task != nullptr);
+  const int worker_index =
+      current_scheduler == this
+          ? current_worker_index
+          : static_cast<int>(next_worker_++ % workers_.size());
+  {
+    auto& worker = *workers_[worker_index];
+    absl::MutexLock l(&worker.mu);
+    worker.tasks.push_back(
+        {std::move(task),
+         queue_wait_metric_ != nullptr ? MonotonicNanos() : int64_t{0}});
+  }
+  ++num_queued_;
+  if (queued_tasks_metric_ != nullptr) {
+    queued_tasks_metric_->Add(1);
+  }
+
+  // Workers increment num_sleeping_ before checking num_queued_, so either
+  // they see the new task or we see them sleeping.
+  if (num_sleeping_ > 0) {
+    absl::MutexLock l(&sleep_mu_);
+    work_available_.Signal();
+  }
+}
+
+std::function<void()> Scheduler::NextTask(const int worker_index) {
+  QueuedTask result;
+  const int num_workers = static_cast<int>(workers_.size());
+  for (int i = 0; i < num_workers && result.task == nullptr; ++i) {
+    auto& worker = *workers_[(worker_index + i) % num_workers];
+    absl::MutexLock l(&worker.mu);
+    if (worker.tasks.empty()) {
+      continue;
+    }
+    if (i == 0) {
+      result = std::move(worker.tasks.front());
+      worker.tasks.pop_front();
+    } else {
+      // Steal from the other end, to keep contention with the owner low.
+      result = std::move(worker.tasks.back());
+      worker.tasks.pop_back();
+    }
+  }
+  if (result.task == nullptr) {
+    return nullptr;
+  }
+  --num_queued_;
+  if (queued_tasks_metric_ != nullptr) {
+    queued_tasks_metric_->Add(-1);
+    queue_wait_metric_->Record(MonotonicNanos() - result.submit_nanos);
+  }
+  return std::move(result.task);
+}
+
+void Scheduler::WorkLoop(const int worker_index) {
+  current_scheduler = this;
+  current_worker_index = worker_index;
+  while (true) {
+    if (auto task = NextTask(worker_index); task != nullptr) {
+      task();
+      if (tasks_metric_ != nullptr) {
+        tasks_metric_->Add();
+      }
+      continue;
+    }
+
+    absl::MutexLock l(&sleep_mu_);
+    ++num_sleeping_;
+    while (!WorkAvailableOrStopping()) {
+      work_available_.Wait(&sleep_mu_);
+    }
+    --num_sleeping_;
+    if (num_queued_ == 0 && stopping_) {
+      break;
+    }
+  }
+}
+
+Scheduler::TaskGroup::TaskGroup(Scheduler* const scheduler,
+                                const int max_parallelism)
+    : scheduler_(*scheduler),
+      max_parallelism_(max_parallelism > 0 ? max_parallelism
+                                           : scheduler->num_threads()) {}
+
+void Scheduler::TaskGroup::Schedule(std::function<void()> task) {
+  {
+    absl::MutexLock l(&mu_);
+    ++num_unfinished_;
+    if (num_submitted_ >= max_parallelism_) {
+      pending_.push(std::move(task));
+      return;
+    }
+    ++num_submitted_;
+  }
+  Submit(std::move(task));
+}
+
+void Scheduler::TaskGroup::Wait() {
+  absl::MutexLock l(&mu_);
+  mu_.Await(absl::Condition(this, &TaskGroup::Done));
+}
+
+void Scheduler::TaskGroup::Submit(std::function<void()> task) {
+  scheduler_.Submit([this, task = std::move(task)]() mutable {
+    // Release the task's captures before the group can be destroyed.
+    std::exchange(task, nullptr)();
+    OnTaskDone();
+  });
+}
+
+void Scheduler::TaskGroup::OnTaskDone() {
+  std::function<void()> next_task;
+  {
+    absl::MutexLock l(&mu_);
+    if (!pending_.empty()) {
+      next_task = std::move(pending_.front());
+      pending_.pop();
+    } else {
+      --num_submitted_;
+    }
+    // The group may be destroyed once this reaches zero, so it must not be
+    // accessed afterwards.
+    --num_unfinished_;
+  }
+  if (next_task != nullptr) {
+    // Queued behind the tasks of other groups on this worker.
+    Submit(std::move(next_task));
+  }
+}
+
+}  // namespace seqr
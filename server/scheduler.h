@@ -0,0 +1,123 @@
+#pragma once
+
+#include <absl/base/thread_annotations.h>
+#include <absl/synchronization/mutex.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string_view>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "metrics.h"
+
+namespace seqr {
+
+// A work-stealing thread pool. Each worker has its own task deque, so workers
+// only contend when one of them runs out of work and steals from another.
+//
+// Tasks are scheduled through task groups, typically one per query. To keep
+// one huge query from starving smaller ones, each group only has a bounded
+// number of tasks queued or running at a time; further tasks wait in the
+// group until one of its tasks finishes. Workers run their own tasks in FIFO
+// order, so the tasks of concurrent groups get interleaved.
+class Scheduler {
+ public:
+  // With a name, the queue depth, queue wait times and number of tasks are
+  // recorded in the default MetricsRegistry, labeled with the name. Schedulers
+  // with the same name share their metrics.
+  explicit Scheduler(int num_threads, std::string_view name = {});
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  // Runs all remaining tasks before returning.
+  ~Scheduler();
+
+  int num_threads() const { return static_cast<int>(threads_.size()); }
+
+  class TaskGroup {
+   public:
+    // At most `max_parallelism` tasks of the group are queued or running at
+    // the same time. Defaults to the number of threads.
+    explicit TaskGroup(Scheduler* scheduler, int max_parallelism = 0);
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    // Waits for all tasks, as they might reference the group.
+    ~TaskGroup() { Wait(); }
+
+    // Schedules a task. This may be called from within tasks of the group.
+    void Schedule(std::function<void()> task);
+
+    // Blocks until all tasks of the group have finished, including tasks
+    // that were scheduled by other tasks in the meantime.
+    void Wait();
+
+   private:
+    void Submit(std::function<void()> task);
+    void OnTaskDone();
+    bool Done() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+      return num_unfinished_ == 0;
+    }
+
+    Scheduler& scheduler_;
+    const int max_parallelism_;
+    absl::Mutex mu_;
+    // Tasks that wait for a free slot, in scheduling order.
+    std::queue<std::function<void()>> pending_ ABSL_GUARDED_BY(mu_);
+    int num_submitted_ ABSL_GUARDED_BY(mu_) = 0;  // Queued or running.
+    int64_t num_unfinished_ ABSL_GUARDED_BY(mu_) = 0;
+  };
+
+ private:
+  struct QueuedTask {
+    std::function<void()> task;
+    // Only set if metrics are recorded.
+    int64_t submit_nanos = 0;
+  };
+
+  struct Worker {
+    absl::Mutex mu;
+    std::deque<QueuedTask> tasks ABSL_GUARDED_BY(mu);
+  };
+
+  // Queues a task on the current worker's deque if called from a worker,
+  // and on the next worker's deque in round-robin order otherwise.
+  void Submit(std::function<void()> task);
+
+  // Returns the next task of the given worker: its own oldest task, or
+  // otherwise the newest task of another worker. Returns nullptr if there's
+  // no work.
+  std::function<void()> NextTask(int worker_index);
+
+  void WorkLoop(int worker_index);
+
+  bool WorkAvailableOrStopping() const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(sleep_mu_) {
+    return num_queued_ > 0 || stopping_;
+  }
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::atomic<uint64_t> next_worker_ = 0;
+  // The number of tasks in all deques.
+  std::atomic<int64_t> num_queued_ = 0;
+  // Idle workers wait on this until work becomes available. Submitting only
+  // takes the lock if any workers are idle.
+  std::atomic<int> num_sleeping_ = 0;
+  absl::Mutex sleep_mu_;
+  absl::CondVar work_available_;
+  bool stopping_ ABSL_GUARDED_BY(sleep_mu_) = false;
+  // Null without a name.
+  Gauge* queued_tasks_metric_ = nullptr;
+  Histogram* queue_wait_metric_ = nullptr;
+  Counter* tasks_metric_ = nullptr;
+};
+
+}  // namespace seqr
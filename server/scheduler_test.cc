@@ -0,0 +1,106 @@
+#include "scheduler.h"
+
+#include <absl/synchronization/mutex.h>
+#include <absl/synchronization/notification.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace seqr {
+
+constexpr int kNumThreads = 4;
+
+TEST(Scheduler, RunsNestedTasks) {
+  Scheduler scheduler(kNumThreads);
+  Scheduler::TaskGroup task_group(&scheduler);
+  std::atomic<int> num_runs = 0;
+  for (int i = 0; i < 10; ++i) {
+    task_group.Schedule([&task_group, &num_runs] {
+      for (int j = 0; j < 10; ++j) {
+        task_group.Schedule([&num_runs] { ++num_runs; });
+      }
+      ++num_runs;
+    });
+  }
+  task_group.Wait();
+  EXPECT_EQ(num_runs, 110);
+}
+
+TEST(Scheduler, SpreadsWorkAcrossThreads) {
+  // All tasks block until every worker is running one, which only finishes if
+  // idle workers pick up queued tasks.
+  Scheduler scheduler(kNumThreads);
+  Scheduler::TaskGroup task_group(&scheduler);
+  absl::Mutex mu;
+  int num_running = 0;
+  task_group.Schedule([&] {
+    for (int i = 0; i < kNumThreads; ++i) {
+      task_group.Schedule([&] {
+        absl::MutexLock l(&mu);
+        ++num_running;
+        mu.Await(absl::Condition(
+            +[](int* num_running) { return *num_running == kNumThreads; },
+            &num_running));
+      });
+    }
+  });
+  task_group.Wait();
+  EXPECT_EQ(num_running, kNumThreads);
+}
+
+TEST(Scheduler, LimitsParallelismPerGroup) {
+  // A group that has used up its parallelism doesn't keep other groups from
+  // running.
+  Scheduler scheduler(2);
+  absl::Notification unblock;
+  Scheduler::TaskGroup large_group(&scheduler, /* max_parallelism */ 1);
+  std::atomic<int> num_large_runs = 0;
+  for (int i = 0; i < 5; ++i) {
+    large_group.Schedule([&unblock, &num_large_runs] {
+      unblock.WaitForNotification();
+      ++num_large_runs;
+    });
+  }
+
+  {
+    Scheduler::TaskGroup small_group(&scheduler);
+    std::atomic<int> num_small_runs = 0;
+    small_group.Schedule([&num_small_runs] { ++num_small_runs; });
+    small_group.Wait();
+    EXPECT_EQ(num_small_runs, 1);
+  }
+  EXPECT_EQ(num_large_runs, 0);
+
+  unblock.Notify();
+  large_group.Wait();
+  EXPECT_EQ(num_large_runs, 5);
+}
+
+TEST(Scheduler, InterleavesGroups) {
+  // With a single worker, tasks of a second group run before the queued tasks
+  // of the first group that exceed its parallelism.
+  Scheduler scheduler(1);
+  absl::Mutex mu;
+  std::string order;
+  absl::Notification unblock;
+  Scheduler::TaskGroup first_group(&scheduler, /* max_parallelism */ 1);
+  Scheduler::TaskGroup second_group(&scheduler, /* max_parallelism */ 1);
+  const auto append = [&mu, &order](const char c) {
+    absl::MutexLock l(&mu);
+    order += c;
+  };
+  first_group.Schedule([&] {
+    unblock.WaitForNotification();
+    append('a');
+  });
+  first_group.Schedule([&] { append('a'); });
+  second_group.Schedule([&] { append('b'); });
+  unblock.Notify();
+  first_group.Wait();
+  second_group.Wait();
+  EXPECT_EQ(order, "aba");
+}
+
+}  // namespace seqr
@@ -1,415 +1,2647 @@
 #include "server.h"
 
 #include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
 #include <absl/flags/flag.h>
+#include <absl/status/status.h>
 #include <absl/status/statusor.h>
 #include <absl/strings/str_cat.h>
-#include <absl/synchronization/blocking_counter.h>
+#include <absl/strings/str_join.h>
 #include <absl/synchronization/mutex.h>
 #include <absl/time/time.h>
-#include <arrow/array/builder_binary.h>
-#include <arrow/compute/api_scalar.h>
+#include <arrow/buffer.h>
+#include <arrow/compute/exec/expression.h>
 #include <arrow/compute/function.h>
-#include <arrow/dataset/dataset.h>
-#include <arrow/dataset/scanner.h>
+#include <arrow/io/interfaces.h>
 #include <arrow/io/memory.h>
+#include <arrow/memory_pool.h>
 #include <arrow/ipc/options.h>
 #include <arrow/ipc/reader.h>
 #include <arrow/ipc/writer.h>
+#include <arrow/util/bit_util.h>
+#include <arrow/util/cancel.h>
+#include <arrow/util/key_value_metadata.h>
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
+#include <grpcpp/support/server_interceptor.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <numeric>
 #include <optional>
 #include <queue>
+#include <string>
 #include <string_view>
-#include <thread>  // NOLINT(build/c++11)
+#include <tuple>
+#include <utility>
 #include <vector>
 
+#include "aggregation.h"
+#include "async_server.h"
+#include "grpc_metrics.h"
+#include "health_service.h"
+#include "http_server.h"
+#include "inverted_index.h"
+#include "ipc_ranges.h"
+#include "lru_cache.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "monotonic_clock.h"
+#include "prepared_query.h"
+#include "resident_datasets.h"
+#include "result_cache.h"
+#include "sample_bitset.h"
+#include "scan.h"
+#include "scheduler.h"
 #include "seqr_query_service.grpc.pb.h"
 #include "string_list_contains_any.h"
+#include "top_k.h"
+#include "zone_map.h"
 
 ABSL_FLAG(int, num_threads, 16,
-          "The number of thread pool workers. This implicitly puts a limit on "
-          "the amount of memory that's required, which is important for Cloud "
-          "Run deployments that only have 8 GB of RAM.");
+          "The number of thread pool workers. Memory usage is bounded by "
+          "--memory_budget_bytes, independently of the number of threads.");
+
+ABSL_FLAG(bool, async_grpc, true,
+          "Whether to serve queries through the asynchronous gRPC API, where "
+          "in-flight calls are state machines driven by completion queues. "
+          "Otherwise the synchronous API blocks a gRPC thread per in-flight "
+          "call while waiting for results.");
+
+ABSL_FLAG(int, num_grpc_threads, 4,
+          "The number of threads driving the asynchronous gRPC API, each with "
+          "its own completion queue. They only encode responses, so a few are "
+          "enough for thousands of concurrent calls.");
+
+ABSL_FLAG(int, num_io_threads, 32,
+          "The number of threads that fetch generations, footers and whole "
+          "files or, with --ranged_reads, the record batch ranges of morsels. "
+          "They mostly wait on the network, so "
+          "they're separate from the workers that process morsels, and "
+          "downloads overlap with computation.");
+
+ABSL_FLAG(int, prefetch_window, 4,
+          "The maximum number of files per query that are being fetched or "
+          "hold fetched data at the same time, including the record batch "
+          "ranges of --ranged_reads. Further files are fetched as earlier "
+          "ones finish, which bounds the memory of downloaded files and the "
+          "number of outstanding reads while keeping the workers busy.");
+
+ABSL_FLAG(int, morsel_record_batches, 4,
+          "The number of record batches per morsel, the unit of work that's "
+          "scheduled on the thread pool. Files are split into morsels after "
+          "reading their footers, so large files are processed by multiple "
+          "threads.");
+
+ABSL_FLAG(int64_t, memory_budget_bytes, int64_t{4} << 30,
+          "Memory budget in bytes for in-flight queries, shared by all "
+          "queries. A morsel is only processed once its estimated memory fits "
+          "into the budget, in addition to the memory that queries already "
+          "hold. Caches are budgeted separately, so together with them this "
+          "needs to stay below the Cloud Run memory limit, e.g. 8 GB.");
+
+ABSL_FLAG(int64_t, query_memory_limit_bytes, int64_t{1} << 30,
+          "Memory limit in bytes for a single query, counting downloaded "
+          "files, filtered results and result serialization. Queries that "
+          "exceed the limit, or whose morsels are estimated to exceed it, "
+          "fail with RESOURCE_EXHAUSTED.");
+
+ABSL_FLAG(absl::Duration, memory_admission_timeout, absl::Seconds(30),
+          "How long a morsel may wait for its estimated memory to fit into "
+          "the budget, before its query fails with RESOURCE_EXHAUSTED.");
+
+ABSL_FLAG(double, default_expansion_factor, 4.0,
+          "The estimated ratio of decoded to compressed size, for files whose "
+          "zone maps don't record their uncompressed size.");
+
+ABSL_FLAG(bool, ranged_reads, true,
+          "Whether to read Arrow files using ranged reads, fetching the footer "
+          "first and then only the record batches that are needed, instead of "
+          "downloading whole files upfront.");
+
+ABSL_FLAG(int64_t, record_batch_cache_bytes, int64_t{2} << 30,
+          "Memory budget in bytes for caching decoded record batches across "
+          "queries. Record batches are cached by URL, generation and index, "
+          "so repeated queries over the same files skip downloading and "
+          "decompression. This counts towards the Cloud Run memory limit, in "
+          "addition to the memory used by in-flight queries. Set to 0 to "
+          "disable caching.");
+
+ABSL_FLAG(int64_t, footer_cache_bytes, int64_t{64} << 20,
+          "Memory budget in bytes for caching Arrow file footers, including "
+          "their schemas and zone maps, across queries. Set to 0 to disable "
+          "caching.");
+
+ABSL_FLAG(std::vector<std::string>, inverted_index_columns, {},
+          "Comma-separated list<utf8> columns, like sample or gene ID lists, "
+          "to build inverted indexes for. The index of a record batch maps "
+          "each distinct string to the rows that contain it, so "
+          "string_list_contains_any filters on these columns are answered by "
+          "bitmap operations instead of scanning all lists. The indexes of "
+          "all record batches of a file are built together, when the file is "
+          "first queried on an indexed column.");
+
+ABSL_FLAG(int64_t, inverted_index_cache_bytes, int64_t{512} << 20,
+          "Memory budget in bytes for caching inverted indexes across "
+          "queries. Set to 0 to disable caching.");
+
+ABSL_FLAG(int64_t, result_cache_bytes, int64_t{256} << 20,
+          "Memory budget in bytes for caching serialized responses of Query "
+          "and Execute calls. Responses are cached by the canonicalized "
+          "request and the generations of its URLs, which are checked before "
+          "every lookup, so changed files never return stale results. Set to "
+          "0 to disable caching.");
+
+ABSL_FLAG(absl::Duration, result_cache_ttl, absl::Minutes(10),
+          "How long cached responses are kept at most.");
+
+ABSL_FLAG(int64_t, prepared_query_cache_bytes, int64_t{64} << 20,
+          "Memory budget in bytes for prepared queries, including the "
+          "scanner options bound for recent parameter values. Evicted "
+          "queries need to be prepared again.");
+
+ABSL_FLAG(std::string, dataset_manifest, "",
+          "The URL of a DatasetManifest in protobuf text format. Its datasets "
+          "are loaded before the health check reports SERVING, and are kept "
+          "decoded in memory for queries with QueryRequest.dataset_id.");
+
+ABSL_FLAG(absl::Duration, dataset_manifest_poll_interval, absl::Minutes(1),
+          "How often --dataset_manifest is checked for changes, which are "
+          "applied without restarting.");
+
+ABSL_FLAG(int, metrics_port, 0,
+          "If set, metrics are served in the Prometheus text format at "
+          "/metrics on this port, over plain HTTP.");
 
 namespace seqr {
 namespace {
 
-absl::Status MaxRowsExceededError(const size_t max_rows) {
-  return absl::CancelledError(
-      absl::StrCat("More than ", max_rows,
-                   " rows matched; please use a more restrictive search"));
+absl::Status MaxRowsExceededError(const size_t max_rows) {
+  return absl::CancelledError(
+      absl::StrCat("More than ", max_rows,
+                   " rows matched; please use a more restrictive search"));
+}
+
+absl::Status QueryMemoryLimitError(const int64_t limit_bytes) {
+  return absl::ResourceExhaustedError(
+      absl::StrCat("Query exceeds its memory limit of ", limit_bytes,
+                   " bytes; please use a more restrictive search"));
+}
+
+// Returns the gRPC status for a failed query. Running out of memory is
+// reported separately, so clients can retry later.
+grpc::Status QueryErrorStatus(const absl::Status& status) {
+  grpc::StatusCode code = grpc::StatusCode::INVALID_ARGUMENT;
+  if (absl::IsResourceExhausted(status)) {
+    code = grpc::StatusCode::RESOURCE_EXHAUSTED;
+  } else if (absl::IsCancelled(status)) {
+    code = grpc::StatusCode::CANCELLED;
+  }
+  return grpc::Status(code, std::string(status.message()));
+}
+
+// Returns an error with the given context for a failed Arrow operation. Reads
+// that were stopped by cancellation are kept apart from actual failures.
+absl::Status ArrowError(const arrow::Status& status,
+                        const std::string_view context) {
+  const std::string message = absl::StrCat(context, ": ", status.ToString());
+  return status.IsCancelled() ? absl::CancelledError(message)
+                              : absl::InvalidArgumentError(message);
+}
+
+// Returns the number of bytes referenced by the array, including its children.
+size_t ArrayDataSizeBytes(const arrow::ArrayData& array_data) {
+  size_t result = 0;
+  for (const auto& buffer : array_data.buffers) {
+    if (buffer != nullptr) {
+      result += buffer->size();
+    }
+  }
+  for (const auto& child_data : array_data.child_data) {
+    result += ArrayDataSizeBytes(*child_data);
+  }
+  if (array_data.dictionary != nullptr) {
+    result += ArrayDataSizeBytes(*array_data.dictionary);
+  }
+  return result;
+}
+
+// The parts of an Arrow IPC file footer that are needed to plan reads. The
+// footer is small, so caching it avoids a round trip per file and query.
+struct ArrowFileFooter {
+  size_t SizeBytes() const { return size_bytes; }
+
+  std::shared_ptr<arrow::Schema> schema;  // All columns.
+  std::optional<ZoneMap> zone_map;
+  SampleIndex sample_index;
+  int num_record_batches = 0;
+  int64_t file_size = 0;
+  size_t size_bytes = 0;  // Approximate memory used by the above.
+};
+
+// A record batch of an Arrow IPC file, decoded for a set of columns.
+struct DecodedRecordBatch {
+  size_t SizeBytes() const { return size_bytes; }
+
+  // The pool of the query that decoded the record batch, which has to
+  // outlive its buffers.
+  std::shared_ptr<arrow::MemoryPool> memory_pool;
+  std::shared_ptr<arrow::RecordBatch> record_batch;
+  size_t size_bytes = 0;  // Memory referenced by record_batch.
+};
+
+using FooterCache = LruCache<ArrowFileFooter>;
+using RecordBatchCache = LruCache<DecodedRecordBatch>;
+
+// The inverted indexes of a column for all record batches of a file.
+struct FileInvertedIndex {
+  size_t SizeBytes() const { return size_bytes; }
+
+  std::vector<std::shared_ptr<const InvertedIndex>> record_batches;
+  size_t size_bytes = 0;
+};
+
+using InvertedIndexCache = LruCache<FileInvertedIndex>;
+
+// Returns the footer of a file with the given schema, parsing the zone map
+// and sample index from its metadata.
+absl::StatusOr<std::shared_ptr<const ArrowFileFooter>> BuildArrowFileFooter(
+    std::shared_ptr<arrow::Schema> schema, const int num_record_batches,
+    const int64_t file_size, const std::string_view url) {
+  auto result = std::make_shared<ArrowFileFooter>();
+  result->schema = std::move(schema);
+  result->num_record_batches = num_record_batches;
+  result->file_size = file_size;
+  auto zone_map = ReadZoneMap(*result->schema);
+  if (!zone_map.ok()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Failed to read zone map of ", url, ": ",
+                     zone_map.status().message()));
+  }
+  result->zone_map = *std::move(zone_map);
+  result->sample_index = ReadSampleIndex(*result->schema);
+
+  result->size_bytes = sizeof(ArrowFileFooter) +
+                       result->schema->num_fields() * sizeof(arrow::Field);
+  if (const auto& metadata = result->schema->metadata()) {
+    for (int64_t i = 0; i < metadata->size(); ++i) {
+      result->size_bytes +=
+          metadata->key(i).size() + metadata->value(i).size();
+    }
+  }
+  if (result->zone_map) {
+    result->size_bytes += result->zone_map->SpaceUsedLong();
+  }
+  for (const auto& [sample_id, position] : result->sample_index) {
+    result->size_bytes += sizeof(position) + sizeof(sample_id) +
+                          sample_id.size();
+  }
+  return result;
+}
+
+// Returns the given columns of a record batch of a resident file, in schema
+// order like LazyArrowFileReader::ReadRecordBatch.
+absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> SelectResidentColumns(
+    const ResidentFile& resident_file, const int index,
+    const std::vector<std::string>& columns) {
+  const auto& record_batch = *resident_file.record_batches[index];
+  std::vector<int> field_indices;
+  for (const auto& column : columns) {
+    if (const int field_index =
+            record_batch.schema()->GetFieldIndex(column);
+        field_index >= 0) {
+      field_indices.push_back(field_index);
+    }
+  }
+  std::sort(field_indices.begin(), field_indices.end());
+  if (field_indices.empty()) {
+    field_indices.push_back(0);
+  }
+  auto result = record_batch.SelectColumns(field_indices);
+  if (!result.ok()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Failed to select columns of record batch ", index,
+                     " of ", resident_file.url, ": ",
+                     result.status().ToString()));
+  }
+  return *std::move(result);
+}
+
+// Returns a file for reading the downloaded content of the given URL. Record
+// batches that point into uncompressed file data keep the buffer alive.
+absl::StatusOr<std::shared_ptr<arrow::io::RandomAccessFile>> DownloadedFile(
+    const std::string_view url,
+    absl::StatusOr<std::shared_ptr<arrow::Buffer>> data) {
+  if (!data.ok()) {
+    return absl::Status(
+        data.status().code(),
+        absl::StrCat("Failed to read ", url, ": ", data.status().message()));
+  }
+  return std::make_shared<arrow::io::BufferReader>(*std::move(data));
+}
+
+// Returns a file for reading the given URL that's backed by ranged reads.
+// The reads are pinned to `generation`, see UrlReader::Read.
+absl::StatusOr<std::shared_ptr<arrow::io::RandomAccessFile>> OpenArrowUrl(
+    const UrlReader& url_reader, const std::string_view url,
+    const arrow::StopToken& stop_token, std::string* const generation) {
+  auto file = url_reader.Open(url, stop_token, generation);
+  if (!file.ok()) {
+    return absl::Status(
+        file.status().code(),
+        absl::StrCat("Failed to open ", url, ": ", file.status().message()));
+  }
+  return file;
+}
+
+// Collects the profile of a URL of a profiled query, see QueryProfile.Url.
+// Apart from reads, which are counted concurrently, fields are only written by
+// one task at a time: the fetch, then the planning, then each morsel in its
+// own slot. They're read once all tasks of the query have completed.
+struct UrlProfile {
+  int64_t queue_nanos = 0;
+  int64_t fetch_nanos = 0;
+  std::atomic<int64_t> read_bytes = 0;
+  std::atomic<int64_t> read_nanos = 0;
+  int num_record_batches = 0;
+  int pruned_record_batches = 0;
+  // Sized before the morsels are scheduled.
+  std::vector<seqr::QueryProfile::Morsel> morsels;
+};
+
+// Opens the file at a URL on first use, unless it has been downloaded ahead of
+// time. Thread-safe, so all morsels of a file share one download or
+// ranged-read file. All reads are pinned to one generation: the given one,
+// or otherwise the one that's current when the file gets opened. Downloaded
+// files count towards the memory of the query until the file is destroyed,
+// unless the reader maps their content. Reads stop once the query gets
+// cancelled. With a profile, reads are counted in it.
+class ArrowUrlFile {
+ public:
+  ArrowUrlFile(const UrlReader& url_reader, std::string url,
+               std::string generation, TrackingMemoryPool* const memory_pool,
+               arrow::StopToken stop_token, UrlProfile* const profile)
+      : url_reader_(url_reader),
+        url_(std::move(url)),
+        memory_pool_(*memory_pool),
+        stop_token_(std::move(stop_token)),
+        profile_(profile),
+        generation_(std::move(generation)) {}
+
+  ArrowUrlFile(const ArrowUrlFile&) = delete;
+  ArrowUrlFile& operator=(const ArrowUrlFile&) = delete;
+
+  ~ArrowUrlFile() { memory_pool_.Release(reserved_bytes_); }
+
+  const std::string& url() const { return url_; }
+
+  // Empty until the file has been opened, unless it was given upfront.
+  std::string generation() const {
+    absl::MutexLock l(&mu_);
+    return generation_;
+  }
+
+  absl::StatusOr<std::shared_ptr<arrow::io::RandomAccessFile>> Open() {
+    absl::MutexLock l(&mu_);
+    if (file_.has_value()) {
+      return *file_;
+    }
+
+    const int64_t start = MonotonicNanos();
+    if (!absl::GetFlag(FLAGS_ranged_reads)) {
+      auto data = url_reader_.Read(url_, stop_token_, &generation_);
+      if (profile_ != nullptr && data.ok()) {
+        profile_->read_nanos += MonotonicNanos() - start;
+        profile_->read_bytes += (*data)->size();
+      }
+      SetData(std::move(data));
+      return *file_;
+    }
+
+    file_ = OpenArrowUrl(url_reader_, url_, stop_token_, &generation_);
+    if (profile_ != nullptr && file_->ok()) {
+      file_.emplace(ObserveReads(
+          **file_, [profile = profile_](const arrow::Status& /* status */,
+                                        const int64_t bytes,
+                                        const int64_t nanos) {
+            profile->read_nanos += nanos;
+            profile->read_bytes += bytes;
+          }));
+    }
+    return *file_;
+  }
+
+  // Uses the content of the URL that was downloaded ahead of time, pinned to
+  // the given generation.
+  void SetDownloaded(std::shared_ptr<arrow::Buffer> data,
+                     std::string generation) {
+    absl::MutexLock l(&mu_);
+    assert(!file_.has_value());
+    generation_ = std::move(generation);
+    SetData(std::move(data));
+  }
+
+ private:
+  // Uses the downloaded content, which counts towards the memory of the
+  // query unless it's mapped.
+  void SetData(absl::StatusOr<std::shared_ptr<arrow::Buffer>> data)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    if (data.ok() && !url_reader_.MapsContent(**data)) {
+      const int64_t size = (*data)->size();
+      if (const auto status = memory_pool_.Reserve(size); !status.ok()) {
+        file_.emplace(absl::ResourceExhaustedError(absl::StrCat(
+            "Failed to download ", url_, ": ", status.message())));
+        return;
+      }
+      reserved_bytes_ = size;
+    }
+    file_ = DownloadedFile(url_, std::move(data));
+  }
+
+  const UrlReader& url_reader_;
+  const std::string url_;
+  TrackingMemoryPool& memory_pool_;
+  const arrow::StopToken stop_token_;
+  UrlProfile* const profile_;
+  mutable absl::Mutex mu_;
+  std::string generation_ ABSL_GUARDED_BY(mu_);
+  std::optional<absl::StatusOr<std::shared_ptr<arrow::io::RandomAccessFile>>>
+      file_ ABSL_GUARDED_BY(mu_);
+  int64_t reserved_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+// Gaps between the buffers of included columns of up to this size are
+// fetched along with them, as the per-request latency dominates for small
+// ranges.
+constexpr int64_t kMaxBufferGapBytes = 64 << 10;
+
+// Reads the footer and record batches of an Arrow IPC file. The file is only
+// opened on first use, so nothing is fetched if all reads are served from
+// the caches. Files that aren't in memory already, like those backed by
+// ranged reads, only have the buffers of included columns fetched. Decoded
+// data is allocated from the given pool of the query, so it counts towards
+// the query's memory limit. Not thread-safe, so each morsel uses its own
+// reader.
+class LazyArrowFileReader {
+ public:
+  LazyArrowFileReader(ArrowUrlFile* const url_file,
+                      std::shared_ptr<TrackingMemoryPool> memory_pool)
+      : url_file_(*url_file),
+        url_(url_file->url()),
+        memory_pool_(std::move(memory_pool)) {}
+
+  absl::StatusOr<std::shared_ptr<const ArrowFileFooter>> ReadFooter() {
+    if (const auto status = OpenFooter(); !status.ok()) {
+      return status;
+    }
+
+    const auto file_size = file_->GetSize();
+    if (!file_size.ok()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Failed to get size of ", url_, ": ",
+                       file_size.status().ToString()));
+    }
+    return BuildArrowFileFooter(footer_reader_->schema(),
+                                footer_reader_->num_record_batches(),
+                                *file_size, url_);
+  }
+
+  // Decodes the given record batch, including only the given columns.
+  absl::StatusOr<std::shared_ptr<const DecodedRecordBatch>> ReadRecordBatch(
+      const int index, const std::vector<std::string>& columns) {
+    if (const auto status = OpenFooter(); !status.ok()) {
+      return status;
+    }
+
+    std::shared_ptr<arrow::RecordBatch> record_batch;
+    if (!file_->supports_zero_copy()) {
+      auto ranged_record_batch = ReadRecordBatchRanges(index, columns);
+      if (ranged_record_batch.ok()) {
+        record_batch = *std::move(ranged_record_batch);
+      } else if (!absl::IsUnimplemented(ranged_record_batch.status())) {
+        return ranged_record_batch.status();
+      }
+    }
+
+    if (record_batch == nullptr) {
+      const auto record_batch_reader = GetRecordBatchReader(columns);
+      if (!record_batch_reader.ok()) {
+        return record_batch_reader.status();
+      }
+
+      auto read_result = (*record_batch_reader)->ReadRecordBatch(index);
+      if (!read_result.ok()) {
+        return ArrowError(read_result.status(),
+                          absl::StrCat("Failed to read record batch ", index,
+                                       " for ", url_));
+      }
+      record_batch = *std::move(read_result);
+    }
+
+    auto result = std::make_shared<DecodedRecordBatch>();
+    result->memory_pool = memory_pool_;
+    result->record_batch = std::move(record_batch);
+    for (const auto& column_data : result->record_batch->column_data()) {
+      result->size_bytes += ArrayDataSizeBytes(*column_data);
+    }
+    return result;
+  }
+
+  // Reads the byte ranges that ReadRecordBatch needs for the given columns
+  // ahead of time and serves them from memory from then on. Does nothing
+  // for files that are in memory already or need the full reader.
+  absl::Status FetchRecordBatch(const int index,
+                                const std::vector<std::string>& columns) {
+    if (const auto status = OpenFooter(); !status.ok()) {
+      return status;
+    }
+    if (file_->supports_zero_copy()) {
+      return absl::OkStatus();
+    }
+    if (const auto status = ReadBlocks(index); !status.ok()) {
+      return status;
+    }
+
+    auto ranges = FetchRecordBatchColumns(
+        file_.get(), blocks_[index], footer_reader_->schema(),
+        IncludedColumnsReadOptions(columns), kMaxBufferGapBytes);
+    if (!ranges.ok()) {
+      if (absl::IsUnimplemented(ranges.status())) {
+        return absl::OkStatus();
+      }
+      return absl::Status(
+          ranges.status().code(),
+          absl::StrCat("Failed to fetch record batch ", index, " for ", url_,
+                       ": ", ranges.status().message()));
+    }
+    file_ = WithFetchedRanges(std::move(file_), *std::move(ranges));
+    return absl::OkStatus();
+  }
+
+ private:
+  arrow::ipc::IpcReadOptions DefaultIpcReadOptions() const {
+    arrow::ipc::IpcReadOptions result;
+    result.memory_pool = memory_pool_.get();
+    // We parallelize over URLs already, no need for nested parallelism.
+    result.use_threads = false;
+    return result;
+  }
+
+  // Returns the read options that include the given columns.
+  arrow::ipc::IpcReadOptions IncludedColumnsReadOptions(
+      const std::vector<std::string>& columns) const {
+    arrow::ipc::IpcReadOptions result = DefaultIpcReadOptions();
+    // Columns that are missing from the schema are reported by the scan.
+    const auto& full_schema = *footer_reader_->schema();
+    for (const auto& column : columns) {
+      if (const int field_index = full_schema.GetFieldIndex(column);
+          field_index >= 0) {
+        result.included_fields.push_back(field_index);
+      }
+    }
+    std::sort(result.included_fields.begin(), result.included_fields.end());
+    if (result.included_fields.empty()) {
+      // None of the columns exist, which the scan will report. An empty
+      // selection would decode all columns, so only decode the first one.
+      result.included_fields.push_back(0);
+    }
+    return result;
+  }
+
+  // Decodes the given record batch from the byte ranges of the buffers of
+  // the given columns, which get located through the message metadata.
+  // Returns an Unimplemented error for schemas that need the full reader.
+  absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> ReadRecordBatchRanges(
+      const int index, const std::vector<std::string>& columns) {
+    if (const auto status = ReadBlocks(index); !status.ok()) {
+      return status;
+    }
+
+    auto result = ReadRecordBatchColumns(
+        file_.get(), blocks_[index], footer_reader_->schema(),
+        IncludedColumnsReadOptions(columns), kMaxBufferGapBytes);
+    if (!result.ok()) {
+      return absl::Status(
+          result.status().code(),
+          absl::StrCat("Failed to read record batch ", index, " for ", url_,
+                       ": ", result.status().message()));
+    }
+    return result;
+  }
+
+  // Reads the locations of the record batch messages, unless they're known
+  // already, and checks that the given record batch exists.
+  absl::Status ReadBlocks(const int index) {
+    if (blocks_.empty()) {
+      auto blocks = ReadIpcFileBlocks(file_.get());
+      if (!blocks.ok()) {
+        return absl::Status(blocks.status().code(),
+                            absl::StrCat("Failed to read blocks of ", url_,
+                                         ": ", blocks.status().message()));
+      }
+      blocks_ = *std::move(blocks);
+    }
+    if (index < 0 || index >= static_cast<int>(blocks_.size())) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Record batch ", index, " is out of range for ", url_));
+    }
+    return absl::OkStatus();
+  }
+
+  // Returns a reader for the given column selection, reusing the file and the
+  // footer.
+  absl::StatusOr<arrow::ipc::RecordBatchFileReader*> GetRecordBatchReader(
+      const std::vector<std::string>& columns) {
+    auto& result = record_batch_readers_[absl::StrJoin(columns, ",")];
+    if (result != nullptr) {
+      return result.get();
+    }
+
+    // Reopen with the column selection. The footer will be served from the
+    // file's read buffer. Record batch messages are fetched as a whole, but
+    // only the buffers of included fields get decompressed.
+    auto record_batch_reader = arrow::ipc::RecordBatchFileReader::Open(
+        file_, IncludedColumnsReadOptions(columns));
+    if (!record_batch_reader.ok()) {
+      return ArrowError(
+          record_batch_reader.status(),
+          absl::StrCat("Failed to open record batch reader for ", url_));
+    }
+    result = *std::move(record_batch_reader);
+    return result.get();
+  }
+
+  // Opens the file and reads its footer, which contains the schema. This is
+  // needed to map column names to field indices.
+  absl::Status OpenFooter() {
+    if (footer_reader_ != nullptr) {
+      return absl::OkStatus();
+    }
+
+    auto file = url_file_.Open();
+    if (!file.ok()) {
+      return file.status();
+    }
+    file_ = *std::move(file);
+
+    auto footer_reader =
+        arrow::ipc::RecordBatchFileReader::Open(file_, DefaultIpcReadOptions());
+    if (!footer_reader.ok()) {
+      return ArrowError(
+          footer_reader.status(),
+          absl::StrCat("Failed to open record batch reader for ", url_));
+    }
+    footer_reader_ = *std::move(footer_reader);
+    return absl::OkStatus();
+  }
+
+  ArrowUrlFile& url_file_;
+  const std::string_view url_;
+  const std::shared_ptr<TrackingMemoryPool> memory_pool_;
+  std::shared_ptr<arrow::io::RandomAccessFile> file_;
+  std::shared_ptr<arrow::ipc::RecordBatchFileReader> footer_reader_;
+  // Locations of the record batch messages, for ranged decoding.
+  std::vector<IpcBlock> blocks_;
+  // Keyed by the joined column selection.
+  absl::flat_hash_map<std::string,
+                      std::shared_ptr<arrow::ipc::RecordBatchFileReader>>
+      record_batch_readers_;
+};
+
+// The result of a range of record batches of a URL, or of planning the scan
+// of a URL.
+struct MorselResult {
+  size_t url_index = 0;
+  int first_record_batch = -1;  // -1 for planning.
+  absl::StatusOr<arrow::RecordBatchVector> record_batches =
+      arrow::RecordBatchVector{};
+};
+
+// Hands out the results of morsels processed by the scheduler in the order in
+// which they complete. The number of results isn't known upfront, as URLs are
+// only split into morsels once their footers have been read.
+class CompletedResults {
+ public:
+  // Announces `num_results` further results. This has to be called before the
+  // corresponding results can be added.
+  void Expect(const size_t num_results) {
+    absl::MutexLock l(&mu_);
+    num_expected_ += num_results;
+  }
+
+  // Calls `listener` whenever a result is added or the results get
+  // cancelled, so callers can wait for results without blocking a thread.
+  // The listener is called from worker threads and must not block. It has to
+  // be set before any results are added.
+  void SetListener(std::function<void()> listener) {
+    listener_ = std::move(listener);
+  }
+
+  void Add(MorselResult result) {
+    {
+      absl::MutexLock l(&mu_);
+      results_.push(std::move(result));
+    }
+    Notify();
+  }
+
+  // Stops handing out results, e.g. because the query failed.
+  void Cancel() {
+    {
+      absl::MutexLock l(&mu_);
+      cancelled_ = true;
+    }
+    Notify();
+  }
+
+  // Blocks until a result is available, but at most for the given timeout.
+  // Returns nullopt on timeout, once all expected results have been handed
+  // out, or once cancelled. The latter two are indicated by finished().
+  std::optional<MorselResult> Next(
+      const absl::Duration timeout = absl::InfiniteDuration()) {
+    absl::MutexLock l(&mu_);
+    mu_.AwaitWithTimeout(
+        absl::Condition(this, &CompletedResults::ResultAvailableOrFinished),
+        timeout);
+    if (cancelled_ || results_.empty()) {
+      return std::nullopt;
+    }
+    auto result = std::move(results_.front());
+    results_.pop();
+    ++num_returned_;
+    return result;
+  }
+
+  bool finished() const {
+    absl::MutexLock l(&mu_);
+    return Finished();
+  }
+
+ private:
+  bool Finished() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return cancelled_ || num_returned_ == num_expected_;
+  }
+
+  bool ResultAvailableOrFinished() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return !results_.empty() || Finished();
+  }
+
+  void Notify() const {
+    if (listener_ != nullptr) {
+      listener_();
+    }
+  }
+
+  std::function<void()> listener_;
+  mutable absl::Mutex mu_;
+  std::queue<MorselResult> results_ ABSL_GUARDED_BY(mu_);
+  size_t num_expected_ ABSL_GUARDED_BY(mu_) = 0;
+  size_t num_returned_ ABSL_GUARDED_BY(mu_) = 0;
+  bool cancelled_ ABSL_GUARDED_BY(mu_) = false;
+};
+
+// Hands out the URLs of a query for fetching in order, so that at most
+// `size` of them are being fetched or hold fetched data at the same time.
+class PrefetchWindow {
+ public:
+  using StartFetch = std::function<void(size_t url_index)>;
+
+  explicit PrefetchWindow(const size_t size) : size_(size) {}
+
+  // Starts fetching `num_urls` URLs, calling `start_fetch` for each of them
+  // once there's room in the window. `start_fetch` is called while holding a
+  // lock, so it must not block.
+  void Start(const size_t num_urls, StartFetch start_fetch) {
+    absl::MutexLock l(&mu_);
+    num_urls_ = num_urls;
+    start_fetch_ = std::move(start_fetch);
+    Fill();
+  }
+
+  // Frees the slot of a URL that no longer holds fetched data, which starts
+  // the next fetch.
+  void Release() {
+    absl::MutexLock l(&mu_);
+    --num_active_;
+    Fill();
+  }
+
+  // Stops starting further fetches.
+  void Close() {
+    absl::MutexLock l(&mu_);
+    closed_ = true;
+  }
+
+ private:
+  void Fill() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    while (!closed_ && num_active_ < size_ && next_url_index_ < num_urls_) {
+      ++num_active_;
+      start_fetch_(next_url_index_++);
+    }
+  }
+
+  const size_t size_;
+  absl::Mutex mu_;
+  StartFetch start_fetch_ ABSL_GUARDED_BY(mu_);
+  size_t num_urls_ ABSL_GUARDED_BY(mu_) = 0;
+  size_t next_url_index_ ABSL_GUARDED_BY(mu_) = 0;
+  size_t num_active_ ABSL_GUARDED_BY(mu_) = 0;
+  bool closed_ ABSL_GUARDED_BY(mu_) = false;
+};
+
+// State that's shared by all tasks of a query.
+struct QueryContext {
+  QueryContext(const UrlReader& url_reader, FooterCache* const footer_cache,
+               RecordBatchCache* const record_batch_cache,
+               InvertedIndexCache* const inverted_index_cache,
+               MemoryBudget* const memory_budget,
+               std::vector<std::string> arrow_urls,
+               std::shared_ptr<const ScannerOptions> scanner_options,
+               Scheduler* const scheduler, Scheduler* const io_scheduler)
+      : url_reader(url_reader),
+        footer_cache(*footer_cache),
+        record_batch_cache(*record_batch_cache),
+        inverted_index_cache(*inverted_index_cache),
+        memory_budget(*memory_budget),
+        shared_memory_pool(std::make_shared<TrackingMemoryPool>(
+            memory_budget, absl::GetFlag(FLAGS_query_memory_limit_bytes))),
+        memory_pool(*shared_memory_pool),
+        arrow_urls(std::move(arrow_urls)),
+        scanner_options(std::move(scanner_options)),
+        start_nanos(MonotonicNanos()),
+        stop_token(stop_source.token()),
+        prefetch_window(static_cast<size_t>(
+            std::max(1, absl::GetFlag(FLAGS_prefetch_window)))),
+        io_task_group(io_scheduler),
+        task_group(scheduler),
+        num_workers(scheduler->num_threads()) {}
+
+  // Tasks reference the query, so we need to wait for them, even if the
+  // query returned early. Fetches schedule CPU tasks, and finished URLs start
+  // further fetches, so fetching is stopped before waiting for both. Morsels
+  // that still wait for memory aren't needed anymore, and admitted ones may
+  // be scheduled until they're done.
+  ~QueryContext() {
+    StopWork(absl::CancelledError("The query is done"));
+    prefetch_window.Close();
+    io_task_group.Wait();
+    task_group.Wait();
+    {
+      absl::MutexLock l(&admissions->mu);
+      admissions->mu.Await(absl::Condition(
+          +[](int* const pending) { return *pending == 0; },
+          &admissions->pending));
+    }
+    // Record batches that stay cached are bounded by the cache instead.
+    memory_pool.DetachFromBudget();
+  }
+
+  // Stops all work of the query as soon as possible: pending tasks return
+  // immediately, running ones at their next check, and ongoing downloads
+  // between chunks. Only the first reason is kept.
+  void Cancel(const absl::Status& reason) {
+    if (StopWork(reason)) {
+      completed_results.Cancel();
+    }
+  }
+
+  bool IsCancelled() const { return stop_token.IsStopRequested(); }
+
+  // Adds the result of a task. An error fails the whole query, so the
+  // remaining work gets cancelled.
+  void AddResult(MorselResult result) {
+    if (!result.record_batches.ok()) {
+      Cancel(result.record_batches.status());
+    }
+    completed_results.Add(std::move(result));
+  }
+
+  // Returns OK if the query hasn't been cancelled.
+  absl::Status CancelReason() const {
+    absl::MutexLock l(&cancel_mu);
+    return cancel_reason;
+  }
+
+  // Stops the tasks of the query and fails its morsels that wait for memory.
+  // Returns false if the query was stopped already.
+  bool StopWork(const absl::Status& reason) {
+    {
+      absl::MutexLock l(&cancel_mu);
+      if (!cancel_reason.ok()) {
+        return false;
+      }
+      cancel_reason = reason;
+    }
+    stop_source.RequestStop(arrow::Status::Cancelled(reason.message()));
+    memory_budget.CancelReservations(this, reason);
+    return true;
+  }
+
+  const UrlReader& url_reader;
+  FooterCache& footer_cache;
+  RecordBatchCache& record_batch_cache;
+  InvertedIndexCache& inverted_index_cache;
+  MemoryBudget& memory_budget;
+  // For the memory owned by the query, including the record batches it
+  // decodes. Cached record batches share it, so it may outlive the query.
+  // Declared before the results, which reference it.
+  const std::shared_ptr<TrackingMemoryPool> shared_memory_pool;
+  TrackingMemoryPool& memory_pool;
+  const std::vector<std::string> arrow_urls;
+  // Only set for queries on a resident dataset, whose files are the URLs.
+  // Holding on to it keeps the files alive if the dataset gets reloaded.
+  std::shared_ptr<const ResidentDataset> resident_dataset;
+  // Shared with prepared queries, which reuse them across executions.
+  const std::shared_ptr<const ScannerOptions> scanner_options;
+  // Only set for sorted queries, which keep their first rows instead of all
+  // matches.
+  std::unique_ptr<TopK> top_k;
+  // Only set for aggregation queries. Morsels merge their partial aggregates
+  // into it.
+  absl::Mutex aggregates_mu;
+  std::optional<GroupedAggregates> aggregates ABSL_GUARDED_BY(aggregates_mu);
+  // Only set if the response gets cached. The key is completed by the
+  // generations of the URLs, which are then resolved upfront. With ranged
+  // reads, that opens the files, which are kept for the fetches, so their
+  // reads are pinned to the same generations.
+  ResultCache* result_cache = nullptr;
+  std::string result_cache_key;
+  std::vector<absl::StatusOr<std::string>> generations;
+  std::vector<std::unique_ptr<ArrowUrlFile>> url_files;
+  std::shared_ptr<const seqr::QueryResponse> cached_response;
+  // Only set for profiled queries, by URL index.
+  std::vector<std::unique_ptr<UrlProfile>> url_profiles;
+  const int64_t start_nanos;
+  // Number of filtered rows across URLs. For sorted queries, only rows after
+  // the page token are counted.
+  std::atomic<size_t> num_rows = 0;
+  CompletedResults completed_results;
+  arrow::StopSource stop_source;
+  const arrow::StopToken stop_token;
+  mutable absl::Mutex cancel_mu;
+  absl::Status cancel_reason ABSL_GUARDED_BY(cancel_mu);
+  PrefetchWindow prefetch_window;
+  // Fetches run on the I/O threads, so CPU workers don't block on the
+  // network.
+  Scheduler::TaskGroup io_task_group;
+  Scheduler::TaskGroup task_group;
+  // The morsels of a query run on up to all workers at the same time.
+  const int num_workers;
+  // Morsels that wait for their estimated memory or have been admitted and
+  // not processed yet, see ScheduleMorselWithinBudget. Shared with their
+  // callbacks, which may outlive the query's destructor by a few
+  // instructions.
+  struct Admissions {
+    absl::Mutex mu;
+    int pending ABSL_GUARDED_BY(mu) = 0;
+  };
+  const std::shared_ptr<Admissions> admissions =
+      std::make_shared<Admissions>();
+};
+
+// Like LruCache::GetOrLoad, for loaders that stop when the query gets
+// cancelled. Concurrent loads of the same key are shared across queries, so
+// if another query's load got cancelled, it's retried for this query. Errors
+// aren't cached, so the retry runs the loader again.
+template <typename Value>
+absl::StatusOr<std::shared_ptr<const Value>> GetOrLoadUnlessCancelled(
+    const QueryContext& context, LruCache<Value>* const cache,
+    const std::string& key, const typename LruCache<Value>::Loader& loader) {
+  while (true) {
+    auto result = cache->GetOrLoad(key, loader);
+    if (result.ok() || !absl::IsCancelled(result.status()) ||
+        context.IsCancelled()) {
+      return result;
+    }
+  }
+}
+
+// The scan of a URL, shared by its morsels.
+struct UrlScan {
+  explicit UrlScan(PrefetchWindow* const prefetch_window)
+      : prefetch_window(prefetch_window) {}
+
+  UrlScan(const UrlScan&) = delete;
+  UrlScan& operator=(const UrlScan&) = delete;
+
+  ~UrlScan() { ReleasePrefetchSlot(); }
+
+  // Lets the next URL of the query be fetched. Called once the scan no longer
+  // holds fetched data, at the latest when it's destroyed.
+  void ReleasePrefetchSlot() {
+    if (prefetch_window != nullptr) {
+      prefetch_window->Release();
+      prefetch_window = nullptr;
+    }
+  }
+
+  PrefetchWindow* prefetch_window;
+  size_t url_index = 0;  // Within the query's URLs.
+  std::unique_ptr<ArrowUrlFile> url_file;
+  // Only set for the files of resident datasets, which are read from memory
+  // instead of url_file.
+  std::shared_ptr<const ResidentFile> resident_file;
+  std::string file_key;  // URL and generation.
+  std::shared_ptr<const ArrowFileFooter> footer;
+  // With sample IDs resolved for the file's sample index.
+  ScannerOptions scanner_options;
+  // Inverted indexes of the columns that can restrict the matching rows,
+  // keyed by column name.
+  absl::flat_hash_map<std::string, std::shared_ptr<const FileInvertedIndex>>
+      inverted_indexes;
+  // Only set for profiled queries.
+  UrlProfile* profile = nullptr;
+};
+
+// Returns the key of a record batch in the cache. As only the given columns
+// are decoded, they're part of the key too.
+std::string RecordBatchCacheKey(const std::string& file_key,
+                                const std::vector<std::string>& columns,
+                                const int record_batch_index) {
+  return absl::StrCat(file_key, "#", absl::StrJoin(columns, ","), "#",
+                      record_batch_index);
+}
+
+// Returns the rows of a record batch that may match, as far as the inverted
+// indexes of the file can tell.
+std::optional<IndexedFilter> EvaluateWithFileIndexes(
+    const UrlScan& url_scan, const int record_batch_index) {
+  InvertedIndexes indexes;
+  for (const auto& [column, file_index] : url_scan.inverted_indexes) {
+    indexes.emplace(column, file_index->record_batches[record_batch_index]);
+  }
+  return EvaluateWithIndexes(url_scan.scanner_options.filter_expression,
+                             indexes);
+}
+
+// Fetches the filter columns of the given record batches with the reader,
+// so the worker that processes them doesn't wait on the network. Runs on an
+// I/O thread. Record batches that are cached already, or whose matches the
+// inverted indexes determine without the filter columns, are skipped.
+absl::Status FetchMorsel(QueryContext* const context, const UrlScan& url_scan,
+                         const std::vector<int>& record_batch_indices,
+                         LazyArrowFileReader* const reader) {
+  const auto& columns = url_scan.scanner_options.filter_columns;
+  for (const int i : record_batch_indices) {
+    if (context->IsCancelled()) {
+      return context->CancelReason();
+    }
+    if (context->record_batch_cache.Contains(
+            RecordBatchCacheKey(url_scan.file_key, columns, i))) {
+      continue;
+    }
+    if (!url_scan.inverted_indexes.empty()) {
+      const auto indexed_filter = EvaluateWithFileIndexes(url_scan, i);
+      if (indexed_filter &&
+          (indexed_filter->rows.empty() || indexed_filter->exact)) {
+        continue;
+      }
+    }
+    if (const auto status = reader->FetchRecordBatch(i, columns);
+        !status.ok()) {
+      return status;
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Returns the matching rows of the given record batches, read with the given
+// reader. Decoded record batches are served from the cache if possible.
+// Concurrent requests for the same record batch only read it once. For sorted
+// and aggregation queries, matches are added to the query's first rows or
+// aggregates instead. With a profile, each record batch is recorded in it.
+absl::StatusOr<arrow::RecordBatchVector> ProcessMorsel(
+    QueryContext* const context, const UrlScan& url_scan,
+    LazyArrowFileReader* const reader,
+    const std::vector<int>& record_batch_indices,
+    seqr::QueryProfile::Morsel* const profile) {
+  const std::string& url = url_scan.url_file->url();
+  const size_t max_rows = context->scanner_options->max_rows;
+  arrow::RecordBatchVector result;
+  for (const int i : record_batch_indices) {
+    // Checked between record batches, so cancelled queries stop early.
+    if (context->IsCancelled()) {
+      return context->CancelReason();
+    }
+
+    // Resident files are decoded already, so they bypass the cache.
+    const auto loader = [context, &url_scan, &file_key = url_scan.file_key,
+                         reader, i](const std::vector<std::string>& columns)
+        -> absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> {
+      // The scan loads filter and projection columns separately.
+      if (context->IsCancelled()) {
+        return context->CancelReason();
+      }
+      if (url_scan.resident_file != nullptr) {
+        return SelectResidentColumns(*url_scan.resident_file, i, columns);
+      }
+      const auto decoded_record_batch = GetOrLoadUnlessCancelled(
+          *context, &context->record_batch_cache,
+          RecordBatchCacheKey(file_key, columns, i), [reader, i, &columns] {
+            return reader->ReadRecordBatch(i, columns);
+          });
+      if (!decoded_record_batch.ok()) {
+        return decoded_record_batch.status();
+      }
+      return (*decoded_record_batch)->record_batch;
+    };
+
+    seqr::QueryProfile::RecordBatch* record_batch_profile = nullptr;
+    if (profile != nullptr) {
+      record_batch_profile = profile->add_record_batches();
+      record_batch_profile->set_index(i);
+    }
+
+    // The indexes were built when the file was planned.
+    const int64_t index_start =
+        record_batch_profile != nullptr ? MonotonicNanos() : 0;
+    const auto indexed_filter = EvaluateWithFileIndexes(url_scan, i);
+    if (record_batch_profile != nullptr) {
+      record_batch_profile->set_index_nanos(MonotonicNanos() - index_start);
+    }
+
+    // Filtered results are owned by the query, so they're allocated from its
+    // pool.
+    auto record_batch = ScanRecordBatch(
+        url_scan.scanner_options, loader,
+        indexed_filter ? &*indexed_filter : nullptr, &context->memory_pool,
+        record_batch_profile);
+    if (!record_batch.ok()) {
+      if (context->memory_pool.limit_exceeded()) {
+        return QueryMemoryLimitError(context->memory_pool.limit_bytes());
+      }
+      return absl::InvalidArgumentError(
+          absl::StrCat("Failed to scan record batch ", i, " of ", url, ": ",
+                       record_batch.status().message()));
+    }
+    if (*record_batch == nullptr) {
+      continue;
+    }
+    if (context->top_k != nullptr) {
+      auto with_positions = context->top_k->AddPositions(
+          *std::move(record_batch), static_cast<int>(url_scan.url_index), i);
+      if (!with_positions.ok()) {
+        if (context->memory_pool.limit_exceeded()) {
+          return QueryMemoryLimitError(context->memory_pool.limit_bytes());
+        }
+        return with_positions.status();
+      }
+      result.push_back(*std::move(with_positions));
+      continue;
+    }
+    if (!context->scanner_options->aggregation.has_value()) {
+      context->num_rows += (*record_batch)->num_rows();
+      if (context->num_rows > max_rows) {
+        context->Cancel(MaxRowsExceededError(max_rows));
+      }
+    }
+    result.push_back(*std::move(record_batch));
+  }
+
+  // Only the first rows of the morsel are kept, so sorted queries stay
+  // within their memory limit regardless of the number of matches.
+  if (context->top_k != nullptr) {
+    const auto num_rows = context->top_k->Add(result);
+    if (!num_rows.ok()) {
+      if (context->memory_pool.limit_exceeded()) {
+        return QueryMemoryLimitError(context->memory_pool.limit_bytes());
+      }
+      return absl::InvalidArgumentError(
+          absl::StrCat("Failed to sort rows of ", url, ": ",
+                       num_rows.status().message()));
+    }
+    context->num_rows += *num_rows;
+    return arrow::RecordBatchVector();
+  }
+
+  // Matches are aggregated per morsel without holding a lock, so only merging
+  // the much smaller partial aggregates is serialized.
+  if (const auto& aggregation = context->scanner_options->aggregation;
+      aggregation.has_value()) {
+    GroupedAggregates partial_aggregates(*aggregation, &context->memory_pool);
+    for (const auto& record_batch : result) {
+      if (const auto status = partial_aggregates.Add(*record_batch);
+          !status.ok()) {
+        if (context->memory_pool.limit_exceeded()) {
+          return QueryMemoryLimitError(context->memory_pool.limit_bytes());
+        }
+        return absl::Status(status.code(),
+                            absl::StrCat("Failed to aggregate rows of ", url,
+                                         ": ", status.message()));
+      }
+    }
+    absl::MutexLock lock(&context->aggregates_mu);
+    if (const auto status =
+            context->aggregates->Merge(std::move(partial_aggregates));
+        !status.ok()) {
+      return status;
+    }
+    if (context->aggregates->num_groups() > max_rows) {
+      context->Cancel(MaxRowsExceededError(max_rows));
+    }
+    return arrow::RecordBatchVector();
+  }
+
+  return result;
+}
+
+// A morsel on its way from admission through fetching to processing.
+struct AdmittedMorsel {
+  size_t url_index = 0;
+  std::shared_ptr<const UrlScan> url_scan;
+  std::vector<int> record_batch_indices;
+  int64_t estimated_bytes = 0;
+  seqr::QueryProfile::Morsel* profile = nullptr;
+  std::unique_ptr<LazyArrowFileReader> reader;
+  int64_t scheduled_nanos = 0;
+};
+
+// Schedules a morsel once its estimated memory fits into the server's
+// budget. Waiting doesn't occupy a worker: the budget admits the morsel when
+// enough memory gets released, and only then is it handed on. With ranged
+// reads, an I/O thread fetches its filter columns first, while the URL
+// holds a slot of the query's prefetch window, so the worker doesn't wait
+// on the network. The reservation is released after processing, as the
+// memory that the results hold is counted by the query's pool.
+void ScheduleMorselWithinBudget(QueryContext* const context,
+                                const size_t url_index,
+                                std::shared_ptr<const UrlScan> url_scan,
+                                std::vector<int> record_batch_indices,
+                                const int64_t estimated_bytes,
+                                seqr::QueryProfile::Morsel* const profile) {
+  const auto admissions = context->admissions;
+  const auto done = [admissions] {
+    absl::MutexLock l(&admissions->mu);
+    --admissions->pending;
+  };
+  {
+    absl::MutexLock l(&admissions->mu);
+    ++admissions->pending;
+  }
+  auto morsel = std::make_shared<AdmittedMorsel>();
+  morsel->url_index = url_index;
+  morsel->url_scan = std::move(url_scan);
+  morsel->record_batch_indices = std::move(record_batch_indices);
+  morsel->estimated_bytes = estimated_bytes;
+  morsel->profile = profile;
+  const int64_t reserve_start = profile != nullptr ? MonotonicNanos() : 0;
+  context->memory_budget.ReserveAsync(
+      estimated_bytes, absl::GetFlag(FLAGS_memory_admission_timeout), context,
+      [context, morsel, reserve_start, done](const absl::Status& status) {
+        const auto finish = [context, morsel, done](
+                                absl::StatusOr<arrow::RecordBatchVector>
+                                    result) {
+          context->memory_budget.Release(morsel->estimated_bytes);
+          context->AddResult(MorselResult{morsel->url_index,
+                                          morsel->record_batch_indices.front(),
+                                          std::move(result)});
+          done();
+        };
+        if (!status.ok()) {
+          context->AddResult(MorselResult{
+              morsel->url_index, morsel->record_batch_indices.front(),
+              status});
+          done();
+          return;
+        }
+        if (morsel->profile != nullptr) {
+          morsel->scheduled_nanos = MonotonicNanos();
+          morsel->profile->set_memory_wait_nanos(morsel->scheduled_nanos -
+                                                 reserve_start);
+        }
+        const UrlScan& url_scan = *morsel->url_scan;
+        if (url_scan.resident_file == nullptr) {
+          morsel->reader = std::make_unique<LazyArrowFileReader>(
+              url_scan.url_file.get(), context->shared_memory_pool);
+        }
+
+        const auto process = [context, morsel, finish] {
+          if (morsel->profile != nullptr) {
+            morsel->profile->set_queue_nanos(MonotonicNanos() -
+                                             morsel->scheduled_nanos);
+          }
+          if (context->IsCancelled()) {
+            finish(context->CancelReason());
+            return;
+          }
+          finish(ProcessMorsel(context, *morsel->url_scan,
+                               morsel->reader.get(),
+                               morsel->record_batch_indices, morsel->profile));
+        };
+        if (morsel->reader == nullptr ||
+            !absl::GetFlag(FLAGS_ranged_reads)) {
+          context->task_group.Schedule(process);
+          return;
+        }
+        context->io_task_group.Schedule([context, morsel, finish, process] {
+          const auto status =
+              context->IsCancelled()
+                  ? context->CancelReason()
+                  : FetchMorsel(context, *morsel->url_scan,
+                                morsel->record_batch_indices,
+                                morsel->reader.get());
+          if (!status.ok()) {
+            finish(status);
+            return;
+          }
+          context->task_group.Schedule(process);
+        });
+      });
+  // Otherwise a query that got cancelled in the meantime might keep waiting.
+  if (context->IsCancelled()) {
+    context->memory_budget.CancelReservations(context,
+                                              context->CancelReason());
+  }
+}
+
+// Returns the estimated memory needed to decode a record batch of a file.
+int64_t EstimateDecodedBytes(const ArrowFileFooter& footer,
+                             const int record_batch_index) {
+  const auto& zone_map = footer.zone_map;
+  if (zone_map &&
+      zone_map->record_batches_size() == footer.num_record_batches &&
+      zone_map->record_batches(record_batch_index).uncompressed_bytes() > 0) {
+    return zone_map->record_batches(record_batch_index).uncompressed_bytes();
+  }
+
+  // Otherwise assume that all record batches have a similar size.
+  int64_t file_bytes =
+      zone_map && zone_map->has_file() ? zone_map->file().uncompressed_bytes()
+                                       : 0;
+  if (file_bytes == 0) {
+    file_bytes = static_cast<int64_t>(
+        footer.file_size * absl::GetFlag(FLAGS_default_expansion_factor));
+  }
+  return file_bytes / std::max(1, footer.num_record_batches);
+}
+
+// Returns the key of a file in the caches. Including the generation that
+// reads of the file are pinned to guarantees that stale entries are never
+// used, even if files get overwritten.
+std::string FileKey(const std::string_view url,
+                    const std::string_view generation) {
+  return absl::StrCat(url, "#", generation);
+}
+
+// Resolves the generation of a URL of the query ahead of fetching it. Files
+// of resident datasets keep the generation they were loaded with. With
+// ranged reads, the file is opened, which pins the generation for all its
+// reads, and kept for the fetch. Otherwise the download is pinned to the
+// generation.
+absl::StatusOr<std::string> ResolveUrlGeneration(QueryContext* const context,
+                                                 const size_t url_index) {
+  if (context->resident_dataset != nullptr) {
+    return context->resident_dataset->files[url_index]->generation;
+  }
+  const std::string& url = context->arrow_urls[url_index];
+  if (!absl::GetFlag(FLAGS_ranged_reads)) {
+    auto generation = context->url_reader.GetGeneration(url);
+    if (!generation.ok()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Failed to get generation of ", url, ": ",
+                       generation.status().message()));
+    }
+    return generation;
+  }
+  auto url_file = std::make_unique<ArrowUrlFile>(
+      context->url_reader, url, /* generation */ "", &context->memory_pool,
+      context->stop_token,
+      context->url_profiles.empty() ? nullptr
+                                    : context->url_profiles[url_index].get());
+  if (const auto file = url_file->Open(); !file.ok()) {
+    return file.status();
+  }
+  std::string generation = url_file->generation();
+  context->url_files[url_index] = std::move(url_file);
+  return generation;
+}
+
+// Fetches the footer of the given URL, and without ranged reads the whole
+// file, unless its footer is cached. Unless the generation has been resolved
+// already, this pins it. Runs on an I/O thread. Files of resident datasets
+// are taken from memory instead.
+absl::Status FetchUrl(QueryContext* const context, UrlScan* const url_scan,
+                      const size_t url_index) {
+  if (context->IsCancelled()) {
+    return context->CancelReason();
+  }
+
+  url_scan->url_index = url_index;
+  const std::string& url = context->arrow_urls[url_index];
+  if (context->resident_dataset != nullptr) {
+    const auto& resident_file = context->resident_dataset->files[url_index];
+    url_scan->url_file = std::make_unique<ArrowUrlFile>(
+        context->url_reader, url, resident_file->generation,
+        &context->memory_pool, context->stop_token, url_scan->profile);
+    url_scan->file_key = FileKey(url, resident_file->generation);
+    url_scan->resident_file = resident_file;
+    auto footer = context->footer_cache.GetOrLoad(
+        url_scan->file_key, [&resident_file] {
+          return BuildArrowFileFooter(
+              resident_file->schema,
+              static_cast<int>(resident_file->record_batches.size()),
+              resident_file->file_size, resident_file->url);
+        });
+    if (!footer.ok()) {
+      return footer.status();
+    }
+    url_scan->footer = *std::move(footer);
+    url_scan->ReleasePrefetchSlot();
+    return absl::OkStatus();
+  }
+
+  // Generations have been resolved already if the response gets cached.
+  std::string generation;
+  if (!context->generations.empty()) {
+    const auto& resolved_generation = context->generations[url_index];
+    if (!resolved_generation.ok()) {
+      return resolved_generation.status();
+    }
+    generation = *resolved_generation;
+    url_scan->url_file = std::move(context->url_files[url_index]);
+  }
+  if (url_scan->url_file == nullptr) {
+    url_scan->url_file = std::make_unique<ArrowUrlFile>(
+        context->url_reader, url, generation, &context->memory_pool,
+        context->stop_token, url_scan->profile);
+  }
+
+  // Otherwise the first read of the file pins its generation, which all
+  // further reads and the cache keys use.
+  const bool ranged_reads = absl::GetFlag(FLAGS_ranged_reads);
+  if (!ranged_reads &&
+      (generation.empty() ||
+       !context->footer_cache.Contains(FileKey(url, generation)))) {
+    const int64_t start = MonotonicNanos();
+    auto data = context->url_reader.Read(url, context->stop_token, &generation);
+    if (!data.ok()) {
+      return absl::Status(data.status().code(),
+                          absl::StrCat("Failed to read ", url, ": ",
+                                       data.status().message()));
+    }
+    if (url_scan->profile != nullptr) {
+      url_scan->profile->read_nanos += MonotonicNanos() - start;
+      url_scan->profile->read_bytes += (*data)->size();
+    }
+    url_scan->url_file->SetDownloaded(*std::move(data), generation);
+  } else if (generation.empty()) {
+    if (const auto file = url_scan->url_file->Open(); !file.ok()) {
+      return file.status();
+    }
+    generation = url_scan->url_file->generation();
+  }
+  url_scan->file_key = FileKey(url, generation);
+
+  LazyArrowFileReader reader(url_scan->url_file.get(),
+                             context->shared_memory_pool);
+  auto footer = GetOrLoadUnlessCancelled(
+      *context, &context->footer_cache, url_scan->file_key,
+      [&reader] { return reader.ReadFooter(); });
+  if (!footer.ok()) {
+    return footer.status();
+  }
+  // With ranged reads, the slot is held until the morsels, which fetch their
+  // record batch ranges on the I/O threads, are done with the file.
+  url_scan->footer = *std::move(footer);
+  return absl::OkStatus();
+}
+
+// Builds the inverted indexes of a column for all record batches of a
+// file. The decoded column isn't cached itself.
+absl::StatusOr<std::shared_ptr<const FileInvertedIndex>>
+BuildFileInvertedIndex(const QueryContext& context, const UrlScan& url_scan,
+                       const std::string& column) {
+  LazyArrowFileReader reader(url_scan.url_file.get(),
+                             context.shared_memory_pool);
+  auto result = std::make_shared<FileInvertedIndex>();
+  for (int i = 0; i < url_scan.footer->num_record_batches; ++i) {
+    if (context.IsCancelled()) {
+      return context.CancelReason();
+    }
+    std::shared_ptr<arrow::RecordBatch> record_batch;
+    if (url_scan.resident_file != nullptr) {
+      auto selected =
+          SelectResidentColumns(*url_scan.resident_file, i, {column});
+      if (!selected.ok()) {
+        return selected.status();
+      }
+      record_batch = *std::move(selected);
+    } else {
+      auto decoded_record_batch = reader.ReadRecordBatch(i, {column});
+      if (!decoded_record_batch.ok()) {
+        return decoded_record_batch.status();
+      }
+      record_batch = (*decoded_record_batch)->record_batch;
+    }
+    auto index = InvertedIndex::Build(*record_batch->column(0));
+    if (!index.ok()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Failed to build index of ", column,
+                       " for record batch ", i, " of ",
+                       url_scan.url_file->url(), ": ",
+                       index.status().message()));
+    }
+    result->size_bytes += (*index)->SizeBytes();
+    result->record_batches.push_back(*std::move(index));
+  }
+  return result;
+}
+
+// Prunes record batches of a fetched URL that can't match and schedules a
+// task per morsel for the remaining ones.
+absl::Status ScheduleMorsels(QueryContext* const context,
+                             const size_t url_index,
+                             std::shared_ptr<UrlScan> url_scan) {
+  if (context->IsCancelled()) {
+    return context->CancelReason();
+  }
+
+  const std::string& url = url_scan->url_file->url();
+  const ArrowFileFooter& footer = *url_scan->footer;
+
+  // Sample bitset columns are specific to the file's sample index.
+  auto filter_expression = ResolveSampleBitsetSamples(
+      context->scanner_options->filter_expression, footer.sample_index);
+  if (!filter_expression.ok()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Failed to resolve samples for ", url, ": ",
+                     filter_expression.status().message()));
+  }
+  url_scan->scanner_options = *context->scanner_options;
+  if (!filter_expression->Equals(url_scan->scanner_options.filter_expression)) {
+    url_scan->scanner_options.filter_expression =
+        *std::move(filter_expression);
+    // Bindings of the query's filter don't apply to the resolved one.
+    url_scan->scanner_options.bound_filters =
+        std::make_shared<BoundFilterCache>();
+  }
+
+  // Skip the whole file or individual record batches if their statistics
+  // rule out any matches.
+  if (url_scan->profile != nullptr) {
+    url_scan->profile->num_record_batches = footer.num_record_batches;
+    url_scan->profile->pruned_record_batches = footer.num_record_batches;
+  }
+  const auto& zone_map = footer.zone_map;
+  if (zone_map && zone_map->has_file() &&
+      !MayMatch(url_scan->scanner_options.filter_expression,
+                zone_map->file())) {
+    return absl::OkStatus();
+  }
+  const bool has_record_batch_statistics =
+      zone_map && zone_map->record_batches_size() == footer.num_record_batches;
+  std::vector<int> record_batch_indices;
+  for (int i = 0; i < footer.num_record_batches; ++i) {
+    if (!has_record_batch_statistics ||
+        MayMatch(url_scan->scanner_options.filter_expression,
+                 zone_map->record_batches(i))) {
+      record_batch_indices.push_back(i);
+    }
+  }
+  if (url_scan->profile != nullptr) {
+    url_scan->profile->pruned_record_batches =
+        footer.num_record_batches -
+        static_cast<int>(record_batch_indices.size());
+  }
+
+  // Indexes cover the whole file, so they're shared by all its morsels and
+  // by later queries, whichever record batches they don't prune.
+  for (auto& column :
+       GetIndexableColumns(url_scan->scanner_options.filter_expression,
+                           absl::GetFlag(FLAGS_inverted_index_columns))) {
+    const auto field = footer.schema->GetFieldByName(column);
+    if (record_batch_indices.empty() || field == nullptr ||
+        !InvertedIndex::CanIndex(*field->type())) {
+      continue;
+    }
+    auto file_index = GetOrLoadUnlessCancelled(
+        *context, &context->inverted_index_cache,
+        absl::StrCat(url_scan->file_key, "#", column),
+        [context, &url_scan, &column] {
+          return BuildFileInvertedIndex(*context, *url_scan, column);
+        });
+    if (!file_index.ok()) {
+      return file_index.status();
+    }
+    url_scan->inverted_indexes.emplace(std::move(column),
+                                       *std::move(file_index));
+  }
+
+  // Split the record batches into morsels, so large files are spread across
+  // workers.
+  const size_t morsel_size = static_cast<size_t>(
+      std::max(1, absl::GetFlag(FLAGS_morsel_record_batches)));
+  std::vector<std::pair<std::vector<int>, int64_t>> morsels;
+  for (size_t begin = 0; begin < record_batch_indices.size();
+       begin += morsel_size) {
+    std::vector<int> morsel(
+        record_batch_indices.begin() + begin,
+        record_batch_indices.begin() +
+            std::min(begin + morsel_size, record_batch_indices.size()));
+    // Resident files don't need to be decoded.
+    int64_t estimated_bytes = 0;
+    for (const int i : morsel) {
+      if (url_scan->resident_file == nullptr) {
+        estimated_bytes += EstimateDecodedBytes(footer, i);
+      }
+    }
+    morsels.emplace_back(std::move(morsel), estimated_bytes);
+  }
+
+  // The largest morsels may all run at the same time, so if they could never
+  // fit into the query's memory limit together, the query is rejected before
+  // anything gets scheduled.
+  std::vector<int64_t> morsel_bytes;
+  for (const auto& [morsel, estimated_bytes] : morsels) {
+    morsel_bytes.push_back(estimated_bytes);
+  }
+  const size_t num_concurrent = std::min(
+      morsel_bytes.size(), static_cast<size_t>(context->num_workers));
+  std::partial_sort(morsel_bytes.begin(),
+                    morsel_bytes.begin() + num_concurrent, morsel_bytes.end(),
+                    std::greater<>());
+  const int64_t concurrent_bytes =
+      std::accumulate(morsel_bytes.begin(),
+                      morsel_bytes.begin() + num_concurrent, int64_t{0});
+  if (concurrent_bytes > context->memory_pool.limit_bytes()) {
+    return absl::ResourceExhaustedError(absl::StrCat(
+        "Decoding record batches of ", url, " needs an estimated ",
+        concurrent_bytes, " bytes, exceeding the query memory limit of ",
+        context->memory_pool.limit_bytes(), " bytes"));
+  }
+
+  context->completed_results.Expect(morsels.size());
+  if (url_scan->profile != nullptr) {
+    url_scan->profile->morsels.resize(morsels.size());
+  }
+  for (size_t i = 0; i < morsels.size(); ++i) {
+    auto& [morsel, estimated_bytes] = morsels[i];
+    ScheduleMorselWithinBudget(
+        context, url_index, url_scan, std::move(morsel), estimated_bytes,
+        url_scan->profile != nullptr ? &url_scan->profile->morsels[i]
+                                     : nullptr);
+  }
+  return absl::OkStatus();
 }
 
-// Adapted from the Abseil thread pool.
-class ThreadPool {
- public:
-  explicit ThreadPool(const int num_threads) {
-    assert(num_threads > 0);
-    for (int i = 0; i < num_threads; ++i) {
-      threads_.push_back(std::thread(&ThreadPool::WorkLoop, this));
+// Fetches a URL on an I/O thread and hands it to the workers to schedule its
+// morsels. Adds the URL's planning result to the query.
+void FetchAndScheduleMorsels(QueryContext* const context,
+                             const size_t url_index) {
+  auto url_scan = std::make_shared<UrlScan>(&context->prefetch_window);
+  const int64_t fetch_start = MonotonicNanos();
+  if (!context->url_profiles.empty()) {
+    url_scan->profile = context->url_profiles[url_index].get();
+    url_scan->profile->queue_nanos = fetch_start - context->start_nanos;
+  }
+  const auto fetch_status = FetchUrl(context, url_scan.get(), url_index);
+  if (url_scan->profile != nullptr) {
+    url_scan->profile->fetch_nanos = MonotonicNanos() - fetch_start;
+  }
+  if (!fetch_status.ok()) {
+    MorselResult result{url_index};
+    result.record_batches = fetch_status;
+    context->AddResult(std::move(result));
+    return;
+  }
+  context->task_group.Schedule([context, url_index, url_scan] {
+    const auto status = ScheduleMorsels(context, url_index, url_scan);
+    MorselResult result{url_index};
+    if (!status.ok()) {
+      result.record_batches = status;
+    }
+    context->AddResult(std::move(result));
+  });
+}
+
+// Schedules the processing of all URLs of a query. URLs are fetched on the
+// I/O threads within the query's prefetch window, and their morsels are
+// processed by the workers, so fetching the next files overlaps with
+// processing earlier ones. Results are added to the query's completed
+// results as they become available.
+void FetchArrowUrls(QueryContext* const context) {
+  context->completed_results.Expect(context->arrow_urls.size());
+  context->prefetch_window.Start(
+      context->arrow_urls.size(), [context](const size_t i) {
+        context->io_task_group.Schedule(
+            [context, i] { FetchAndScheduleMorsels(context, i); });
+      });
+}
+
+// Looks up the response of a query in the result cache, once the
+// generations of all its URLs have been resolved. URLs are only fetched on a
+// miss. Adds the lookup's result to the query.
+void LookUpCachedResponse(QueryContext* const context) {
+  MorselResult result{0};
+  if (context->IsCancelled()) {
+    result.record_batches = context->CancelReason();
+    context->AddResult(std::move(result));
+    return;
+  }
+  for (size_t i = 0; i < context->arrow_urls.size(); ++i) {
+    const auto& generation = context->generations[i];
+    if (!generation.ok()) {
+      result.record_batches = generation.status();
+      context->AddResult(std::move(result));
+      return;
     }
+    const std::string& url = context->arrow_urls[i];
+    absl::StrAppend(&context->result_cache_key, "#", url.size(), ":", url,
+                    *generation);
   }
 
-  ThreadPool(const ThreadPool&) = delete;
-  ThreadPool& operator=(const ThreadPool&) = delete;
+  context->cached_response =
+      context->result_cache->Get(context->result_cache_key);
+  if (context->cached_response == nullptr) {
+    FetchArrowUrls(context);
+  }
+  context->AddResult(std::move(result));
+}
 
-  ~ThreadPool() {
-    {
-      absl::MutexLock l(&mu_);
-      for (size_t i = 0; i < threads_.size(); i++) {
-        queue_.push(nullptr);  // Shutdown signal.
+// Like FetchArrowUrls, but if the response of the query gets cached, its
+// generations are resolved in parallel first, to look up the response.
+void ScheduleArrowUrls(QueryContext* const context) {
+  if (context->result_cache == nullptr) {
+    FetchArrowUrls(context);
+    return;
+  }
+
+  const size_t num_urls = context->arrow_urls.size();
+  context->completed_results.Expect(1);
+  context->generations.resize(num_urls);
+  context->url_files.resize(num_urls);
+  if (num_urls == 0) {
+    LookUpCachedResponse(context);
+    return;
+  }
+  const auto num_pending = std::make_shared<std::atomic<size_t>>(num_urls);
+  for (size_t i = 0; i < num_urls; ++i) {
+    context->io_task_group.Schedule([context, i, num_pending] {
+      context->generations[i] =
+          context->IsCancelled()
+              ? absl::StatusOr<std::string>(context->CancelReason())
+              : ResolveUrlGeneration(context, i);
+      if (--*num_pending == 0) {
+        LookUpCachedResponse(context);
       }
+    });
+  }
+}
+
+// An output stream that accumulates written data in memory until it's taken
+// out, so IPC messages can be sent incrementally.
+class StringOutputStream : public arrow::io::OutputStream {
+ public:
+  arrow::Status Close() override {
+    closed_ = true;
+    return arrow::Status::OK();
+  }
+
+  bool closed() const override { return closed_; }
+
+  arrow::Result<int64_t> Tell() const override { return position_; }
+
+  arrow::Status Write(const void* const data, const int64_t nbytes) override {
+    buffer_.append(static_cast<const char*>(data), nbytes);
+    position_ += nbytes;
+    return arrow::Status::OK();
+  }
+
+  // Returns the data written since the last call.
+  std::string Take() { return std::exchange(buffer_, {}); }
+
+ private:
+  std::string buffer_;
+  int64_t position_ = 0;
+  bool closed_ = false;
+};
+
+// How often a waiting query checks whether the client cancelled the call. The
+// synchronous gRPC API doesn't notify about cancellation.
+constexpr absl::Duration kCancellationPollInterval = absl::Milliseconds(50);
+
+// Returns the next completed result of a query, or nullopt once all results
+// have been returned or the query got cancelled. Cancels the query if the
+// client cancels the call or its deadline expires in the meantime.
+std::optional<MorselResult> NextResult(
+    QueryContext* const context, grpc::ServerContext* const server_context) {
+  while (true) {
+    if (server_context->IsCancelled()) {
+      context->Cancel(absl::CancelledError(
+          "The query was cancelled by the client or its deadline expired"));
     }
-    for (auto& t : threads_) {
-      t.join();
+    auto result = context->completed_results.Next(kCancellationPollInterval);
+    if (result.has_value() || context->completed_results.finished()) {
+      return result;
     }
   }
+}
 
-  // Schedule a function to be run on a ThreadPool thread immediately.
-  void Schedule(std::function<void()> func) {
-    assert(func != nullptr);
-    absl::MutexLock l(&mu_);
-    queue_.push(std::move(func));
+// Returns the gRPC status for a request whose scanner options are invalid,
+// or whose prepared query or dataset isn't known or loaded yet.
+grpc::Status ScannerOptionsErrorStatus(const absl::Status& status) {
+  if (absl::IsNotFound(status)) {
+    return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                        std::string(status.message()));
   }
+  if (absl::IsUnavailable(status)) {
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                        std::string(status.message()));
+  }
+  return grpc::Status(
+      grpc::StatusCode::INVALID_ARGUMENT,
+      absl::StrCat("Failed to build scanner options: ", status.message()));
+}
 
- private:
-  bool WorkAvailable() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
-    return !queue_.empty();
+// Sorted and aggregation queries only know their results once all URLs have
+// been scanned, so they can't be streamed.
+grpc::Status CheckStreamable(const seqr::QueryRequest& request) {
+  if (request.sort_keys_size() > 0) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "Sorted queries can't be streamed, use Query instead");
+  }
+  if (request.has_aggregation()) {
+    return grpc::Status(
+        grpc::StatusCode::INVALID_ARGUMENT,
+        "Aggregation queries can't be streamed, use Query instead");
   }
+  return grpc::Status::OK;
+}
 
-  void WorkLoop() {
-    while (true) {
-      std::function<void()> func;
-      {
-        absl::MutexLock l(&mu_);
-        mu_.Await(absl::Condition(this, &ThreadPool::WorkAvailable));
-        func = std::move(queue_.front());
-        queue_.pop();
-      }
-      if (func == nullptr) {  // Shutdown signal.
-        break;
-      }
-      func();
+// Serializes all results of a finished query into a single Arrow IPC file,
+// keeping the order of the URLs and record batches.
+grpc::Status SerializeResults(QueryContext* const context,
+                              std::vector<MorselResult> results,
+                              seqr::QueryResponse* const response) {
+  // Keep the order of the URLs and record batches in the response.
+  std::sort(results.begin(), results.end(),
+            [](const MorselResult& lhs, const MorselResult& rhs) {
+              return std::tie(lhs.url_index, lhs.first_record_batch) <
+                     std::tie(rhs.url_index, rhs.first_record_batch);
+            });
+
+  for (const auto& result : results) {
+    if (!result.record_batches.ok()) {
+      return QueryErrorStatus(result.record_batches.status());
     }
   }
 
-  absl::Mutex mu_;
-  std::queue<std::function<void()>> queue_ ABSL_GUARDED_BY(mu_);
-  std::vector<std::thread> threads_;
-};
+  // Serialize the result record batches to the response proto.
+  std::shared_ptr<arrow::Schema> schema;
+  for (const auto& result : results) {
+    if (!result.record_batches->empty()) {
+      schema = result.record_batches->front()->schema();
+      break;
+    }
+  }
 
-// Returns an Arrow compute expression from the protobuf specification.
-absl::StatusOr<arrow::compute::Expression> BuildFilterExpression(
-    const seqr::QueryRequest::Expression& filter_expression) {
-  namespace cp = arrow::compute;
-  switch (filter_expression.type_case()) {
-    case seqr::QueryRequest::Expression::TYPE_NOT_SET:
-      return absl::InvalidArgumentError("Expression type not set");
-
-    case seqr::QueryRequest::Expression::kColumn:
-      return cp::field_ref(filter_expression.column());
-
-    case seqr::QueryRequest::Expression::kLiteral: {
-      const auto& literal = filter_expression.literal();
-      switch (literal.type_case()) {
-        case seqr::QueryRequest::Expression::Literal::TYPE_NOT_SET:
-          return absl::InvalidArgumentError("Literal type not set");
-        case seqr::QueryRequest::Expression::Literal::kBoolValue:
-          return cp::literal(literal.bool_value());
-        case seqr::QueryRequest::Expression::Literal::kInt32Value:
-          return cp::literal(literal.int32_value());
-        case seqr::QueryRequest::Expression::Literal::kInt64Value:
-          return cp::literal(literal.int64_value());
-        case seqr::QueryRequest::Expression::Literal::kFloatValue:
-          return cp::literal(literal.float_value());
-        case seqr::QueryRequest::Expression::Literal::kDoubleValue:
-          return cp::literal(literal.double_value());
-        case seqr::QueryRequest::Expression::Literal::kStringValue:
-          return cp::literal(literal.string_value());
-      }
-    }
-
-    case seqr::QueryRequest::Expression::kCall: {
-      const auto& call = filter_expression.call();
-      std::vector<cp::Expression> arguments;
-      arguments.reserve(call.arguments_size());
-      for (const auto& argument : call.arguments()) {
-        auto expression = BuildFilterExpression(argument);
-        if (!expression.ok()) {
-          return expression.status();
-        }
-        arguments.push_back(*std::move(expression));
-      }
-
-      std::shared_ptr<cp::FunctionOptions> options;
-      switch (call.options_case()) {
-        case seqr::QueryRequest::Expression::Call::OPTIONS_NOT_SET:
-          break;
-        case seqr::QueryRequest::Expression::Call::kSetLookupOptions: {
-          arrow::StringBuilder builder;
-          for (const auto& str : call.set_lookup_options().values()) {
-            if (const auto status = builder.Append(str); !status.ok()) {
-              return absl::InvalidArgumentError(absl::StrCat(
-                  "Failed to append string value: ", status.message()));
-            }
-          }
-          std::shared_ptr<arrow::StringArray> value_set;
-          if (const auto status = builder.Finish(&value_set); !status.ok()) {
-            return absl::InvalidArgumentError(absl::StrCat(
-                "Failed to build string array: ", status.message()));
-          }
-          options =
-              std::make_shared<cp::SetLookupOptions>(value_set,
-                                                     /* skip_nulls */ true);
+  if (schema == nullptr) {  // No results found.
+    return grpc::Status::OK;
+  }
+
+  // The serialized response counts towards the query's memory limit.
+  auto& memory_pool = context->memory_pool;
+  auto buffer_output_stream = arrow::io::BufferOutputStream::Create(
+      /* initial_capacity */ 4096, &memory_pool);
+  if (!buffer_output_stream.ok()) {
+    return grpc::Status(
+        grpc::StatusCode::INVALID_ARGUMENT,
+        absl::StrCat("Failed to create buffer output stream: ",
+                     buffer_output_stream.status().message()));
+  }
+
+  auto ipc_write_options = arrow::ipc::IpcWriteOptions::Defaults();
+  ipc_write_options.memory_pool = &memory_pool;
+  auto file_writer = arrow::ipc::MakeFileWriter(*buffer_output_stream, schema,
+                                                ipc_write_options);
+  if (!file_writer.ok()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        absl::StrCat("Failed to create file writer: ",
+                                     file_writer.status().message()));
+  }
+
+  int64_t num_rows = 0;
+  for (const auto& result : results) {
+    for (const auto& record_batch : *result.record_batches) {
+      num_rows += record_batch->num_rows();
+      if (const auto status = (*file_writer)->WriteRecordBatch(*record_batch);
+          !status.ok()) {
+        if (memory_pool.limit_exceeded()) {
+          return QueryErrorStatus(
+              QueryMemoryLimitError(memory_pool.limit_bytes()));
         }
+        return grpc::Status(
+            grpc::StatusCode::INVALID_ARGUMENT,
+            absl::StrCat("Failed to write record batch: ", status.message()));
       }
-
-      return cp::call(call.function_name(), std::move(arguments), options);
     }
   }
 
-  return absl::InternalError(
-      absl::StrCat("Unhandled case: ", filter_expression.type_case()));
+  if (const auto status = (*file_writer)->Close(); !status.ok()) {
+    return grpc::Status(
+        grpc::StatusCode::INVALID_ARGUMENT,
+        absl::StrCat("Failed to close file writer: ", status.message()));
+  }
+
+  const auto buffer = (*buffer_output_stream)->Finish();
+  if (!buffer.ok()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        absl::StrCat("Failed to finish buffer output stream: ",
+                                     buffer.status().message()));
+  }
+
+  response->set_num_rows(num_rows);
+  response->set_record_batches((*buffer)->ToString());
+
+  return grpc::Status::OK;
 }
 
-struct ScannerOptions {
-  std::vector<std::string> projection_columns;
-  arrow::compute::Expression filter_expression;
-  size_t max_rows = 0;
-};
+// Adds the profile of a finished query to its response, which has been
+// serialized since `serialization_start`.
+void AddQueryProfile(QueryContext* const context,
+                     const int64_t serialization_start,
+                     seqr::QueryResponse* const response) {
+  const int64_t now = MonotonicNanos();
+  auto& profile = *response->mutable_profile();
+  profile.set_total_nanos(now - context->start_nanos);
+  profile.set_serialization_nanos(now - serialization_start);
+  profile.set_serialized_bytes(
+      static_cast<int64_t>(response->record_batches().size()));
+  for (const auto& node :
+       GetFilterNodes(context->scanner_options->filter_expression)) {
+    profile.add_filter_nodes(node.ToString());
+  }
+  profile.mutable_filter_node_nanos()->Resize(profile.filter_nodes_size(), 0);
 
-absl::StatusOr<ScannerOptions> BuildScannerOptions(
-    const seqr::QueryRequest& request) {
-  auto filter_expression = BuildFilterExpression(request.filter_expression());
-  if (!filter_expression.ok()) {
-    return filter_expression.status();
+  for (size_t i = 0; i < context->url_profiles.size(); ++i) {
+    UrlProfile& url_profile = *context->url_profiles[i];
+    auto& url = *profile.add_urls();
+    url.set_url(context->arrow_urls[i]);
+    url.set_queue_nanos(url_profile.queue_nanos);
+    url.set_fetch_nanos(url_profile.fetch_nanos);
+    url.set_read_bytes(url_profile.read_bytes);
+    url.set_read_nanos(url_profile.read_nanos);
+    url.set_num_record_batches(url_profile.num_record_batches);
+    url.set_pruned_record_batches(url_profile.pruned_record_batches);
+    for (auto& morsel : url_profile.morsels) {
+      for (const auto& record_batch : morsel.record_batches()) {
+        profile.set_rows_scanned(profile.rows_scanned() +
+                                 record_batch.rows_scanned());
+        profile.set_rows_matched(profile.rows_matched() +
+                                 record_batch.rows_matched());
+        profile.set_decode_nanos(profile.decode_nanos() +
+                                 record_batch.decode_nanos());
+        profile.set_filter_nanos(profile.filter_nanos() +
+                                 record_batch.filter_nanos());
+        // The filters of files only differ from the query's in resolved
+        // sample bitset samples, so they have the same nodes.
+        const int num_nodes = std::min(record_batch.filter_node_nanos_size(),
+                                       profile.filter_node_nanos_size());
+        for (int j = 0; j < num_nodes; ++j) {
+          *profile.mutable_filter_node_nanos()->Mutable(j) +=
+              record_batch.filter_node_nanos(j);
+        }
+      }
+      *url.add_morsels() = std::move(morsel);
+    }
+  }
+}
+
+// Returns the response of a finished query, from the result cache if
+// possible. Successful responses get cached, and profiled ones carry their
+// profile.
+grpc::Status BuildQueryResponse(QueryContext* const context,
+                                std::vector<MorselResult> results,
+                                seqr::QueryResponse* const response) {
+  // Errors and exceeding max_rows cancel the query, in which case we return
+  // without waiting for the remaining results.
+  if (const auto status = context->CancelReason(); !status.ok()) {
+    return QueryErrorStatus(status);
   }
 
-  if (request.max_rows() <= 0) {
-    return absl::InvalidArgumentError(
-        absl::StrCat("Invalid max_rows value of ", request.max_rows()));
+  if (context->cached_response != nullptr) {
+    *response = *context->cached_response;
+    return grpc::Status::OK;
+  }
+
+  // Sorted queries return their first rows, which replace the (empty)
+  // results of the morsels.
+  std::string next_page_token;
+  if (context->top_k != nullptr) {
+    auto page = context->top_k->Finish(context->num_rows);
+    if (!page.ok()) {
+      return QueryErrorStatus(page.status());
+    }
+    results.clear();
+    if (page->record_batch != nullptr) {
+      MorselResult result;
+      result.record_batches = arrow::RecordBatchVector{page->record_batch};
+      results.push_back(std::move(result));
+    }
+    next_page_token = std::move(page->next_page_token);
+  } else if (context->scanner_options->aggregation.has_value()) {
+    // Likewise, aggregation queries return a single row per group.
+    absl::MutexLock lock(&context->aggregates_mu);
+    auto record_batch = context->aggregates->Finish(&context->memory_pool);
+    if (!record_batch.ok()) {
+      if (context->memory_pool.limit_exceeded()) {
+        return QueryErrorStatus(
+            QueryMemoryLimitError(context->memory_pool.limit_bytes()));
+      }
+      return QueryErrorStatus(record_batch.status());
+    }
+    results.clear();
+    MorselResult result;
+    result.record_batches = arrow::RecordBatchVector{*std::move(record_batch)};
+    results.push_back(std::move(result));
   }
 
-  return ScannerOptions{{request.projection_columns().begin(),
-                         request.projection_columns().end()},
-                        *std::move(filter_expression),
-                        static_cast<size_t>(request.max_rows())};
+  const int64_t serialization_start = MonotonicNanos();
+  const auto status = SerializeResults(context, std::move(results), response);
+  if (status.ok()) {
+    response->set_next_page_token(std::move(next_page_token));
+  }
+  if (status.ok() && !context->url_profiles.empty()) {
+    AddQueryProfile(context, serialization_start, response);
+  }
+  if (status.ok() && context->result_cache != nullptr) {
+    context->result_cache->Insert(
+        context->result_cache_key,
+        std::make_shared<const seqr::QueryResponse>(*response));
+  }
+  return status;
 }
 
-absl::StatusOr<arrow::RecordBatchVector> ProcessArrowUrl(
-    const UrlReader& url_reader, const std::string_view url,
-    const ScannerOptions& scanner_options,
-    std::atomic<size_t>* const num_rows) {
-  // Early cancellation.
-  if (*num_rows > scanner_options.max_rows) {
-    return MaxRowsExceededError(scanner_options.max_rows);
+// Returns the size of the first message of an Arrow IPC stream, which has to
+// be a message without body, like the schema. Messages start with a
+// continuation marker and the little-endian size of their padded metadata.
+absl::StatusOr<size_t> BodylessMessageSize(const std::string_view messages) {
+  constexpr std::string_view kContinuation("\xff\xff\xff\xff", 4);
+  constexpr size_t kPrefixSize = 8;
+  if (messages.size() < kPrefixSize ||
+      messages.substr(0, kContinuation.size()) != kContinuation) {
+    return absl::InternalError("IPC stream doesn't start with a message");
+  }
+  int32_t metadata_size = 0;
+  std::memcpy(&metadata_size, messages.data() + kContinuation.size(),
+              sizeof(metadata_size));
+  metadata_size = arrow::BitUtil::FromLittleEndian(metadata_size);
+  if (metadata_size < 0 || kPrefixSize + metadata_size > messages.size()) {
+    return absl::InternalError("IPC stream has a truncated first message");
   }
+  return kPrefixSize + metadata_size;
+}
 
-  const auto data = url_reader.Read(url);
-  if (!data.ok()) {
-    return absl::InvalidArgumentError(
-        absl::StrCat("Failed to read ", url, ": ", data.status().message()));
+// Encodes the results of a query as chunks of a single Arrow IPC stream, in
+// the order in which they complete. The schema is sent as its own first
+// chunk, followed by a chunk per result with record batches, and finally the
+// end-of-stream marker.
+class ResponseChunkEncoder {
+ public:
+  explicit ResponseChunkEncoder(QueryContext* const context)
+      : context_(*context) {}
+
+  // Encodes the record batches of a result as further chunks, see NextChunk.
+  // Results without record batches don't add any.
+  grpc::Status Encode(const MorselResult& morsel_result) {
+    const auto& result = morsel_result.record_batches;
+    if (!result.ok()) {
+      return QueryErrorStatus(result.status());
+    }
+
+    if (result->empty()) {
+      return grpc::Status::OK;
+    }
+
+    const bool first_result = stream_writer_ == nullptr;
+    if (first_result) {
+      auto ipc_write_options = arrow::ipc::IpcWriteOptions::Defaults();
+      ipc_write_options.memory_pool = &context_.memory_pool;
+      auto writer_result = arrow::ipc::MakeStreamWriter(
+          output_stream_, result->front()->schema(), ipc_write_options);
+      if (!writer_result.ok()) {
+        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                            absl::StrCat("Failed to create stream writer: ",
+                                         writer_result.status().message()));
+      }
+      stream_writer_ = *std::move(writer_result);
+    }
+
+    int64_t chunk_num_rows = 0;
+    for (const auto& record_batch : *result) {
+      if (const auto status = stream_writer_->WriteRecordBatch(*record_batch);
+          !status.ok()) {
+        return grpc::Status(
+            grpc::StatusCode::INVALID_ARGUMENT,
+            absl::StrCat("Failed to write record batch: ", status.message()));
+      }
+      chunk_num_rows += record_batch->num_rows();
+    }
+
+    std::string messages = output_stream_->Take();
+    if (first_result) {
+      // The writer writes the schema message together with the first record
+      // batch, so it's split off.
+      const auto schema_size = BodylessMessageSize(messages);
+      if (!schema_size.ok()) {
+        return grpc::Status(grpc::StatusCode::INTERNAL,
+                            std::string(schema_size.status().message()));
+      }
+      AddChunk(/* num_rows */ 0, messages.substr(0, *schema_size));
+      messages.erase(0, *schema_size);
+    }
+    AddChunk(chunk_num_rows, std::move(messages));
+    return grpc::Status::OK;
   }
 
-  arrow::ipc::IpcReadOptions ipc_read_options;
-  // We parallelize over URLs already, no need for nested parallelism.
-  ipc_read_options.use_threads = false;
+  // Encodes the end-of-stream marker once all results have been encoded. No
+  // chunk is added if no results were found.
+  grpc::Status Finish() {
+    // Errors and exceeding max_rows cancel the query.
+    if (const auto status = context_.CancelReason(); !status.ok()) {
+      return QueryErrorStatus(status);
+    }
 
-  arrow::io::BufferReader buffer_reader{{data->data(), data->size()}};
-  auto record_batch_file_reader =
-      arrow::ipc::RecordBatchFileReader::Open(&buffer_reader, ipc_read_options);
-  if (!record_batch_file_reader.ok()) {
-    return absl::InvalidArgumentError(
-        absl::StrCat("Failed to open record batch reader for ", url, ": ",
-                     record_batch_file_reader.status().ToString()));
+    if (stream_writer_ == nullptr) {  // No results found.
+      return grpc::Status::OK;
+    }
+
+    if (const auto status = stream_writer_->Close(); !status.ok()) {
+      return grpc::Status(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          absl::StrCat("Failed to close stream writer: ", status.message()));
+    }
+    AddChunk(/* num_rows */ 0, output_stream_->Take());
+    return grpc::Status::OK;
+  }
+
+  // Returns the next chunk to send, in order, or nullopt if all encoded
+  // chunks have been returned.
+  std::optional<seqr::QueryResponseChunk> NextChunk() {
+    if (chunks_.empty()) {
+      return std::nullopt;
+    }
+    auto result = std::move(chunks_.front());
+    chunks_.pop();
+    return result;
   }
 
-  const auto schema = (*record_batch_file_reader)->schema();
+ private:
+  void AddChunk(const int64_t num_rows, std::string ipc_messages) {
+    auto& chunk = chunks_.emplace();
+    chunk.set_num_rows(num_rows);
+    chunk.set_ipc_messages(std::move(ipc_messages));
+  }
 
-  const int num_record_batches =
-      (*record_batch_file_reader)->num_record_batches();
-  arrow::RecordBatchVector record_batches;
-  record_batches.reserve(num_record_batches);
-  for (int i = 0; i < num_record_batches; ++i) {
-    auto record_batch = (*record_batch_file_reader)->ReadRecordBatch(i);
-    if (!record_batch.ok()) {
-      return absl::InvalidArgumentError(
-          absl::StrCat("Failed to read record batch ", i, " for ", url, ": ",
-                       record_batch.status().ToString()));
+  QueryContext& context_;
+  const std::shared_ptr<StringOutputStream> output_stream_ =
+      std::make_shared<StringOutputStream>();
+  std::shared_ptr<arrow::ipc::RecordBatchWriter> stream_writer_;
+  std::queue<seqr::QueryResponseChunk> chunks_;
+};
+
+// Writes the completed results of a query to the given gRPC stream, as soon
+// as they become available.
+grpc::Status StreamCompletedResults(
+    QueryContext* const context, grpc::ServerContext* const server_context,
+    grpc::ServerWriter<seqr::QueryResponseChunk>* const writer) {
+  ResponseChunkEncoder encoder(context);
+  // Previous results are released after they've been written.
+  while (auto morsel_result = NextResult(context, server_context)) {
+    if (const auto status = encoder.Encode(*morsel_result); !status.ok()) {
+      return status;
+    }
+    while (auto chunk = encoder.NextChunk()) {
+      if (!writer->Write(*chunk)) {
+        context->Cancel(
+            absl::CancelledError("Failed to write response chunk"));
+        return QueryErrorStatus(context->CancelReason());
+      }
     }
-    record_batches.push_back(std::move(*record_batch));
   }
 
-  auto in_memory_dataset = std::make_shared<arrow::dataset::InMemoryDataset>(
-      schema, std::move(record_batches));
-  auto scanner_builder = in_memory_dataset->NewScan();
-  if (!scanner_builder.ok()) {
-    return absl::InvalidArgumentError(
-        absl::StrCat("Failed to create scanner builder for ", url, ": ",
-                     scanner_builder.status().ToString()));
+  // Writes the end-of-stream marker.
+  if (const auto status = encoder.Finish(); !status.ok()) {
+    return status;
+  }
+  if (auto chunk = encoder.NextChunk(); chunk && !writer->Write(*chunk)) {
+    return grpc::Status(grpc::StatusCode::CANCELLED,
+                        "Failed to write response chunk");
   }
 
-  if (const auto status =
-          (*scanner_builder)->Project(scanner_options.projection_columns);
-      !status.ok()) {
-    return absl::InvalidArgumentError(absl::StrCat(
-        "Failed to set projection columns for ", url, ": ", status.ToString()));
+  return grpc::Status::OK;
+}
+
+// The thread pools, caches and memory budget that are shared by all queries,
+// independently of the gRPC front end.
+class QueryEngine {
+ public:
+  explicit QueryEngine(const UrlReader& url_reader) : url_reader_(url_reader) {}
+
+  QueryEngine(const QueryEngine&) = delete;
+  QueryEngine& operator=(const QueryEngine&) = delete;
+
+  // Starts processing the URLs of a query in parallel, split into morsels.
+  // `on_results` is called whenever results become available, see
+  // CompletedResults::SetListener. With `cache_response`, the response is
+  // looked up in and added to the result cache (see BuildQueryResponse),
+  // unless the request asks for a profile. Streamed responses, which aren't
+  // cached, don't carry a profile either. Fails if the scanner options are
+  // invalid.
+  absl::StatusOr<std::unique_ptr<QueryContext>> StartQuery(
+      const seqr::QueryRequest& request, const bool cache_response,
+      std::function<void()> on_results = nullptr) {
+    // Build options that are shared between worker threads.
+    auto scanner_options = BuildScannerOptions(request);
+    if (!scanner_options.ok()) {
+      return scanner_options.status();
+    }
+    const bool profile = cache_response && request.profile();
+    return StartQuery(
+        request.arrow_urls(), request.dataset_id(),
+        std::make_shared<const ScannerOptions>(*std::move(scanner_options)),
+        cache_response && !profile ? CanonicalQueryKey(request) : "", profile,
+        std::move(on_results));
   }
 
-  if (const auto status =
-          (*scanner_builder)->Filter(scanner_options.filter_expression);
-      !status.ok()) {
-    return absl::InvalidArgumentError(absl::StrCat(
-        "Failed to set scanner filter for ", url, ": ", status.ToString()));
+  // Like above, for an execution of a prepared query. Fails with NotFound if
+  // the query hasn't been prepared, or has been evicted since.
+  absl::StatusOr<std::unique_ptr<QueryContext>> StartQuery(
+      const seqr::ExecuteRequest& request, const bool cache_response,
+      std::function<void()> on_results = nullptr) {
+    const auto prepared_query =
+        prepared_query_cache_.Get(request.prepared_query_id());
+    if (prepared_query == nullptr) {
+      return absl::NotFoundError(
+          absl::StrCat("Unknown prepared query ", request.prepared_query_id(),
+                       "; please prepare it again"));
+    }
+    auto scanner_options = prepared_query->Bind(request);
+    if (!scanner_options.ok()) {
+      return scanner_options.status();
+    }
+    const bool profile = cache_response && request.profile();
+    return StartQuery(
+        request.arrow_urls(), request.dataset_id(), *std::move(scanner_options),
+        cache_response && !profile ? CanonicalQueryKey(request) : "", profile,
+        std::move(on_results));
   }
 
-  // We parallelize over URLs already, no need for nested parallelism.
-  if (const auto status = (*scanner_builder)->UseThreads(false); !status.ok()) {
-    return absl::InvalidArgumentError(
-        absl::StrCat("Failed to disable scanner threads for ", url, ": ",
-                     status.ToString()));
+  // Compiles the query and keeps it for executions, returning its ID.
+  absl::StatusOr<std::string> Prepare(const seqr::PrepareRequest& request) {
+    std::string id = PreparedQuery::Id(request);
+    const auto prepared_query = prepared_query_cache_.GetOrLoad(
+        id, [&request] { return PreparedQuery::Prepare(request); });
+    if (!prepared_query.ok()) {
+      return prepared_query.status();
+    }
+    return id;
   }
 
-  const auto scanner = (*scanner_builder)->Finish();
-  if (!scanner.ok()) {
-    return absl::InvalidArgumentError(
-        absl::StrCat("Failed to create scanner for ", url, ": ",
-                     scanner.status().ToString()));
+  ResultCache::Stats result_cache_stats() const {
+    return result_cache_.stats();
   }
 
-  arrow::RecordBatchVector result;
-  if (const auto status = (*scanner)->Scan(
-          [&result,
-           num_rows](arrow::dataset::TaggedRecordBatch tagged_record_batch) {
-            auto& record_batch = tagged_record_batch.record_batch;
-            if (record_batch->num_rows() > 0) {
-              *num_rows += record_batch->num_rows();
-              result.push_back(std::move(record_batch));
-            }
-            return arrow::Status::OK();
-          });
-      !status.ok()) {
-    return absl::InvalidArgumentError(absl::StrCat(
-        "Failed to run scanner on ", url, ": ", status.ToString()));
+  // Loads the datasets of the manifest at the given URL and applies its
+  // changes from then on, see ResidentDatasets::Watch.
+  void WatchDatasets(std::string manifest_url,
+                     const absl::Duration poll_interval,
+                     std::function<void()> on_loaded) {
+    resident_datasets_.Watch(std::move(manifest_url), poll_interval,
+                             std::move(on_loaded));
   }
 
-  return result;
-}
+  void StopWatchingDatasets() { resident_datasets_.StopWatching(); }
 
+ private:
+  // Exports the memory budget and the caches in the default MetricsRegistry.
+  // Servers in the same process are summed.
+  std::vector<std::unique_ptr<MetricsRegistry::CallbackRegistration>>
+  RegisterMetricCallbacks() {
+    auto& registry = MetricsRegistry::Default();
+    std::vector<std::unique_ptr<MetricsRegistry::CallbackRegistration>>
+        result;
+    result.push_back(registry.AddGaugeCallback(
+        "seqr_memory_budget_reserved_bytes",
+        "The memory reserved by in-flight queries, see --memory_budget_bytes.",
+        [this] { return memory_budget_.reserved_bytes(); }));
+    result.push_back(registry.AddGaugeCallback(
+        "seqr_memory_budget_limit_bytes", "See --memory_budget_bytes.",
+        [this] { return memory_budget_.limit_bytes(); }));
+    const auto add_cache_size = [&](const std::string_view cache,
+                                    std::function<double()> size_bytes) {
+      result.push_back(registry.AddGaugeCallback(
+          absl::StrCat("seqr_cache_size_bytes{cache=\"", cache, "\"}"),
+          "The total size of the cached entries.", std::move(size_bytes)));
+    };
+    add_cache_size("footer", [this] { return footer_cache_.SizeBytes(); });
+    add_cache_size("record_batch",
+                   [this] { return record_batch_cache_.SizeBytes(); });
+    add_cache_size("inverted_index",
+                   [this] { return inverted_index_cache_.SizeBytes(); });
+    add_cache_size("prepared_query",
+                   [this] { return prepared_query_cache_.SizeBytes(); });
+    add_cache_size("result", [this] { return result_cache_.SizeBytes(); });
+    result.push_back(registry.AddCounterCallback(
+        "seqr_result_cache_hits_total",
+        "The number of responses that were returned from the result cache.",
+        [this] { return result_cache_.stats().hits; }));
+    result.push_back(registry.AddCounterCallback(
+        "seqr_result_cache_misses_total",
+        "The number of cacheable responses that weren't in the result cache.",
+        [this] { return result_cache_.stats().misses; }));
+    return result;
+  }
+
+  // Responses are only cached if `result_cache_key` isn't empty. Queries on
+  // a resident dataset scan its files instead of `arrow_urls`.
+  absl::StatusOr<std::unique_ptr<QueryContext>> StartQuery(
+      const google::protobuf::RepeatedPtrField<std::string>& arrow_urls,
+      const std::string& dataset_id,
+      std::shared_ptr<const ScannerOptions> scanner_options,
+      std::string result_cache_key, const bool profile,
+      std::function<void()> on_results) {
+    std::vector<std::string> urls(arrow_urls.begin(), arrow_urls.end());
+    std::shared_ptr<const ResidentDataset> resident_dataset;
+    if (!dataset_id.empty()) {
+      if (!urls.empty()) {
+        return absl::InvalidArgumentError(
+            "Only one of arrow_urls and dataset_id can be given");
+      }
+      auto dataset = resident_datasets_.Get(dataset_id);
+      if (!dataset.ok()) {
+        return dataset.status();
+      }
+      resident_dataset = *std::move(dataset);
+      for (const auto& file : resident_dataset->files) {
+        urls.push_back(file->url);
+      }
+    }
+
+    auto context = std::make_unique<QueryContext>(
+        url_reader_, &footer_cache_, &record_batch_cache_,
+        &inverted_index_cache_, &memory_budget_, std::move(urls),
+        std::move(scanner_options), &scheduler_, &io_scheduler_);
+    context->resident_dataset = std::move(resident_dataset);
+    if (!context->scanner_options->sort_keys.empty()) {
+      auto top_k =
+          TopK::Make(*context->scanner_options, &context->memory_pool);
+      if (!top_k.ok()) {
+        return top_k.status();
+      }
+      context->top_k = *std::move(top_k);
+    }
+    if (const auto& aggregation = context->scanner_options->aggregation;
+        aggregation.has_value()) {
+      absl::MutexLock lock(&context->aggregates_mu);
+      context->aggregates.emplace(*aggregation, &context->memory_pool);
+    }
+    if (!result_cache_key.empty() && result_cache_.enabled()) {
+      context->result_cache = &result_cache_;
+      context->result_cache_key = std::move(result_cache_key);
+    }
+    if (profile) {
+      for (size_t i = 0; i < context->arrow_urls.size(); ++i) {
+        context->url_profiles.push_back(std::make_unique<UrlProfile>());
+      }
+    }
+    context->completed_results.SetListener(std::move(on_results));
+    ScheduleArrowUrls(context.get());
+    return context;
+  }
+
+ private:
+  Scheduler scheduler_{absl::GetFlag(FLAGS_num_threads), "cpu"};
+  Scheduler io_scheduler_{absl::GetFlag(FLAGS_num_io_threads), "io"};
+  MemoryBudget memory_budget_{absl::GetFlag(FLAGS_memory_budget_bytes)};
+  const UrlReader& url_reader_;
+  // Loads files on the I/O threads. Declared after them, so it's destroyed
+  // first and stops watching the manifest.
+  ResidentDatasets resident_datasets_{url_reader_, &io_scheduler_,
+                                      &memory_budget_};
+  FooterCache footer_cache_{
+      static_cast<size_t>(absl::GetFlag(FLAGS_footer_cache_bytes))};
+  RecordBatchCache record_batch_cache_{
+      static_cast<size_t>(absl::GetFlag(FLAGS_record_batch_cache_bytes))};
+  InvertedIndexCache inverted_index_cache_{
+      static_cast<size_t>(absl::GetFlag(FLAGS_inverted_index_cache_bytes))};
+  LruCache<PreparedQuery> prepared_query_cache_{
+      static_cast<size_t>(absl::GetFlag(FLAGS_prepared_query_cache_bytes))};
+  ResultCache result_cache_{
+      static_cast<size_t>(absl::GetFlag(FLAGS_result_cache_bytes)),
+      absl::GetFlag(FLAGS_result_cache_ttl)};
+  // Declared last, so the callbacks are unregistered before the state they
+  // read is destroyed.
+  const std::vector<std::unique_ptr<MetricsRegistry::CallbackRegistration>>
+      metric_callbacks_ = RegisterMetricCallbacks();
+};
+
+// The synchronous front end, which blocks a gRPC thread per in-flight call
+// while waiting for results.
 class QueryServiceImpl final : public seqr::QueryService::Service {
  public:
-  QueryServiceImpl(const UrlReader& url_reader) : url_reader_(url_reader) {}
+  explicit QueryServiceImpl(QueryEngine* const engine) : engine_(*engine) {}
 
  private:
   grpc::Status Query(grpc::ServerContext* const context,
                      const seqr::QueryRequest* const request,
                      seqr::QueryResponse* const response) override {
-    // Build options that are shared between worker threads.
-    const auto scanner_options = BuildScannerOptions(*request);
-    if (!scanner_options.ok()) {
-      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
-                          absl::StrCat("Failed to build scanner options: ",
-                                       scanner_options.status().message()));
-    }
-
-    // Process the URLs in parallel.
-    const size_t num_arrow_urls = request->arrow_urls_size();
-    std::vector<absl::StatusOr<arrow::RecordBatchVector>> partial_results(
-        num_arrow_urls);
-    std::atomic<size_t> num_rows = 0;  // Number of filtered rows across URLs.
-    absl::BlockingCounter blocking_counter(num_arrow_urls);
-    for (size_t i = 0; i < num_arrow_urls; ++i) {
-      thread_pool_.Schedule([&url_reader = url_reader_,
-                             &url = request->arrow_urls(i),
-                             &result = partial_results[i], &scanner_options,
-                             &num_rows, &blocking_counter] {
-        result = ProcessArrowUrl(url_reader, url, *scanner_options, &num_rows);
-        blocking_counter.DecrementCount();
-      });
+    return RunQuery(context, *request, response);
+  }
+
+  grpc::Status Prepare(grpc::ServerContext* /* context */,
+                       const seqr::PrepareRequest* const request,
+                       seqr::PrepareResponse* const response) override {
+    auto id = engine_.Prepare(*request);
+    if (!id.ok()) {
+      return ScannerOptionsErrorStatus(id.status());
     }
+    response->set_prepared_query_id(*std::move(id));
+    return grpc::Status::OK;
+  }
 
-    blocking_counter.Wait();
+  grpc::Status Execute(grpc::ServerContext* const context,
+                       const seqr::ExecuteRequest* const request,
+                       seqr::QueryResponse* const response) override {
+    return RunQuery(context, *request, response);
+  }
 
-    if (num_rows > scanner_options->max_rows) {
-      return grpc::Status(
-          grpc::StatusCode::CANCELLED,
-          std::string(
-              MaxRowsExceededError(scanner_options->max_rows).message()));
+  grpc::Status QueryStream(
+      grpc::ServerContext* const context,
+      const seqr::QueryRequest* const request,
+      grpc::ServerWriter<seqr::QueryResponseChunk>* const writer) override {
+    if (const auto status = CheckStreamable(*request); !status.ok()) {
+      return status;
     }
-
-    // Serialize the result record batches to the response proto.
-    std::shared_ptr<arrow::Schema> schema;
-    for (const auto& result : partial_results) {
-      if (!result.ok()) {
-        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
-                            std::string(result.status().message()));
-      }
-      if (!result->empty()) {
-        schema = result->front()->schema();
-        break;
-      }
+    const auto query_context =
+        engine_.StartQuery(*request, /* cache_response */ false);
+    if (!query_context.ok()) {
+      return ScannerOptionsErrorStatus(query_context.status());
     }
+    const auto status =
+        StreamCompletedResults(query_context->get(), context, writer);
 
-    if (schema == nullptr) {  // No results found.
-      return grpc::Status::OK;
+    // The query context waits for its tasks even if streaming stopped early.
+    // Stop their remaining work in that case.
+    if (!status.ok()) {
+      (*query_context)
+          ->Cancel(absl::CancelledError(status.error_message()));
     }
 
-    auto buffer_output_stream = arrow::io::BufferOutputStream::Create();
-    if (!buffer_output_stream.ok()) {
-      return grpc::Status(
-          grpc::StatusCode::INVALID_ARGUMENT,
-          absl::StrCat("Failed to create buffer output stream: ",
-                       buffer_output_stream.status().message()));
+    return status;
+  }
+
+  // Responds once all results of the request's query are available.
+  template <typename Request>
+  grpc::Status RunQuery(grpc::ServerContext* const context,
+                        const Request& request,
+                        seqr::QueryResponse* const response) {
+    const auto query_context =
+        engine_.StartQuery(request, /* cache_response */ true);
+    if (!query_context.ok()) {
+      return ScannerOptionsErrorStatus(query_context.status());
+    }
+    std::vector<MorselResult> results;
+    while (auto result = NextResult(query_context->get(), context)) {
+      results.push_back(*std::move(result));
     }
+    return BuildQueryResponse(query_context->get(), std::move(results),
+                              response);
+  }
+
+  QueryEngine& engine_;
+};
+
+// A query of the asynchronous front end, which takes results without
+// blocking.
+class AsyncQueryImpl final : public AsyncQuery {
+ public:
+  explicit AsyncQueryImpl(std::unique_ptr<QueryContext> context)
+      : context_(std::move(context)) {}
+
+  void Cancel(const absl::Status& reason) override {
+    context_->Cancel(reason);
+  }
+
+  grpc::Status CancelStatus() const override {
+    return QueryErrorStatus(context_->CancelReason());
+  }
 
-    auto file_writer =
-        arrow::ipc::MakeFileWriter(*buffer_output_stream, schema);
-    if (!file_writer.ok()) {
-      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
-                          absl::StrCat("Failed to create file writer: ",
-                                       file_writer.status().message()));
+  bool TakeAvailableResults() override {
+    auto& completed_results = context_->completed_results;
+    while (auto result = completed_results.Next(absl::ZeroDuration())) {
+      results_.push_back(*std::move(result));
     }
+    return completed_results.finished();
+  }
 
-    for (const auto& result : partial_results) {
-      for (const auto& record_batch : *result) {
-        if (const auto status = (*file_writer)->WriteRecordBatch(*record_batch);
-            !status.ok()) {
-          return grpc::Status(
-              grpc::StatusCode::INVALID_ARGUMENT,
-              absl::StrCat("Failed to write record batch: ", status.message()));
-        }
+  grpc::Status BuildResponse(seqr::QueryResponse* const response) override {
+    return BuildQueryResponse(context_.get(), std::exchange(results_, {}),
+                              response);
+  }
+
+  grpc::Status NextChunk(std::optional<seqr::QueryResponseChunk>* const chunk,
+                         bool* const last) override {
+    if (encoder_ == nullptr) {
+      encoder_ = std::make_unique<ResponseChunkEncoder>(context_.get());
+    }
+    auto& completed_results = context_->completed_results;
+    *chunk = encoder_->NextChunk();
+    while (!chunk->has_value()) {
+      const auto result = completed_results.Next(absl::ZeroDuration());
+      if (!result.has_value()) {
+        break;
+      }
+      if (const auto status = encoder_->Encode(*result); !status.ok()) {
+        return status;
       }
+      *chunk = encoder_->NextChunk();
+    }
+    *last = !chunk->has_value() && completed_results.finished();
+    if (!*last) {
+      return grpc::Status::OK;
     }
 
-    if (const auto status = (*file_writer)->Close(); !status.ok()) {
-      return grpc::Status(
-          grpc::StatusCode::INVALID_ARGUMENT,
-          absl::StrCat("Failed to close file writer: ", status.message()));
+    // Encodes the end-of-stream marker.
+    if (const auto status = encoder_->Finish(); !status.ok()) {
+      return status;
     }
+    *chunk = encoder_->NextChunk();
+    return grpc::Status::OK;
+  }
 
-    const auto buffer = (*buffer_output_stream)->Finish();
-    if (!buffer.ok()) {
-      return grpc::Status(
-          grpc::StatusCode::INVALID_ARGUMENT,
-          absl::StrCat("Failed to finish buffer output stream: ",
-                       buffer.status().message()));
+ private:
+  // Declared first, so it's destroyed last, after the results and the
+  // encoder, which allocate from the query's memory pool.
+  const std::unique_ptr<QueryContext> context_;
+  std::vector<MorselResult> results_;
+  std::unique_ptr<ResponseChunkEncoder> encoder_;
+};
+
+// Runs the queries of the asynchronous front end on the engine.
+class AsyncQueryEngineImpl final : public AsyncQueryEngine {
+ public:
+  explicit AsyncQueryEngineImpl(QueryEngine* const engine)
+      : engine_(*engine) {}
+
+  grpc::Status StartQuery(const seqr::QueryRequest& request,
+                          std::function<void()> on_results,
+                          std::unique_ptr<AsyncQuery>* const query) override {
+    return Start(request, /* cache_response */ true, std::move(on_results),
+                 query);
+  }
+
+  grpc::Status StartExecution(
+      const seqr::ExecuteRequest& request, std::function<void()> on_results,
+      std::unique_ptr<AsyncQuery>* const query) override {
+    return Start(request, /* cache_response */ true, std::move(on_results),
+                 query);
+  }
+
+  grpc::Status StartQueryStream(
+      const seqr::QueryRequest& request, std::function<void()> on_results,
+      std::unique_ptr<AsyncQuery>* const query) override {
+    if (const auto status = CheckStreamable(request); !status.ok()) {
+      return status;
     }
+    return Start(request, /* cache_response */ false, std::move(on_results),
+                 query);
+  }
 
-    response->set_num_rows(num_rows);
-    response->set_record_batches((*buffer)->ToString());
+  grpc::Status Prepare(const seqr::PrepareRequest& request,
+                       seqr::PrepareResponse* const response) override {
+    auto id = engine_.Prepare(request);
+    if (!id.ok()) {
+      return ScannerOptionsErrorStatus(id.status());
+    }
+    response->set_prepared_query_id(*std::move(id));
+    return grpc::Status::OK;
+  }
 
+ private:
+  template <typename Request>
+  grpc::Status Start(const Request& request, const bool cache_response,
+                     std::function<void()> on_results,
+                     std::unique_ptr<AsyncQuery>* const query) {
+    auto context =
+        engine_.StartQuery(request, cache_response, std::move(on_results));
+    if (!context.ok()) {
+      return ScannerOptionsErrorStatus(context.status());
+    }
+    *query = std::make_unique<AsyncQueryImpl>(*std::move(context));
     return grpc::Status::OK;
   }
 
-  ThreadPool thread_pool_{absl::GetFlag(FLAGS_num_threads)};
-  const UrlReader& url_reader_;
+  QueryEngine& engine_;
 };
 
 absl::Status RegisterArrowComputeFunctions() {
@@ -419,17 +2651,50 @@ absl::Status RegisterArrowComputeFunctions() {
     return absl::InternalError(absl::StrCat(
         "Error calling RegisterStringListContainsAny: ", status.message()));
   }
+  if (const auto status = RegisterSampleBitsetFunctions(registry);
+      !status.ok()) {
+    return absl::InternalError(absl::StrCat(
+        "Error calling RegisterSampleBitsetFunctions: ", status.message()));
+  }
   return absl::OkStatus();
 }
 
 class GrpcServerImpl : public GrpcServer {
  public:
-  GrpcServerImpl(const UrlReader& url_reader)
-      : query_service_impl(url_reader) {}
+  GrpcServerImpl(const UrlReader& url_reader, const bool serving)
+      : instrumented_url_reader(MakeInstrumentedReader(url_reader)),
+        engine(*instrumented_url_reader),
+        health_service(QueryService::service_full_name(), serving) {}
+
+  ResultCache::Stats result_cache_stats() const override {
+    return engine.result_cache_stats();
+  }
+
+  ~GrpcServerImpl() override {
+    // The manifest watcher updates the health service.
+    engine.StopWatchingDatasets();
+    // Completion queues can only be shut down after the server, which waits
+    // for in-flight calls. The server is destroyed before the services.
+    if (server != nullptr) {
+      server->Shutdown();
+    }
+    async_query_server.Shutdown();
+    server.reset();
+  }
 
+  // Records the metrics of all reads. Declared before the engine, which
+  // reads through it.
+  const std::unique_ptr<UrlReader> instrumented_url_reader;
+  QueryEngine engine;
   // The server does not take ownership of the services, which is why we keep
-  // the service alive here.
-  QueryServiceImpl query_service_impl;
+  // the services alive here.
+  QueryServiceImpl query_service_impl{&engine};
+  AsyncQueryEngineImpl async_query_engine{&engine};
+  AsyncQueryServer async_query_server{
+      &async_query_engine, absl::GetFlag(FLAGS_num_grpc_threads)};
+  HealthServiceImpl health_service;
+  // Only set with --metrics_port.
+  std::unique_ptr<HttpServer> metrics_server;
 };
 
 }  // namespace
@@ -441,17 +2706,62 @@ absl::StatusOr<std::unique_ptr<GrpcServer>> CreateServer(
         "Failed to register Arrow compute functions: ", status.message()));
   }
 
-  grpc::EnableDefaultHealthCheckService(true);
+  // Replaced by HealthServiceImpl.
+  grpc::EnableDefaultHealthCheckService(false);
   grpc::reflection::InitProtoReflectionServerBuilderPlugin();
 
   const std::string server_address = absl::StrCat("[::]:", port);
   std::cout << "Starting server on " << server_address << std::endl;
   grpc::ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  std::vector<std::unique_ptr<
+      grpc::experimental::ServerInterceptorFactoryInterface>>
+      interceptor_factories;
+  interceptor_factories.push_back(
+      MakeMetricsInterceptorFactory());
+  builder.experimental().SetInterceptorCreators(
+      std::move(interceptor_factories));
 
-  auto result = std::make_unique<GrpcServerImpl>(url_reader);
-  builder.RegisterService(&result->query_service_impl);
+  // Queries on datasets fail until they're loaded, so load balancers should
+  // wait.
+  std::string manifest_url = absl::GetFlag(FLAGS_dataset_manifest);
+  auto result = std::make_unique<GrpcServerImpl>(
+      url_reader, /* serving */ manifest_url.empty());
+  const bool async_grpc = absl::GetFlag(FLAGS_async_grpc);
+  if (async_grpc) {
+    result->async_query_server.Register(&builder);
+  } else {
+    builder.RegisterService(&result->query_service_impl);
+  }
+  builder.RegisterService(&result->health_service);
   result->server = builder.BuildAndStart();
+  if (result->server == nullptr) {
+    return absl::InternalError(
+        absl::StrCat("Failed to start server on ", server_address));
+  }
+  if (async_grpc) {
+    result->async_query_server.Start();
+  }
+
+  if (const int metrics_port = absl::GetFlag(FLAGS_metrics_port);
+      metrics_port > 0) {
+    auto metrics_server = HttpServer::Start(metrics_port, HandleMetricsRequest);
+    if (!metrics_server.ok()) {
+      return absl::InternalError(
+          absl::StrCat("Failed to start metrics server on port ", metrics_port,
+                       ": ", metrics_server.status().message()));
+    }
+    result->metrics_server = *std::move(metrics_server);
+  }
+
+  if (!manifest_url.empty()) {
+    result->engine.WatchDatasets(
+        std::move(manifest_url),
+        absl::GetFlag(FLAGS_dataset_manifest_poll_interval),
+        [health_service = &result->health_service] {
+          health_service->SetServing(true);
+        });
+  }
   return result;
 }
 
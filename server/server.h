@@ -5,6 +5,7 @@
 
 #include <memory>
 
+#include "result_cache.h"
 #include "url_reader.h"
 
 namespace seqr {
@@ -17,6 +18,9 @@ class GrpcServer {
     }
   }
 
+  // Returns the counters of the result cache, see --result_cache_bytes.
+  virtual ResultCache::Stats result_cache_stats() const = 0;
+
   std::unique_ptr<grpc::Server> server;
 };
 
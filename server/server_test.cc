@@ -1,17 +1,57 @@
 #include "server.h"
 
+#include <absl/flags/declare.h>
+#include <absl/flags/flag.h>
+#include <absl/flags/reflection.h>
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/strip.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <arrow/buffer.h>
+#include <arrow/io/memory.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/record_batch.h>
+#include <arrow/testing/gtest_util.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/text_format.h>
 #include <grpcpp/grpcpp.h>
 #include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <filesystem>
 #include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+#include "fake_gcs_server.h"
+#include "health.grpc.pb.h"
 #include "seqr_query_service.grpc.pb.h"
 
+ABSL_DECLARE_FLAG(int64_t, query_memory_limit_bytes);
+ABSL_DECLARE_FLAG(bool, ranged_reads);
+ABSL_DECLARE_FLAG(int, prefetch_window);
+ABSL_DECLARE_FLAG(bool, async_grpc);
+ABSL_DECLARE_FLAG(std::string, dataset_manifest);
+ABSL_DECLARE_FLAG(int, metrics_port);
+
 namespace seqr {
 
+void ReadTrioQueryRequest(QueryRequest* const request) {
+  const char kQueryTextProtoFilename[] =
+      "testdata/na12878_trio_query.textproto";
+  std::ifstream ifs{kQueryTextProtoFilename};
+  ASSERT_TRUE(ifs);
+  google::protobuf::io::IstreamInputStream iis{&ifs};
+  ASSERT_TRUE(google::protobuf::TextFormat::Parse(&iis, request));
+}
+
 TEST(Server, EndToEnd) {
   constexpr int kPort = 12345;
   const auto local_file_reader = MakeLocalFileReader();
@@ -24,13 +64,8 @@ TEST(Server, EndToEnd) {
   auto stub = QueryService::NewStub(channel);
   ASSERT_TRUE(stub != nullptr);
 
-  const char kQueryTextProtoFilename[] =
-      "testdata/na12878_trio_query.textproto";
-  std::ifstream ifs{kQueryTextProtoFilename};
-  ASSERT_TRUE(ifs);
-  google::protobuf::io::IstreamInputStream iis{&ifs};
   QueryRequest request;
-  ASSERT_TRUE(google::protobuf::TextFormat::Parse(&iis, &request));
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
 
   grpc::ClientContext context;
   QueryResponse response;
@@ -50,4 +85,846 @@ TEST(Server, EndToEnd) {
   // TODO(@lgruen): implement result table comparison
 }
 
+TEST(Server, QueryStream) {
+  constexpr int kPort = 12346;
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok());
+  auto server = CreateServer(kPort, **local_file_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+
+  grpc::ClientContext context;
+  auto reader = stub->QueryStream(&context, request);
+  QueryResponseChunk chunk;
+  int num_chunks = 0;
+  int num_rows = 0;
+  std::string ipc_stream;
+  while (reader->Read(&chunk)) {
+    // The first chunk only contains the schema.
+    if (num_chunks == 0) {
+      EXPECT_EQ(chunk.num_rows(), 0);
+      ASSERT_OK_AND_ASSIGN(
+          const auto schema_reader,
+          arrow::ipc::RecordBatchStreamReader::Open(
+              std::make_shared<arrow::io::BufferReader>(
+                  arrow::Buffer::FromString(chunk.ipc_messages()))));
+      EXPECT_NE(schema_reader->schema()->GetFieldByName("xpos"), nullptr);
+    }
+    ++num_chunks;
+    num_rows += chunk.num_rows();
+    ipc_stream += chunk.ipc_messages();
+  }
+  const auto status = reader->Finish();
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  EXPECT_EQ(num_rows, 6);
+
+  // The concatenated chunks form a complete IPC stream.
+  ASSERT_OK_AND_ASSIGN(const auto stream_reader,
+                       arrow::ipc::RecordBatchStreamReader::Open(
+                           std::make_shared<arrow::io::BufferReader>(
+                               arrow::Buffer::FromString(ipc_stream))));
+  int64_t num_decoded_rows = 0;
+  std::shared_ptr<arrow::RecordBatch> record_batch;
+  while (true) {
+    ASSERT_OK(stream_reader->ReadNext(&record_batch));
+    if (record_batch == nullptr) {
+      break;
+    }
+    EXPECT_TRUE(record_batch->schema()->Equals(*stream_reader->schema()));
+    num_decoded_rows += record_batch->num_rows();
+  }
+  EXPECT_EQ(num_decoded_rows, 6);
+}
+
+TEST(Server, QueryMemoryLimit) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_query_memory_limit_bytes, 1);
+
+  constexpr int kPort = 12348;
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok());
+  auto server = CreateServer(kPort, **local_file_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+
+  grpc::ClientContext context;
+  QueryResponse response;
+  auto status = stub->Query(&context, request, &response);
+  EXPECT_EQ(status.error_code(), grpc::StatusCode::RESOURCE_EXHAUSTED)
+      << status.error_message();
+}
+
+TEST(Server, CancelsWhenMaxRowsExceeded) {
+  constexpr int kPort = 12349;
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok());
+  auto server = CreateServer(kPort, **local_file_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+  request.set_max_rows(1);
+
+  grpc::ClientContext context;
+  QueryResponse response;
+  auto status = stub->Query(&context, request, &response);
+  EXPECT_EQ(status.error_code(), grpc::StatusCode::CANCELLED)
+      << status.error_message();
+
+  grpc::ClientContext stream_context;
+  auto reader = stub->QueryStream(&stream_context, request);
+  QueryResponseChunk chunk;
+  while (reader->Read(&chunk)) {
+  }
+  status = reader->Finish();
+  EXPECT_EQ(status.error_code(), grpc::StatusCode::CANCELLED)
+      << status.error_message();
+}
+
+TEST(Server, EndToEndGcs) {
+  auto fake_gcs_server = FakeGcsServer::Start();
+  ASSERT_TRUE(fake_gcs_server.ok()) << fake_gcs_server.status();
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+  for (auto& url : *request.mutable_arrow_urls()) {
+    std::string_view path = url;
+    ASSERT_TRUE(absl::ConsumePrefix(&path, "file://"));
+    const std::string name(path.substr(path.find_last_of('/') + 1));
+    ASSERT_TRUE((*fake_gcs_server)
+                    ->PutObjectFromFile("bucket", name, std::string(path))
+                    .ok());
+    url = absl::StrCat("gs://bucket/", name);
+  }
+
+  constexpr int kPort = 12347;
+  const auto gcs_reader = MakeGcsReader((*fake_gcs_server)->endpoint());
+  ASSERT_TRUE(gcs_reader.ok());
+  auto server = CreateServer(kPort, **gcs_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  grpc::ClientContext context;
+  QueryResponse response;
+  auto status = stub->Query(&context, request, &response);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+
+  EXPECT_EQ(response.num_rows(), 6);
+  // Opening a file pins the generation that keys the caches, so that's the
+  // only metadata lookup per file.
+  EXPECT_EQ((*fake_gcs_server)->num_metadata_requests(),
+            request.arrow_urls_size());
+}
+
+TEST(Server, RangedReadsOnlyFetchIncludedColumns) {
+  auto fake_gcs_server = FakeGcsServer::Start();
+  ASSERT_TRUE(fake_gcs_server.ok()) << fake_gcs_server.status();
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+  int64_t total_file_size = 0;
+  for (auto& url : *request.mutable_arrow_urls()) {
+    std::string_view path = url;
+    ASSERT_TRUE(absl::ConsumePrefix(&path, "file://"));
+    const std::string name(path.substr(path.find_last_of('/') + 1));
+    ASSERT_TRUE((*fake_gcs_server)
+                    ->PutObjectFromFile("bucket", name, std::string(path))
+                    .ok());
+    url = absl::StrCat("gs://bucket/", name);
+    total_file_size += std::filesystem::file_size(path);
+  }
+
+  const auto gcs_reader = MakeGcsReader((*fake_gcs_server)->endpoint());
+  ASSERT_TRUE(gcs_reader.ok());
+  // Each query runs on a new server, so nothing is served from its caches.
+  const auto bytes_served = [&](const int port, const QueryRequest& request) {
+    auto server = CreateServer(port, **gcs_reader);
+    if (!server.ok()) {
+      ADD_FAILURE() << server.status();
+      return int64_t{0};
+    }
+    auto stub = QueryService::NewStub(
+        grpc::CreateChannel(absl::StrCat("localhost:", port),
+                            grpc::InsecureChannelCredentials()));
+    const int64_t bytes_served_before = (*fake_gcs_server)->bytes_served();
+    grpc::ClientContext context;
+    QueryResponse response;
+    const auto status = stub->Query(&context, request, &response);
+    EXPECT_TRUE(status.ok()) << status.error_message();
+    EXPECT_EQ(response.num_rows(), 6);
+    return (*fake_gcs_server)->bytes_served() - bytes_served_before;
+  };
+
+  // The projection and filter columns are a small part of the files.
+  const int64_t narrow_bytes_served = bytes_served(12361, request);
+  EXPECT_LT(narrow_bytes_served, total_file_size / 4);
+
+  request.add_projection_columns("sortedTranscriptConsequences");
+  const int64_t wide_bytes_served = bytes_served(12362, request);
+  EXPECT_GT(wide_bytes_served, narrow_bytes_served + total_file_size / 4);
+}
+
+TEST(Server, RangedReadsStayWithinPrefetchWindow) {
+  // Record batch ranges are fetched on the I/O threads while their file
+  // holds a slot of the prefetch window.
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_ranged_reads, true);
+  absl::SetFlag(&FLAGS_prefetch_window, 2);
+
+  auto fake_gcs_server = FakeGcsServer::Start();
+  ASSERT_TRUE(fake_gcs_server.ok()) << fake_gcs_server.status();
+  (*fake_gcs_server)->set_latency(absl::Milliseconds(20));
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+  for (auto& url : *request.mutable_arrow_urls()) {
+    std::string_view path = url;
+    ASSERT_TRUE(absl::ConsumePrefix(&path, "file://"));
+    const std::string name(path.substr(path.find_last_of('/') + 1));
+    ASSERT_TRUE((*fake_gcs_server)
+                    ->PutObjectFromFile("bucket", name, std::string(path))
+                    .ok());
+    url = absl::StrCat("gs://bucket/", name);
+  }
+
+  constexpr int kPort = 12363;
+  const auto gcs_reader = MakeGcsReader((*fake_gcs_server)->endpoint());
+  ASSERT_TRUE(gcs_reader.ok());
+  auto server = CreateServer(kPort, **gcs_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  grpc::ClientContext context;
+  QueryResponse response;
+  auto status = stub->Query(&context, request, &response);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+
+  EXPECT_EQ(response.num_rows(), 6);
+  EXPECT_GT((*fake_gcs_server)->max_concurrent_media_requests(), 0);
+  EXPECT_LE((*fake_gcs_server)->max_concurrent_media_requests(), 2);
+}
+
+TEST(Server, PrefetchesDownloads) {
+  // Whole files are downloaded on the I/O threads, one at a time.
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_ranged_reads, false);
+  absl::SetFlag(&FLAGS_prefetch_window, 1);
+
+  auto fake_gcs_server = FakeGcsServer::Start();
+  ASSERT_TRUE(fake_gcs_server.ok()) << fake_gcs_server.status();
+  (*fake_gcs_server)->set_latency(absl::Milliseconds(20));
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+  for (auto& url : *request.mutable_arrow_urls()) {
+    std::string_view path = url;
+    ASSERT_TRUE(absl::ConsumePrefix(&path, "file://"));
+    const std::string name(path.substr(path.find_last_of('/') + 1));
+    ASSERT_TRUE((*fake_gcs_server)
+                    ->PutObjectFromFile("bucket", name, std::string(path))
+                    .ok());
+    url = absl::StrCat("gs://bucket/", name);
+  }
+
+  constexpr int kPort = 12350;
+  const auto gcs_reader = MakeGcsReader((*fake_gcs_server)->endpoint());
+  ASSERT_TRUE(gcs_reader.ok());
+  auto server = CreateServer(kPort, **gcs_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  grpc::ClientContext context;
+  QueryResponse response;
+  auto status = stub->Query(&context, request, &response);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+
+  EXPECT_EQ(response.num_rows(), 6);
+  EXPECT_EQ((*fake_gcs_server)->num_media_requests(),
+            request.arrow_urls_size());
+}
+
+TEST(Server, SynchronousApi) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_async_grpc, false);
+
+  constexpr int kPort = 12351;
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok());
+  auto server = CreateServer(kPort, **local_file_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+
+  grpc::ClientContext context;
+  QueryResponse response;
+  auto status = stub->Query(&context, request, &response);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  EXPECT_EQ(response.num_rows(), 6);
+
+  grpc::ClientContext stream_context;
+  auto reader = stub->QueryStream(&stream_context, request);
+  QueryResponseChunk chunk;
+  int num_rows = 0;
+  while (reader->Read(&chunk)) {
+    num_rows += chunk.num_rows();
+  }
+  status = reader->Finish();
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  EXPECT_EQ(num_rows, 6);
+}
+
+TEST(Server, ConcurrentCalls) {
+  constexpr int kPort = 12352;
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok());
+  auto server = CreateServer(kPort, **local_file_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+
+  // Many more calls than completion queue threads are in flight at once.
+  struct Call {
+    grpc::ClientContext context;
+    QueryResponse response;
+    grpc::Status status;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<QueryResponse>> reader;
+  };
+  constexpr int kNumCalls = 100;
+  grpc::CompletionQueue completion_queue;
+  std::vector<std::unique_ptr<Call>> calls;
+  for (int i = 0; i < kNumCalls; ++i) {
+    auto call = std::make_unique<Call>();
+    call->reader =
+        stub->AsyncQuery(&call->context, request, &completion_queue);
+    call->reader->Finish(&call->response, &call->status, call.get());
+    calls.push_back(std::move(call));
+  }
+
+  for (int i = 0; i < kNumCalls; ++i) {
+    void* tag = nullptr;
+    bool ok = false;
+    ASSERT_TRUE(completion_queue.Next(&tag, &ok));
+    ASSERT_TRUE(ok);
+    const auto& call = *static_cast<const Call*>(tag);
+    ASSERT_TRUE(call.status.ok()) << call.status.error_message();
+    EXPECT_EQ(call.response.num_rows(), 6);
+  }
+}
+
+TEST(Server, CachesResultsUntilFilesChange) {
+  auto fake_gcs_server = FakeGcsServer::Start();
+  ASSERT_TRUE(fake_gcs_server.ok()) << fake_gcs_server.status();
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+  std::vector<std::pair<std::string, std::string>> objects;
+  for (auto& url : *request.mutable_arrow_urls()) {
+    std::string_view path = url;
+    ASSERT_TRUE(absl::ConsumePrefix(&path, "file://"));
+    const std::string name(path.substr(path.find_last_of('/') + 1));
+    objects.emplace_back(name, path);
+    ASSERT_TRUE((*fake_gcs_server)
+                    ->PutObjectFromFile("bucket", name, std::string(path))
+                    .ok());
+    url = absl::StrCat("gs://bucket/", name);
+  }
+
+  constexpr int kPort = 12355;
+  const auto gcs_reader = MakeGcsReader((*fake_gcs_server)->endpoint());
+  ASSERT_TRUE(gcs_reader.ok());
+  auto server = CreateServer(kPort, **gcs_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  const auto query = [&stub, &request] {
+    grpc::ClientContext context;
+    QueryResponse response;
+    const auto status = stub->Query(&context, request, &response);
+    EXPECT_TRUE(status.ok()) << status.error_message();
+    EXPECT_EQ(response.num_rows(), 6);
+    return response.record_batches();
+  };
+
+  const std::string record_batches = query();
+  EXPECT_EQ((*server)->result_cache_stats().hits, 0);
+  const int64_t num_media_requests = (*fake_gcs_server)->num_media_requests();
+
+  // The second query is answered from the cache, without reading any data.
+  EXPECT_EQ(query(), record_batches);
+  EXPECT_EQ((*server)->result_cache_stats().hits, 1);
+  EXPECT_GT((*server)->result_cache_stats().bytes_saved, 0);
+  EXPECT_EQ((*fake_gcs_server)->num_media_requests(), num_media_requests);
+
+  // Rewriting a file changes its generation, which invalidates the entry.
+  const auto& [name, path] = objects.front();
+  ASSERT_TRUE(
+      (*fake_gcs_server)->PutObjectFromFile("bucket", name, path).ok());
+  EXPECT_EQ(query(), record_batches);
+  EXPECT_EQ((*server)->result_cache_stats().hits, 1);
+  EXPECT_EQ((*server)->result_cache_stats().misses, 2);
+}
+
+// Replaces the set lookup values that contain the given value by a parameter.
+void ParameterizeValueSet(const std::string& value,
+                          const std::string& parameter,
+                          QueryRequest::Expression* const expression) {
+  if (!expression->has_call()) {
+    return;
+  }
+  auto* const call = expression->mutable_call();
+  if (call->has_set_lookup_options()) {
+    auto* const options = call->mutable_set_lookup_options();
+    if (std::find(options->values().begin(), options->values().end(),
+                  value) != options->values().end()) {
+      options->clear_values();
+      options->set_values_parameter(parameter);
+    }
+  }
+  for (auto& argument : *call->mutable_arguments()) {
+    ParameterizeValueSet(value, parameter, &argument);
+  }
+}
+
+TEST(Server, PrepareAndExecute) {
+  for (const bool async_grpc : {true, false}) {
+    absl::FlagSaver flag_saver;
+    absl::SetFlag(&FLAGS_async_grpc, async_grpc);
+
+    const int port = async_grpc ? 12353 : 12354;
+    const auto local_file_reader = MakeLocalFileReader();
+    ASSERT_TRUE(local_file_reader.ok());
+    auto server = CreateServer(port, **local_file_reader);
+    ASSERT_TRUE(server.ok()) << server.status();
+
+    auto channel = grpc::CreateChannel(absl::StrCat("localhost:", port),
+                                       grpc::InsecureChannelCredentials());
+    auto stub = QueryService::NewStub(channel);
+    ASSERT_TRUE(stub != nullptr);
+
+    QueryRequest query_request;
+    ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&query_request));
+    PrepareRequest prepare_request;
+    *prepare_request.mutable_projection_columns() =
+        query_request.projection_columns();
+    *prepare_request.mutable_filter_expression() =
+        query_request.filter_expression();
+    ParameterizeValueSet("NA12878", "proband",
+                         prepare_request.mutable_filter_expression());
+
+    grpc::ClientContext prepare_context;
+    PrepareResponse prepare_response;
+    auto status =
+        stub->Prepare(&prepare_context, prepare_request, &prepare_response);
+    ASSERT_TRUE(status.ok()) << status.error_message();
+    ASSERT_FALSE(prepare_response.prepared_query_id().empty());
+
+    ExecuteRequest execute_request;
+    execute_request.set_prepared_query_id(
+        prepare_response.prepared_query_id());
+    *execute_request.mutable_arrow_urls() = query_request.arrow_urls();
+    (*execute_request.mutable_parameters())["proband"]
+        .mutable_value_set()
+        ->add_values("NA12878");
+    // The second execution reuses the bound scanner options.
+    for (int i = 0; i < 2; ++i) {
+      grpc::ClientContext context;
+      QueryResponse response;
+      status = stub->Execute(&context, execute_request, &response);
+      ASSERT_TRUE(status.ok()) << status.error_message();
+      EXPECT_EQ(response.num_rows(), 6);
+    }
+
+    ExecuteRequest missing_parameter = execute_request;
+    missing_parameter.clear_parameters();
+    grpc::ClientContext missing_parameter_context;
+    QueryResponse response;
+    status = stub->Execute(&missing_parameter_context, missing_parameter,
+                           &response);
+    EXPECT_EQ(status.error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+
+    ExecuteRequest unknown_query = execute_request;
+    unknown_query.set_prepared_query_id("unknown");
+    grpc::ClientContext unknown_query_context;
+    status = stub->Execute(&unknown_query_context, unknown_query, &response);
+    EXPECT_EQ(status.error_code(), grpc::StatusCode::NOT_FOUND);
+  }
+}
+
+TEST(Server, PagesThroughSortedResults) {
+  constexpr int kPort = 12356;
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok());
+  auto server = CreateServer(kPort, **local_file_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+  // max_rows doesn't apply to sorted queries.
+  request.set_max_rows(1);
+  auto* const sort_key = request.add_sort_keys();
+  sort_key->set_column("xpos");
+  sort_key->set_descending(true);
+  request.set_limit(4);
+
+  // The six matches are returned in two pages.
+  grpc::ClientContext first_context;
+  QueryResponse first_page;
+  auto status = stub->Query(&first_context, request, &first_page);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  EXPECT_EQ(first_page.num_rows(), 4);
+  ASSERT_FALSE(first_page.next_page_token().empty());
+
+  request.set_page_token(first_page.next_page_token());
+  grpc::ClientContext second_context;
+  QueryResponse second_page;
+  status = stub->Query(&second_context, request, &second_page);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  EXPECT_EQ(second_page.num_rows(), 2);
+  EXPECT_TRUE(second_page.next_page_token().empty());
+
+  // Tokens only apply to the query they were returned for.
+  request.set_limit(5);
+  grpc::ClientContext invalid_token_context;
+  QueryResponse response;
+  status = stub->Query(&invalid_token_context, request, &response);
+  EXPECT_EQ(status.error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+
+  // Sorted queries can't be streamed.
+  grpc::ClientContext stream_context;
+  auto reader = stub->QueryStream(&stream_context, request);
+  QueryResponseChunk chunk;
+  while (reader->Read(&chunk)) {
+  }
+  status = reader->Finish();
+  EXPECT_EQ(status.error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(Server, AggregatesResults) {
+  constexpr int kPort = 12357;
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok());
+  auto server = CreateServer(kPort, **local_file_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+  auto* const aggregation = request.mutable_aggregation();
+  aggregation->add_aggregates()->set_function(
+      QueryRequest::Aggregation::COUNT);
+  auto* const max = aggregation->add_aggregates();
+  max->set_function(QueryRequest::Aggregation::MAX);
+  max->set_column("xpos");
+
+  // A single row with the count of the six matches.
+  grpc::ClientContext context;
+  QueryResponse response;
+  auto status = stub->Query(&context, request, &response);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  EXPECT_EQ(response.num_rows(), 1);
+
+  // One row per distinct xpos.
+  aggregation->add_group_by_columns("xpos");
+  grpc::ClientContext grouped_context;
+  status = stub->Query(&grouped_context, request, &response);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  EXPECT_EQ(response.num_rows(), 6);
+
+  // max_rows applies to the number of groups.
+  request.set_max_rows(2);
+  grpc::ClientContext max_rows_context;
+  status = stub->Query(&max_rows_context, request, &response);
+  EXPECT_EQ(status.error_code(), grpc::StatusCode::CANCELLED)
+      << status.error_message();
+}
+
+TEST(Server, QueriesResidentDatasets) {
+  absl::FlagSaver flag_saver;
+  const std::string manifest_path =
+      (std::filesystem::path(testing::TempDir()) / "server_datasets.textpb")
+          .string();
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+  {
+    std::ofstream manifest(manifest_path);
+    manifest << R"(datasets { id: "trio" )";
+    for (const auto& url : request.arrow_urls()) {
+      manifest << R"(files { url: ")" << url << R"(" } )";
+    }
+    manifest << "}";
+  }
+  absl::SetFlag(&FLAGS_dataset_manifest,
+                absl::StrCat("file://", manifest_path));
+
+  constexpr int kPort = 12358;
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok());
+  auto server = CreateServer(kPort, **local_file_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  // URLs and a dataset can't be combined.
+  request.set_dataset_id("trio");
+  grpc::ClientContext invalid_context;
+  QueryResponse response;
+  auto status = stub->Query(&invalid_context, request, &response);
+  EXPECT_EQ(status.error_code(), grpc::StatusCode::INVALID_ARGUMENT)
+      << status.error_message();
+
+  // Queries fail with UNAVAILABLE until the manifest has been loaded.
+  request.clear_arrow_urls();
+  const absl::Time deadline = absl::Now() + absl::Seconds(30);
+  do {
+    grpc::ClientContext context;
+    status = stub->Query(&context, request, &response);
+  } while (status.error_code() == grpc::StatusCode::UNAVAILABLE &&
+           absl::Now() < deadline);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  EXPECT_EQ(response.num_rows(), 6);
+
+  // The health check reports SERVING once the datasets are loaded.
+  auto health_stub = grpc::health::v1::Health::NewStub(channel);
+  const grpc::health::v1::HealthCheckRequest health_request;
+  grpc::health::v1::HealthCheckResponse health_response;
+  do {
+    grpc::ClientContext context;
+    status = health_stub->Check(&context, health_request, &health_response);
+  } while (status.ok() &&
+           health_response.status() !=
+               grpc::health::v1::HealthCheckResponse::SERVING &&
+           absl::Now() < deadline);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  EXPECT_EQ(health_response.status(),
+            grpc::health::v1::HealthCheckResponse::SERVING);
+
+  request.set_dataset_id("unknown");
+  grpc::ClientContext unknown_context;
+  status = stub->Query(&unknown_context, request, &response);
+  EXPECT_EQ(status.error_code(), grpc::StatusCode::NOT_FOUND)
+      << status.error_message();
+
+  std::filesystem::remove(manifest_path);
+}
+
+TEST(Server, ReportsNotServingUntilDatasetsAreLoaded) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_dataset_manifest, "file:///nonexistent/datasets");
+
+  constexpr int kPort = 12364;
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok());
+  auto server = CreateServer(kPort, **local_file_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = grpc::health::v1::Health::NewStub(channel);
+  for (const std::string service : {"", "seqr.QueryService"}) {
+    grpc::ClientContext context;
+    grpc::health::v1::HealthCheckRequest request;
+    request.set_service(service);
+    grpc::health::v1::HealthCheckResponse response;
+    const auto status = stub->Check(&context, request, &response);
+    ASSERT_TRUE(status.ok()) << status.error_message();
+    EXPECT_EQ(response.status(),
+              grpc::health::v1::HealthCheckResponse::NOT_SERVING);
+  }
+
+  grpc::ClientContext context;
+  grpc::health::v1::HealthCheckRequest request;
+  request.set_service("unknown");
+  grpc::health::v1::HealthCheckResponse response;
+  EXPECT_EQ(stub->Check(&context, request, &response).error_code(),
+            grpc::StatusCode::NOT_FOUND);
+}
+
+TEST(Server, ReturnsProfile) {
+  constexpr int kPort = 12359;
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok());
+  auto server = CreateServer(kPort, **local_file_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+  grpc::ClientContext unprofiled_context;
+  QueryResponse response;
+  auto status = stub->Query(&unprofiled_context, request, &response);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  EXPECT_FALSE(response.has_profile());
+
+  // Profiled queries bypass the result cache, so repeating the query
+  // profiles it again.
+  request.set_profile(true);
+  for (int i = 0; i < 2; ++i) {
+    grpc::ClientContext context;
+    status = stub->Query(&context, request, &response);
+    ASSERT_TRUE(status.ok()) << status.error_message();
+    EXPECT_EQ(response.num_rows(), 6);
+
+    const auto& profile = response.profile();
+    EXPECT_GT(profile.total_nanos(), 0);
+    EXPECT_EQ(profile.serialized_bytes(),
+              static_cast<int64_t>(response.record_batches().size()));
+    EXPECT_EQ(profile.rows_matched(), 6);
+    EXPECT_GT(profile.rows_scanned(), profile.rows_matched());
+    // The conjuncts of the nested top-level "and" calls.
+    EXPECT_EQ(profile.filter_nodes_size(), 5);
+    EXPECT_EQ(profile.filter_node_nanos_size(), 5);
+    ASSERT_EQ(profile.urls_size(), request.arrow_urls_size());
+    int64_t rows_scanned = 0;
+    for (int j = 0; j < profile.urls_size(); ++j) {
+      const auto& url = profile.urls(j);
+      EXPECT_EQ(url.url(), request.arrow_urls(j));
+      EXPECT_GT(url.num_record_batches(), 0);
+      for (const auto& morsel : url.morsels()) {
+        for (const auto& record_batch : morsel.record_batches()) {
+          rows_scanned += record_batch.rows_scanned();
+        }
+      }
+    }
+    EXPECT_EQ(rows_scanned, profile.rows_scanned());
+  }
+}
+
+// Returns the full response to a GET request to a local HTTP server, or an
+// empty string if the request fails.
+std::string HttpGet(const int port, const std::string_view path) {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return "";
+  }
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  std::string result;
+  if (connect(fd, reinterpret_cast<const sockaddr*>(&address),
+              sizeof(address)) == 0) {
+    const std::string request =
+        absl::StrCat("GET ", path, " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) ==
+        static_cast<ssize_t>(request.size())) {
+      char buffer[4096];
+      ssize_t n = 0;
+      while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        result.append(buffer, n);
+      }
+    }
+  }
+  close(fd);
+  return result;
+}
+
+TEST(Server, ExportsMetrics) {
+  absl::FlagSaver flag_saver;
+  constexpr int kMetricsPort = 12362;
+  absl::SetFlag(&FLAGS_metrics_port, kMetricsPort);
+
+  constexpr int kPort = 12360;
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok());
+  auto server = CreateServer(kPort, **local_file_reader);
+  ASSERT_TRUE(server.ok()) << server.status();
+
+  auto channel = grpc::CreateChannel(absl::StrCat("localhost:", kPort),
+                                     grpc::InsecureChannelCredentials());
+  auto stub = QueryService::NewStub(channel);
+  ASSERT_TRUE(stub != nullptr);
+
+  QueryRequest request;
+  ASSERT_NO_FATAL_FAILURE(ReadTrioQueryRequest(&request));
+  grpc::ClientContext context;
+  QueryResponse response;
+  const auto status = stub->Query(&context, request, &response);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+
+  const std::string metrics = HttpGet(kMetricsPort, "/metrics");
+  EXPECT_TRUE(absl::StartsWith(metrics, "HTTP/1.1 200")) << metrics;
+  for (const std::string_view series : {
+           "seqr_grpc_requests_total{method=\"/seqr.QueryService/Query\","
+           "code=\"OK\"} ",
+           "seqr_grpc_request_seconds_count{method=\"/seqr.QueryService/"
+           "Query\"} ",
+           "seqr_grpc_sent_message_bytes_sum{method=\"/seqr.QueryService/"
+           "Query\"} ",
+           "seqr_scan_rows_total ",
+           "seqr_scan_matched_rows_total ",
+           "seqr_scheduler_queue_wait_seconds_count{pool=\"cpu\"} ",
+           "seqr_scheduler_tasks_total{pool=\"io\"} ",
+           "seqr_url_reader_seconds_count{operation=\"read_range\"} ",
+           "seqr_url_reader_bytes_total{operation=\"read_range\"} ",
+           "seqr_memory_budget_limit_bytes ",
+           "seqr_result_cache_misses_total ",
+       }) {
+    EXPECT_TRUE(absl::StrContains(metrics, series)) << series;
+  }
+  EXPECT_TRUE(absl::StartsWith(HttpGet(kMetricsPort, "/"), "HTTP/1.1 404"));
+}
+
 }  // namespace seqr
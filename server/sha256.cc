@@ -0,0 +1,14 @@
+#include "sha256.h"
+
+#include <openssl/sha.h>
+
+namespace seqr {
+
+std::string Sha256(const std::string_view data) {
+  std::string result(SHA256_DIGEST_LENGTH, '\0');
+  SHA256(reinterpret_cast<const unsigned char*>(data.data()), data.size(),
+         reinterpret_cast<unsigned char*>(result.data()));
+  return result;
+}
+
+}  // namespace seqr
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace seqr {
+
+// Returns the SHA-256 digest of the data as 32 raw bytes. Unlike std::hash,
+// it's stable across builds and collisions are infeasible, so it can
+// identify requests that are compared only by their digests.
+std::string Sha256(std::string_view data);
+
+}  // namespace seqr
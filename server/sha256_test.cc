@@ -0,0 +1,17 @@
+#include "sha256.h"
+
+#include <absl/strings/escaping.h>
+#include <gtest/gtest.h>
+
+namespace seqr {
+
+TEST(Sha256, MatchesKnownDigests) {
+  EXPECT_EQ(absl::BytesToHexString(Sha256("")),
+            "e3b0c44298fc1c149afbf4c8996fb924"
+            "27ae41e4649b934ca495991b7852b855");
+  EXPECT_EQ(absl::BytesToHexString(Sha256("abc")),
+            "ba7816bf8f01cfea414140de5dae2223"
+            "b00361a396177a9cb410ff61f20015ad");
+}
+
+}  // namespace seqr
@@ -1,6 +1,7 @@
 #include "string_list_contains_any.h"
 
 #include <absl/container/flat_hash_set.h>
+#include <arrow/array/array_dict.h>
 #include <arrow/compute/api_scalar.h>
 #include <arrow/compute/exec.h>
 #include <arrow/compute/function.h>
@@ -11,6 +12,9 @@
 #include <arrow/util/string_view.h>
 #include <arrow/visitor_inline.h>
 
+#include <cstdint>
+#include <vector>
+
 namespace seqr {
 namespace cp = arrow::compute;
 namespace {
@@ -98,7 +102,7 @@ arrow::Status ExecStringListContainsAnyWithComparator(
 arrow::Status ExecStringListContainsAny(cp::KernelContext* const ctx,
                                         const cp::ExecBatch& batch,
                                         arrow::Datum* const out) {
-  const auto state =
+  const auto& state =
       static_cast<const StringListContainsAnyState&>(*ctx->state());
   const auto& value_set = state.value_set;  // Based on SetLookupOptions.
 
@@ -117,6 +121,108 @@ arrow::Status ExecStringListContainsAny(cp::KernelContext* const ctx,
       });
 }
 
+// Returns a lookup table indexed by dictionary code, which is 1 for codes of
+// strings in the value set and 0 otherwise.
+std::vector<uint8_t> DictionaryCodesInValueSet(
+    const arrow::StringArray& dictionary,
+    const absl::flat_hash_set<arrow::util::string_view>& value_set) {
+  std::vector<uint8_t> result(dictionary.length(), 0);
+  for (int64_t i = 0; i < dictionary.length(); ++i) {
+    result[i] =
+        !dictionary.IsNull(i) && value_set.contains(dictionary.GetView(i));
+  }
+  return result;
+}
+
+// Checks that the dictionary codes in [begin, end) index into a dictionary
+// of the given length, as the lookup table is indexed without bounds checks.
+arrow::Status ValidateDictionaryCodes(const arrow::Int32Array& indices,
+                                      const int64_t begin, const int64_t end,
+                                      const int64_t dictionary_length) {
+  const int32_t* const codes = indices.raw_values();
+  bool valid = true;
+  if (indices.null_count() == 0) {
+    for (auto j = begin; j < end; ++j) {
+      valid &= codes[j] >= 0 && codes[j] < dictionary_length;
+    }
+  } else {
+    for (auto j = begin; j < end; ++j) {
+      valid &= indices.IsNull(j) ||
+               (codes[j] >= 0 && codes[j] < dictionary_length);
+    }
+  }
+  if (!valid) {
+    return arrow::Status::Invalid("Dictionary code out of range for a ",
+                                  "dictionary of length ", dictionary_length);
+  }
+  return arrow::Status::OK();
+}
+
+// Like ExecStringListContainsAny, but for lists of dictionary-encoded strings.
+// The value set is translated to dictionary codes once per batch, so the
+// inner loop only compares integers.
+arrow::Status ExecDictionaryListContainsAny(cp::KernelContext* const ctx,
+                                            const cp::ExecBatch& batch,
+                                            arrow::Datum* const out) {
+  const auto& state =
+      static_cast<const StringListContainsAnyState&>(*ctx->state());
+
+  arrow::ArrayData* const output = out->mutable_array();
+  arrow::internal::FirstTimeBitmapWriter writer{
+      output->buffers[1]->mutable_data(), output->offset, output->length};
+
+  arrow::ListArray lists(batch[0].array());
+  const auto& values =
+      static_cast<const arrow::DictionaryArray&>(*lists.values());
+  const auto codes_in_value_set = DictionaryCodesInValueSet(
+      static_cast<const arrow::StringArray&>(*values.dictionary()),
+      state.value_set);
+  const auto& indices =
+      static_cast<const arrow::Int32Array&>(*values.indices());
+  const auto* const list_offsets = lists.raw_value_offsets();
+  if (lists.length() > 0) {
+    // Offsets are monotonic, so this covers the values of all lists.
+    ARROW_RETURN_NOT_OK(ValidateDictionaryCodes(
+        indices, list_offsets[0], list_offsets[lists.length()],
+        static_cast<int64_t>(codes_in_value_set.size())));
+  }
+  const int32_t* const codes = indices.raw_values();
+  const uint8_t* const in_value_set = codes_in_value_set.data();
+  const bool has_null_codes = indices.null_count() != 0;
+  arrow::internal::VisitBitBlocksVoid(
+      lists.data()->buffers[0], lists.offset(), lists.length(),
+      [&](const int64_t i) {
+        const auto begin = list_offsets[i];
+        const auto end = list_offsets[i + 1];
+        uint8_t found = 0;
+        if (!has_null_codes) {
+          // Branch-free, as sample lists are short and matches are rare.
+          for (auto j = begin; j < end; ++j) {
+            found |= in_value_set[codes[j]];
+          }
+        } else {
+          // Codes of null values are undefined, see ExecStringListContainsAny.
+          for (auto j = begin; j < end; ++j) {
+            found |= indices.IsValid(j) && in_value_set[codes[j]];
+          }
+        }
+        if (found) {
+          writer.Set();
+        } else {
+          writer.Clear();
+        }
+        writer.Next();
+      },
+      [&]() {
+        writer.Clear();
+        writer.Next();
+      });
+
+  writer.Finish();
+
+  return arrow::Status::OK();
+}
+
 }  // namespace
 
 arrow::Status RegisterStringListContainsAny(
@@ -138,6 +244,18 @@ arrow::Status RegisterStringListContainsAny(
         !status.ok()) {
       return status;
     }
+
+    // Sample lists are typically dictionary-encoded, as the same few sample
+    // IDs are repeated for every row.
+    kernel.exec = ExecDictionaryListContainsAny;
+    kernel.signature = cp::KernelSignature::Make(
+        {arrow::list(std::make_shared<arrow::Field>(
+            field_name, arrow::dictionary(arrow::int32(), arrow::utf8())))},
+        arrow::boolean());
+    if (const auto status = string_list_contains_any->AddKernel(kernel);
+        !status.ok()) {
+      return status;
+    }
   }
   return registry->AddFunction(std::move(string_list_contains_any));
 }
@@ -6,7 +6,8 @@
 namespace seqr {
 
 // Call this function once at startup time to register the Arrow compute
-// function "string_list_contains_any".
+// function "string_list_contains_any". It accepts lists of strings as well as
+// lists of dictionary-encoded strings.
 arrow::Status RegisterStringListContainsAny(
     arrow::compute::FunctionRegistry* registry);
 
@@ -1,9 +1,12 @@
 #include "string_list_contains_any.h"
 
+#include <arrow/array/array_dict.h>
+#include <arrow/array/array_nested.h>
 #include <arrow/array/builder_binary.h>
 #include <arrow/array/builder_nested.h>
 #include <arrow/array/builder_primitive.h>
 #include <arrow/compute/api_scalar.h>
+#include <arrow/compute/api_vector.h>
 #include <arrow/compute/exec.h>
 #include <arrow/testing/gtest_util.h>
 #include <gtest/gtest.h>
@@ -63,11 +66,14 @@ void CheckStringListContainsAny(
   const auto registry = cp::FunctionRegistry::Make();
   ASSERT_OK(RegisterStringListContainsAny(registry.get()));
 
-  // Execute the function.
-  cp::ExecContext ctx(memory_pool, nullptr, registry.get());
-  auto result =
-      cp::CallFunction("string_list_contains_any", {input}, &options, &ctx);
-  ASSERT_OK(result);
+  // The same lists, but with dictionary-encoded strings.
+  ASSERT_OK_AND_ASSIGN(const auto encoded_strings,
+                       cp::DictionaryEncode(input->values()));
+  const auto dictionary_input = arrow::MakeArray(arrow::ArrayData::Make(
+      arrow::list(arrow::field("item", encoded_strings.type())),
+      input->length(),
+      {input->data()->buffers[0], input->data()->buffers[1]},
+      {encoded_strings.array()}, input->null_count(), input->offset()));
 
   // Compare with the expected result.
   arrow::BooleanBuilder expected_builder(memory_pool);
@@ -76,7 +82,16 @@ void CheckStringListContainsAny(
   }
   std::shared_ptr<arrow::BooleanArray> expected;
   ASSERT_OK(expected_builder.Finish(&expected));
-  ASSERT_EQ(*result, *expected);
+
+  // Execute the function.
+  cp::ExecContext ctx(memory_pool, nullptr, registry.get());
+  for (const auto& array : {std::shared_ptr<arrow::Array>(input),
+                            dictionary_input}) {
+    auto result =
+        cp::CallFunction("string_list_contains_any", {array}, &options, &ctx);
+    ASSERT_OK(result);
+    ASSERT_EQ(*result, *expected) << array->type()->ToString();
+  }
 }
 
 TEST(TestStringListContainsAny, OneLookupValues) {
@@ -166,4 +181,25 @@ TEST(TestStringListContainsAny, TwoLookupValues) {
                              string_validity, expected_values);
 }
 
+TEST(TestStringListContainsAny, RejectsInvalidDictionaryCodes) {
+  // Lists [["a", <code 2>]] with a dictionary of length 2.
+  const auto dictionary = arrow::ArrayFromJSON(arrow::utf8(), R"(["a", "b"])");
+  const auto indices = arrow::ArrayFromJSON(arrow::int32(), "[0, 2]");
+  // Unlike FromArrays, the constructor doesn't validate the codes.
+  const auto values = std::make_shared<arrow::DictionaryArray>(
+      arrow::dictionary(arrow::int32(), arrow::utf8()), indices, dictionary);
+  const auto offsets = arrow::ArrayFromJSON(arrow::int32(), "[0, 2]");
+  ASSERT_OK_AND_ASSIGN(const auto lists,
+                       arrow::ListArray::FromArrays(*offsets, *values));
+
+  const auto registry = cp::FunctionRegistry::Make();
+  ASSERT_OK(RegisterStringListContainsAny(registry.get()));
+  const cp::SetLookupOptions options{
+      arrow::ArrayFromJSON(arrow::utf8(), R"(["b"])"), false};
+  cp::ExecContext ctx(arrow::default_memory_pool(), nullptr, registry.get());
+  const auto result =
+      cp::CallFunction("string_list_contains_any", {lists}, &options, &ctx);
+  EXPECT_TRUE(result.status().IsInvalid()) << result.status();
+}
+
 }  // namespace seqr
@@ -0,0 +1,316 @@
+#include "top_k.h"
+
+#include <absl/strings/str_cat.h>
+#include <arrow/array/builder_primitive.h>
+#include <arrow/array/util.h>
+#include <arrow/compute/exec.h>
+#include <arrow/datum.h>
+#include <arrow/scalar.h>
+#include <arrow/table.h>
+
+#include <algorithm>
+#include <string_view>
+#include <utility>
+
+namespace seqr {
+namespace cp = arrow::compute;
+namespace {
+
+// Hidden columns that hold the position of rows in the query's files: the
+// index of the URL, of the record batch within the file, and of the row
+// among the matches of the record batch.
+constexpr char kUrlIndexColumn[] = "__seqr_url_index";
+constexpr char kRecordBatchIndexColumn[] = "__seqr_record_batch_index";
+constexpr char kRowIndexColumn[] = "__seqr_row_index";
+constexpr int kNumPositionColumns = 3;
+
+absl::Status ArrowError(const std::string_view message,
+                        const arrow::Status& status) {
+  return absl::InternalError(absl::StrCat(message, ": ", status.ToString()));
+}
+
+// A column in the order of sorted rows, with its value in the row of a page
+// token.
+struct OrderColumn {
+  std::string name;
+  bool descending = false;
+  // Sort keys may be null, unlike the position columns.
+  bool nullable = false;
+  // Invalid for nulls, which sort last.
+  std::shared_ptr<arrow::Scalar> value;
+};
+
+// Returns an expression that matches rows that come strictly after the
+// values, in lexicographic order of the columns.
+cp::Expression BuildAfterExpression(const std::vector<OrderColumn>& columns) {
+  std::vector<cp::Expression> disjuncts;
+  std::vector<cp::Expression> equal_prefix;
+  for (const auto& [name, descending, nullable, value] : columns) {
+    const auto column = cp::field_ref(name);
+    // Nothing comes after a null but other nulls.
+    if (!value->is_valid) {
+      equal_prefix.push_back(cp::is_null(column));
+      continue;
+    }
+    std::vector<cp::Expression> conjuncts = equal_prefix;
+    auto after = cp::call(descending ? "less" : "greater",
+                          {column, cp::literal(value)});
+    if (nullable) {
+      after = cp::or_(std::move(after), cp::is_null(column));
+    }
+    conjuncts.push_back(std::move(after));
+    disjuncts.push_back(cp::and_(conjuncts));
+    equal_prefix.push_back(cp::equal(column, cp::literal(value)));
+  }
+  return cp::or_(disjuncts);
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<TopK>> TopK::Make(
+    const ScannerOptions& scanner_options, arrow::MemoryPool* const pool) {
+  if (scanner_options.sort_keys.empty() || scanner_options.limit == 0) {
+    return absl::InvalidArgumentError("Sort keys and a limit are required");
+  }
+  std::optional<cp::Expression> after_page_token;
+  if (scanner_options.page_token.has_value()) {
+    const PageToken& page_token = *scanner_options.page_token;
+    std::vector<OrderColumn> columns;
+    for (size_t i = 0; i < scanner_options.sort_keys.size(); ++i) {
+      const auto& sort_key = scanner_options.sort_keys[i];
+      auto value = DecodeSortKeyValue(page_token.sort_key_values(i));
+      if (!value.ok()) {
+        return value.status();
+      }
+      columns.push_back({sort_key.column(), sort_key.descending(),
+                         /* nullable */ true, *std::move(value)});
+    }
+    columns.push_back({kUrlIndexColumn, false, false,
+                       arrow::MakeScalar(page_token.url_index())});
+    columns.push_back({kRecordBatchIndexColumn, false, false,
+                       arrow::MakeScalar(page_token.record_batch_index())});
+    columns.push_back({kRowIndexColumn, false, false,
+                       arrow::MakeScalar(page_token.row_index())});
+    after_page_token = BuildAfterExpression(columns);
+  }
+  return std::unique_ptr<TopK>(
+      new TopK(scanner_options, std::move(after_page_token), pool));
+}
+
+TopK::TopK(const ScannerOptions& scanner_options,
+           std::optional<cp::Expression> after_page_token,
+           arrow::MemoryPool* const pool)
+    : sort_keys_(scanner_options.sort_keys),
+      limit_(static_cast<int64_t>(scanner_options.limit)),
+      request_fingerprint_(scanner_options.request_fingerprint),
+      after_page_token_(std::move(after_page_token)),
+      pool_(pool) {
+  for (const auto& sort_key : sort_keys_) {
+    sort_options_.sort_keys.emplace_back(sort_key.column(),
+                                         sort_key.descending()
+                                             ? cp::SortOrder::Descending
+                                             : cp::SortOrder::Ascending);
+  }
+  for (const char* const column :
+       {kUrlIndexColumn, kRecordBatchIndexColumn, kRowIndexColumn}) {
+    sort_options_.sort_keys.emplace_back(column);
+  }
+}
+
+absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> TopK::AddPositions(
+    const std::shared_ptr<arrow::RecordBatch>& record_batch,
+    const int url_index, const int record_batch_index) const {
+  const int64_t num_rows = record_batch->num_rows();
+  auto url_indices = arrow::MakeArrayFromScalar(arrow::Int32Scalar(url_index),
+                                                num_rows, pool_);
+  if (!url_indices.ok()) {
+    return ArrowError("Failed to add positions", url_indices.status());
+  }
+  auto record_batch_indices = arrow::MakeArrayFromScalar(
+      arrow::Int32Scalar(record_batch_index), num_rows, pool_);
+  if (!record_batch_indices.ok()) {
+    return ArrowError("Failed to add positions",
+                      record_batch_indices.status());
+  }
+  arrow::Int64Builder row_index_builder(pool_);
+  if (const auto status = row_index_builder.Reserve(num_rows); !status.ok()) {
+    return ArrowError("Failed to add positions", status);
+  }
+  for (int64_t i = 0; i < num_rows; ++i) {
+    row_index_builder.UnsafeAppend(i);
+  }
+  std::shared_ptr<arrow::Array> row_indices;
+  if (const auto status = row_index_builder.Finish(&row_indices);
+      !status.ok()) {
+    return ArrowError("Failed to add positions", status);
+  }
+
+  arrow::FieldVector fields = record_batch->schema()->fields();
+  arrow::ArrayVector columns = record_batch->columns();
+  fields.push_back(arrow::field(kUrlIndexColumn, arrow::int32(), false));
+  columns.push_back(*std::move(url_indices));
+  fields.push_back(
+      arrow::field(kRecordBatchIndexColumn, arrow::int32(), false));
+  columns.push_back(*std::move(record_batch_indices));
+  fields.push_back(arrow::field(kRowIndexColumn, arrow::int64(), false));
+  columns.push_back(std::move(row_indices));
+  return arrow::RecordBatch::Make(arrow::schema(std::move(fields)), num_rows,
+                                  std::move(columns));
+}
+
+absl::StatusOr<int64_t> TopK::Add(
+    const arrow::RecordBatchVector& record_batches) {
+  cp::ExecContext exec_context(pool_);
+  arrow::RecordBatchVector remaining;
+  int64_t num_rows = 0;
+  for (const auto& record_batch : record_batches) {
+    std::shared_ptr<arrow::RecordBatch> filtered = record_batch;
+    if (after_page_token_.has_value()) {
+      const auto bound_expression = bound_after_page_token_.Bind(
+          *after_page_token_, *record_batch->schema());
+      if (!bound_expression.ok()) {
+        return bound_expression.status();
+      }
+      const auto mask = cp::ExecuteScalarExpression(
+          *bound_expression, arrow::Datum(record_batch), &exec_context);
+      if (!mask.ok()) {
+        return ArrowError("Failed to compare rows to the page token",
+                          mask.status());
+      }
+      const auto result = cp::Filter(record_batch, *mask,
+                                     cp::FilterOptions::Defaults(),
+                                     &exec_context);
+      if (!result.ok()) {
+        return ArrowError("Failed to filter record batch", result.status());
+      }
+      filtered = result->record_batch();
+    }
+    if (filtered->num_rows() > 0) {
+      num_rows += filtered->num_rows();
+      remaining.push_back(std::move(filtered));
+    }
+  }
+
+  // Sort outside of the lock, so only the much smaller merge is serialized.
+  auto first_rows = SortAndLimit(remaining);
+  if (!first_rows.ok()) {
+    return first_rows.status();
+  }
+  if (*first_rows == nullptr) {
+    return num_rows;
+  }
+  absl::MutexLock lock(&mu_);
+  if (first_rows_ == nullptr) {
+    first_rows_ = *std::move(first_rows);
+    return num_rows;
+  }
+  auto merged = SortAndLimit({first_rows_, *std::move(first_rows)});
+  if (!merged.ok()) {
+    return merged.status();
+  }
+  first_rows_ = *std::move(merged);
+  return num_rows;
+}
+
+absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> TopK::SortAndLimit(
+    const arrow::RecordBatchVector& record_batches) const {
+  if (record_batches.empty()) {
+    return nullptr;
+  }
+  const auto table = arrow::Table::FromRecordBatches(record_batches);
+  if (!table.ok()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Failed to combine rows: ", table.status().ToString()));
+  }
+  cp::ExecContext exec_context(pool_);
+  const auto indices =
+      cp::SortIndices(arrow::Datum(*table), sort_options_, &exec_context);
+  if (!indices.ok()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Failed to sort rows: ", indices.status().ToString()));
+  }
+  const int64_t num_rows = std::min((*indices)->length(), limit_);
+  const auto taken = cp::Take(arrow::Datum(*table),
+                              arrow::Datum((*indices)->Slice(0, num_rows)),
+                              cp::TakeOptions::Defaults(), &exec_context);
+  if (!taken.ok()) {
+    return ArrowError("Failed to take rows", taken.status());
+  }
+  const auto combined = taken->table()->CombineChunks(pool_);
+  if (!combined.ok()) {
+    return ArrowError("Failed to combine rows", combined.status());
+  }
+  arrow::ArrayVector columns;
+  for (const auto& column : (*combined)->columns()) {
+    columns.push_back(column->chunk(0));
+  }
+  return arrow::RecordBatch::Make((*combined)->schema(), num_rows,
+                                  std::move(columns));
+}
+
+absl::StatusOr<TopK::Page> TopK::Finish(const int64_t num_rows) const {
+  absl::MutexLock lock(&mu_);
+  Page result;
+  if (first_rows_ == nullptr) {
+    return result;
+  }
+
+  // Strip the position columns, which come last.
+  arrow::FieldVector fields = first_rows_->schema()->fields();
+  arrow::ArrayVector columns = first_rows_->columns();
+  fields.resize(fields.size() - kNumPositionColumns);
+  columns.resize(columns.size() - kNumPositionColumns);
+  result.record_batch =
+      arrow::RecordBatch::Make(arrow::schema(std::move(fields)),
+                               first_rows_->num_rows(), std::move(columns));
+  if (num_rows <= limit_) {
+    return result;
+  }
+
+  // The next page starts after the last row of this one.
+  const int64_t last_row = first_rows_->num_rows() - 1;
+  const auto get_value = [&](const std::string& column)
+      -> absl::StatusOr<std::shared_ptr<arrow::Scalar>> {
+    const auto array = first_rows_->GetColumnByName(column);
+    if (array == nullptr) {
+      return absl::InternalError(absl::StrCat("Missing column ", column));
+    }
+    auto value = array->GetScalar(last_row);
+    if (!value.ok()) {
+      return ArrowError("Failed to read page token value", value.status());
+    }
+    return *std::move(value);
+  };
+  PageToken page_token;
+  for (const auto& sort_key : sort_keys_) {
+    const auto value = get_value(sort_key.column());
+    if (!value.ok()) {
+      return value.status();
+    }
+    auto sort_key_value = EncodeSortKeyValue(**value);
+    if (!sort_key_value.ok()) {
+      return sort_key_value.status();
+    }
+    *page_token.add_sort_key_values() = *std::move(sort_key_value);
+  }
+  const auto url_index = get_value(kUrlIndexColumn);
+  const auto record_batch_index = get_value(kRecordBatchIndexColumn);
+  const auto row_index = get_value(kRowIndexColumn);
+  for (const auto* const value :
+       {&url_index, &record_batch_index, &row_index}) {
+    if (!value->ok()) {
+      return value->status();
+    }
+  }
+  page_token.set_url_index(
+      static_cast<const arrow::Int32Scalar&>(**url_index).value);
+  page_token.set_record_batch_index(
+      static_cast<const arrow::Int32Scalar&>(**record_batch_index).value);
+  page_token.set_row_index(
+      static_cast<const arrow::Int64Scalar&>(**row_index).value);
+  page_token.set_request_fingerprint(request_fingerprint_);
+  result.next_page_token = page_token.SerializeAsString();
+  return result;
+}
+
+}  // namespace seqr
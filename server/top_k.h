@@ -0,0 +1,79 @@
+#pragma once
+
+#include <absl/base/thread_annotations.h>
+#include <absl/status/statusor.h>
+#include <absl/synchronization/mutex.h>
+#include <arrow/compute/api_vector.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/memory_pool.h>
+#include <arrow/record_batch.h>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "scan.h"
+#include "seqr_query_service.pb.h"
+
+namespace seqr {
+
+// Keeps the first rows of a sorted query (see QueryRequest.sort_keys) while
+// morsels are scanned, so memory is bounded by the page size instead of the
+// number of matches. Ties are broken by the position of rows in the query's
+// files, which makes pages deterministic. Thread-safe.
+class TopK {
+ public:
+  struct Page {
+    // Without position columns. Null if there are no rows.
+    std::shared_ptr<arrow::RecordBatch> record_batch;
+    // Empty for the last page.
+    std::string next_page_token;
+  };
+
+  // Builds and filters record batches with memory from `pool`.
+  static absl::StatusOr<std::unique_ptr<TopK>> Make(
+      const ScannerOptions& scanner_options, arrow::MemoryPool* pool);
+
+  TopK(const TopK&) = delete;
+  TopK& operator=(const TopK&) = delete;
+
+  // Appends the position of every row in a record batch as hidden columns,
+  // as required by Add.
+  absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> AddPositions(
+      const std::shared_ptr<arrow::RecordBatch>& record_batch, int url_index,
+      int record_batch_index) const;
+
+  // Adds the rows of record batches that were returned by AddPositions,
+  // typically those of a morsel. Rows up to the page token are dropped.
+  // Returns the number of remaining rows.
+  absl::StatusOr<int64_t> Add(const arrow::RecordBatchVector& record_batches);
+
+  // Returns the first `limit` rows. `num_rows` is the total number of rows
+  // that Add has returned, which determines whether there's a next page.
+  absl::StatusOr<Page> Finish(int64_t num_rows) const;
+
+ private:
+  TopK(const ScannerOptions& scanner_options,
+       std::optional<arrow::compute::Expression> after_page_token,
+       arrow::MemoryPool* pool);
+
+  // Returns the first `limit_` rows of the given record batches, or null if
+  // there are none.
+  absl::StatusOr<std::shared_ptr<arrow::RecordBatch>> SortAndLimit(
+      const arrow::RecordBatchVector& record_batches) const;
+
+  const std::vector<QueryRequest::SortKey> sort_keys_;
+  const int64_t limit_;
+  const std::string request_fingerprint_;
+  // Matches rows that come after the page token, if there is one.
+  const std::optional<arrow::compute::Expression> after_page_token_;
+  BoundFilterCache bound_after_page_token_;
+  arrow::compute::SortOptions sort_options_;
+  arrow::MemoryPool* const pool_;
+  mutable absl::Mutex mu_;
+  std::shared_ptr<arrow::RecordBatch> first_rows_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace seqr
@@ -0,0 +1,166 @@
+#include "top_k.h"
+
+#include <arrow/array/array_primitive.h>
+#include <arrow/array/builder_primitive.h>
+#include <arrow/testing/gtest_util.h>
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace seqr {
+namespace {
+
+std::shared_ptr<arrow::Array> MakeArray(const std::vector<int64_t>& xpos) {
+  arrow::Int64Builder builder;
+  EXPECT_TRUE(builder.AppendValues(xpos).ok());
+  std::shared_ptr<arrow::Array> array;
+  EXPECT_TRUE(builder.Finish(&array).ok());
+  return array;
+}
+
+QueryRequest MakeSortedRequest(const bool descending, const int32_t limit) {
+  QueryRequest request;
+  request.add_projection_columns("xpos");
+  request.mutable_filter_expression()->mutable_literal()->set_bool_value(true);
+  auto* const sort_key = request.add_sort_keys();
+  sort_key->set_column("xpos");
+  sort_key->set_descending(descending);
+  request.set_limit(limit);
+  return request;
+}
+
+std::vector<int64_t> GetXpos(const arrow::Array& column) {
+  const auto& array = static_cast<const arrow::Int64Array&>(column);
+  return std::vector<int64_t>(array.raw_values(),
+                              array.raw_values() + array.length());
+}
+
+// Returns the xpos column of a page, adding the given columns as those of
+// separate URLs, and sets the page token. Null if there are no rows.
+std::shared_ptr<arrow::Array> GetPageColumn(
+    const QueryRequest& request, const arrow::ArrayVector& url_xpos,
+    std::string* const next_page_token) {
+  const auto scanner_options = BuildScannerOptions(request);
+  EXPECT_TRUE(scanner_options.ok()) << scanner_options.status();
+  auto top_k = TopK::Make(*scanner_options, arrow::default_memory_pool());
+  EXPECT_TRUE(top_k.ok()) << top_k.status();
+  int64_t num_rows = 0;
+  for (size_t i = 0; i < url_xpos.size(); ++i) {
+    const auto& xpos = url_xpos[i];
+    const auto record_batch = (*top_k)->AddPositions(
+        arrow::RecordBatch::Make(
+            arrow::schema({arrow::field("xpos", xpos->type())}),
+            xpos->length(), {xpos}),
+        static_cast<int>(i), 0);
+    EXPECT_TRUE(record_batch.ok()) << record_batch.status();
+    const auto added = (*top_k)->Add({*record_batch});
+    EXPECT_TRUE(added.ok()) << added.status();
+    num_rows += *added;
+  }
+  const auto page = (*top_k)->Finish(num_rows);
+  EXPECT_TRUE(page.ok()) << page.status();
+  *next_page_token = page->next_page_token;
+  if (page->record_batch == nullptr) {
+    return nullptr;
+  }
+  EXPECT_EQ(page->record_batch->num_columns(), 1);
+  return page->record_batch->column(0);
+}
+
+// Like GetPageColumn, for int64 xpos values without nulls.
+std::vector<int64_t> GetPage(
+    const QueryRequest& request,
+    const std::vector<std::vector<int64_t>>& url_xpos,
+    std::string* const next_page_token) {
+  arrow::ArrayVector arrays;
+  for (const auto& xpos : url_xpos) {
+    arrays.push_back(MakeArray(xpos));
+  }
+  const auto column = GetPageColumn(request, arrays, next_page_token);
+  if (column == nullptr) {
+    return {};
+  }
+  return GetXpos(*column);
+}
+
+TEST(TopK, ReturnsFirstRowsAcrossRecordBatches) {
+  std::string next_page_token;
+  EXPECT_EQ(GetPage(MakeSortedRequest(/* descending */ false, 3),
+                    {{5, 1, 7}, {3, 9, 2}}, &next_page_token),
+            (std::vector<int64_t>{1, 2, 3}));
+  EXPECT_FALSE(next_page_token.empty());
+
+  EXPECT_EQ(GetPage(MakeSortedRequest(/* descending */ true, 3),
+                    {{5, 1, 7}, {3, 9, 2}}, &next_page_token),
+            (std::vector<int64_t>{9, 7, 5}));
+}
+
+TEST(TopK, PagesThroughTies) {
+  // Ties are broken by position, so every row is returned exactly once.
+  const std::vector<std::vector<int64_t>> url_xpos = {{2, 1, 2}, {2, 3}};
+  QueryRequest request = MakeSortedRequest(/* descending */ false, 2);
+  std::vector<int64_t> all_xpos;
+  for (int i = 0; i < 3; ++i) {
+    std::string next_page_token;
+    const auto page = GetPage(request, url_xpos, &next_page_token);
+    all_xpos.insert(all_xpos.end(), page.begin(), page.end());
+    if (next_page_token.empty()) {
+      break;
+    }
+    request.set_page_token(next_page_token);
+  }
+  EXPECT_EQ(all_xpos, (std::vector<int64_t>{1, 2, 2, 2, 3}));
+}
+
+// Expects the pages of a query, each given as a JSON array of xpos values.
+void ExpectPages(QueryRequest request, const arrow::ArrayVector& url_xpos,
+                 const std::vector<std::string>& expected_pages) {
+  const auto& type = url_xpos.front()->type();
+  for (size_t i = 0; i < expected_pages.size(); ++i) {
+    std::string next_page_token;
+    const auto page = GetPageColumn(request, url_xpos, &next_page_token);
+    ASSERT_NE(page, nullptr);
+    EXPECT_TRUE(page->Equals(arrow::ArrayFromJSON(type, expected_pages[i])))
+        << "Page " << i << ": " << page->ToString();
+    EXPECT_EQ(next_page_token.empty(), i + 1 == expected_pages.size());
+    request.set_page_token(next_page_token);
+  }
+}
+
+TEST(TopK, SortsNullsLast) {
+  const arrow::ArrayVector url_xpos = {
+      arrow::ArrayFromJSON(arrow::int64(), "[2, null, 1]"),
+      arrow::ArrayFromJSON(arrow::int64(), "[null, 3]")};
+  ExpectPages(MakeSortedRequest(/* descending */ false, 2), url_xpos,
+              {"[1, 2]", "[3, null]", "[null]"});
+  ExpectPages(MakeSortedRequest(/* descending */ true, 2), url_xpos,
+              {"[3, 2]", "[1, null]", "[null]"});
+}
+
+TEST(TopK, PagesThroughLargeUnsignedIntegers) {
+  // Above INT64_MAX, so they'd wrap around as int64 values.
+  const arrow::ArrayVector url_xpos = {arrow::ArrayFromJSON(
+      arrow::uint64(),
+      "[18446744073709551615, 9223372036854775809, 9223372036854775808]")};
+  ExpectPages(MakeSortedRequest(/* descending */ false, 1), url_xpos,
+              {"[9223372036854775808]", "[9223372036854775809]",
+               "[18446744073709551615]"});
+}
+
+TEST(TopK, LastPageHasNoToken) {
+  std::string next_page_token;
+  EXPECT_EQ(GetPage(MakeSortedRequest(/* descending */ false, 2), {{4, 3}},
+                    &next_page_token),
+            (std::vector<int64_t>{3, 4}));
+  EXPECT_TRUE(next_page_token.empty());
+
+  EXPECT_TRUE(GetPage(MakeSortedRequest(/* descending */ false, 2), {},
+                      &next_page_token)
+                  .empty());
+  EXPECT_TRUE(next_page_token.empty());
+}
+
+}  // namespace
+}  // namespace seqr
@@ -2,13 +2,40 @@
 
 #include <absl/flags/declare.h>
 #include <absl/flags/flag.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
 #include <absl/strings/strip.h>
+#include <absl/synchronization/mutex.h>
+#include <arrow/buffer.h>
+#include <arrow/io/file.h>
+#include <arrow/result.h>
 #include <google/cloud/storage/client.h>
+#include <google/cloud/storage/oauth2/google_credentials.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
 #include <filesystem>
-#include <fstream>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "metrics.h"
+#include "monotonic_clock.h"
+#include "scheduler.h"
+
+ABSL_FLAG(int64_t, parallel_read_min_bytes, int64_t{32} << 20,
+          "GCS objects of at least this size are downloaded as concurrent "
+          "range reads, as a single stream's throughput is limited.");
+
+ABSL_FLAG(int, parallel_read_ranges, 8,
+          "The maximum number of concurrent range reads per GCS object "
+          "download. Each uses its own connection.");
 
 ABSL_DECLARE_FLAG(int, num_threads);
+ABSL_DECLARE_FLAG(int, num_io_threads);
 
 namespace seqr {
 
@@ -16,87 +43,618 @@ namespace gcs = google::cloud::storage;
 
 namespace {
 
+// GCS reads are split into chunks of this size, so they can be stopped in
+// between.
+constexpr int64_t kReadChunkSize = 4 << 20;
+
+// Parallel downloads split objects into ranges that are multiples of this
+// size.
+constexpr int64_t kParallelRangeAlignment = 1 << 20;
+
+// Failed range reads are resumed where they stopped, up to this many times.
+// This is on top of the retries of the GCS client itself, which don't cover
+// errors in the middle of a download.
+constexpr int kMaxRangeReadAttempts = 3;
+
+// Opens a local file as a memory map. Reads return slices of the map, which
+// keep it alive, so decoded record batches point straight into the page cache.
+absl::StatusOr<std::shared_ptr<arrow::io::MemoryMappedFile>> MapLocalFile(
+    std::string_view url) {
+  if (!absl::ConsumePrefix(&url, "file://")) {
+    return absl::InvalidArgumentError(absl::StrCat("Unsupported URL: ", url));
+  }
+  auto result = arrow::io::MemoryMappedFile::Open(std::string(url),
+                                                  arrow::io::FileMode::READ);
+  if (!result.ok()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Failed to open ", url, ": ", result.status().ToString()));
+  }
+  return *std::move(result);
+}
+
+// Returns the generation of a local file, see UrlReader::GetGeneration.
+absl::StatusOr<std::string> LocalFileGeneration(std::string_view url) {
+  if (!absl::ConsumePrefix(&url, "file://")) {
+    return absl::InvalidArgumentError(absl::StrCat("Unsupported URL: ", url));
+  }
+
+  std::error_code error_code;
+  const auto last_write_time =
+      std::filesystem::last_write_time(url, error_code);
+  if (error_code) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Failed to determine modification time for ", url, ": ",
+                     error_code.message()));
+  }
+
+  const std::uintmax_t file_size = std::filesystem::file_size(url, error_code);
+  if (error_code) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Failed to determine file size for ", url, ": ",
+                     error_code.message()));
+  }
+
+  // The modification time alone has a coarse resolution on some file
+  // systems, so also include the file size.
+  return absl::StrCat(last_write_time.time_since_epoch().count(), "-",
+                      file_size);
+}
+
+// Pins a read of a local file, see UrlReader::Read. Earlier generations of
+// local files aren't kept, so pinning one of them fails.
+absl::Status PinLocalFileGeneration(const std::string_view url,
+                                    std::string* const generation) {
+  if (generation == nullptr) {
+    return absl::OkStatus();
+  }
+  auto current_generation = LocalFileGeneration(url);
+  if (!current_generation.ok()) {
+    return current_generation.status();
+  }
+  if (generation->empty()) {
+    *generation = *std::move(current_generation);
+  } else if (*generation != *current_generation) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("Generation of ", url, " is ", *current_generation,
+                     " instead of ", *generation));
+  }
+  return absl::OkStatus();
+}
+
 class LocalFileReader : public UrlReader {
  public:
-  absl::StatusOr<std::vector<char>> Read(std::string_view url) const override {
-    if (!absl::ConsumePrefix(&url, "file://")) {
-      return absl::InvalidArgumentError(absl::StrCat("Unsupported URL: ", url));
+  absl::StatusOr<std::shared_ptr<arrow::Buffer>> Read(
+      const std::string_view url, const arrow::StopToken stop_token,
+      std::string* const generation) const override {
+    // Mapping doesn't read anything yet, so only check once.
+    if (const auto status = stop_token.Poll(); !status.ok()) {
+      return absl::CancelledError(status.message());
+    }
+    const auto file = Open(url, stop_token, generation);
+    if (!file.ok()) {
+      return file.status();
+    }
+    auto result = (*file)->ReadAt(0, (*file)->GetSize().ValueOr(0));
+    if (!result.ok()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Failed to read ", url, ": ", result.status().ToString()));
     }
+    return *std::move(result);
+  }
 
-    const std::uintmax_t file_size = std::filesystem::file_size(url);
-    if (file_size == static_cast<std::uintmax_t>(-1)) {
-      return absl::InvalidArgumentError(
-          absl::StrCat("Failed to determine file size for ", url));
+  bool MapsContent(const arrow::Buffer& /* content */) const override {
+    return true;
+  }
+
+  absl::StatusOr<std::string> GetGeneration(
+      const std::string_view url) const override {
+    return LocalFileGeneration(url);
+  }
+
+  absl::StatusOr<std::shared_ptr<arrow::io::RandomAccessFile>> Open(
+      const std::string_view url, arrow::StopToken /* stop_token */,
+      std::string* const generation) const override {
+    if (const auto status = PinLocalFileGeneration(url, generation);
+        !status.ok()) {
+      return status;
+    }
+    return MapLocalFile(url);
+  }
+};
+
+// Splits a "gs://bucket/blob" URL into its bucket and blob components.
+absl::StatusOr<std::pair<std::string, std::string>> ParseGcsUrl(
+    std::string_view url) {
+  if (!absl::ConsumePrefix(&url, "gs://")) {
+    return absl::InvalidArgumentError(absl::StrCat("Unsupported URL: ", url));
+  }
+
+  const size_t slash_pos = url.find_first_of('/');
+  if (slash_pos == std::string_view::npos) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Incomplete blob URL ", url));
+  }
+
+  return std::make_pair(std::string(url.substr(0, slash_pos)),
+                        std::string(url.substr(slash_pos + 1)));
+}
+
+// Reads the range [begin, end) of an object generation into `out`.
+arrow::Status ReadGcsRange(gcs::Client gcs_client, const std::string& bucket,
+                           const std::string& blob, const int64_t generation,
+                           const int64_t begin, const int64_t end,
+                           char* const out,
+                           const arrow::StopToken& stop_token) {
+  int64_t offset = begin;
+  std::string error;
+  for (int attempt = 0; attempt < kMaxRangeReadAttempts && offset < end;
+       ++attempt) {
+    try {
+      // Pinning the generation guarantees consistent reads, even if the
+      // object gets overwritten in the meantime.
+      auto reader =
+          gcs_client.ReadObject(bucket, blob, gcs::Generation(generation),
+                                gcs::ReadRange(offset, end));
+      while (offset < end) {
+        ARROW_RETURN_NOT_OK(stop_token.Poll());
+        const int64_t chunk_size = std::min(kReadChunkSize, end - offset);
+        reader.read(out + (offset - begin), chunk_size);
+        offset += reader.gcount();
+        if (reader.bad() || reader.gcount() != chunk_size) {
+          error = reader.status().message();
+          break;
+        }
+      }
+    } catch (const std::exception& e) {
+      // Unfortunately the googe-cloud-storage library throws exceptions.
+      error = e.what();
+    }
+  }
+  if (offset < end) {
+    return arrow::Status::IOError("Failed to read range [", begin, ", ", end,
+                                  ") of gs://", bucket, "/", blob, ": ",
+                                  error);
+  }
+  return arrow::Status::OK();
+}
+
+// A random access file backed by ranged reads of a GCS object. Small reads
+// fetch a larger window around the requested range and keep it, so that
+// adjacent small reads (e.g. the IPC footer, followed by the schema, or record
+// batch metadata, followed by a small body) are coalesced into one request.
+class GcsRandomAccessFile : public arrow::io::RandomAccessFile {
+ public:
+  GcsRandomAccessFile(gcs::Client gcs_client, std::string bucket,
+                      std::string blob, const int64_t generation,
+                      const int64_t size, arrow::StopToken stop_token)
+      : gcs_client_(std::move(gcs_client)),
+        bucket_(std::move(bucket)),
+        blob_(std::move(blob)),
+        generation_(generation),
+        size_(size),
+        stop_token_(std::move(stop_token)) {}
+
+  arrow::Status Close() override {
+    closed_ = true;
+    return arrow::Status::OK();
+  }
+
+  bool closed() const override { return closed_; }
+
+  arrow::Result<int64_t> Tell() const override {
+    absl::MutexLock lock(&mu_);
+    return position_;
+  }
+
+  arrow::Status Seek(const int64_t position) override {
+    if (position < 0) {
+      return arrow::Status::Invalid("Negative seek position");
+    }
+    absl::MutexLock lock(&mu_);
+    position_ = position;
+    return arrow::Status::OK();
+  }
+
+  arrow::Result<int64_t> GetSize() override { return size_; }
+
+  arrow::Result<int64_t> Read(const int64_t nbytes, void* const out) override {
+    ARROW_ASSIGN_OR_RAISE(auto buffer, Read(nbytes));
+    std::memcpy(out, buffer->data(), buffer->size());
+    return buffer->size();
+  }
+
+  arrow::Result<std::shared_ptr<arrow::Buffer>> Read(
+      const int64_t nbytes) override {
+    const int64_t position = *Tell();
+    ARROW_ASSIGN_OR_RAISE(auto buffer, ReadAt(position, nbytes));
+    absl::MutexLock lock(&mu_);
+    position_ = position + buffer->size();
+    return buffer;
+  }
+
+  arrow::Result<int64_t> ReadAt(const int64_t position, const int64_t nbytes,
+                                void* const out) override {
+    ARROW_ASSIGN_OR_RAISE(auto buffer, ReadAt(position, nbytes));
+    std::memcpy(out, buffer->data(), buffer->size());
+    return buffer->size();
+  }
+
+  // Thread-safe, as required by the RandomAccessFile interface.
+  arrow::Result<std::shared_ptr<arrow::Buffer>> ReadAt(
+      const int64_t position, int64_t nbytes) override {
+    if (position < 0 || nbytes < 0) {
+      return arrow::Status::Invalid("Invalid read range");
+    }
+    nbytes = std::max<int64_t>(0, std::min(nbytes, size_ - position));
+    {
+      absl::MutexLock lock(&mu_);
+      for (const auto& [offset, buffer] : recent_ranges_) {
+        if (position >= offset &&
+            position + nbytes <= offset + buffer->size()) {
+          return arrow::SliceBuffer(buffer, position - offset, nbytes);
+        }
+      }
+    }
+
+    int64_t begin = position;
+    int64_t end = position + nbytes;
+    if (nbytes < kMinRangeSize) {
+      if (position + kMinRangeSize > size_) {
+        // Close to the end of the file, e.g. when reading the footer, further
+        // reads are more likely to happen before the requested range.
+        begin = std::max<int64_t>(0, size_ - kMinRangeSize);
+        end = size_;
+      } else {
+        end = position + kMinRangeSize;
+      }
+    }
+
+    ARROW_ASSIGN_OR_RAISE(auto buffer, FetchRange(begin, end));
+    {
+      absl::MutexLock lock(&mu_);
+      recent_ranges_.emplace_front(begin, buffer);
+      if (recent_ranges_.size() > kMaxRecentRanges) {
+        recent_ranges_.pop_back();
+      }
     }
+    return arrow::SliceBuffer(buffer, position - begin, nbytes);
+  }
+
+ private:
+  // Reads smaller than this are widened, as the per-request latency
+  // dominates for small ranges.
+  static constexpr int64_t kMinRangeSize = 64 << 10;
+
+  // Keeping a few recently fetched ranges lets the same record batch message
+  // be decoded for different column selections without fetching it again.
+  static constexpr size_t kMaxRecentRanges = 4;
 
-    std::vector<char> result(file_size, 0);
-    std::ifstream ifs{std::string(url)};
-    ifs.read(result.data(), file_size);
+  arrow::Result<std::shared_ptr<arrow::Buffer>> FetchRange(
+      const int64_t begin, const int64_t end) const {
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Buffer> result,
+                          arrow::AllocateBuffer(end - begin));
+    if (begin == end) {
+      return result;
+    }
+
+    // Pass a copy of the GCS client for thread-safety.
+    ARROW_RETURN_NOT_OK(ReadGcsRange(
+        gcs_client_, bucket_, blob_, generation_, begin, end,
+        reinterpret_cast<char*>(result->mutable_data()), stop_token_));
     return result;
   }
+
+  const gcs::Client gcs_client_;
+  const std::string bucket_;
+  const std::string blob_;
+  const int64_t generation_;
+  const int64_t size_;
+  const arrow::StopToken stop_token_;
+  std::atomic<bool> closed_ = false;
+  mutable absl::Mutex mu_;
+  int64_t position_ ABSL_GUARDED_BY(mu_) = 0;
+  // Offsets and data of the most recently fetched ranges, newest first.
+  std::deque<std::pair<int64_t, std::shared_ptr<arrow::Buffer>>> recent_ranges_
+      ABSL_GUARDED_BY(mu_);
 };
 
 class GcsReader : public UrlReader {
  public:
-  absl::StatusOr<std::vector<char>> Read(std::string_view url) const override {
-    if (!absl::ConsumePrefix(&url, "gs://")) {
-      return absl::InvalidArgumentError(absl::StrCat("Unsupported URL: ", url));
-    }
+  explicit GcsReader(google::cloud::Options options)
+      : shared_gcs_client_(std::move(options)) {}
 
-    const size_t slash_pos = url.find_first_of('/');
-    if (slash_pos == std::string_view::npos) {
-      return absl::InvalidArgumentError(
-          absl::StrCat("Incomplete blob URL ", url));
+  // Objects of at least --parallel_read_min_bytes are split into ranges that
+  // are read concurrently, each directly into its part of the result.
+  absl::StatusOr<std::shared_ptr<arrow::Buffer>> Read(
+      std::string_view url, const arrow::StopToken stop_token,
+      std::string* const generation) const override {
+    // The generation is pinned, so all ranges read the same content.
+    const auto metadata = GetMetadata(url, generation);
+    if (!metadata.ok()) {
+      return metadata.status();
     }
+    const auto size = static_cast<int64_t>(metadata->size());
 
-    const auto bucket = url.substr(0, slash_pos);
-    const auto blob = url.substr(slash_pos + 1);
+    // Allocations are 64-byte aligned.
+    auto result = arrow::AllocateBuffer(size);
+    if (!result.ok()) {
+      return absl::ResourceExhaustedError(
+          absl::StrCat("Failed to allocate buffer for ", url, ": ",
+                       result.status().ToString()));
+    }
+    char* const data = reinterpret_cast<char*>((*result)->mutable_data());
 
-    // Make a copy of the GCS client for thread-safety.
-    gcs::Client gcs_client = shared_gcs_client_;
+    int64_t range_size = size;
+    if (size >= absl::GetFlag(FLAGS_parallel_read_min_bytes)) {
+      const int64_t max_ranges =
+          std::max(1, absl::GetFlag(FLAGS_parallel_read_ranges));
+      const int64_t num_alignments =
+          (size + kParallelRangeAlignment - 1) / kParallelRangeAlignment;
+      range_size = (num_alignments + max_ranges - 1) / max_ranges *
+                   kParallelRangeAlignment;
+    }
+    const int64_t num_ranges =
+        range_size == 0 ? 0 : (size + range_size - 1) / range_size;
 
-    try {
-      auto reader =
-          gcs_client.ReadObject(std::string(bucket), std::string(blob));
-      if (reader.bad()) {
-        return absl::InvalidArgumentError(
-            absl::StrCat("Failed to read blob: ", reader.status().message()));
+    // The calling thread reads the first range, so reads make progress even
+    // if all range threads are busy with other objects.
+    std::vector<arrow::Status> statuses(num_ranges);
+    const auto read_range = [&](const int64_t index) {
+      const int64_t begin = index * range_size;
+      statuses[index] = ReadGcsRange(
+          shared_gcs_client_, metadata->bucket(), metadata->name(),
+          metadata->generation(), begin, std::min(begin + range_size, size),
+          data + begin, stop_token);
+    };
+    {
+      Scheduler::TaskGroup task_group(
+          &range_scheduler_,
+          std::max<int>(1, static_cast<int>(num_ranges) - 1));
+      for (int64_t i = 1; i < num_ranges; ++i) {
+        task_group.Schedule([&read_range, i] { read_range(i); });
       }
+      if (num_ranges > 0) {
+        read_range(0);
+      }
+      // The group's destructor waits for the remaining ranges.
+    }
 
-      std::optional<int> content_length;
-      for (const auto& header : reader.headers()) {
-        if (header.first == "content-length") {
-          int value = 0;
-          if (!absl::SimpleAtoi(header.second, &value)) {
-            return absl::NotFoundError(
-                "Couldn't parse content-length header value");
-          }
-          content_length = value;
-        }
+    for (const auto& status : statuses) {
+      if (status.IsCancelled()) {
+        return absl::CancelledError(status.message());
       }
-      if (!content_length) {
-        return absl::NotFoundError("Couldn't find content-length header");
+      if (!status.ok()) {
+        return absl::InvalidArgumentError(status.message());
       }
+    }
+    return std::shared_ptr<arrow::Buffer>(*std::move(result));
+  }
+
+  absl::StatusOr<std::string> GetGeneration(
+      std::string_view url) const override {
+    const auto metadata = GetMetadata(url);
+    if (!metadata.ok()) {
+      return metadata.status();
+    }
+    return absl::StrCat(metadata->generation());
+  }
+
+  absl::StatusOr<std::shared_ptr<arrow::io::RandomAccessFile>> Open(
+      std::string_view url, arrow::StopToken stop_token,
+      std::string* const generation) const override {
+    const auto metadata = GetMetadata(url, generation);
+    if (!metadata.ok()) {
+      return metadata.status();
+    }
+    return std::make_shared<GcsRandomAccessFile>(
+        shared_gcs_client_, metadata->bucket(), metadata->name(),
+        metadata->generation(), static_cast<int64_t>(metadata->size()),
+        std::move(stop_token));
+  }
+
+ private:
+  // Returns the metadata of the object, of the generation that `generation`
+  // points to if it isn't null or empty. Otherwise the current generation is
+  // stored in it, see UrlReader::Read.
+  absl::StatusOr<gcs::ObjectMetadata> GetMetadata(
+      std::string_view url, std::string* const generation = nullptr) const {
+    const auto bucket_and_blob = ParseGcsUrl(url);
+    if (!bucket_and_blob.ok()) {
+      return bucket_and_blob.status();
+    }
+    const auto& [bucket, blob] = *bucket_and_blob;
+
+    int64_t pinned_generation = 0;
+    if (generation != nullptr && !generation->empty() &&
+        !absl::SimpleAtoi(*generation, &pinned_generation)) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid generation ", *generation, " of ", url));
+    }
+
+    // Make a copy of the GCS client for thread-safety.
+    gcs::Client gcs_client = shared_gcs_client_;
 
-      std::vector<char> result(*content_length, '\0');
-      reader.read(result.data(), result.size());
-      if (reader.bad()) {
-        return absl::InvalidArgumentError(
-            absl::StrCat("Failed to read blob: ", reader.status().message()));
+    try {
+      auto metadata =
+          pinned_generation != 0
+              ? gcs_client.GetObjectMetadata(bucket, blob,
+                                             gcs::Generation(pinned_generation))
+              : gcs_client.GetObjectMetadata(bucket, blob);
+      if (!metadata) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "Failed to get blob metadata: ", metadata.status().message()));
       }
-      return result;
+      if (generation != nullptr && generation->empty()) {
+        *generation = absl::StrCat(metadata->generation());
+      }
+      return *std::move(metadata);
     } catch (const std::exception& e) {
       // Unfortunately the googe-cloud-storage library throws exceptions.
-      return absl::InternalError(
-          absl::StrCat("Exception during reading of ", url, ": ", e.what()));
+      return absl::InternalError(absl::StrCat(
+          "Exception during metadata lookup of ", url, ": ", e.what()));
     }
   }
 
- private:
   // Share connection pool, but need to make copies for thread-safety.
-  gcs::Client shared_gcs_client_{
-      google::cloud::Options{}.set<gcs::ConnectionPoolSizeOption>(
-          absl::GetFlag(FLAGS_num_threads))};
+  const gcs::Client shared_gcs_client_;
+  // Reads the ranges of parallel downloads, other than the first one. The
+  // per-download task groups keep concurrent downloads from starving each
+  // other.
+  mutable Scheduler range_scheduler_{absl::GetFlag(FLAGS_num_io_threads),
+                                     "gcs_range"};
+};
+
+class ObservedFile : public arrow::io::RandomAccessFile {
+ public:
+  ObservedFile(std::shared_ptr<arrow::io::RandomAccessFile> file,
+               ReadObserver observer)
+      : file_(std::move(file)), observer_(std::move(observer)) {}
+
+  arrow::Status Close() override { return file_->Close(); }
+
+  bool closed() const override { return file_->closed(); }
+
+  bool supports_zero_copy() const override {
+    return file_->supports_zero_copy();
+  }
+
+  arrow::Result<int64_t> Tell() const override { return file_->Tell(); }
+
+  arrow::Status Seek(const int64_t position) override {
+    return file_->Seek(position);
+  }
+
+  arrow::Result<int64_t> GetSize() override { return file_->GetSize(); }
+
+  arrow::Result<int64_t> Read(const int64_t nbytes, void* const out) override {
+    return Observe([&] { return file_->Read(nbytes, out); });
+  }
+
+  arrow::Result<std::shared_ptr<arrow::Buffer>> Read(
+      const int64_t nbytes) override {
+    return Observe([&] { return file_->Read(nbytes); });
+  }
+
+  arrow::Result<int64_t> ReadAt(const int64_t position, const int64_t nbytes,
+                                void* const out) override {
+    return Observe([&] { return file_->ReadAt(position, nbytes, out); });
+  }
+
+  arrow::Result<std::shared_ptr<arrow::Buffer>> ReadAt(
+      const int64_t position, const int64_t nbytes) override {
+    return Observe([&] { return file_->ReadAt(position, nbytes); });
+  }
+
+ private:
+  static int64_t Size(const int64_t nbytes) { return nbytes; }
+
+  static int64_t Size(const std::shared_ptr<arrow::Buffer>& buffer) {
+    return buffer->size();
+  }
+
+  template <typename ReadFunction>
+  auto Observe(const ReadFunction& read) {
+    const int64_t start = MonotonicNanos();
+    auto result = read();
+    observer_(result.status(), result.ok() ? Size(*result) : 0,
+              MonotonicNanos() - start);
+    return result;
+  }
+
+  const std::shared_ptr<arrow::io::RandomAccessFile> file_;
+  const ReadObserver observer_;
+};
+
+// The metrics of one kind of UrlReader operation. They live as long as the
+// default registry, so they can be captured by opened files.
+struct OperationMetrics {
+  explicit OperationMetrics(const std::string_view operation) {
+    auto& registry = MetricsRegistry::Default();
+    const std::string labels =
+        absl::StrCat("{operation=\"", operation, "\"}");
+    latency = registry.GetHistogram(
+        absl::StrCat("seqr_url_reader_seconds", labels),
+        "The latency of URL reader operations.", /* unit */ 1e-9);
+    bytes = registry.GetCounter(
+        absl::StrCat("seqr_url_reader_bytes_total", labels),
+        "The number of bytes read from URLs.");
+    errors = registry.GetCounter(
+        absl::StrCat("seqr_url_reader_errors_total", labels),
+        "The number of failed URL reader operations.");
+  }
+
+  void Record(const bool failed, const int64_t num_bytes,
+              const int64_t nanos) const {
+    latency->Record(nanos);
+    bytes->Add(num_bytes);
+    if (failed) {
+      errors->Add();
+    }
+  }
+
+  Histogram* latency;
+  Counter* bytes;
+  Counter* errors;
+};
+
+class InstrumentedReader : public UrlReader {
+ public:
+  explicit InstrumentedReader(const UrlReader& url_reader)
+      : url_reader_(url_reader) {}
+
+  absl::StatusOr<std::shared_ptr<arrow::Buffer>> Read(
+      std::string_view url, arrow::StopToken stop_token,
+      std::string* const generation) const override {
+    const int64_t start = MonotonicNanos();
+    auto result = url_reader_.Read(url, std::move(stop_token), generation);
+    read_metrics_.Record(Failed(result.status()),
+                         result.ok() ? (*result)->size() : 0,
+                         MonotonicNanos() - start);
+    return result;
+  }
+
+  bool MapsContent(const arrow::Buffer& content) const override {
+    return url_reader_.MapsContent(content);
+  }
+
+  absl::StatusOr<std::shared_ptr<arrow::io::RandomAccessFile>> Open(
+      std::string_view url, arrow::StopToken stop_token,
+      std::string* const generation) const override {
+    const int64_t start = MonotonicNanos();
+    auto result = url_reader_.Open(url, std::move(stop_token), generation);
+    open_metrics_.Record(Failed(result.status()), 0,
+                         MonotonicNanos() - start);
+    if (!result.ok()) {
+      return result;
+    }
+    return ObserveReads(
+        *std::move(result),
+        [metrics = read_range_metrics_](const arrow::Status& status,
+                                        const int64_t bytes,
+                                        const int64_t nanos) {
+          metrics.Record(!status.ok() && !status.IsCancelled(), bytes, nanos);
+        });
+  }
+
+  absl::StatusOr<std::string> GetGeneration(
+      std::string_view url) const override {
+    const int64_t start = MonotonicNanos();
+    auto result = url_reader_.GetGeneration(url);
+    generation_metrics_.Record(Failed(result.status()), 0,
+                               MonotonicNanos() - start);
+    return result;
+  }
+
+ private:
+  static bool Failed(const absl::Status& status) {
+    return !status.ok() && !absl::IsCancelled(status);
+  }
+
+  const UrlReader& url_reader_;
+  const OperationMetrics read_metrics_{"read"};
+  const OperationMetrics read_range_metrics_{"read_range"};
+  const OperationMetrics open_metrics_{"open"};
+  const OperationMetrics generation_metrics_{"generation"};
 };
 
 }  // namespace
@@ -105,8 +663,29 @@ absl::StatusOr<std::unique_ptr<UrlReader>> MakeLocalFileReader() {
   return std::make_unique<LocalFileReader>();
 }
 
-absl::StatusOr<std::unique_ptr<UrlReader>> MakeGcsReader() {
-  return std::make_unique<GcsReader>();
+absl::StatusOr<std::unique_ptr<UrlReader>> MakeGcsReader(
+    const std::string_view endpoint) {
+  // The I/O threads, the range threads of parallel downloads and the
+  // workers, with ranged reads, all use connections.
+  auto options = google::cloud::Options{}.set<gcs::ConnectionPoolSizeOption>(
+      absl::GetFlag(FLAGS_num_threads) +
+      2 * absl::GetFlag(FLAGS_num_io_threads));
+  if (!endpoint.empty()) {
+    options.set<gcs::RestEndpointOption>(std::string(endpoint))
+        .set<gcs::Oauth2CredentialsOption>(
+            gcs::oauth2::CreateAnonymousCredentials());
+  }
+  return std::make_unique<GcsReader>(std::move(options));
+}
+
+std::shared_ptr<arrow::io::RandomAccessFile> ObserveReads(
+    std::shared_ptr<arrow::io::RandomAccessFile> file, ReadObserver observer) {
+  return std::make_shared<ObservedFile>(std::move(file), std::move(observer));
+}
+
+std::unique_ptr<UrlReader> MakeInstrumentedReader(
+    const UrlReader& url_reader) {
+  return std::make_unique<InstrumentedReader>(url_reader);
 }
 
 }  // namespace seqr
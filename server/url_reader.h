@@ -1,10 +1,15 @@
 #pragma once
 
 #include <absl/status/statusor.h>
+#include <arrow/buffer.h>
+#include <arrow/io/interfaces.h>
+#include <arrow/util/cancel.h>
 
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <string>
 #include <string_view>
-#include <vector>
 
 namespace seqr {
 
@@ -12,14 +17,67 @@ class UrlReader {
  public:
   virtual ~UrlReader() = default;
 
-  virtual absl::StatusOr<std::vector<char>> Read(
+  // Reads the full content at the given URL. Large reads stop early once
+  // `stop_token` is triggered. If `generation` isn't null, the read is pinned
+  // to a generation (see GetGeneration): the one it points to, or if that's
+  // empty, the current one, which is then stored in it. Keying caches by the
+  // pinned generation guarantees that they hold what was actually read, even
+  // if the content changes in the meantime. Reads of a generation that's no
+  // longer available fail.
+  virtual absl::StatusOr<std::shared_ptr<arrow::Buffer>> Read(
+      std::string_view url,
+      arrow::StopToken stop_token = arrow::StopToken::Unstoppable(),
+      std::string* generation = nullptr) const = 0;
+
+  // Returns true if `content`, as returned by Read, maps the content instead
+  // of holding a copy of it. Such buffers only occupy page cache, which is
+  // shared across queries and processes, so they don't count towards memory
+  // limits.
+  virtual bool MapsContent(const arrow::Buffer& /* content */) const {
+    return false;
+  }
+
+  // Opens the given URL for random access, so only the byte ranges that are
+  // actually needed get fetched. Reads of the file stop early once
+  // `stop_token` is triggered. `generation` pins all reads of the file, like
+  // for Read.
+  virtual absl::StatusOr<std::shared_ptr<arrow::io::RandomAccessFile>> Open(
+      std::string_view url,
+      arrow::StopToken stop_token = arrow::StopToken::Unstoppable(),
+      std::string* generation = nullptr) const = 0;
+
+  // Returns an opaque version identifier that changes whenever the content at
+  // the given URL changes (e.g. the GCS object generation or the file
+  // modification time). This is typically much cheaper than reading the data,
+  // but reads that need a consistent generation should pin it instead.
+  virtual absl::StatusOr<std::string> GetGeneration(
       std::string_view url) const = 0;
 };
 
-// Reads from a local file system.
+// Reads from a local file system. Files are memory-mapped, so reads don't
+// copy any data and only the pages that are actually accessed get loaded.
 absl::StatusOr<std::unique_ptr<UrlReader>> MakeLocalFileReader();
 
-// Reads from Google Cloud Storage.
-absl::StatusOr<std::unique_ptr<UrlReader>> MakeGcsReader();
+// Reads from Google Cloud Storage. If `endpoint` is not empty, it replaces the
+// default GCS endpoint and anonymous credentials are used, e.g. for testing
+// against a local emulator.
+absl::StatusOr<std::unique_ptr<UrlReader>> MakeGcsReader(
+    std::string_view endpoint = "");
+
+// Called after each read of a file returned by ObserveReads, with the outcome
+// of the read, the number of bytes read and how long it took.
+using ReadObserver = std::function<void(
+    const arrow::Status& status, int64_t bytes, int64_t nanos)>;
+
+// Returns a file that forwards to `file` and reports each read to
+// `observer`. Thread-safe if `file` and `observer` are.
+std::shared_ptr<arrow::io::RandomAccessFile> ObserveReads(
+    std::shared_ptr<arrow::io::RandomAccessFile> file, ReadObserver observer);
+
+// Returns a reader that forwards to `url_reader`, which must outlive it, and
+// records the latency, bytes and errors of all operations, including reads of
+// opened files, in the default MetricsRegistry. Operations that were stopped
+// by their stop token don't count as errors.
+std::unique_ptr<UrlReader> MakeInstrumentedReader(const UrlReader& url_reader);
 
 }  // namespace seqr
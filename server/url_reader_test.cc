@@ -0,0 +1,233 @@
+#include "url_reader.h"
+
+#include <absl/flags/declare.h>
+#include <absl/flags/flag.h>
+#include <absl/strings/str_cat.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/testing/gtest_util.h>
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <string>
+
+#include "fake_gcs_server.h"
+
+ABSL_DECLARE_FLAG(int64_t, parallel_read_min_bytes);
+ABSL_DECLARE_FLAG(int, parallel_read_ranges);
+
+namespace seqr {
+
+constexpr char kArrowPath[] = "testdata/part-00000-na12878-trio.zstd.arrow";
+
+TEST(LocalFileReaderTest, MapsFiles) {
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok()) << local_file_reader.status();
+
+  const std::string url = absl::StrCat("file://", kArrowPath);
+  const auto data = (*local_file_reader)->Read(url);
+  ASSERT_TRUE(data.ok()) << data.status();
+  EXPECT_TRUE((*local_file_reader)->MapsContent(**data));
+  EXPECT_EQ((*data)->size(),
+            static_cast<int64_t>(std::filesystem::file_size(kArrowPath)));
+  EXPECT_EQ((*data)->ToString().substr(0, 6), "ARROW1");
+
+  // Ranged reads are slices of the same map.
+  const auto file = (*local_file_reader)->Open(url);
+  ASSERT_TRUE(file.ok()) << file.status();
+  ASSERT_OK_AND_ASSIGN(const auto buffer, (*file)->ReadAt(0, 6));
+  EXPECT_EQ(buffer->ToString(), "ARROW1");
+
+  EXPECT_FALSE((*local_file_reader)->Read("file:///does/not/exist").ok());
+}
+
+TEST(LocalFileReaderTest, PinsGenerations) {
+  const auto local_file_reader = MakeLocalFileReader();
+  ASSERT_TRUE(local_file_reader.ok()) << local_file_reader.status();
+  const std::string url = absl::StrCat("file://", kArrowPath);
+
+  std::string generation;
+  ASSERT_TRUE((*local_file_reader)
+                  ->Read(url, arrow::StopToken::Unstoppable(), &generation)
+                  .ok());
+  const auto current_generation = (*local_file_reader)->GetGeneration(url);
+  ASSERT_TRUE(current_generation.ok()) << current_generation.status();
+  EXPECT_EQ(generation, *current_generation);
+  EXPECT_TRUE((*local_file_reader)
+                  ->Open(url, arrow::StopToken::Unstoppable(), &generation)
+                  .ok());
+
+  generation = "earlier";
+  EXPECT_TRUE(absl::IsFailedPrecondition(
+      (*local_file_reader)
+          ->Open(url, arrow::StopToken::Unstoppable(), &generation)
+          .status()));
+}
+
+class GcsReaderTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    auto fake_gcs_server = FakeGcsServer::Start();
+    ASSERT_TRUE(fake_gcs_server.ok()) << fake_gcs_server.status();
+    fake_gcs_server_ = *std::move(fake_gcs_server);
+
+    auto gcs_reader = MakeGcsReader(fake_gcs_server_->endpoint());
+    ASSERT_TRUE(gcs_reader.ok()) << gcs_reader.status();
+    gcs_reader_ = *std::move(gcs_reader);
+  }
+
+  std::unique_ptr<FakeGcsServer> fake_gcs_server_;
+  std::unique_ptr<UrlReader> gcs_reader_;
+};
+
+TEST_F(GcsReaderTest, ReadsWholeObject) {
+  fake_gcs_server_->PutObject("bucket", "dir/blob", "hello world");
+
+  const auto data = gcs_reader_->Read("gs://bucket/dir/blob");
+  ASSERT_TRUE(data.ok()) << data.status();
+  EXPECT_EQ((*data)->ToString(), "hello world");
+
+  const auto generation = gcs_reader_->GetGeneration("gs://bucket/dir/blob");
+  ASSERT_TRUE(generation.ok()) << generation.status();
+  fake_gcs_server_->PutObject("bucket", "dir/blob", "updated");
+  const auto new_generation =
+      gcs_reader_->GetGeneration("gs://bucket/dir/blob");
+  ASSERT_TRUE(new_generation.ok()) << new_generation.status();
+  EXPECT_NE(*generation, *new_generation);
+}
+
+TEST_F(GcsReaderTest, PinsGenerations) {
+  fake_gcs_server_->PutObject("bucket", "blob", "first");
+
+  // The generation is resolved by the same metadata lookup as the size.
+  std::string generation;
+  const auto data = gcs_reader_->Read(
+      "gs://bucket/blob", arrow::StopToken::Unstoppable(), &generation);
+  ASSERT_TRUE(data.ok()) << data.status();
+  EXPECT_EQ((*data)->ToString(), "first");
+  EXPECT_FALSE(generation.empty());
+  EXPECT_EQ(fake_gcs_server_->num_metadata_requests(), 1);
+
+  const auto file = gcs_reader_->Open(
+      "gs://bucket/blob", arrow::StopToken::Unstoppable(), &generation);
+  ASSERT_TRUE(file.ok()) << file.status();
+  ASSERT_OK_AND_ASSIGN(const auto buffer, (*file)->ReadAt(0, 5));
+  EXPECT_EQ(buffer->ToString(), "first");
+
+  // Only the latest generation is kept, so the pinned one is gone.
+  fake_gcs_server_->PutObject("bucket", "blob", "second");
+  EXPECT_FALSE(gcs_reader_
+                   ->Read("gs://bucket/blob", arrow::StopToken::Unstoppable(),
+                          &generation)
+                   .ok());
+  std::string new_generation;
+  const auto new_data = gcs_reader_->Read(
+      "gs://bucket/blob", arrow::StopToken::Unstoppable(), &new_generation);
+  ASSERT_TRUE(new_data.ok()) << new_data.status();
+  EXPECT_EQ((*new_data)->ToString(), "second");
+  EXPECT_NE(new_generation, generation);
+}
+
+TEST_F(GcsReaderTest, ReadsLargeObjectsInParallelRanges) {
+  constexpr int64_t kSize = 4 << 20;
+  std::string data(kSize, '\0');
+  for (int64_t i = 0; i < kSize; ++i) {
+    data[i] = static_cast<char>(i * 13);
+  }
+  fake_gcs_server_->PutObject("bucket", "blob", data);
+  // Slow down the ranges, so they overlap.
+  fake_gcs_server_->set_bandwidth(16 << 20);
+
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_parallel_read_min_bytes, 1 << 20);
+  absl::SetFlag(&FLAGS_parallel_read_ranges, 1);
+  auto result = gcs_reader_->Read("gs://bucket/blob");
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_EQ((*result)->ToString(), data);
+  EXPECT_EQ(fake_gcs_server_->num_media_requests(), 1);
+  EXPECT_EQ(fake_gcs_server_->max_concurrent_media_requests(), 1);
+
+  absl::SetFlag(&FLAGS_parallel_read_ranges, 4);
+  result = gcs_reader_->Read("gs://bucket/blob");
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_EQ((*result)->ToString(), data);
+  EXPECT_EQ(fake_gcs_server_->num_media_requests(), 5);
+  EXPECT_EQ(fake_gcs_server_->bytes_served(), 2 * kSize);
+  EXPECT_GT(fake_gcs_server_->max_concurrent_media_requests(), 1);
+  EXPECT_LE(fake_gcs_server_->max_concurrent_media_requests(), 4);
+
+  // Smaller objects are read as a single stream.
+  absl::SetFlag(&FLAGS_parallel_read_min_bytes, kSize + 1);
+  result = gcs_reader_->Read("gs://bucket/blob");
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_EQ(fake_gcs_server_->num_media_requests(), 6);
+}
+
+TEST_F(GcsReaderTest, CoalescesSmallRangedReads) {
+  constexpr int64_t kSize = 1 << 20;
+  std::string data(kSize, '\0');
+  for (int64_t i = 0; i < kSize; ++i) {
+    data[i] = static_cast<char>(i * 7);
+  }
+  fake_gcs_server_->PutObject("bucket", "blob", data);
+
+  const auto file = gcs_reader_->Open("gs://bucket/blob");
+  ASSERT_TRUE(file.ok()) << file.status();
+  ASSERT_OK_AND_ASSIGN(const int64_t size, (*file)->GetSize());
+  EXPECT_EQ(size, kSize);
+
+  // A small read at the end fetches a window before it.
+  ASSERT_OK_AND_ASSIGN(auto buffer, (*file)->ReadAt(kSize - 10, 10));
+  EXPECT_EQ(buffer->ToString(), data.substr(kSize - 10));
+  EXPECT_EQ(fake_gcs_server_->num_media_requests(), 1);
+  const int64_t window_size = fake_gcs_server_->bytes_served();
+  EXPECT_LT(window_size, kSize / 4);
+
+  // Served from the window.
+  ASSERT_OK_AND_ASSIGN(buffer, (*file)->ReadAt(kSize - 5000, 100));
+  EXPECT_EQ(buffer->ToString(), data.substr(kSize - 5000, 100));
+  EXPECT_EQ(fake_gcs_server_->num_media_requests(), 1);
+
+  // Large reads are fetched exactly.
+  ASSERT_OK_AND_ASSIGN(buffer, (*file)->ReadAt(1000, kSize / 2));
+  EXPECT_EQ(buffer->ToString(), data.substr(1000, kSize / 2));
+  EXPECT_EQ(fake_gcs_server_->num_media_requests(), 2);
+  EXPECT_EQ(fake_gcs_server_->bytes_served(), window_size + kSize / 2);
+
+  // Recently fetched ranges are kept, e.g. for decoding the same record batch
+  // for another column selection.
+  ASSERT_OK_AND_ASSIGN(buffer, (*file)->ReadAt(1000, kSize / 2));
+  EXPECT_EQ(buffer->ToString(), data.substr(1000, kSize / 2));
+  EXPECT_EQ(fake_gcs_server_->num_media_requests(), 2);
+}
+
+TEST_F(GcsReaderTest, OpeningIpcFileOnlyReadsFooter) {
+  ASSERT_TRUE(
+      fake_gcs_server_->PutObjectFromFile("bucket", "trio.arrow", kArrowPath)
+          .ok());
+
+  const auto file = gcs_reader_->Open("gs://bucket/trio.arrow");
+  ASSERT_TRUE(file.ok()) << file.status();
+  ASSERT_OK_AND_ASSIGN(const auto reader,
+                       arrow::ipc::RecordBatchFileReader::Open(*file));
+  EXPECT_NE(reader->schema()->GetFieldByName("xpos"), nullptr);
+
+  const auto file_size =
+      static_cast<int64_t>(std::filesystem::file_size(kArrowPath));
+  EXPECT_LT(fake_gcs_server_->bytes_served(), file_size / 10);
+}
+
+TEST_F(GcsReaderTest, StopsReadsWhenCancelled) {
+  fake_gcs_server_->PutObject("bucket", "blob", std::string(1 << 20, 'x'));
+
+  arrow::StopSource stop_source;
+  const auto file = gcs_reader_->Open("gs://bucket/blob", stop_source.token());
+  ASSERT_TRUE(file.ok()) << file.status();
+  ASSERT_OK((*file)->ReadAt(0, 100).status());
+
+  stop_source.RequestStop();
+  EXPECT_TRUE((*file)->ReadAt(1000, 1 << 19).status().IsCancelled());
+  EXPECT_TRUE(absl::IsCancelled(
+      gcs_reader_->Read("gs://bucket/blob", stop_source.token()).status()));
+}
+
+}  // namespace seqr
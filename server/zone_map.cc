@@ -0,0 +1,321 @@
+#include "zone_map.h"
+
+#include <absl/strings/str_cat.h>
+#include <arrow/scalar.h>
+#include <arrow/type_traits.h>
+#include <arrow/util/key_value_metadata.h>
+#include <google/protobuf/util/json_util.h>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+
+namespace seqr {
+namespace cp = arrow::compute;
+namespace {
+
+// What the statistics imply about an expression's value for all rows. Nulls
+// are filtered out, so kNeverTrue includes rows where the value is null.
+enum class Truth {
+  kAlwaysTrue,
+  kNeverTrue,
+  kUnknown,
+};
+
+Truth Invert(const Truth truth) {
+  // If a value is never true, it might still be null instead of false, so the
+  // inverse isn't necessarily always true.
+  return truth == Truth::kAlwaysTrue ? Truth::kNeverTrue : Truth::kUnknown;
+}
+
+// A numeric value, keeping integers exact.
+using Number = std::variant<int64_t, double>;
+
+// Returns -1, 0 or 1 if an integer is less than, equal to or greater than a
+// double, without rounding either of them. The double must not be NaN.
+int CompareExactly(const int64_t a, const double b) {
+  // -2^63 and 2^63 are exact doubles, and truncating any double in between
+  // yields an int64.
+  constexpr double kTwoToThe63 = 9223372036854775808.0;
+  if (b >= kTwoToThe63) {
+    return -1;
+  }
+  if (b < -kTwoToThe63) {
+    return 1;
+  }
+  const double truncated = std::trunc(b);
+  const auto b_integer = static_cast<int64_t>(truncated);
+  if (a != b_integer) {
+    return a < b_integer ? -1 : 1;
+  }
+  const double fraction = b - truncated;
+  return fraction > 0 ? -1 : fraction < 0 ? 1 : 0;
+}
+
+// Returns -1, 0 or 1 if a is less than, equal to or greater than b.
+int Compare(const Number& a, const Number& b) {
+  const auto* const a_integer = std::get_if<int64_t>(&a);
+  const auto* const b_integer = std::get_if<int64_t>(&b);
+  if (a_integer != nullptr && b_integer != nullptr) {
+    return *a_integer < *b_integer ? -1 : *a_integer > *b_integer ? 1 : 0;
+  }
+  if (a_integer != nullptr) {
+    return CompareExactly(*a_integer, std::get<double>(b));
+  }
+  if (b_integer != nullptr) {
+    return -CompareExactly(*b_integer, std::get<double>(a));
+  }
+  const double a_double = std::get<double>(a);
+  const double b_double = std::get<double>(b);
+  return a_double < b_double ? -1 : a_double > b_double ? 1 : 0;
+}
+
+// Returns the value of a numeric literal expression, or nullopt for other
+// expressions and NaN.
+std::optional<Number> GetNumericLiteral(const cp::Expression& expression) {
+  const arrow::Datum* const literal = expression.literal();
+  if (literal == nullptr || !literal->is_scalar()) {
+    return std::nullopt;
+  }
+  const auto& scalar = *literal->scalar();
+  if (!scalar.is_valid) {
+    return std::nullopt;
+  }
+  if (scalar.type->id() == arrow::Type::UINT64 &&
+      static_cast<const arrow::UInt64Scalar&>(scalar).value >
+          static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+    // Larger than any int64, which the double still is after rounding.
+    return static_cast<double>(
+        static_cast<const arrow::UInt64Scalar&>(scalar).value);
+  }
+  if (arrow::is_integer(scalar.type->id())) {
+    const auto cast_result = scalar.CastTo(arrow::int64());
+    if (!cast_result.ok()) {
+      return std::nullopt;
+    }
+    return static_cast<const arrow::Int64Scalar&>(**cast_result).value;
+  }
+  if (!arrow::is_floating(scalar.type->id())) {
+    return std::nullopt;
+  }
+  const auto cast_result = scalar.CastTo(arrow::float64());
+  if (!cast_result.ok()) {
+    return std::nullopt;
+  }
+  const double value =
+      static_cast<const arrow::DoubleScalar&>(**cast_result).value;
+  if (std::isnan(value)) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+// Returns the statistics for a column reference expression.
+const ZoneMap::ColumnStatistics* GetColumnStatistics(
+    const cp::Expression& expression, const ZoneMap::Statistics& statistics) {
+  const arrow::FieldRef* const field_ref = expression.field_ref();
+  if (field_ref == nullptr || field_ref->name() == nullptr) {
+    return nullptr;
+  }
+  const auto it = statistics.columns().find(*field_ref->name());
+  return it == statistics.columns().end() ? nullptr : &it->second;
+}
+
+// Returns the comparison function with swapped arguments, e.g. for "1 < x".
+std::string_view SwapComparison(const std::string_view function_name) {
+  if (function_name == "less") {
+    return "greater";
+  }
+  if (function_name == "less_equal") {
+    return "greater_equal";
+  }
+  if (function_name == "greater") {
+    return "less";
+  }
+  if (function_name == "greater_equal") {
+    return "less_equal";
+  }
+  return function_name;  // Symmetric.
+}
+
+// Evaluates "<column> <function_name> <value>".
+Truth EvaluateComparison(const std::string_view function_name,
+                         const ZoneMap::ColumnStatistics& column,
+                         const int64_t num_rows, const Number& value) {
+  if (column.null_count() == num_rows) {
+    return Truth::kNeverTrue;  // Comparisons with null are null.
+  }
+
+  Number min;
+  Number max;
+  if (column.has_min_int() || column.has_max_int()) {
+    // An integer column.
+    if (!column.has_min_int() || !column.has_max_int()) {
+      return Truth::kUnknown;
+    }
+    min = column.min_int();
+    max = column.max_int();
+  } else if (column.has_min() && column.has_max()) {
+    min = column.min();
+    max = column.max();
+  } else {
+    return Truth::kUnknown;
+  }
+
+  // The comparisons of the bounds with the value.
+  const int min_cmp = Compare(min, value);
+  const int max_cmp = Compare(max, value);
+  bool never_true = false;
+  bool always_true_if_valid = false;
+  if (function_name == "less") {
+    never_true = min_cmp >= 0;
+    always_true_if_valid = max_cmp < 0;
+  } else if (function_name == "less_equal") {
+    never_true = min_cmp > 0;
+    always_true_if_valid = max_cmp <= 0;
+  } else if (function_name == "greater") {
+    never_true = max_cmp <= 0;
+    always_true_if_valid = min_cmp > 0;
+  } else if (function_name == "greater_equal") {
+    never_true = max_cmp < 0;
+    always_true_if_valid = min_cmp >= 0;
+  } else if (function_name == "equal") {
+    never_true = min_cmp > 0 || max_cmp < 0;
+    always_true_if_valid = min_cmp == 0 && max_cmp == 0;
+  } else if (function_name == "not_equal") {
+    never_true = min_cmp == 0 && max_cmp == 0;
+    always_true_if_valid = min_cmp > 0 || max_cmp < 0;
+  } else {
+    return Truth::kUnknown;
+  }
+
+  if (never_true) {
+    return Truth::kNeverTrue;
+  }
+  if (always_true_if_valid && column.null_count() == 0) {
+    return Truth::kAlwaysTrue;
+  }
+  return Truth::kUnknown;
+}
+
+Truth Evaluate(const cp::Expression& expression,
+               const ZoneMap::Statistics& statistics) {
+  if (const arrow::Datum* const literal = expression.literal()) {
+    if (!literal->is_scalar() ||
+        literal->scalar()->type->id() != arrow::Type::BOOL) {
+      return Truth::kUnknown;
+    }
+    const auto& scalar =
+        static_cast<const arrow::BooleanScalar&>(*literal->scalar());
+    return scalar.is_valid && scalar.value ? Truth::kAlwaysTrue
+                                           : Truth::kNeverTrue;
+  }
+
+  const cp::Expression::Call* const call = expression.call();
+  if (call == nullptr) {
+    return Truth::kUnknown;
+  }
+  const std::string_view function_name = call->function_name;
+  const auto& arguments = call->arguments;
+
+  if (function_name == "and" || function_name == "and_kleene") {
+    bool all_true = true;
+    for (const auto& argument : arguments) {
+      const Truth truth = Evaluate(argument, statistics);
+      if (truth == Truth::kNeverTrue) {
+        return Truth::kNeverTrue;
+      }
+      all_true &= truth == Truth::kAlwaysTrue;
+    }
+    return all_true ? Truth::kAlwaysTrue : Truth::kUnknown;
+  }
+
+  if (function_name == "or" || function_name == "or_kleene") {
+    bool all_never_true = true;
+    for (const auto& argument : arguments) {
+      const Truth truth = Evaluate(argument, statistics);
+      if (truth == Truth::kAlwaysTrue) {
+        return Truth::kAlwaysTrue;
+      }
+      all_never_true &= truth == Truth::kNeverTrue;
+    }
+    return all_never_true ? Truth::kNeverTrue : Truth::kUnknown;
+  }
+
+  if (function_name == "invert" && arguments.size() == 1) {
+    return Invert(Evaluate(arguments[0], statistics));
+  }
+
+  if ((function_name == "is_null" || function_name == "is_valid") &&
+      arguments.size() == 1) {
+    const auto* const column = GetColumnStatistics(arguments[0], statistics);
+    if (column == nullptr) {
+      return Truth::kUnknown;
+    }
+    const bool no_nulls = column->null_count() == 0;
+    const bool all_nulls = column->null_count() == statistics.num_rows();
+    if (function_name == "is_null") {
+      return no_nulls    ? Truth::kNeverTrue
+             : all_nulls ? Truth::kAlwaysTrue
+                         : Truth::kUnknown;
+    }
+    return all_nulls   ? Truth::kNeverTrue
+           : no_nulls  ? Truth::kAlwaysTrue
+                       : Truth::kUnknown;
+  }
+
+  if (arguments.size() == 2) {
+    if (const auto* const column =
+            GetColumnStatistics(arguments[0], statistics)) {
+      if (const auto value = GetNumericLiteral(arguments[1])) {
+        return EvaluateComparison(function_name, *column,
+                                  statistics.num_rows(), *value);
+      }
+    }
+    if (const auto* const column =
+            GetColumnStatistics(arguments[1], statistics)) {
+      if (const auto value = GetNumericLiteral(arguments[0])) {
+        return EvaluateComparison(SwapComparison(function_name), *column,
+                                  statistics.num_rows(), *value);
+      }
+    }
+  }
+
+  return Truth::kUnknown;
+}
+
+}  // namespace
+
+absl::StatusOr<std::optional<ZoneMap>> ReadZoneMap(
+    const arrow::Schema& schema) {
+  const auto& metadata = schema.metadata();
+  if (metadata == nullptr) {
+    return std::nullopt;
+  }
+  const int index = metadata->FindKey(kZoneMapMetadataKey);
+  if (index < 0) {
+    return std::nullopt;
+  }
+
+  ZoneMap result;
+  google::protobuf::util::JsonParseOptions json_parse_options;
+  json_parse_options.ignore_unknown_fields = true;
+  if (const auto status = google::protobuf::util::JsonStringToMessage(
+          metadata->value(index), &result, json_parse_options);
+      !status.ok()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Failed to parse zone map: ", status.ToString()));
+  }
+  return result;
+}
+
+bool MayMatch(const cp::Expression& filter_expression,
+              const ZoneMap::Statistics& statistics) {
+  return Evaluate(filter_expression, statistics) != Truth::kNeverTrue;
+}
+
+}  // namespace seqr
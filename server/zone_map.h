@@ -0,0 +1,26 @@
+#pragma once
+
+#include <absl/status/statusor.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/type.h>
+
+#include <optional>
+
+#include "zone_map.pb.h"
+
+namespace seqr {
+
+// The schema metadata key under which the pipeline stores the zone map.
+inline constexpr char kZoneMapMetadataKey[] = "seqr.zone_map";
+
+// Returns the zone map stored in the schema metadata of an Arrow file, or
+// nullopt if the file doesn't have one.
+absl::StatusOr<std::optional<ZoneMap>> ReadZoneMap(const arrow::Schema& schema);
+
+// Returns false if the statistics guarantee that no row can match the given
+// (unbound) filter expression. This is conservative: any expression that
+// can't be evaluated against the statistics may match.
+bool MayMatch(const arrow::compute::Expression& filter_expression,
+              const ZoneMap::Statistics& statistics);
+
+}  // namespace seqr
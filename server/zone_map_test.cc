@@ -0,0 +1,147 @@
+#include "zone_map.h"
+
+#include <arrow/scalar.h>
+#include <arrow/util/key_value_metadata.h>
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <limits>
+
+namespace seqr {
+namespace cp = arrow::compute;
+
+// 100 rows, AF in [0.01, 0.2] with 10 nulls, xpos in [1000, 2000] without
+// nulls, and an all-null column.
+ZoneMap::Statistics MakeStatistics() {
+  ZoneMap::Statistics result;
+  result.set_num_rows(100);
+  auto& columns = *result.mutable_columns();
+  columns["AF"].set_min(0.01);
+  columns["AF"].set_max(0.2);
+  columns["AF"].set_null_count(10);
+  columns["xpos"].set_min(1000);
+  columns["xpos"].set_max(2000);
+  columns["empty"].set_null_count(100);
+  return result;
+}
+
+TEST(ZoneMap, Comparisons) {
+  const auto statistics = MakeStatistics();
+  const auto af = cp::field_ref("AF");
+
+  EXPECT_TRUE(MayMatch(cp::less(af, cp::literal(0.05)), statistics));
+  EXPECT_FALSE(MayMatch(cp::less(af, cp::literal(0.01)), statistics));
+  EXPECT_TRUE(MayMatch(cp::less_equal(af, cp::literal(0.01)), statistics));
+  EXPECT_FALSE(MayMatch(cp::greater(af, cp::literal(0.2)), statistics));
+  EXPECT_TRUE(MayMatch(cp::greater_equal(af, cp::literal(0.2)), statistics));
+  EXPECT_FALSE(MayMatch(cp::equal(af, cp::literal(0.5)), statistics));
+  EXPECT_TRUE(MayMatch(cp::not_equal(af, cp::literal(0.5)), statistics));
+
+  // Integer literals and literals on the left-hand side.
+  const auto xpos = cp::field_ref("xpos");
+  EXPECT_FALSE(MayMatch(cp::less(xpos, cp::literal(1000)), statistics));
+  EXPECT_FALSE(
+      MayMatch(cp::greater(cp::literal(int64_t{1000}), xpos), statistics));
+  EXPECT_TRUE(MayMatch(cp::greater(cp::literal(1001), xpos), statistics));
+
+  // Comparisons with an all-null column never match.
+  EXPECT_FALSE(MayMatch(cp::less(cp::field_ref("empty"), cp::literal(1)),
+                        statistics));
+
+  // Unknown columns, functions and literal types may match.
+  EXPECT_TRUE(MayMatch(cp::less(cp::field_ref("AC"), cp::literal(1)),
+                       statistics));
+  EXPECT_TRUE(MayMatch(cp::call("add", {af, cp::literal(1.0)}), statistics));
+  EXPECT_TRUE(MayMatch(cp::equal(af, cp::literal("x")), statistics));
+}
+
+TEST(ZoneMap, ComparesIntegersExactly) {
+  // 2^53 + 1 isn't representable as a double.
+  constexpr int64_t kPosition = (int64_t{1} << 53) + 1;
+  ZoneMap::Statistics statistics;
+  statistics.set_num_rows(1);
+  auto& column = (*statistics.mutable_columns())["position"];
+  column.set_min_int(kPosition);
+  column.set_max_int(kPosition);
+  const auto position = cp::field_ref("position");
+
+  EXPECT_TRUE(
+      MayMatch(cp::equal(position, cp::literal(kPosition)), statistics));
+  EXPECT_FALSE(
+      MayMatch(cp::equal(position, cp::literal(kPosition - 1)), statistics));
+  EXPECT_FALSE(
+      MayMatch(cp::less(position, cp::literal(kPosition)), statistics));
+  EXPECT_FALSE(MayMatch(
+      cp::less_equal(position, cp::literal(9007199254740992.0)), statistics));
+  EXPECT_TRUE(MayMatch(cp::greater(position, cp::literal(9007199254740992.0)),
+                       statistics));
+  // Larger than any int64.
+  EXPECT_FALSE(MayMatch(
+      cp::greater(position, cp::literal(arrow::MakeScalar(
+                                std::numeric_limits<uint64_t>::max()))),
+      statistics));
+}
+
+TEST(ZoneMap, LogicalOperators) {
+  const auto statistics = MakeStatistics();
+  const auto af = cp::field_ref("AF");
+  const auto xpos = cp::field_ref("xpos");
+  const auto never = cp::greater(af, cp::literal(0.5));
+  const auto maybe = cp::less(af, cp::literal(0.05));
+  const auto always = cp::greater_equal(xpos, cp::literal(1000));
+
+  EXPECT_FALSE(MayMatch(cp::and_(maybe, never), statistics));
+  EXPECT_TRUE(MayMatch(cp::and_(maybe, always), statistics));
+  EXPECT_FALSE(MayMatch(cp::or_(never, never), statistics));
+  EXPECT_TRUE(MayMatch(cp::or_(never, maybe), statistics));
+  EXPECT_TRUE(MayMatch(cp::call("or_kleene", {never, always}), statistics));
+
+  EXPECT_FALSE(MayMatch(cp::not_(always), statistics));
+  // AF > 0.5 is never true, but it's null for some rows, so its inverse isn't
+  // always true. Still, it may match.
+  EXPECT_TRUE(MayMatch(cp::not_(never), statistics));
+  EXPECT_FALSE(MayMatch(cp::and_(cp::not_(never), never), statistics));
+
+  EXPECT_FALSE(MayMatch(cp::literal(false), statistics));
+  EXPECT_TRUE(MayMatch(cp::literal(true), statistics));
+}
+
+TEST(ZoneMap, NullChecks) {
+  const auto statistics = MakeStatistics();
+
+  EXPECT_TRUE(MayMatch(cp::is_null(cp::field_ref("AF")), statistics));
+  EXPECT_FALSE(MayMatch(cp::is_null(cp::field_ref("xpos")), statistics));
+  EXPECT_TRUE(MayMatch(cp::is_valid(cp::field_ref("xpos")), statistics));
+  EXPECT_FALSE(MayMatch(cp::is_valid(cp::field_ref("empty")), statistics));
+  EXPECT_FALSE(
+      MayMatch(cp::not_(cp::is_null(cp::field_ref("empty"))), statistics));
+}
+
+TEST(ZoneMap, ReadFromSchemaMetadata) {
+  const auto schema = arrow::schema({arrow::field("AF", arrow::float64())});
+  const auto no_zone_map = ReadZoneMap(*schema);
+  ASSERT_TRUE(no_zone_map.ok()) << no_zone_map.status();
+  EXPECT_FALSE(no_zone_map->has_value());
+
+  const auto zone_map = ReadZoneMap(*schema->WithMetadata(
+      arrow::key_value_metadata({kZoneMapMetadataKey}, {R"({
+        "file": {"numRows": "3", "columns": {
+          "AF": {"min": 0.1, "max": 0.3},
+          "xpos": {"minInt": "9007199254740993", "maxInt": "9007199254740995"}
+        }},
+        "recordBatches": [{"numRows": "3", "unknownField": 1}]
+      })"})));
+  ASSERT_TRUE(zone_map.ok()) << zone_map.status();
+  ASSERT_TRUE(zone_map->has_value());
+  EXPECT_EQ((*zone_map)->file().num_rows(), 3);
+  EXPECT_EQ((*zone_map)->file().columns().at("AF").max(), 0.3);
+  EXPECT_EQ((*zone_map)->file().columns().at("xpos").min_int(),
+            9007199254740993);
+  EXPECT_EQ((*zone_map)->record_batches_size(), 1);
+
+  const auto invalid = ReadZoneMap(*schema->WithMetadata(
+      arrow::key_value_metadata({kZoneMapMetadataKey}, {"not json"})));
+  EXPECT_FALSE(invalid.ok());
+}
+
+}  // namespace seqr